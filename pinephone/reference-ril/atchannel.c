@@ -41,6 +41,8 @@
 #define MAX_AT_RESPONSE (8 * 1024)
 #define HANDSHAKE_RETRY_COUNT 8
 #define HANDSHAKE_TIMEOUT_MSEC 250
+#define HANDSHAKE_QUIET_MSEC 50
+#define HANDSHAKE_DRAIN_STEP_MSEC 10
 
 static pthread_t s_tid_reader;
 static int s_fd = -1;    /* fd of the AT channel */
@@ -51,6 +53,13 @@ static ATUnsolHandler s_unsolHandler;
 static char s_ATBuffer[MAX_AT_RESPONSE+1];
 static char *s_ATBufferCur = s_ATBuffer;
 
+/* time the thread spent in commands, see at_thread_command_time_us() */
+static __thread int64_t s_threadCommandUs = 0;
+
+/* when the reader thread last got a line, for draining the input */
+static pthread_mutex_t s_lineTimeMutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t s_lastLineMs = 0;
+
 #if AT_DEBUG
 void  AT_DUMP(const char*  prefix __unused, const char*  buff, int  len)
 {
@@ -76,6 +85,7 @@ static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
 static ATCommandType s_type;
 static const char *s_responsePrefix = NULL;
 static const char *s_smsPDU = NULL;
+static int s_pduExpected = 0;
 static ATResponse *sp_response = NULL;
 
 static void (*s_onTimeout)(void) = NULL;
@@ -281,6 +291,18 @@ static void processLine(const char *line)
                 handleUnsolicited(line);
             }
         break;
+        case MULTILINE_PDU:
+            if (s_pduExpected) {
+                /* the PDU belonging to the previous prefixed line */
+                addIntermediate(line);
+                s_pduExpected = 0;
+            } else if (strStartsWith (line, s_responsePrefix)) {
+                addIntermediate(line);
+                s_pduExpected = 1;
+            } else {
+                handleUnsolicited(line);
+            }
+        break;
 
         default: /* this should never be reached */
             RLOGE("Unsupported AT command type %d\n", s_type);
@@ -438,6 +460,10 @@ static void *readerLoop(void *arg __unused)
             break;
         }
 
+        pthread_mutex_lock(&s_lineTimeMutex);
+        s_lastLineMs = monotonicMsec();
+        pthread_mutex_unlock(&s_lineTimeMutex);
+
         if(isSMSUnsolicited(line)) {
             char *line1;
             const char *line2;
@@ -690,6 +716,7 @@ static int at_send_command_full_nolock (const char *command, ATCommandType type,
     s_type = type;
     s_responsePrefix = responsePrefix;
     s_smsPDU = smspdu;
+    s_pduExpected = 0;
     sp_response = at_response_new();
 
     if (timeoutMsec != 0) {
@@ -742,6 +769,7 @@ static int at_send_command_full (const char *command, ATCommandType type,
 {
     int err;
     bool inEmulator;
+    int64_t start;
 
     if (0 != pthread_equal(s_tid_reader, pthread_self())) {
         /* cannot be called from reader thread */
@@ -751,9 +779,11 @@ static int at_send_command_full (const char *command, ATCommandType type,
     pthread_mutex_lock(&s_writeMutex);
     pthread_mutex_lock(&s_commandmutex);
 
+    start = monotonicUsec();
     err = at_send_command_full_nolock(command, type,
                     responsePrefix, smspdu,
                     timeoutMsec, pp_outResponse);
+    s_threadCommandUs += monotonicUsec() - start;
 
     pthread_mutex_unlock(&s_commandmutex);
     pthread_mutex_unlock(&s_writeMutex);
@@ -869,6 +899,19 @@ int at_send_command_multiline (const char *command,
 }
 
 
+/**
+ * Intermediates come in pairs: the prefixed line and the PDU line
+ * that follows it
+ */
+int at_send_command_multiline_pdu (const char *command,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse)
+{
+    return at_send_command_full (command, MULTILINE_PDU, responsePrefix,
+                                    NULL, 0, pp_outResponse);
+}
+
+
 /** This callback is invoked on the command thread */
 void at_set_on_timeout(void (*onTimeout)(void))
 {
@@ -888,6 +931,29 @@ void at_set_on_reader_closed(void (*onClose)(void))
 }
 
 
+/**
+ * Wait until the reader has been quiet for HANDSHAKE_QUIET_MSEC, at most
+ * HANDSHAKE_TIMEOUT_MSEC
+ */
+static void drainInput()
+{
+    int64_t start = monotonicMsec();
+    int64_t now, last;
+
+    for (;;) {
+        now = monotonicMsec();
+        pthread_mutex_lock(&s_lineTimeMutex);
+        last = s_lastLineMs > start ? s_lastLineMs : start;
+        pthread_mutex_unlock(&s_lineTimeMutex);
+
+        if (now - last >= HANDSHAKE_QUIET_MSEC
+                || now - start >= HANDSHAKE_TIMEOUT_MSEC) {
+            break;
+        }
+        sleepMsec(HANDSHAKE_DRAIN_STEP_MSEC);
+    }
+}
+
 /**
  * Periodically issue an AT command and wait for a response.
  * Used to ensure channel has start up and is active
@@ -919,11 +985,13 @@ int at_handshake()
         }
     }
 
-    if (err == 0) {
-        /* pause for a bit to let the input buffer drain any unmatched OK's
-           (they will appear as extraneous unsolicited responses) */
+    if (err == 0 && i > 0) {
+        /* let the input buffer drain any unmatched OK's of the attempts
+           that timed out (they will appear as extraneous unsolicited
+           responses). When the first attempt was answered there are
+           none to wait for. */
 
-        sleepMsec(HANDSHAKE_TIMEOUT_MSEC);
+        drainInput();
     }
 
     pthread_mutex_unlock(&s_commandmutex);
@@ -934,6 +1002,11 @@ int at_handshake()
     return err;
 }
 
+int64_t at_thread_command_time_us(void)
+{
+    return s_threadCommandUs;
+}
+
 /**
  * Returns error code from response
  * Assumes AT+CMEE=1 (numeric) mode
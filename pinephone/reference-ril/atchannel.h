@@ -18,6 +18,8 @@
 #ifndef ATCHANNEL_H
 #define ATCHANNEL_H 1
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -47,8 +49,10 @@ typedef enum {
     NO_RESULT,   /* no intermediate response expected */
     NUMERIC,     /* a single intermediate response starting with a 0-9 */
     SINGLELINE,  /* a single intermediate response starting with a prefix */
-    MULTILINE    /* multiple line intermediate response
+    MULTILINE,   /* multiple line intermediate response
                     starting with a prefix */
+    MULTILINE_PDU /* like MULTILINE, but each prefixed line is followed
+                     by a PDU line, eg AT+CMGL in PDU mode */
 } ATCommandType;
 
 /** a singly-lined list of intermediate responses */
@@ -98,6 +102,10 @@ int at_send_command_multiline (const char *command,
                                 const char *responsePrefix,
                                  ATResponse **pp_outResponse);
 
+int at_send_command_multiline_pdu (const char *command,
+                                const char *responsePrefix,
+                                 ATResponse **pp_outResponse);
+
 
 int at_handshake();
 
@@ -117,6 +125,12 @@ typedef enum {
 
 AT_CME_Error at_get_cme_error(const ATResponse *p_response);
 
+/**
+ * Total time the calling thread spent waiting for the modem to answer
+ * its commands, in microseconds. Only differences are meaningful.
+ */
+int64_t at_thread_command_time_us(void);
+
 #ifdef __cplusplus
 }
 #endif
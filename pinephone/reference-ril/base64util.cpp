@@ -17,26 +17,226 @@
 
 #include "base64util.h"
 
-#include <vector>
+#include <string.h>
 
-#include "common/libs/utils/base64.h"
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define BASE64_USE_NEON 1
+#endif
+
+namespace {
+
+const char kEncodeTable[64 + 1] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 6 bit value of each base64 character, 0xff for anything else. The
+// first 128 entries double as the NEON lookup tables.
+const uint8_t kDecodeTable[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,   62, 0xff, 0xff, 0xff,   63,
+      52,   53,   54,   55,   56,   57,   58,   59,   60,   61, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,    0,    1,    2,    3,    4,    5,    6,    7,    8,    9,   10,   11,   12,   13,   14,
+      15,   16,   17,   18,   19,   20,   21,   22,   23,   24,   25, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,
+      41,   42,   43,   44,   45,   46,   47,   48,   49,   50,   51, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+#if defined(BASE64_USE_NEON)
+
+// Encodes 48 byte blocks into 64 characters, returns the bytes consumed.
+size_t EncodeBlocks(const uint8_t *in, size_t len, char *out) {
+  const uint8x16x4_t table = {{
+      vld1q_u8(reinterpret_cast<const uint8_t *>(kEncodeTable)),
+      vld1q_u8(reinterpret_cast<const uint8_t *>(kEncodeTable) + 16),
+      vld1q_u8(reinterpret_cast<const uint8_t *>(kEncodeTable) + 32),
+      vld1q_u8(reinterpret_cast<const uint8_t *>(kEncodeTable) + 48),
+  }};
+  const uint8x16_t mask6 = vdupq_n_u8(0x3f);
+  size_t i;
+
+  for (i = 0; i + 48 <= len; i += 48) {
+    uint8x16x3_t src = vld3q_u8(in + i);
+    uint8x16x4_t idx;
+
+    idx.val[0] = vshrq_n_u8(src.val[0], 2);
+    idx.val[1] = vandq_u8(
+        vorrq_u8(vshlq_n_u8(src.val[0], 4), vshrq_n_u8(src.val[1], 4)), mask6);
+    idx.val[2] = vandq_u8(
+        vorrq_u8(vshlq_n_u8(src.val[1], 2), vshrq_n_u8(src.val[2], 6)), mask6);
+    idx.val[3] = vandq_u8(src.val[2], mask6);
+
+    idx.val[0] = vqtbl4q_u8(table, idx.val[0]);
+    idx.val[1] = vqtbl4q_u8(table, idx.val[1]);
+    idx.val[2] = vqtbl4q_u8(table, idx.val[2]);
+    idx.val[3] = vqtbl4q_u8(table, idx.val[3]);
+    vst4q_u8(reinterpret_cast<uint8_t *>(out) + i / 3 * 4, idx);
+  }
+  return i;
+}
+
+// Looks up 16 characters, marking invalid ones with 0xff.
+inline uint8x16_t DecodeLanes(const uint8x16x4_t &lo, const uint8x16x4_t &hi,
+                              uint8x16_t c) {
+  uint8x16_t v = vqtbl4q_u8(lo, c);
+  v = vqtbx4q_u8(v, hi, vsubq_u8(c, vdupq_n_u8(64)));
+  // vqtbx keeps the first lookup (0) for characters >= 128
+  return vorrq_u8(v, vcgtq_u8(c, vdupq_n_u8(127)));
+}
+
+// Decodes 64 character blocks into 48 bytes. Stops before the last
+// block so that padding is always handled by the scalar code.
+// Returns the characters consumed or -1 on invalid input.
+long DecodeBlocks(const char *in, size_t len, uint8_t *out) {
+  const uint8x16x4_t lo = {{
+      vld1q_u8(kDecodeTable), vld1q_u8(kDecodeTable + 16),
+      vld1q_u8(kDecodeTable + 32), vld1q_u8(kDecodeTable + 48),
+  }};
+  const uint8x16x4_t hi = {{
+      vld1q_u8(kDecodeTable + 64), vld1q_u8(kDecodeTable + 80),
+      vld1q_u8(kDecodeTable + 96), vld1q_u8(kDecodeTable + 112),
+  }};
+  size_t i;
+
+  for (i = 0; i + 64 < len; i += 64) {
+    uint8x16x4_t src = vld4q_u8(reinterpret_cast<const uint8_t *>(in) + i);
+    uint8x16_t a = DecodeLanes(lo, hi, src.val[0]);
+    uint8x16_t b = DecodeLanes(lo, hi, src.val[1]);
+    uint8x16_t c = DecodeLanes(lo, hi, src.val[2]);
+    uint8x16_t d = DecodeLanes(lo, hi, src.val[3]);
+    uint8x16x3_t dst;
+
+    if (vmaxvq_u8(vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d))) > 63) {
+      return -1;
+    }
+    dst.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+    dst.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+    dst.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+    vst3q_u8(out + i / 4 * 3, dst);
+  }
+  return static_cast<long>(i);
+}
+
+#else
+
+size_t EncodeBlocks(const uint8_t *, size_t, char *) { return 0; }
+
+long DecodeBlocks(const char *, size_t, uint8_t *) { return 0; }
+
+#endif
+
+}  // namespace
 
 extern "C" {
 
+int base64_encode_buf(const uint8_t *bindata, size_t binlength, char *base64,
+                      size_t capacity) {
+  if (!bindata || !base64 || capacity < BASE64_ENCODED_LEN(binlength) + 1) {
+    return -1;
+  }
+
+  size_t i = EncodeBlocks(bindata, binlength, base64);
+  char *out = base64 + i / 3 * 4;
+
+  for (; i + 3 <= binlength; i += 3) {
+    uint32_t v = (bindata[i] << 16) | (bindata[i + 1] << 8) | bindata[i + 2];
+    *out++ = kEncodeTable[(v >> 18) & 0x3f];
+    *out++ = kEncodeTable[(v >> 12) & 0x3f];
+    *out++ = kEncodeTable[(v >> 6) & 0x3f];
+    *out++ = kEncodeTable[v & 0x3f];
+  }
+  if (i < binlength) {
+    uint32_t v = bindata[i] << 16;
+    if (i + 1 < binlength) {
+      v |= bindata[i + 1] << 8;
+    }
+    *out++ = kEncodeTable[(v >> 18) & 0x3f];
+    *out++ = kEncodeTable[(v >> 12) & 0x3f];
+    *out++ = (i + 1 < binlength) ? kEncodeTable[(v >> 6) & 0x3f] : '=';
+    *out++ = '=';
+  }
+  *out = '\0';
+
+  return static_cast<int>(out - base64);
+}
+
+int base64_decode_buf(const char *base64, size_t length, uint8_t *bindata,
+                      size_t capacity) {
+  if (!base64 || !bindata) {
+    return -1;
+  }
+
+  // strip padding, at most two '=' are allowed and only at the end
+  size_t padding = 0;
+  while (length > 0 && base64[length - 1] == '=' && padding < 2) {
+    length--;
+    padding++;
+  }
+  if (length % 4 == 1 || (padding && (length + padding) % 4)) {
+    return -1;
+  }
+
+  size_t outlen = length / 4 * 3 + (length % 4 ? length % 4 - 1 : 0);
+  if (outlen > capacity) {
+    return -1;
+  }
+
+  long consumed = DecodeBlocks(base64, length, bindata);
+  if (consumed < 0) {
+    return -1;
+  }
+
+  size_t i = static_cast<size_t>(consumed);
+  uint8_t *out = bindata + i / 4 * 3;
+  for (; i + 4 <= length; i += 4) {
+    uint32_t a = kDecodeTable[static_cast<uint8_t>(base64[i])];
+    uint32_t b = kDecodeTable[static_cast<uint8_t>(base64[i + 1])];
+    uint32_t c = kDecodeTable[static_cast<uint8_t>(base64[i + 2])];
+    uint32_t d = kDecodeTable[static_cast<uint8_t>(base64[i + 3])];
+    if ((a | b | c | d) > 63) {
+      return -1;
+    }
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    *out++ = v >> 16;
+    *out++ = v >> 8;
+    *out++ = v;
+  }
+  if (i < length) {
+    uint32_t a = kDecodeTable[static_cast<uint8_t>(base64[i])];
+    uint32_t b = kDecodeTable[static_cast<uint8_t>(base64[i + 1])];
+    uint32_t c = (i + 2 < length)
+                     ? kDecodeTable[static_cast<uint8_t>(base64[i + 2])]
+                     : 0;
+    if ((a | b | c) > 63) {
+      return -1;
+    }
+    uint32_t v = (a << 18) | (b << 12) | (c << 6);
+    *out++ = v >> 16;
+    if (i + 2 < length) {
+      *out++ = v >> 8;
+    }
+  }
+
+  return static_cast<int>(out - bindata);
+}
+
 int base64_decode(const char *base64input, unsigned char *bindata) {
   if (!base64input || !bindata) {
     return 0;
   }
 
-  std::vector<uint8_t> output;
-  std::string input(base64input);
-  bool success = cuttlefish::DecodeBase64(input, &output);
-  if (!success) {
-    return 0;
-  }
-  memcpy(bindata, reinterpret_cast<unsigned char *>(output.data()),
-         output.size());
-  return output.size();
+  size_t length = strlen(base64input);
+  int ret = base64_decode_buf(base64input, length, bindata,
+                              BASE64_DECODED_MAX_LEN(length));
+  return ret < 0 ? 0 : ret;
 }
 
 char *base64_encode(const unsigned char *bindata, char *base64output,
@@ -45,15 +245,11 @@ char *base64_encode(const unsigned char *bindata, char *base64output,
     return NULL;
   }
 
-  std::string output;
-  bool success = cuttlefish::EncodeBase64(
-      bindata, static_cast<size_t>(binlength), &output);
-
-  if (!success) {
+  size_t length = static_cast<size_t>(binlength);
+  if (base64_encode_buf(bindata, length, base64output,
+                        BASE64_ENCODED_LEN(length) + 1) < 0) {
     return NULL;
   }
-
-  memcpy(base64output, output.data(), output.size());
   return base64output;
 }
 }
@@ -16,13 +16,43 @@
 */
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/** decode base64, returns the encoded output */
+/** length of the base64 encoding of len bytes, without terminator */
+#define BASE64_ENCODED_LEN(len) ((((len) + 2) / 3) * 4)
+/** upper bound of the number of bytes decoded from len base64 characters */
+#define BASE64_DECODED_MAX_LEN(len) ((((len) + 3) / 4) * 3)
+
+/**
+ * encode binlength bytes into the NUL-terminated base64 buffer of the given
+ * capacity, which must be at least BASE64_ENCODED_LEN(binlength) + 1.
+ * returns the number of characters written (excluding NUL), -1 on error
+ */
+int base64_encode_buf(const uint8_t *bindata, size_t binlength, char *base64,
+                      size_t capacity);
+/**
+ * decode length base64 characters into bindata, without reading beyond
+ * length or writing beyond capacity. Invalid characters are rejected.
+ * returns the number of bytes decoded, -1 on error
+ */
+int base64_decode_buf(const char *base64, size_t length, uint8_t *bindata,
+                      size_t capacity);
+
+/**
+ * decode NUL-terminated base64, bindata must hold
+ * BASE64_DECODED_MAX_LEN(strlen(base64)) bytes.
+ * returns the number of bytes decoded, 0 on error
+ */
 int base64_decode(const char *base64, unsigned char *bindata);
-/** encode base64, returns the number of bytes decoded */
+/**
+ * encode base64, base64 must hold BASE64_ENCODED_LEN(binlength) + 1 bytes.
+ * returns base64 on success, NULL on error
+ */
 char *base64_encode(const unsigned char *bindata, char *base64, int binlength);
 #ifdef __cplusplus
 }
@@ -0,0 +1,267 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "hexutil.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HEX_USE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_USE_SSE2 1
+#endif
+
+static const char s_hexDigits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7',
+    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+};
+
+/* nibble value of an ASCII hex digit, -1 for anything else */
+static const int8_t s_hexValues[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#if defined(HEX_USE_NEON)
+
+static inline uint8x16_t nibblesToHex(uint8x16_t n)
+{
+    uint8x16_t alpha = vandq_u8(vcgtq_u8(n, vdupq_n_u8(9)), vdupq_n_u8(7));
+    return vaddq_u8(vaddq_u8(n, vdupq_n_u8('0')), alpha);
+}
+
+/* converts 16 characters to nibbles, clearing bits in *valid for bad input */
+static inline uint8x16_t hexToNibbles(uint8x16_t c, uint8x16_t *valid)
+{
+    uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t alpha = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t isDigit = vcleq_u8(digit, vdupq_n_u8(9));
+    uint8x16_t isAlpha = vcleq_u8(alpha, vdupq_n_u8(5));
+
+    *valid = vandq_u8(*valid, vorrq_u8(isDigit, isAlpha));
+    return vbslq_u8(isDigit, digit, vaddq_u8(alpha, vdupq_n_u8(10)));
+}
+
+static inline int allLanesSet(uint8x16_t v)
+{
+#if defined(__aarch64__)
+    return vminvq_u8(v) == 0xff;
+#else
+    uint8x8_t m = vand_u8(vget_low_u8(v), vget_high_u8(v));
+    return vget_lane_u64(vreinterpret_u64_u8(m), 0) == ~0ULL;
+#endif
+}
+
+static size_t encodeBlocks(const uint8_t *bin, size_t len, char *hex)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16_t in = vld1q_u8(bin + i);
+        uint8x16x2_t out;
+
+        out.val[0] = nibblesToHex(vshrq_n_u8(in, 4));
+        out.val[1] = nibblesToHex(vandq_u8(in, vdupq_n_u8(0x0f)));
+        vst2q_u8((uint8_t *)hex + 2 * i, out);
+    }
+    return i;
+}
+
+static int decodeBlocks(const char *hex, size_t len, uint8_t *bin, size_t *done)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        uint8x16x2_t in = vld2q_u8((const uint8_t *)hex + 2 * i);
+        uint8x16_t valid = vdupq_n_u8(0xff);
+        uint8x16_t hi = hexToNibbles(in.val[0], &valid);
+        uint8x16_t lo = hexToNibbles(in.val[1], &valid);
+
+        if (!allLanesSet(valid)) {
+            return -1;
+        }
+        vst1q_u8(bin + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+    }
+    *done = i;
+    return 0;
+}
+
+#elif defined(HEX_USE_SSE2)
+
+static inline __m128i nibblesToHex(__m128i n)
+{
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)),
+                                  _mm_set1_epi8(7));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), alpha);
+}
+
+/* unsigned a <= b for each byte lane */
+static inline __m128i lessEqualU8(__m128i a, __m128i b)
+{
+    return _mm_cmpeq_epi8(_mm_min_epu8(a, b), a);
+}
+
+/* converts 16 characters to nibbles, clearing bits in *valid for bad input */
+static inline __m128i hexToNibbles(__m128i c, __m128i *valid)
+{
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                                 _mm_set1_epi8('a'));
+    __m128i isDigit = lessEqualU8(digit, _mm_set1_epi8(9));
+    __m128i isAlpha = lessEqualU8(alpha, _mm_set1_epi8(5));
+
+    *valid = _mm_and_si128(*valid, _mm_or_si128(isDigit, isAlpha));
+    return _mm_or_si128(_mm_and_si128(isDigit, digit),
+            _mm_and_si128(isAlpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+}
+
+/* folds the nibble pairs of each 16 bit lane into one byte per lane */
+static inline __m128i joinNibbles(__m128i n)
+{
+    __m128i hi = _mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00ff)), 4);
+    return _mm_or_si128(hi, _mm_srli_epi16(n, 8));
+}
+
+static size_t encodeBlocks(const uint8_t *bin, size_t len, char *hex)
+{
+    size_t i;
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(bin + i));
+        __m128i hi = nibblesToHex(_mm_and_si128(_mm_srli_epi16(in, 4), mask));
+        __m128i lo = nibblesToHex(_mm_and_si128(in, mask));
+
+        _mm_storeu_si128((__m128i *)(hex + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(hex + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    return i;
+}
+
+static int decodeBlocks(const char *hex, size_t len, uint8_t *bin, size_t *done)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i valid = _mm_set1_epi8((char)0xff);
+        __m128i a = hexToNibbles(_mm_loadu_si128((const __m128i *)(hex + 2 * i)), &valid);
+        __m128i b = hexToNibbles(_mm_loadu_si128((const __m128i *)(hex + 2 * i + 16)), &valid);
+
+        if (_mm_movemask_epi8(valid) != 0xffff) {
+            return -1;
+        }
+        _mm_storeu_si128((__m128i *)(bin + i),
+                         _mm_packus_epi16(joinNibbles(a), joinNibbles(b)));
+    }
+    *done = i;
+    return 0;
+}
+
+#else
+
+static size_t encodeBlocks(const uint8_t *bin, size_t len, char *hex)
+{
+    (void)bin;
+    (void)len;
+    (void)hex;
+    return 0;
+}
+
+static int decodeBlocks(const char *hex, size_t len, uint8_t *bin, size_t *done)
+{
+    (void)hex;
+    (void)len;
+    (void)bin;
+    *done = 0;
+    return 0;
+}
+
+#endif
+
+int hex_encode(const uint8_t *bin, size_t len, char *hex, size_t hexcap)
+{
+    size_t i;
+
+    if (bin == NULL || hex == NULL || hexcap < HEX_ENCODED_LEN(len) + 1) {
+        return -1;
+    }
+
+    if ((const void *)hex == (const void *)bin) {
+        /* in place: walk backwards so no byte is overwritten before use */
+        for (i = len; i > 0; i--) {
+            uint8_t b = bin[i - 1];
+            hex[2 * i - 1] = s_hexDigits[b & 0x0f];
+            hex[2 * i - 2] = s_hexDigits[b >> 4];
+        }
+    } else {
+        for (i = encodeBlocks(bin, len, hex); i < len; i++) {
+            hex[2 * i] = s_hexDigits[bin[i] >> 4];
+            hex[2 * i + 1] = s_hexDigits[bin[i] & 0x0f];
+        }
+    }
+    hex[HEX_ENCODED_LEN(len)] = '\0';
+
+    return (int)HEX_ENCODED_LEN(len);
+}
+
+int hex_decode(const char *hex, size_t hexlen, uint8_t *bin, size_t bincap)
+{
+    size_t i, len = hexlen / 2;
+
+    if (hex == NULL || bin == NULL || (hexlen & 1) || len > bincap) {
+        return -1;
+    }
+
+    /*
+     * Output byte i is only written after input characters 2i and 2i + 1
+     * were consumed, so decoding front to back is safe in place.
+     */
+    if (decodeBlocks(hex, len, bin, &i) < 0) {
+        return -1;
+    }
+    for (; i < len; i++) {
+        int hi = s_hexValues[(uint8_t)hex[2 * i]];
+        int lo = s_hexValues[(uint8_t)hex[2 * i + 1]];
+
+        if ((hi | lo) < 0) {
+            return -1;
+        }
+        bin[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    return (int)len;
+}
+
+int hex_decode_byte(const char *hex)
+{
+    int hi, lo;
+
+    if (hex == NULL) {
+        return -1;
+    }
+    hi = s_hexValues[(uint8_t)hex[0]];
+    if (hi < 0) {
+        return -1;
+    }
+    lo = s_hexValues[(uint8_t)hex[1]];
+    if (lo < 0) {
+        return -1;
+    }
+    return (hi << 4) | lo;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** number of hex characters (without terminator) needed for len bytes */
+#define HEX_ENCODED_LEN(len) ((len) * 2)
+
+/**
+ * Encode len bytes as upper case hex into the caller's buffer and
+ * NUL-terminate it. hexcap must be at least HEX_ENCODED_LEN(len) + 1.
+ * hex may point to the same buffer as bin (in-place encoding), provided
+ * the buffer is large enough for the result.
+ *
+ * returns the number of characters written (excluding NUL), -1 on error
+ */
+int hex_encode(const uint8_t *bin, size_t len, char *hex, size_t hexcap);
+
+/**
+ * Decode exactly hexlen hex characters (either case) into bin.
+ * Fails if hexlen is odd, if any character is not a hex digit or if
+ * bincap is too small. bin may point to the same buffer as hex for
+ * in-place decoding. On failure the content of bin is undefined.
+ *
+ * returns the number of bytes written, -1 on error
+ */
+int hex_decode(const char *hex, size_t hexlen, uint8_t *bin, size_t bincap);
+
+/**
+ * Decode a single byte from two hex characters.
+ * returns 0..255 or -1 if either character is not a hex digit
+ */
+int hex_decode_byte(const char *hex);
+
+#ifdef __cplusplus
+}
+#endif
@@ -17,6 +17,7 @@
 #include <sys/system_properties.h>
 
 #include <fcntl.h>
+#include <time.h>
 #include "misc.h"
 /** returns 1 if line starts with prefix, 0 if it does not */
 int strStartsWith(const char *line, const char *prefix)
@@ -48,3 +49,17 @@ int qemu_open_modem_port() {
     int fd = open(propValue, O_RDWR);
     return fd;
 }
+
+int64_t monotonicMsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t monotonicUsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -15,6 +15,7 @@
 ** limitations under the License.
 */
 #include <stdbool.h>
+#include <stdint.h>
 
 /** returns 1 if line starts with prefix, 0 if it does not */
 int strStartsWith(const char *line, const char *prefix);
@@ -22,3 +23,7 @@ int strStartsWith(const char *line, const char *prefix);
 bool isInEmulator(void);
 /** open the modem port inside emulator VM; -1 if fails */
 int qemu_open_modem_port();
+/** milliseconds on CLOCK_MONOTONIC, for measuring intervals */
+int64_t monotonicMsec(void);
+/** microseconds on CLOCK_MONOTONIC, for measuring short intervals */
+int64_t monotonicUsec(void);
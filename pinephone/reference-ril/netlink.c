@@ -0,0 +1,475 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "netlink.h"
+#include "misc.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#define NL_BUF_SIZE         8192
+#define NL_ACK_TIMEOUT_MS   1000
+
+/* request socket, requests are serialized by s_nlMutex */
+static pthread_mutex_t s_nlMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_nlFd = -1;
+static uint32_t s_nlSeq = 0;
+
+/* link event socket, used by netlink_wait_link() */
+static pthread_mutex_t s_nlMonitorMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_nlMonitorFd = -1;
+
+/* several requests sent with a single sendto() */
+typedef struct {
+    uint32_t buf[NL_BUF_SIZE / sizeof(uint32_t)];
+    size_t len;
+    int count;
+} NlBatch;
+
+static int openSocket(unsigned int groups, int flags)
+{
+    struct sockaddr_nl addr;
+    int fd, err;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | flags, NETLINK_ROUTE);
+    if (fd < 0) {
+        RLOGE("failed to open netlink socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err = errno;
+        RLOGE("failed to bind netlink socket: %s", strerror(err));
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/** start a new request in the batch, returns NULL if it doesn't fit */
+static struct nlmsghdr *batchAdd(NlBatch *b, int type, int flags,
+                                 const void *payload, size_t payloadLen)
+{
+    struct nlmsghdr *nlh;
+    size_t len = NLMSG_LENGTH(payloadLen);
+
+    if (b->len + NLMSG_ALIGN(len) > sizeof(b->buf)) {
+        return NULL;
+    }
+
+    nlh = (struct nlmsghdr *)((char *)b->buf + b->len);
+    memset(nlh, 0, NLMSG_ALIGN(len));
+    nlh->nlmsg_len = len;
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    memcpy(NLMSG_DATA(nlh), payload, payloadLen);
+
+    b->len += NLMSG_ALIGN(len);
+    b->count++;
+    return nlh;
+}
+
+/** append an attribute to nlh, which must be the last request of the batch */
+static int batchAttr(NlBatch *b, struct nlmsghdr *nlh, int type,
+                     const void *data, size_t len)
+{
+    size_t offset = (char *)nlh - (char *)b->buf;
+    size_t msgLen = NLMSG_ALIGN(nlh->nlmsg_len);
+    struct rtattr *rta;
+
+    if (offset + msgLen + RTA_SPACE(len) > sizeof(b->buf)) {
+        return -1;
+    }
+
+    rta = (struct rtattr *)((char *)nlh + msgLen);
+    memset(rta, 0, RTA_SPACE(len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+
+    nlh->nlmsg_len = msgLen + RTA_SPACE(len);
+    b->len = offset + NLMSG_ALIGN(nlh->nlmsg_len);
+    return 0;
+}
+
+/**
+ * Send all requests of the batch and wait for their acks. Requests are
+ * handled by the kernel in order. EEXIST and EADDRNOTAVAIL are not
+ * counted as failures, so configuration can be repeated safely.
+ * If p_flags is not NULL it receives ifi_flags of an RTM_NEWLINK reply.
+ *
+ * Must be called with s_nlMutex held.
+ * returns the number of failed requests (errno is set to the first
+ * error), -1 if the socket failed
+ */
+static int sendBatchLocked(NlBatch *b, unsigned int *p_flags)
+{
+    struct sockaddr_nl kernel;
+    struct nlmsghdr *nlh;
+    uint32_t reply[NL_BUF_SIZE / sizeof(uint32_t)];
+    uint32_t first, last;
+    size_t offset;
+    int pending = b->count;
+    int failed = 0, firstError = 0;
+    ssize_t len;
+
+    if (s_nlFd < 0 && (s_nlFd = openSocket(0, 0)) < 0) {
+        return -1;
+    }
+
+    first = s_nlSeq + 1;
+    for (offset = 0; offset < b->len; offset += NLMSG_ALIGN(nlh->nlmsg_len)) {
+        nlh = (struct nlmsghdr *)((char *)b->buf + offset);
+        nlh->nlmsg_seq = ++s_nlSeq;
+    }
+    last = s_nlSeq;
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(s_nlFd, b->buf, b->len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) < 0) {
+        goto error;
+    }
+
+    while (pending > 0) {
+        struct pollfd pfd = { .fd = s_nlFd, .events = POLLIN };
+        int ret = poll(&pfd, 1, NL_ACK_TIMEOUT_MS);
+
+        if (ret == 0) {
+            errno = ETIMEDOUT;
+            goto error;
+        } else if (ret < 0) {
+            if (errno == EINTR) continue;
+            goto error;
+        }
+
+        len = recv(s_nlFd, reply, sizeof(reply), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            goto error;
+        }
+
+        for (nlh = (struct nlmsghdr *)reply; NLMSG_OK(nlh, (size_t)len);
+             nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_seq < first || nlh->nlmsg_seq > last) {
+                /* late reply to an earlier, timed out batch */
+                continue;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                const struct nlmsgerr *e = (const struct nlmsgerr *)NLMSG_DATA(nlh);
+
+                if (e->error != 0 && e->error != -EEXIST
+                        && e->error != -EADDRNOTAVAIL) {
+                    if (failed++ == 0) {
+                        firstError = -e->error;
+                    }
+                }
+                pending--;
+            } else if (nlh->nlmsg_type == RTM_NEWLINK && p_flags != NULL) {
+                *p_flags = ((const struct ifinfomsg *)NLMSG_DATA(nlh))->ifi_flags;
+            }
+        }
+    }
+
+    if (failed > 0) {
+        errno = firstError;
+    }
+    return failed;
+
+error:
+    RLOGE("netlink request failed: %s", strerror(errno));
+    /* the socket may hold stale replies now, start over with a new one */
+    close(s_nlFd);
+    s_nlFd = -1;
+    return -1;
+}
+
+static int batchLink(NlBatch *b, int ifindex, bool up, int mtu)
+{
+    struct ifinfomsg ifi;
+    struct nlmsghdr *nlh;
+    uint32_t value = mtu;
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = ifindex;
+    ifi.ifi_change = IFF_UP;
+    ifi.ifi_flags = up ? IFF_UP : 0;
+
+    nlh = batchAdd(b, RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+    if (nlh == NULL) return -1;
+    if (mtu > 0 && batchAttr(b, nlh, IFLA_MTU, &value, sizeof(value)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parse "address[/prefix]" into addr (16 bytes), the prefix defaults to
+ * the full address length.
+ * returns AF_INET or AF_INET6, -1 if str is not a valid address
+ */
+static int parseAddress(const char *str, uint8_t *addr, int *p_prefix)
+{
+    char buf[INET6_ADDRSTRLEN + 8];
+    char *slash, *end;
+    int family, maxPrefix;
+    long prefix;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+
+    if (inet_pton(AF_INET, buf, addr) == 1) {
+        family = AF_INET;
+        maxPrefix = 32;
+    } else if (inet_pton(AF_INET6, buf, addr) == 1) {
+        family = AF_INET6;
+        maxPrefix = 128;
+    } else {
+        return -1;
+    }
+
+    *p_prefix = maxPrefix;
+    if (slash != NULL) {
+        prefix = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || prefix < 0 || prefix > maxPrefix) {
+            return -1;
+        }
+        *p_prefix = (int)prefix;
+    }
+    return family;
+}
+
+/** add an RTM_NEWADDR/RTM_DELADDR request for each address of list */
+static int batchAddresses(NlBatch *b, int type, int ifindex, const char *list)
+{
+    char copy[512];
+    char *tok, *save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (tok = strtok_r(copy, " ", &save); tok != NULL;
+         tok = strtok_r(NULL, " ", &save)) {
+        struct ifaddrmsg ifa;
+        struct nlmsghdr *nlh;
+        uint8_t addr[16];
+        int prefix, family;
+        size_t alen;
+
+        family = parseAddress(tok, addr, &prefix);
+        if (family < 0) {
+            RLOGE("ignoring invalid address '%s'", tok);
+            continue;
+        }
+        alen = (family == AF_INET) ? 4 : 16;
+
+        memset(&ifa, 0, sizeof(ifa));
+        ifa.ifa_family = family;
+        ifa.ifa_prefixlen = prefix;
+        ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+        ifa.ifa_index = ifindex;
+
+        nlh = batchAdd(b, type,
+                       type == RTM_NEWADDR ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+                       &ifa, sizeof(ifa));
+        if (nlh == NULL
+                || batchAttr(b, nlh, IFA_LOCAL, addr, alen) < 0
+                || batchAttr(b, nlh, IFA_ADDRESS, addr, alen) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int ifindexFromName(const char *ifname)
+{
+    int ifindex = (int)if_nametoindex(ifname);
+
+    if (ifindex == 0) {
+        RLOGE("no interface %s", ifname);
+        errno = ENODEV;
+    }
+    return ifindex;
+}
+
+int netlink_set_link(const char *ifname, bool up, int mtu)
+{
+    NlBatch b;
+    int ifindex, ret = -1;
+
+    if ((ifindex = ifindexFromName(ifname)) == 0) {
+        return -1;
+    }
+
+    b.len = 0;
+    b.count = 0;
+    pthread_mutex_lock(&s_nlMutex);
+    if (batchLink(&b, ifindex, up, mtu) == 0) {
+        ret = sendBatchLocked(&b, NULL) == 0 ? 0 : -1;
+    }
+    pthread_mutex_unlock(&s_nlMutex);
+
+    if (ret < 0) {
+        RLOGE("failed to set %s %s: %s", ifname, up ? "up" : "down",
+              strerror(errno));
+    }
+    return ret;
+}
+
+int netlink_configure(const char *ifname, const char *addresses, int mtu)
+{
+    NlBatch b;
+    int ifindex, ret = -1;
+
+    if ((ifindex = ifindexFromName(ifname)) == 0) {
+        return -1;
+    }
+
+    b.len = 0;
+    b.count = 0;
+    pthread_mutex_lock(&s_nlMutex);
+    if (batchLink(&b, ifindex, true, mtu) == 0
+            && batchAddresses(&b, RTM_NEWADDR, ifindex, addresses) == 0) {
+        ret = sendBatchLocked(&b, NULL) == 0 ? 0 : -1;
+    } else {
+        errno = ENOBUFS;
+    }
+    pthread_mutex_unlock(&s_nlMutex);
+
+    if (ret < 0) {
+        RLOGE("failed to configure %s: %s", ifname, strerror(errno));
+    }
+    return ret;
+}
+
+int netlink_deconfigure(const char *ifname, const char *addresses)
+{
+    NlBatch b;
+    int ifindex, ret = -1;
+
+    if ((ifindex = ifindexFromName(ifname)) == 0) {
+        return -1;
+    }
+
+    b.len = 0;
+    b.count = 0;
+    pthread_mutex_lock(&s_nlMutex);
+    if (batchAddresses(&b, RTM_DELADDR, ifindex, addresses) == 0
+            && batchLink(&b, ifindex, false, 0) == 0) {
+        ret = sendBatchLocked(&b, NULL) == 0 ? 0 : -1;
+    } else {
+        errno = ENOBUFS;
+    }
+    pthread_mutex_unlock(&s_nlMutex);
+
+    if (ret < 0) {
+        RLOGE("failed to deconfigure %s: %s", ifname, strerror(errno));
+    }
+    return ret;
+}
+
+/** returns true if an RTM_NEWLINK message is about ifname with flags set */
+static bool linkEventMatches(const struct nlmsghdr *nlh, const char *ifname,
+                             unsigned int flags)
+{
+    const struct ifinfomsg *ifi = (const struct ifinfomsg *)NLMSG_DATA(nlh);
+    const struct rtattr *rta;
+    int len = IFLA_PAYLOAD(nlh);
+
+    if (nlh->nlmsg_type != RTM_NEWLINK || (ifi->ifi_flags & flags) != flags) {
+        return false;
+    }
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            return strncmp((const char *)RTA_DATA(rta), ifname,
+                           RTA_PAYLOAD(rta)) == 0;
+        }
+    }
+    return false;
+}
+
+int netlink_wait_link(const char *ifname, unsigned int flags, int timeoutMs)
+{
+    uint32_t buf[NL_BUF_SIZE / sizeof(uint32_t)];
+    int64_t deadline = monotonicMsec() + timeoutMs;
+    struct ifinfomsg ifi;
+    struct nlmsghdr *nlh;
+    unsigned int current = 0;
+    NlBatch b;
+    ssize_t len;
+    int ret = -1, remaining;
+
+    pthread_mutex_lock(&s_nlMonitorMutex);
+    if (s_nlMonitorFd < 0
+            && (s_nlMonitorFd = openSocket(RTMGRP_LINK, SOCK_NONBLOCK)) < 0) {
+        goto done;
+    }
+
+    /* drop old events, then look at the current state */
+    while (recv(s_nlMonitorFd, buf, sizeof(buf), 0) > 0);
+
+    memset(&ifi, 0, sizeof(ifi));
+    ifi.ifi_family = AF_UNSPEC;
+    b.len = 0;
+    b.count = 0;
+    nlh = batchAdd(&b, RTM_GETLINK, 0, &ifi, sizeof(ifi));
+    if (nlh != NULL
+            && batchAttr(&b, nlh, IFLA_IFNAME, ifname, strlen(ifname) + 1) == 0) {
+        pthread_mutex_lock(&s_nlMutex);
+        /* fails with ENODEV until the interface shows up */
+        if (sendBatchLocked(&b, &current) == 0 && (current & flags) == flags) {
+            ret = 0;
+        }
+        pthread_mutex_unlock(&s_nlMutex);
+    }
+
+    while (ret < 0) {
+        struct pollfd pfd = { .fd = s_nlMonitorFd, .events = POLLIN };
+
+        remaining = (int)(deadline - monotonicMsec());
+        if (remaining <= 0) {
+            RLOGE("timed out waiting for %s flags 0x%x", ifname, flags);
+            errno = ETIMEDOUT;
+            break;
+        }
+        if (poll(&pfd, 1, remaining) < 0 && errno != EINTR) {
+            break;
+        }
+
+        while (ret < 0 && (len = recv(s_nlMonitorFd, buf, sizeof(buf), 0)) > 0) {
+            for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, (size_t)len);
+                 nlh = NLMSG_NEXT(nlh, len)) {
+                if (linkEventMatches(nlh, ifname, flags)) {
+                    ret = 0;
+                    break;
+                }
+            }
+        }
+    }
+
+done:
+    pthread_mutex_unlock(&s_nlMonitorMutex);
+    return ret;
+}
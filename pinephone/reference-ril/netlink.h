@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * rtnetlink helper for the data interface. All requests go through one
+ * persistent NETLINK_ROUTE socket; link events are received on a second
+ * socket subscribed to RTMGRP_LINK. Functions return 0 on success and
+ * -1 with errno set on failure (ENODEV if the interface doesn't exist).
+ */
+
+/** Set the link up or down and, if mtu > 0, its MTU */
+int netlink_set_link(const char *ifname, bool up, int mtu);
+
+/**
+ * Configure a data interface in a single batch: set the MTU (if > 0),
+ * bring the link up and add addresses. addresses is a space separated
+ * list of IPv4 or IPv6 addresses, optionally with a "/prefix" suffix.
+ * Routes are left to netd, which gets the gateways with the data call.
+ */
+int netlink_configure(const char *ifname, const char *addresses, int mtu);
+
+/** Remove addresses (as passed to netlink_configure) and set the link down */
+int netlink_deconfigure(const char *ifname, const char *addresses);
+
+/**
+ * Wait until the interface exists and has all IFF_* bits in flags set,
+ * using link events rather than polling.
+ * returns 0 once the state is reached, -1 on timeout (ETIMEDOUT) or error
+ */
+int netlink_wait_link(const char *ifname, unsigned int flags, int timeoutMs);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,592 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "qmi.h"
+#include "misc.h"
+#include "netlink.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#define QMI_BUF_SIZE            2048
+#define QMI_TIMEOUT_MS          5000
+/* network attach can take a while on a weak signal */
+#define QMI_START_TIMEOUT_MS    40000
+
+#define QMUX_IF_TYPE            0x01
+#define QMUX_HDR_LEN            6   /* if_type, len, flags, service, client */
+#define QMI_CTL_HDR_LEN         6   /* flags, txn (u8), msg id, tlv len */
+#define QMI_SVC_HDR_LEN         7   /* flags, txn (u16), msg id, tlv len */
+
+#define QMI_SVC_CTL             0x00
+#define QMI_SVC_WDS             0x01
+#define QMI_SVC_NAS             0x03
+#define QMI_SVC_WDA             0x1a
+
+#define QMI_CTL_GET_CLIENT_ID   0x0022
+#define QMI_CTL_RELEASE_CLIENT_ID 0x0023
+#define QMI_CTL_SYNC            0x0027
+
+#define QMI_WDS_START_NETWORK   0x0020
+#define QMI_WDS_STOP_NETWORK    0x0021
+#define QMI_WDS_GET_RUNTIME_SETTINGS 0x002d
+#define QMI_WDS_SET_IP_FAMILY   0x004d
+
+#define QMI_NAS_GET_SERVING_SYSTEM 0x0024
+
+#define QMI_WDA_SET_DATA_FORMAT 0x0020
+
+#define QMI_TLV_RESULT          0x02
+
+/* QMI_WDS_GET_RUNTIME_SETTINGS requested settings */
+#define WDS_SETTINGS_DNS        (1 << 4)
+#define WDS_SETTINGS_IP_ADDRESS (1 << 8)
+#define WDS_SETTINGS_GATEWAY    (1 << 9)
+#define WDS_SETTINGS_MTU        (1 << 13)
+
+#define WDA_LINK_LAYER_RAW_IP   2
+
+struct QmiDevice {
+    int fd;
+    pthread_mutex_t mutex;
+    uint8_t ctlTxn;
+    uint16_t txn;
+    uint8_t wdsClient;
+    uint8_t nasClient;
+    uint8_t wdaClient;
+};
+
+/* request TLVs under construction */
+typedef struct {
+    uint8_t buf[512];
+    size_t len;
+    bool overflow;
+} QmiTlvs;
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void tlvAdd(QmiTlvs *t, uint8_t type, const void *data, size_t len)
+{
+    if (t->len + 3 + len > sizeof(t->buf)) {
+        t->overflow = true;
+        return;
+    }
+    t->buf[t->len] = type;
+    put16(t->buf + t->len + 1, len);
+    memcpy(t->buf + t->len + 3, data, len);
+    t->len += 3 + len;
+}
+
+static void tlvAddU8(QmiTlvs *t, uint8_t type, uint8_t value)
+{
+    tlvAdd(t, type, &value, 1);
+}
+
+static void tlvAddU32(QmiTlvs *t, uint8_t type, uint32_t value)
+{
+    uint8_t le[4] = { value & 0xff, (value >> 8) & 0xff,
+                      (value >> 16) & 0xff, value >> 24 };
+    tlvAdd(t, type, le, sizeof(le));
+}
+
+/** returns the value of TLV type and its length, NULL if absent */
+static const uint8_t *tlvFind(const uint8_t *tlvs, size_t len, uint8_t type,
+                              size_t *p_len)
+{
+    size_t off = 0, tlen;
+
+    while (off + 3 <= len) {
+        tlen = get16(tlvs + off + 1);
+        if (off + 3 + tlen > len) {
+            break;
+        }
+        if (tlvs[off] == type) {
+            *p_len = tlen;
+            return tlvs + off + 3;
+        }
+        off += 3 + tlen;
+    }
+    return NULL;
+}
+
+static int writeAll(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        do {
+            written = write(fd, buf, len);
+        } while (written < 0 && errno == EINTR);
+        if (written < 0) {
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/**
+ * Send a request and wait for its response, skipping indications and
+ * responses to other transactions. The response TLVs are copied to resp
+ * and their length stored in *p_len, also if the result TLV reports a
+ * failure; *p_error receives the QMI error code (-1 if there is none).
+ *
+ * Must be called with dev->mutex held.
+ * returns 0 on success, -1 on failure
+ */
+static int transactLocked(QmiDevice *dev, uint8_t service, uint8_t client,
+                          uint16_t msgId, const QmiTlvs *tlvs, int timeoutMs,
+                          uint8_t *resp, size_t respCap, size_t *p_len,
+                          int *p_error)
+{
+    uint8_t buf[QMI_BUF_SIZE];
+    size_t hdrLen = QMUX_HDR_LEN +
+            (service == QMI_SVC_CTL ? QMI_CTL_HDR_LEN : QMI_SVC_HDR_LEN);
+    size_t total = hdrLen + tlvs->len;
+    uint16_t txn, rTlvLen;
+    const uint8_t *result;
+    size_t resultLen;
+    int64_t deadline;
+    ssize_t len;
+
+    *p_error = -1;
+    *p_len = 0;
+    if (tlvs->overflow || total > sizeof(buf)) {
+        RLOGE("QMI request 0x%04x too large", msgId);
+        return -1;
+    }
+
+    buf[0] = QMUX_IF_TYPE;
+    put16(buf + 1, total - 1);
+    buf[3] = 0x00;              /* sent by control point */
+    buf[4] = service;
+    buf[5] = client;
+    if (service == QMI_SVC_CTL) {
+        if (++dev->ctlTxn == 0) dev->ctlTxn = 1;
+        txn = dev->ctlTxn;
+        buf[6] = 0x00;
+        buf[7] = (uint8_t)txn;
+        put16(buf + 8, msgId);
+        put16(buf + 10, tlvs->len);
+    } else {
+        if (++dev->txn == 0) dev->txn = 1;
+        txn = dev->txn;
+        buf[6] = 0x00;
+        put16(buf + 7, txn);
+        put16(buf + 9, msgId);
+        put16(buf + 11, tlvs->len);
+    }
+    memcpy(buf + hdrLen, tlvs->buf, tlvs->len);
+
+    if (writeAll(dev->fd, buf, total) < 0) {
+        RLOGE("QMI write failed: %s", strerror(errno));
+        return -1;
+    }
+
+    deadline = monotonicMsec() + timeoutMs;
+    for (;;) {
+        struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+        int remaining = (int)(deadline - monotonicMsec());
+        uint16_t rTxn, rMsgId;
+        uint8_t rFlags;
+
+        if (remaining <= 0) {
+            RLOGE("QMI request 0x%04x to service %d timed out", msgId, service);
+            return -1;
+        }
+        if (poll(&pfd, 1, remaining) <= 0) {
+            continue;
+        }
+
+        /* cdc-wdm hands out one complete QMUX message per read */
+        do {
+            len = read(dev->fd, buf, sizeof(buf));
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+            RLOGE("QMI read failed: %s", strerror(errno));
+            return -1;
+        }
+        if ((size_t)len < hdrLen || buf[0] != QMUX_IF_TYPE
+                || buf[4] != service || (service != QMI_SVC_CTL && buf[5] != client)) {
+            continue;
+        }
+
+        if (service == QMI_SVC_CTL) {
+            rFlags = buf[6];
+            rTxn = buf[7];
+            rMsgId = get16(buf + 8);
+            rTlvLen = get16(buf + 10);
+            if (!(rFlags & 0x01)) continue;     /* not a response */
+        } else {
+            rFlags = buf[6];
+            rTxn = get16(buf + 7);
+            rMsgId = get16(buf + 9);
+            rTlvLen = get16(buf + 11);
+            if (!(rFlags & 0x02)) continue;     /* not a response */
+        }
+        if (rTxn != txn || rMsgId != msgId) {
+            continue;
+        }
+        if (hdrLen + rTlvLen > (size_t)len || rTlvLen > respCap) {
+            RLOGE("QMI response 0x%04x malformed", msgId);
+            return -1;
+        }
+        memcpy(resp, buf + hdrLen, rTlvLen);
+        *p_len = rTlvLen;
+        break;
+    }
+
+    result = tlvFind(resp, rTlvLen, QMI_TLV_RESULT, &resultLen);
+    if (result == NULL || resultLen < 4) {
+        RLOGE("QMI response 0x%04x without result", msgId);
+        return -1;
+    }
+    *p_error = get16(result + 2);
+    if (get16(result) != 0) {
+        RLOGE("QMI request 0x%04x to service %d failed: error 0x%x",
+              msgId, service, *p_error);
+        return -1;
+    }
+    return 0;
+}
+
+/** like transactLocked() for callers not holding the mutex */
+static int transact(QmiDevice *dev, uint8_t service, uint8_t client,
+                    uint16_t msgId, const QmiTlvs *tlvs, int timeoutMs,
+                    uint8_t *resp, size_t respCap, size_t *p_len, int *p_error)
+{
+    int ret;
+
+    pthread_mutex_lock(&dev->mutex);
+    ret = transactLocked(dev, service, client, msgId, tlvs, timeoutMs,
+                         resp, respCap, p_len, p_error);
+    pthread_mutex_unlock(&dev->mutex);
+    return ret;
+}
+
+static int allocateClient(QmiDevice *dev, uint8_t service, uint8_t *p_client)
+{
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    const uint8_t *value;
+    size_t vlen, len;
+    int error;
+
+    tlvAddU8(&tlvs, 0x01, service);
+    if (transact(dev, QMI_SVC_CTL, 0, QMI_CTL_GET_CLIENT_ID, &tlvs,
+                 QMI_TIMEOUT_MS, resp, sizeof(resp), &len, &error) < 0) {
+        return -1;
+    }
+    value = tlvFind(resp, len, 0x01, &vlen);
+    if (value == NULL || vlen < 2 || value[0] != service) {
+        return -1;
+    }
+    *p_client = value[1];
+    return 0;
+}
+
+static void releaseClient(QmiDevice *dev, uint8_t service, uint8_t client)
+{
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    uint8_t id[2] = { service, client };
+    size_t len;
+    int error;
+
+    if (client == 0) {
+        return;
+    }
+    tlvAdd(&tlvs, 0x01, id, sizeof(id));
+    transact(dev, QMI_SVC_CTL, 0, QMI_CTL_RELEASE_CLIENT_ID, &tlvs,
+             QMI_TIMEOUT_MS, resp, sizeof(resp), &len, &error);
+}
+
+QmiDevice *qmi_open(const char *path)
+{
+    QmiDevice *dev;
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    size_t len;
+    int error;
+
+    dev = (QmiDevice *)calloc(1, sizeof(*dev));
+    if (dev == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&dev->mutex, NULL);
+
+    dev->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (dev->fd < 0) {
+        RLOGE("failed to open %s: %s", path, strerror(errno));
+        free(dev);
+        return NULL;
+    }
+
+    /* drops clients left allocated by a previous instance of the RIL */
+    if (transact(dev, QMI_SVC_CTL, 0, QMI_CTL_SYNC, &tlvs, QMI_TIMEOUT_MS,
+                 resp, sizeof(resp), &len, &error) < 0) {
+        RLOGE("QMI sync on %s failed", path);
+        goto error;
+    }
+
+    if (allocateClient(dev, QMI_SVC_WDS, &dev->wdsClient) < 0
+            || allocateClient(dev, QMI_SVC_NAS, &dev->nasClient) < 0
+            || allocateClient(dev, QMI_SVC_WDA, &dev->wdaClient) < 0) {
+        RLOGE("failed to allocate QMI clients on %s", path);
+        goto error;
+    }
+
+    RLOGI("QMI device %s ready (wds %d, nas %d, wda %d)", path,
+          dev->wdsClient, dev->nasClient, dev->wdaClient);
+    return dev;
+
+error:
+    qmi_close(dev);
+    return NULL;
+}
+
+void qmi_close(QmiDevice *dev)
+{
+    if (dev == NULL) {
+        return;
+    }
+    releaseClient(dev, QMI_SVC_WDS, dev->wdsClient);
+    releaseClient(dev, QMI_SVC_NAS, dev->nasClient);
+    releaseClient(dev, QMI_SVC_WDA, dev->wdaClient);
+    close(dev->fd);
+    pthread_mutex_destroy(&dev->mutex);
+    free(dev);
+}
+
+int qmi_set_raw_ip(QmiDevice *dev, const char *ifname)
+{
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    const uint8_t *value;
+    char path[128];
+    size_t vlen, len;
+    int error, fd;
+
+    tlvAddU32(&tlvs, 0x11, WDA_LINK_LAYER_RAW_IP);
+    tlvAddU32(&tlvs, 0x12, 0);      /* no uplink aggregation */
+    tlvAddU32(&tlvs, 0x13, 0);      /* no downlink aggregation */
+    if (transact(dev, QMI_SVC_WDA, dev->wdaClient, QMI_WDA_SET_DATA_FORMAT,
+                 &tlvs, QMI_TIMEOUT_MS, resp, sizeof(resp), &len, &error) < 0) {
+        return -1;
+    }
+    value = tlvFind(resp, len, 0x11, &vlen);
+    if (value != NULL && vlen >= 4 && get32(value) != WDA_LINK_LAYER_RAW_IP) {
+        RLOGE("modem refused raw IP, link layer protocol %u", get32(value));
+        return -1;
+    }
+
+    /* qmi_wwan only accepts the framing change while the link is down */
+    netlink_set_link(ifname, false, 0);
+    snprintf(path, sizeof(path), "/sys/class/net/%s/qmi/raw_ip", ifname);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || writeAll(fd, (const uint8_t *)"Y", 1) < 0) {
+        RLOGE("failed to enable raw IP on %s: %s", ifname, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int qmi_get_serving_system(QmiDevice *dev, QmiServingSystem *ss)
+{
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    const uint8_t *value;
+    size_t vlen, len;
+    int error;
+
+    if (transact(dev, QMI_SVC_NAS, dev->nasClient, QMI_NAS_GET_SERVING_SYSTEM,
+                 &tlvs, QMI_TIMEOUT_MS, resp, sizeof(resp), &len, &error) < 0) {
+        return -1;
+    }
+
+    // registration state, CS attach, PS attach, network, n, radio_if[n]
+    value = tlvFind(resp, len, 0x01, &vlen);
+    if (value == NULL || vlen < 5) {
+        return -1;
+    }
+    ss->registrationState = value[0];
+    ss->csAttachState = value[1];
+    ss->psAttachState = value[2];
+    ss->radioInterface = (value[4] > 0 && vlen >= 6) ? value[5] : -1;
+    return 0;
+}
+
+int qmi_start_network(QmiDevice *dev, const QmiStartParams *params,
+                      uint32_t *p_handle, int *p_endReason)
+{
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    const uint8_t *value;
+    size_t vlen, len;
+    int error, ret = -1;
+
+    *p_endReason = -1;
+
+    pthread_mutex_lock(&dev->mutex);
+
+    /* the family preference is per client and must precede the start */
+    tlvAddU8(&tlvs, 0x01, params->ipFamily == 6 ? 6 : 4);
+    if (transactLocked(dev, QMI_SVC_WDS, dev->wdsClient, QMI_WDS_SET_IP_FAMILY,
+                       &tlvs, QMI_TIMEOUT_MS, resp, sizeof(resp), &len, &error) < 0) {
+        goto done;
+    }
+
+    tlvs.len = 0;
+    if (params->apn != NULL) {
+        tlvAdd(&tlvs, 0x14, params->apn, strlen(params->apn));
+    }
+    /* RIL and QMI agree on the bits: PAP 1, CHAP 2 */
+    tlvAddU8(&tlvs, 0x16, params->authType & 0x03);
+    if (params->username != NULL && params->username[0] != '\0') {
+        tlvAdd(&tlvs, 0x17, params->username, strlen(params->username));
+    }
+    if (params->password != NULL && params->password[0] != '\0') {
+        tlvAdd(&tlvs, 0x18, params->password, strlen(params->password));
+    }
+    tlvAddU8(&tlvs, 0x19, params->ipFamily == 6 ? 6 : 4);
+    if (params->profileIndex > 0) {
+        tlvAddU8(&tlvs, 0x31, params->profileIndex);
+    }
+
+    if (transactLocked(dev, QMI_SVC_WDS, dev->wdsClient, QMI_WDS_START_NETWORK,
+                       &tlvs, QMI_START_TIMEOUT_MS, resp, sizeof(resp), &len,
+                       &error) < 0) {
+        /* the response TLVs are valid even if the result is a failure */
+        value = tlvFind(resp, len, 0x10, &vlen);
+        if (error > 0 && value != NULL && vlen >= 2) {
+            *p_endReason = get16(value);
+        }
+        goto done;
+    }
+
+    value = tlvFind(resp, len, 0x01, &vlen);
+    if (value == NULL || vlen < 4) {
+        goto done;
+    }
+    *p_handle = get32(value);
+    ret = 0;
+
+done:
+    pthread_mutex_unlock(&dev->mutex);
+    return ret;
+}
+
+int qmi_stop_network(QmiDevice *dev, uint32_t handle)
+{
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    size_t len;
+    int error;
+
+    tlvAddU32(&tlvs, 0x01, handle);
+    return transact(dev, QMI_SVC_WDS, dev->wdsClient, QMI_WDS_STOP_NETWORK,
+                    &tlvs, QMI_TIMEOUT_MS, resp, sizeof(resp), &len, &error) < 0 ? -1 : 0;
+}
+
+/** IPv4 addresses are sent as little endian integers */
+static void formatIpv4(const uint8_t *value, char *out, size_t outlen)
+{
+    struct in_addr addr;
+
+    addr.s_addr = htonl(get32(value));
+    inet_ntop(AF_INET, &addr, out, outlen);
+}
+
+int qmi_get_runtime_settings(QmiDevice *dev, QmiRuntimeSettings *rs)
+{
+    QmiTlvs tlvs = { .len = 0 };
+    uint8_t resp[QMI_BUF_SIZE];
+    char addr[INET6_ADDRSTRLEN];
+    const uint8_t *value;
+    size_t vlen, len;
+    int error;
+
+    memset(rs, 0, sizeof(*rs));
+
+    tlvAddU32(&tlvs, 0x10, WDS_SETTINGS_DNS | WDS_SETTINGS_IP_ADDRESS
+              | WDS_SETTINGS_GATEWAY | WDS_SETTINGS_MTU);
+    if (transact(dev, QMI_SVC_WDS, dev->wdsClient, QMI_WDS_GET_RUNTIME_SETTINGS,
+                 &tlvs, QMI_TIMEOUT_MS, resp, sizeof(resp), &len, &error) < 0) {
+        return -1;
+    }
+
+    if ((value = tlvFind(resp, len, 0x1e, &vlen)) != NULL && vlen >= 4) {
+        const uint8_t *mask;
+        size_t mlen;
+        int prefix = 32;
+
+        formatIpv4(value, addr, sizeof(addr));
+        mask = tlvFind(resp, len, 0x21, &mlen);
+        if (mask != NULL && mlen >= 4) {
+            prefix = __builtin_popcount(get32(mask));
+        }
+        snprintf(rs->address, sizeof(rs->address), "%s/%d", addr, prefix);
+
+        if ((value = tlvFind(resp, len, 0x20, &vlen)) != NULL && vlen >= 4) {
+            formatIpv4(value, rs->gateway, sizeof(rs->gateway));
+        }
+        if ((value = tlvFind(resp, len, 0x15, &vlen)) != NULL && vlen >= 4) {
+            formatIpv4(value, rs->dns1, sizeof(rs->dns1));
+        }
+        if ((value = tlvFind(resp, len, 0x16, &vlen)) != NULL && vlen >= 4) {
+            formatIpv4(value, rs->dns2, sizeof(rs->dns2));
+        }
+    } else if ((value = tlvFind(resp, len, 0x25, &vlen)) != NULL && vlen >= 17) {
+        /* IPv6 address and gateway carry the prefix length in byte 16 */
+        inet_ntop(AF_INET6, value, addr, sizeof(addr));
+        snprintf(rs->address, sizeof(rs->address), "%s/%d", addr, value[16]);
+
+        if ((value = tlvFind(resp, len, 0x26, &vlen)) != NULL && vlen >= 16) {
+            inet_ntop(AF_INET6, value, rs->gateway, sizeof(rs->gateway));
+        }
+        if ((value = tlvFind(resp, len, 0x27, &vlen)) != NULL && vlen >= 16) {
+            inet_ntop(AF_INET6, value, rs->dns1, sizeof(rs->dns1));
+        }
+        if ((value = tlvFind(resp, len, 0x28, &vlen)) != NULL && vlen >= 16) {
+            inet_ntop(AF_INET6, value, rs->dns2, sizeof(rs->dns2));
+        }
+    } else {
+        RLOGE("QMI runtime settings without an IP address");
+        return -1;
+    }
+
+    if ((value = tlvFind(resp, len, 0x29, &vlen)) != NULL && vlen >= 4) {
+        rs->mtu = (int)get32(value);
+    }
+    return 0;
+}
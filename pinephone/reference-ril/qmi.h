@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Minimal QMI client for the data path on the QMUX control device
+ * (/dev/cdc-wdm0 on the EG25). It holds one client of each of the WDS,
+ * NAS and WDA services; requests are synchronous and serialized per
+ * device. Functions return 0 on success and -1 on failure.
+ */
+typedef struct QmiDevice QmiDevice;
+
+/* NAS serving system, values as defined by QMI */
+typedef struct {
+    int registrationState;  /* 1 registered */
+    int csAttachState;      /* 1 attached, 2 detached */
+    int psAttachState;      /* 1 attached, 2 detached */
+    int radioInterface;     /* first radio interface in use, -1 if none */
+} QmiServingSystem;
+
+typedef struct {
+    const char *apn;
+    const char *username;   /* may be NULL */
+    const char *password;   /* may be NULL */
+    int authType;           /* RIL auth type: 0 none, 1 PAP, 2 CHAP, 3 both */
+    int ipFamily;           /* 4 or 6 */
+    int profileIndex;       /* 3GPP profile (cid) to use, 0 for default */
+} QmiStartParams;
+
+/* WDS runtime settings formatted as text, empty strings if not reported */
+typedef struct {
+    char address[INET6_ADDRSTRLEN + 4];     /* with "/prefix" */
+    char gateway[INET6_ADDRSTRLEN];
+    char dns1[INET6_ADDRSTRLEN];
+    char dns2[INET6_ADDRSTRLEN];
+    int mtu;                                /* 0 if not reported */
+} QmiRuntimeSettings;
+
+/**
+ * Open the QMUX device, release stale clients of an earlier instance and
+ * allocate the service clients.
+ * returns NULL on failure
+ */
+QmiDevice *qmi_open(const char *path);
+
+/** Release the service clients and close the device */
+void qmi_close(QmiDevice *dev);
+
+/**
+ * Switch the modem and the network interface (via the qmi_wwan sysfs
+ * knob) to raw IP framing. Sets the interface down.
+ */
+int qmi_set_raw_ip(QmiDevice *dev, const char *ifname);
+
+int qmi_get_serving_system(QmiDevice *dev, QmiServingSystem *ss);
+
+/**
+ * Start a packet data session. On failure *p_endReason receives the call
+ * end reason reported by the modem (or -1).
+ */
+int qmi_start_network(QmiDevice *dev, const QmiStartParams *params,
+                      uint32_t *p_handle, int *p_endReason);
+
+int qmi_stop_network(QmiDevice *dev, uint32_t handle);
+
+/** Read IP address, gateway, DNS servers and MTU of the current session */
+int qmi_get_runtime_settings(QmiDevice *dev, QmiRuntimeSettings *rs);
+
+#ifdef __cplusplus
+}
+#endif
@@ -19,6 +19,7 @@
 #include <telephony/librilutils.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -31,14 +32,24 @@
 #include <alloca.h>
 #include "atchannel.h"
 #include "at_tok.h"
-#include "base64util.h"
+#include "hexutil.h"
 #include "misc.h"
+#include "netlink.h"
+#include "qmi.h"
+#include "request_stats.h"
+#include "ril_boottime.h"
+#include "sim_auth.h"
+#include "sim_cache.h"
+#include "sms_submit.h"
+#include "urc_dispatch.h"
+#include "workqueue.h"
 #include <getopt.h>
 #include <sys/socket.h>
 #include <cutils/properties.h>
 #include <cutils/sockets.h>
 #include <termios.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -75,6 +86,9 @@ static void *noopRemoveWarning( void *a ) { return a; }
 // Default MTU value
 #define DEFAULT_MTU 1500
 
+// How long data call setup waits for the data interface to come up
+#define DATA_LINK_TIMEOUT_MS 10000
+
 #ifdef USE_TI_COMMANDS
 
 // Enable a workaround
@@ -296,14 +310,13 @@ static void onCancel (RIL_Token t);
 static const char *getVersion();
 static int isRadioOn();
 static SIM_Status getSIMStatus();
+static void invalidateSimState();
 static int getCardStatus(RIL_CardStatus_v1_5 **pp_card_status);
 static void freeCardStatus(RIL_CardStatus_v1_5 *p_card_status);
 static void onDataCallListChanged(void *param);
 bool areUiccApplicationsEnabled = true;
 
 extern const char * requestToString(int request);
-extern uint8_t hexCharToInt(uint8_t c);
-extern uint8_t * convertHexStringToBytes(void *response, size_t responseLen);
 
 /*** Static Variables ***/
 static const RIL_RadioFunctions s_callbacks = {
@@ -318,9 +331,16 @@ static const RIL_RadioFunctions s_callbacks = {
 #ifdef RIL_SHLIB
 static const struct RIL_Env *s_rilenv;
 
-#define RIL_onRequestComplete(t, e, response, responselen) s_rilenv->OnRequestComplete(t,e, response, responselen)
+#define RIL_onRequestComplete(t, e, response, responselen) completeRequest(t, e, response, responselen)
 #define RIL_onUnsolicitedResponse(a,b,c) s_rilenv->OnUnsolicitedResponse(a,b,c)
 #define RIL_requestTimedCallback(a,b,c) s_rilenv->RequestTimedCallback(a,b,c)
+
+/** Complete a request, accounting it in the request statistics */
+static void completeRequest(RIL_Token t, RIL_Errno e, void *response, size_t responselen)
+{
+    request_stats_complete(t, e, at_thread_command_time_us());
+    s_rilenv->OnRequestComplete(t, e, response, responselen);
+}
 #endif
 
 static RIL_RadioState sState = RADIO_STATE_UNAVAILABLE;
@@ -341,7 +361,31 @@ static int sFD;     /* file desc of AT channel */
 static char sATBuffer[MAX_AT_RESPONSE+1];
 static char *sATBufferCur = NULL;
 
-static const struct timeval TIMEVAL_SIMPOLL = {1,0};
+/*
+ * SIM state as last reported by the modem, without the radio state
+ * applied. Kept up to date from +CPIN/+QUSIM/+QSIMSTAT URCs, PIN entry
+ * results and radio state changes so readers need no AT traffic;
+ * AT+CPIN? is only sent after a transition invalidated it.
+ */
+static pthread_mutex_t s_simStateMutex = PTHREAD_MUTEX_INITIALIZER;
+static SIM_Status s_simState = SIM_NOT_READY;
+static bool s_simStateValid = false;
+
+/*
+ * SIM bring-up is driven by +CPIN: READY and +QIND: SMS DONE/PB DONE.
+ * pollSIMState() only keeps polling as a fallback, backing off from
+ * SIM_POLL_INITIAL_MS to SIM_POLL_MAX_MS. Every kick bumps
+ * s_simPollGen so stale timers become no-ops. Both the generation and
+ * s_simPollDelayMs are guarded by s_simStateMutex, since kicks come from
+ * the reader thread.
+ */
+#define SIM_POLL_INITIAL_MS 1000
+#define SIM_POLL_MAX_MS 16000
+static unsigned int s_simPollGen = 0;
+static int s_simPollDelayMs = SIM_POLL_INITIAL_MS;
+static bool s_simReadyDone = false;
+static int64_t s_radioOnTimeMs = -1;
+
 static const struct timeval TIMEVAL_CALLSTATEPOLL = {0,500000};
 static const struct timeval TIMEVAL_0 = {0,0};
 
@@ -366,13 +410,33 @@ static int s_repollCallsCount = 0;
 static int s_expectAnswer = 0;
 #endif /* WORKAROUND_ERRONEOUS_ANSWER */
 
+/* call indices are 1..7 (3GPP TS 22.030 allows up to 7 calls) */
+#define MAX_CALLS 7
+#define MAX_CALL_NUMBER_LEN 64
+
+typedef struct {
+    bool used;
+    RIL_Call call;
+    char number[MAX_CALL_NUMBER_LEN];
+} CallEntry;
+
+/*
+ * Current calls, maintained from ^DSCI call status URCs and served to
+ * GET_CURRENT_CALLS without AT traffic. When s_callTableValid is false
+ * (startup, missed events, modem without ^DSCI) the next request resyncs
+ * it with AT+CLCC. s_callTableGen changes with every URC update so a
+ * resync racing with an URC can be detected.
+ */
+static pthread_mutex_t s_callTableMutex = PTHREAD_MUTEX_INITIALIZER;
+static CallEntry s_calls[MAX_CALLS];
+static bool s_callTableValid = false;
+static unsigned int s_callTableGen = 0;
+static bool s_callUrcSupported = false;
 
 static int s_cell_info_rate_ms = INT_MAX;
 static int s_mcc = 0;
 static int s_mnc = 0;
 static int s_mncLength = 2;
-static int s_lac = 0;
-static int s_cid = 0;
 
 // STK
 static bool s_stkServiceRunning = false;
@@ -404,24 +468,60 @@ enum PDPState {
     PDP_BUSY,
 };
 
+#define PDP_TYPE_LEN    16
+#define PDP_APN_LEN     101
+#define PDP_LIST_LEN    256     /* space separated address lists */
+
+/*
+ * PDP context table. Besides the cid allocation state it caches what the
+ * modem reported for the context, so the data call list is served from
+ * memory and only contexts marked dirty by +CGEV are queried again.
+ */
 struct PDPInfo {
     int cid;
     enum PDPState state;
+    bool active;
+    bool dirty;     /* runtime settings need to be re-read */
+    char type[PDP_TYPE_LEN];
+    char apn[PDP_APN_LEN];
+    char addresses[PDP_LIST_LEN];
+    char dnses[PDP_LIST_LEN];
+    char gateways[PDP_LIST_LEN];
+    int mtu;
+    uint32_t qmiHandle;     /* WDS packet data handle, 0 if not started over QMI */
 };
 
 struct PDPInfo s_PDP[] = {
-     {1, PDP_IDLE},
-     {2, PDP_IDLE},
-     {3, PDP_IDLE},
+     {.cid = 1, .state = PDP_IDLE},
+     {.cid = 2, .state = PDP_IDLE},
+     {.cid = 3, .state = PDP_IDLE},
 };
 
+static pthread_mutex_t s_pdpMutex = PTHREAD_MUTEX_INITIALIZER;
+/* false until AT+CGACT?/AT+CGDCONT? were read, or after unknown events */
+static bool s_pdpTableValid = false;
+/* a data call list update is already scheduled */
+static bool s_pdpUpdatePending = false;
+
+/*
+ * QMI data path. When the modem's QMUX device can be opened, data calls
+ * are started with QMI WDS on the raw IP network interface instead of
+ * dialing up over the AT channel.
+ */
+static pthread_mutex_t s_qmiMutex = PTHREAD_MUTEX_INITIALIZER;
+static QmiDevice *s_qmi = NULL;
+static bool s_qmiProbed = false;
+static char s_qmiIfname[PROPERTY_VALUE_MAX];
+
 static void pollSIMState (void *param);
+static void kickSimPoll();
 static void setRadioState(RIL_RadioState newState);
 static void setRadioTechnology(ModemInfo *mdm, int newtech);
 static int query_ctec(ModemInfo *mdm, int *current, int32_t *preferred);
 static int parse_technology_response(const char *response, int *current, int32_t *preferred);
 static int techFromModemType(int mdmtype);
 static void getIccId(char *iccid, int size);
+static void requestOemHookStrings(void *data, size_t datalen, RIL_Token t);
 
 static int clccStateToRILState(int state, RIL_CallState *p_state)
 {
@@ -436,31 +536,6 @@ static int clccStateToRILState(int state, RIL_CallState *p_state)
     }
 }
 
-void convertBytesToHexString(char *bin_ptr, int length, unsigned char *hex_ptr) {
-    int i;
-    unsigned char tmp;
-
-    if (bin_ptr == NULL || hex_ptr == NULL) {
-        return;
-    }
-    for (i = 0; i < length; i++) {
-        tmp = (unsigned char)((bin_ptr[i] & 0xf0) >> 4);
-        if (tmp <= 9) {
-            *hex_ptr = (unsigned char)(tmp + '0');
-        } else {
-            *hex_ptr = (unsigned char)(tmp + 'A' - 10);
-        }
-        hex_ptr++;
-        tmp = (unsigned char)(bin_ptr[i] & 0x0f);
-        if (tmp <= 9) {
-            *hex_ptr = (unsigned char)(tmp + '0');
-        } else {
-            *hex_ptr = (unsigned char)(tmp + 'A' - 10);
-        }
-        hex_ptr++;
-    }
-}
-
 /**
  * Note: directly modified line and has *p_call point directly into
  * modified line
@@ -524,6 +599,238 @@ error:
     return -1;
 }
 
+/**
+ * Parse a ^DSCI call status indication. *p_active is set to false if
+ * the call was released, p_call is only valid otherwise.
+ * Note: has p_call->number point directly into modified line
+ */
+static int callFromDSCILine(char *line, RIL_Call *p_call, bool *p_active)
+{
+        //^DSCI: 1,0,2,0,"+18005551212",145
+        //     id,dir,stat,type,number,num_type
+
+    int err;
+    int state;
+    int type;
+
+    memset(p_call, 0, sizeof(*p_call));
+
+    err = at_tok_start(&line);
+    if (err < 0) goto error;
+
+    err = at_tok_nextint(&line, &(p_call->index));
+    if (err < 0) goto error;
+
+    err = at_tok_nextbool(&line, &(p_call->isMT));
+    if (err < 0) goto error;
+
+    err = at_tok_nextint(&line, &state);
+    if (err < 0) goto error;
+
+    /* 6 and above mean the call was released */
+    *p_active = (clccStateToRILState(state, &(p_call->state)) == 0);
+
+    err = at_tok_nextint(&line, &type);
+    if (err < 0) goto error;
+
+    p_call->isVoice = (type == 0);
+
+    if (at_tok_hasmore(&line)) {
+        err = at_tok_nextstr(&line, &(p_call->number));
+        if (err < 0) return 0;
+
+        if (p_call->number != NULL
+            && 0 == strspn(p_call->number, "+0123456789")
+        ) {
+            p_call->number = NULL;
+        }
+
+        if (at_tok_hasmore(&line)) {
+            err = at_tok_nextint(&line, &p_call->toa);
+            if (err < 0) goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    RLOGE("invalid DSCI line\n");
+    return -1;
+}
+
+static bool callEntryEquals(const CallEntry *entry, const RIL_Call *call)
+{
+    const char *number = call->number ? call->number : "";
+
+    return entry->call.state == call->state
+        && entry->call.toa == call->toa
+        && entry->call.isMpty == call->isMpty
+        && entry->call.isMT == call->isMT
+        && entry->call.isVoice == call->isVoice
+        && strncmp(entry->number, number, sizeof(entry->number)) == 0;
+}
+
+/** Must be called with s_callTableMutex held. Returns true on change. */
+static bool callTableSetLocked(const RIL_Call *call)
+{
+    CallEntry *entry;
+
+    if (call->index < 1 || call->index > MAX_CALLS) {
+        RLOGE("call index %d out of range", call->index);
+        return false;
+    }
+
+    entry = &s_calls[call->index - 1];
+    if (entry->used && callEntryEquals(entry, call)) {
+        return false;
+    }
+
+    entry->used = true;
+    entry->call = *call;
+    entry->call.name = NULL;
+    entry->call.uusInfo = NULL;
+    strlcpy(entry->number, call->number ? call->number : "",
+            sizeof(entry->number));
+    entry->call.number = NULL;
+    return true;
+}
+
+/** Must be called with s_callTableMutex held. Returns true on change. */
+static bool callTableRemoveLocked(int index)
+{
+    if (index < 1 || index > MAX_CALLS || !s_calls[index - 1].used) {
+        return false;
+    }
+    memset(&s_calls[index - 1], 0, sizeof(CallEntry));
+    return true;
+}
+
+/** Apply a call status URC. Returns true if the call table changed. */
+static bool callTableUpdate(const RIL_Call *call, bool active)
+{
+    RIL_Call update;
+    bool changed;
+
+    pthread_mutex_lock(&s_callTableMutex);
+    if (active) {
+        /* ^DSCI doesn't report multiparty, keep what +CLCC said */
+        update = *call;
+        if (call->index >= 1 && call->index <= MAX_CALLS
+                && s_calls[call->index - 1].used) {
+            update.isMpty = s_calls[call->index - 1].call.isMpty;
+        }
+        changed = callTableSetLocked(&update);
+    } else {
+        changed = callTableRemoveLocked(call->index);
+    }
+    s_callTableGen++;
+    pthread_mutex_unlock(&s_callTableMutex);
+
+    return changed;
+}
+
+/**
+ * Replace the table with an AT+CLCC result, unless an URC updated it
+ * since generation gen was read. Returns true if the table changed.
+ */
+static bool callTableReplace(const RIL_Call *calls, int count,
+                             unsigned int gen)
+{
+    bool changed = false;
+    bool seen[MAX_CALLS] = { false };
+    int i;
+
+    pthread_mutex_lock(&s_callTableMutex);
+    if (gen != s_callTableGen) {
+        /* raced with an URC, the result may be stale: retry next time */
+        pthread_mutex_unlock(&s_callTableMutex);
+        return true;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (calls[i].index >= 1 && calls[i].index <= MAX_CALLS) {
+            seen[calls[i].index - 1] = true;
+            changed |= callTableSetLocked(&calls[i]);
+        }
+    }
+    for (i = 0; i < MAX_CALLS; i++) {
+        if (!seen[i]) {
+            changed |= callTableRemoveLocked(i + 1);
+        }
+    }
+    s_callTableValid = s_callUrcSupported;
+    pthread_mutex_unlock(&s_callTableMutex);
+
+    return changed;
+}
+
+/**
+ * Copy the call table into caller provided storage.
+ * Returns the number of calls, *p_valid tells whether a resync is needed.
+ */
+static int callTableSnapshot(CallEntry *entries, RIL_Call **pp_calls,
+                             bool *p_valid, unsigned int *p_gen)
+{
+    int i, count = 0;
+
+    pthread_mutex_lock(&s_callTableMutex);
+    for (i = 0; i < MAX_CALLS; i++) {
+        if (s_calls[i].used) {
+            entries[count] = s_calls[i];
+            entries[count].call.number =
+                    entries[count].number[0] ? entries[count].number : NULL;
+            pp_calls[count] = &entries[count].call;
+            count++;
+        }
+    }
+    *p_valid = s_callTableValid;
+    *p_gen = s_callTableGen;
+    pthread_mutex_unlock(&s_callTableMutex);
+
+    return count;
+}
+
+/** Returns true if the table holds a call in one of the given states */
+static bool callTableHasState(RIL_CallState a, RIL_CallState b)
+{
+    bool found = false;
+    int i;
+
+    pthread_mutex_lock(&s_callTableMutex);
+    for (i = 0; i < MAX_CALLS && !found; i++) {
+        found = s_calls[i].used && (s_calls[i].call.state == a ||
+                                    s_calls[i].call.state == b);
+    }
+    pthread_mutex_unlock(&s_callTableMutex);
+
+    return found;
+}
+
+static void invalidateCallTable()
+{
+    pthread_mutex_lock(&s_callTableMutex);
+    s_callTableValid = false;
+    pthread_mutex_unlock(&s_callTableMutex);
+}
+
+/**
+ * Split the trailing status word off a hex encoded APDU response
+ * (as returned by +CSIM/+CGLA) in place.
+ * returns 0 on success, -1 if the response is too short or malformed
+ */
+static int parseApduStatusWord(char *hex, RIL_SIM_IO_Response *response) {
+    size_t len;
+    uint8_t sw[2];
+
+    len = strlen(hex);
+    if (len < 4 || hex_decode(hex + len - 4, 4, sw, sizeof(sw)) < 0) {
+        return -1;
+    }
+    response->sw1 = sw[0];
+    response->sw2 = sw[1];
+    return 0;
+}
+
 static int parseSimResponseLine(char* line, RIL_SIM_IO_Response* response) {
     int err;
 
@@ -541,88 +848,20 @@ static int parseSimResponseLine(char* line, RIL_SIM_IO_Response* response) {
     return 0;
 }
 
-#ifdef CUTTLEFISH_ENABLE
-static void set_Ip_Addr(const char *addr, const char* radioInterfaceName) {
-  RLOGD("%s %d setting ip addr %s on interface %s", __func__, __LINE__, addr,
-        radioInterfaceName);
-  struct ifreq request;
-  int status = 0;
-  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-  if (sock == -1) {
-    RLOGE("Failed to open interface socket: %s (%d)", strerror(errno), errno);
-    return;
-  }
-
-  memset(&request, 0, sizeof(request));
-  strncpy(request.ifr_name, radioInterfaceName, sizeof(request.ifr_name));
-  request.ifr_name[sizeof(request.ifr_name) - 1] = '\0';
-
-  char *myaddr = strdup(addr);
-  char *pch = NULL;
-  pch = strchr(myaddr, '/');
-  if (pch) {
-    *pch = '\0';
-  }
-
-  struct sockaddr_in *sin = (struct sockaddr_in *)&request.ifr_addr;
-  sin->sin_family = AF_INET;
-  sin->sin_addr.s_addr = inet_addr(myaddr);
-  if (ioctl(sock, SIOCSIFADDR, &request) < 0) {
-    RLOGE("%s: failed.", __func__);
-  }
-
-  close(sock);
-  free(myaddr);
-  RLOGD("%s %d done.", __func__, __LINE__);
-}
-#endif
-
 enum InterfaceState {
     kInterfaceUp,
     kInterfaceDown,
 };
 
+static RIL_Errno netlinkToRilErrno() {
+    return errno == ENODEV ? RIL_E_RADIO_NOT_AVAILABLE : RIL_E_GENERIC_FAILURE;
+}
+
 static RIL_Errno setInterfaceState(const char* interfaceName,
                                    enum InterfaceState state) {
-    struct ifreq request;
-    int status = 0;
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (sock == -1) {
-        RLOGE("Failed to open interface socket: %s (%d)",
-              strerror(errno), errno);
-        return RIL_E_GENERIC_FAILURE;
-    }
-
-    memset(&request, 0, sizeof(request));
-    strncpy(request.ifr_name, interfaceName, sizeof(request.ifr_name));
-    request.ifr_name[sizeof(request.ifr_name) - 1] = '\0';
-    status = ioctl(sock, SIOCGIFFLAGS, &request);
-    if (status != 0) {
-        RLOGE("Failed to get interface flags for %s: %s (%d)",
-              interfaceName, strerror(errno), errno);
-        close(sock);
-        return RIL_E_RADIO_NOT_AVAILABLE;
-    }
-
-    bool isUp = (request.ifr_flags & IFF_UP);
-    if ((state == kInterfaceUp && isUp) || (state == kInterfaceDown && !isUp)) {
-        // Interface already in desired state
-        close(sock);
-        return RIL_E_SUCCESS;
-    }
-
-    // Simply toggle the flag since we know it's the opposite of what we want
-    request.ifr_flags ^= IFF_UP;
-
-    status = ioctl(sock, SIOCSIFFLAGS, &request);
-    if (status != 0) {
-        RLOGE("Failed to set interface flags for %s: %s (%d)",
-              interfaceName, strerror(errno), errno);
-        close(sock);
-        return RIL_E_GENERIC_FAILURE;
+    if (netlink_set_link(interfaceName, state == kInterfaceUp, 0) < 0) {
+        return netlinkToRilErrno();
     }
-
-    close(sock);
     return RIL_E_SUCCESS;
 }
 
@@ -640,12 +879,27 @@ static void onRadioPowerOn()
     at_send_command("AT%CTZV=1", NULL);
 #endif
 
-    pollSIMState(NULL);
+    s_radioOnTimeMs = monotonicMsec();
+    s_simReadyDone = false;
+    kickSimPoll();
 }
 
-/** do post- SIM ready initialization */
-static void onSIMReady()
+/* new messages to the TE, or stored and announced with +CMTI */
+#define CNMI_ROUTE_DIRECT       "AT+CNMI=1,2,2,1,1"
+#define CNMI_ROUTE_STORAGE      "AT+CNMI=1,1,2,1,1"
+
+/* EF SMS, changed behind the SIM cache by AT+CMGW and AT+CMGD */
+#define EF_SMS                  0x6F3C
+
+/**
+ * do post- SIM ready initialization
+ * returns 0 on success, -1 if SMS could not be set up yet
+ */
+static int onSIMReady()
 {
+    ATResponse *p_response = NULL;
+    int err;
+
     at_send_command_singleline("AT+CSMS=1", "+CSMS:", NULL);
     /*
      * Always send SMS messages directly to the TE
@@ -657,7 +911,24 @@ static void onSIMReady()
      * ds = 1   // Status reports routed to TE
      * bfr = 1  // flush buffer
      */
-    at_send_command("AT+CNMI=1,2,2,1,1", NULL);
+    err = at_send_command(CNMI_ROUTE_DIRECT, &p_response);
+    if (err < 0 || p_response->success == 0) {
+        /* SMS not initialized yet, retried on +QIND: SMS DONE or poll */
+        at_response_free(p_response);
+        return -1;
+    }
+    at_response_free(p_response);
+
+    if (s_radioOnTimeMs >= 0) {
+        char value[PROPERTY_VALUE_MAX];
+        int64_t elapsed = monotonicMsec() - s_radioOnTimeMs;
+
+        RLOGI("SIM ready %" PRId64 " ms after radio power on", elapsed);
+        snprintf(value, sizeof(value), "%" PRId64, elapsed);
+        property_set("vendor.ril.sim_ready_ms", value);
+        s_radioOnTimeMs = -1;
+    }
+    return 0;
 }
 
 static void requestRadioPower(void *data, size_t datalen __unused, RIL_Token t)
@@ -718,6 +989,10 @@ static void requestOrSendDataCallList(int cid, RIL_Token *t);
 
 static void onDataCallListChanged(void *param __unused)
 {
+    pthread_mutex_lock(&s_pdpMutex);
+    s_pdpUpdatePending = false;
+    pthread_mutex_unlock(&s_pdpMutex);
+
     requestOrSendDataCallList(-1, NULL);
 }
 
@@ -780,235 +1055,484 @@ static void requestCallSelection(
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 }
 
+/** returns the QMI device, opening it on first use; NULL to use AT */
+static QmiDevice *getQmiDevice()
+{
+    char path[PROPERTY_VALUE_MAX];
+    QmiDevice *dev;
+
+    pthread_mutex_lock(&s_qmiMutex);
+    if (!s_qmiProbed) {
+        s_qmiProbed = true;
+        property_get("vendor.ril.qmi.device", path, "/dev/cdc-wdm0");
+        property_get("vendor.ril.qmi.ifname", s_qmiIfname, "wwan0");
+
+        s_qmi = qmi_open(path);
+        if (s_qmi != NULL && qmi_set_raw_ip(s_qmi, s_qmiIfname) < 0) {
+            qmi_close(s_qmi);
+            s_qmi = NULL;
+        }
+        RLOGI("using the %s data path", s_qmi != NULL ? "QMI" : "AT");
+    }
+    dev = s_qmi;
+    pthread_mutex_unlock(&s_qmiMutex);
+
+    return dev;
+}
+
 static const char* getRadioInterfaceName()
 {
     if (isInEmulator()) {
         return EMULATOR_RADIO_INTERFACE;
     }
+    if (getQmiDevice() != NULL) {
+        return s_qmiIfname;
+    }
     return PPP_TTY_PATH_ETH0;
 }
 
-static void requestOrSendDataCallList(int cid, RIL_Token *t)
+static struct PDPInfo *pdpFromCid(int cid)
 {
-    ATResponse *p_response = NULL;
-    ATLine *p_cur = NULL;
-    int err = -1;
-    int n = 0;
-    char *out = NULL;
-    char propValue[PROP_VALUE_MAX] = {0};
-    const char* radioInterfaceName = getRadioInterfaceName();
+    if (cid < 1 || cid > MAX_PDP) {
+        return NULL;
+    }
+    return &s_PDP[cid - 1];
+}
 
-    err = at_send_command_multiline ("AT+CGACT?", "+CGACT:", &p_response);
-    if (err != 0 || p_response->success == 0) {
-        if (t != NULL)
-            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        else
-            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                                      NULL, 0);
+/** Must be called with s_pdpMutex held */
+static void pdpClearRuntimeLocked(struct PDPInfo *pdp)
+{
+    pdp->active = false;
+    pdp->dirty = false;
+    pdp->addresses[0] = '\0';
+    pdp->dnses[0] = '\0';
+    pdp->gateways[0] = '\0';
+    pdp->mtu = 0;
+}
+
+static void invalidatePdpTable()
+{
+    pthread_mutex_lock(&s_pdpMutex);
+    s_pdpTableValid = false;
+    pthread_mutex_unlock(&s_pdpMutex);
+}
+
+/** append item to a space separated list */
+static void appendToList(char *list, size_t size, const char *item)
+{
+    if (item == NULL || item[0] == '\0') {
         return;
     }
+    if (list[0] != '\0') {
+        strlcat(list, " ", size);
+    }
+    strlcat(list, item, size);
+}
 
-    for (p_cur = p_response->p_intermediates; p_cur != NULL;
-         p_cur = p_cur->p_next)
-        n++;
+/**
+ * +CGCONTRDP reports addresses in dotted decimal unless +CGPIAF is set,
+ * with the subnet mask appended to local addresses ("a.b.c.d.m1.m2.m3.m4").
+ * Convert those to the notation Android expects (address[/prefix]);
+ * anything else is copied verbatim.
+ */
+static void formatPdpAddress(const char *in, bool withMask, char *out, size_t outlen)
+{
+    uint8_t bytes[32];
+    char addr[INET6_ADDRSTRLEN];
+    const char *p = in;
+    char *end;
+    long value;
+    int n = 0, half, prefix = 0, i;
 
-    RIL_Data_Call_Response_v11 *responses =
-        alloca(n * sizeof(RIL_Data_Call_Response_v11));
+    for (;;) {
+        if (*p < '0' || *p > '9' || n == (int)sizeof(bytes)) goto verbatim;
+        value = strtol(p, &end, 10);
+        if (value > 255) goto verbatim;
+        bytes[n++] = (uint8_t)value;
+        if (*end == '\0') break;
+        if (*end != '.') goto verbatim;
+        p = end + 1;
+    }
 
-    int i;
-    for (i = 0; i < n; i++) {
-        responses[i].status = -1;
-        responses[i].suggestedRetryTime = -1;
-        responses[i].cid = -1;
-        responses[i].active = -1;
-        responses[i].type = "";
-        responses[i].ifname = "";
-        responses[i].addresses = "";
-        responses[i].dnses = "";
-        responses[i].gateways = "";
-        responses[i].pcscf = "";
-        responses[i].mtu = 0;
-    }
-
-    RIL_Data_Call_Response_v11 *response = responses;
-    for (p_cur = p_response->p_intermediates; p_cur != NULL;
-         p_cur = p_cur->p_next) {
-        char *line = p_cur->line;
+    half = withMask ? n / 2 : n;
+    if (half != 4 && half != 16) goto verbatim;
+    if (withMask && n != 2 * half) goto verbatim;
+    if (inet_ntop(half == 4 ? AF_INET : AF_INET6, bytes, addr, sizeof(addr)) == NULL) {
+        goto verbatim;
+    }
 
-        err = at_tok_start(&line);
-        if (err < 0)
-            goto error;
+    if (withMask) {
+        for (i = half; i < n; i++) {
+            prefix += __builtin_popcount(bytes[i]);
+        }
+        snprintf(out, outlen, "%s/%d", addr, prefix);
+    } else {
+        strlcpy(out, addr, outlen);
+    }
+    return;
 
-        err = at_tok_nextint(&line, &response->cid);
-        if (err < 0)
-            goto error;
+verbatim:
+    strlcpy(out, in, outlen);
+}
 
-        err = at_tok_nextint(&line, &response->active);
-        if (err < 0)
-            goto error;
+/**
+ * Rebuild the table from AT+CGACT? and AT+CGDCONT?. Only needed at start,
+ * after radio state changes and for events the table can't follow.
+ * Active contexts are marked dirty so their settings get read.
+ * returns 0 on success, -1 on failure
+ */
+static int pdpTableSync()
+{
+    ATResponse *p_cgact = NULL;
+    ATResponse *p_cgdcont = NULL;
+    ATLine *p_cur;
+    struct PDPInfo *pdp;
+    int err, i;
 
-        response++;
-    }
+    err = at_send_command_multiline("AT+CGACT?", "+CGACT:", &p_cgact);
+    if (err != 0 || p_cgact->success == 0) goto error;
 
-    at_response_free(p_response);
+    err = at_send_command_multiline("AT+CGDCONT?", "+CGDCONT:", &p_cgdcont);
+    if (err != 0 || p_cgdcont->success == 0) goto error;
 
-    err = at_send_command_multiline ("AT+CGDCONT?", "+CGDCONT:", &p_response);
-    if (err != 0 || p_response->success == 0) {
-        if (t != NULL)
-            RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        else
-            RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                                      NULL, 0);
-        return;
+    pthread_mutex_lock(&s_pdpMutex);
+    for (i = 0; i < MAX_PDP; i++) {
+        pdpClearRuntimeLocked(&s_PDP[i]);
+        s_PDP[i].type[0] = '\0';
+        s_PDP[i].apn[0] = '\0';
     }
 
-    for (p_cur = p_response->p_intermediates; p_cur != NULL;
+    for (p_cur = p_cgact->p_intermediates; p_cur != NULL;
          p_cur = p_cur->p_next) {
         char *line = p_cur->line;
-        int ncid;
+        int cid, state;
 
-        err = at_tok_start(&line);
-        if (err < 0)
-            goto error;
+        if (at_tok_start(&line) < 0
+                || at_tok_nextint(&line, &cid) < 0
+                || at_tok_nextint(&line, &state) < 0) {
+            continue;
+        }
+        pdp = pdpFromCid(cid);
+        if (pdp != NULL) {
+            pdp->active = (state == 1);
+            pdp->dirty = pdp->active;
+        }
+    }
 
-        err = at_tok_nextint(&line, &ncid);
-        if (err < 0)
-            goto error;
+    for (p_cur = p_cgdcont->p_intermediates; p_cur != NULL;
+         p_cur = p_cur->p_next) {
+        char *line = p_cur->line;
+        char *type, *apn;
+        int cid;
 
-        if (cid != ncid)
+        if (at_tok_start(&line) < 0
+                || at_tok_nextint(&line, &cid) < 0
+                || at_tok_nextstr(&line, &type) < 0
+                || at_tok_nextstr(&line, &apn) < 0) {
             continue;
+        }
+        pdp = pdpFromCid(cid);
+        if (pdp != NULL) {
+            strlcpy(pdp->type, type, sizeof(pdp->type));
+            strlcpy(pdp->apn, apn, sizeof(pdp->apn));
+        }
+    }
+    s_pdpTableValid = true;
+    pthread_mutex_unlock(&s_pdpMutex);
 
-        i = ncid - 1;
-        // Assume no error
-        responses[i].status = 0;
-
-        // type
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
+    at_response_free(p_cgact);
+    at_response_free(p_cgdcont);
+    return 0;
 
-        int type_size = strlen(out) + 1;
-        responses[i].type = alloca(type_size);
-        strlcpy(responses[i].type, out, type_size);
+error:
+    at_response_free(p_cgact);
+    at_response_free(p_cgdcont);
+    return -1;
+}
 
-        // APN ignored for v5
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
+/**
+ * Read the runtime settings of an active context with AT+CGCONTRDP=<cid>.
+ * Dual stack contexts report one line per address family.
+ * returns 0 on success, -1 on failure
+ */
+static int pdpRefreshContext(int cid)
+{
+    ATResponse *p_response = NULL;
+    ATLine *p_cur;
+    struct PDPInfo *pdp;
+    char cmd[32];
+    char addresses[PDP_LIST_LEN] = "";
+    char dnses[PDP_LIST_LEN] = "";
+    char gateways[PDP_LIST_LEN] = "";
+    char item[PDP_LIST_LEN];
+    int mtu = 0;
+    int err;
 
-        int ifname_size = strlen(radioInterfaceName) + 1;
-        responses[i].ifname = alloca(ifname_size);
-        strlcpy(responses[i].ifname, radioInterfaceName, ifname_size);
+    snprintf(cmd, sizeof(cmd), "AT+CGCONTRDP=%d", cid);
+    err = at_send_command_multiline(cmd, "+CGCONTRDP:", &p_response);
+    if (err < 0 || p_response->success == 0) goto error;
 
-        err = at_tok_nextstr(&line, &out);
-        if (err < 0)
-            goto error;
-
-        int addresses_size = strlen(out) + 1;
-        responses[i].addresses = alloca(addresses_size);
-        strlcpy(responses[i].addresses, out, addresses_size);
-#ifdef CUTTLEFISH_ENABLE
-        set_Ip_Addr(responses[i].addresses, radioInterfaceName);
-#endif
-
-        if (isInEmulator()) {
-            /* We are in the emulator - the dns servers are listed
-                * by the following system properties, setup in
-                * /system/etc/init.goldfish.sh:
-                *  - vendor.net.eth0.dns1
-                *  - vendor.net.eth0.dns2
-                *  - vendor.net.eth0.dns3
-                *  - vendor.net.eth0.dns4
-                */
-            const int   dnslist_sz = 128;
-            char*       dnslist = alloca(dnslist_sz);
-            const char* separator = "";
-            int         nn;
-
-            dnslist[0] = 0;
-            for (nn = 1; nn <= 4; nn++) {
-                /* Probe vendor.net.eth0.dns<n> */
-                char  propName[PROP_NAME_MAX];
-                char  propValue[PROP_VALUE_MAX];
-
-                snprintf(propName, sizeof propName, "vendor.net.eth0.dns%d", nn);
-
-                /* Ignore if undefined */
-                if (property_get(propName, propValue, "") <= 0) {
-                    continue;
-                }
+    for (p_cur = p_response->p_intermediates; p_cur != NULL;
+         p_cur = p_cur->p_next) {
+        // +CGCONTRDP: <cid>,<bearer_id>,<apn>[,<local_addr and subnet_mask>
+        //     [,<gw_addr>[,<DNS_prim_addr>[,<DNS_sec_addr>[,<P-CSCF_prim_addr>
+        //     [,<P-CSCF_sec_addr>[,<IM_CN_Signalling_Flag>[,<LIPA_indication>
+        //     [,<IPv4_MTU>]]]]]]]]]
+        char *line = p_cur->line;
+        char *out;
+        int ncid, skip, i;
+
+        if (at_tok_start(&line) < 0
+                || at_tok_nextint(&line, &ncid) < 0
+                || ncid != cid
+                || at_tok_nextint(&line, &skip) < 0
+                || at_tok_nextstr(&line, &out) < 0) {
+            continue;
+        }
 
-                /* Append the DNS IP address */
-                strlcat(dnslist, separator, dnslist_sz);
-                strlcat(dnslist, propValue, dnslist_sz);
-                separator = " ";
+        if (at_tok_hasmore(&line) && at_tok_nextstr(&line, &out) == 0) {
+            formatPdpAddress(out, true, item, sizeof(item));
+            appendToList(addresses, sizeof(addresses), item);
+        }
+        if (at_tok_hasmore(&line) && at_tok_nextstr(&line, &out) == 0) {
+            formatPdpAddress(out, false, item, sizeof(item));
+            appendToList(gateways, sizeof(gateways), item);
+        }
+        for (i = 0; i < 2; i++) {
+            if (at_tok_hasmore(&line) && at_tok_nextstr(&line, &out) == 0) {
+                formatPdpAddress(out, false, item, sizeof(item));
+                appendToList(dnses, sizeof(dnses), item);
             }
-            responses[i].dnses = dnslist;
+        }
+        /* P-CSCF addresses, IM CN flag and LIPA indication */
+        for (i = 0; i < 4 && at_tok_hasmore(&line); i++) {
+            at_tok_nextstr(&line, &out);
+        }
+        if (at_tok_hasmore(&line)) {
+            at_tok_nextint(&line, &mtu);
+        }
+    }
 
-            if (property_get("vendor.net.eth0.gw", propValue, "") > 0) {
-                responses[i].gateways = propValue;
-            } else {
-                responses[i].gateways = "";
+    if (isInEmulator()) {
+        /* We are in the emulator - the dns servers are listed
+         * by the following system properties, setup in
+         * /system/etc/init.goldfish.sh:
+         *  - vendor.net.eth0.dns1
+         *  - vendor.net.eth0.dns2
+         *  - vendor.net.eth0.dns3
+         *  - vendor.net.eth0.dns4
+         */
+        char propName[PROP_NAME_MAX];
+        char propValue[PROP_VALUE_MAX];
+        int nn;
+
+        dnses[0] = '\0';
+        for (nn = 1; nn <= 4; nn++) {
+            snprintf(propName, sizeof propName, "vendor.net.eth0.dns%d", nn);
+            if (property_get(propName, propValue, "") > 0) {
+                appendToList(dnses, sizeof(dnses), propValue);
             }
-            responses[i].mtu = DEFAULT_MTU;
-        } else {
-            /* I don't know where we are, so use the public Google DNS
-                * servers by default and no gateway.
-                */
-            responses[i].dnses = "8.8.8.8 8.8.4.4";
-            responses[i].gateways = "";
         }
+        if (property_get("vendor.net.eth0.gw", propValue, "") > 0) {
+            strlcpy(gateways, propValue, sizeof(gateways));
+        }
+        mtu = DEFAULT_MTU;
+    } else if (dnses[0] == '\0') {
+        /* No DNS from the network, use the public Google DNS servers */
+        strlcpy(dnses, "8.8.8.8 8.8.4.4", sizeof(dnses));
+    }
+
+    pthread_mutex_lock(&s_pdpMutex);
+    pdp = pdpFromCid(cid);
+    if (pdp != NULL && pdp->active) {
+        strlcpy(pdp->addresses, addresses, sizeof(pdp->addresses));
+        strlcpy(pdp->dnses, dnses, sizeof(pdp->dnses));
+        strlcpy(pdp->gateways, gateways, sizeof(pdp->gateways));
+        pdp->mtu = mtu;
+        pdp->dirty = false;
     }
+    pthread_mutex_unlock(&s_pdpMutex);
 
     at_response_free(p_response);
-    p_response = NULL;
+    return 0;
 
-    char cmd[64] = {0};
-    snprintf(cmd, sizeof(cmd), "AT+CGCONTRDP=%d", cid);
-    err = at_send_command_singleline(cmd, "+CGCONTRDP:", &p_response);
-    if (err < 0 || p_response->success == 0) {
-        goto error;
+error:
+    at_response_free(p_response);
+    return -1;
+}
+
+/**
+ * Bring the table up to date: resync it if it is invalid and re-read the
+ * settings of dirty contexts only.
+ * returns 0 on success, -1 if the table could not be read
+ */
+static int pdpTableUpdate()
+{
+    bool valid, dirty;
+    int cid;
+
+    pthread_mutex_lock(&s_pdpMutex);
+    valid = s_pdpTableValid;
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    if (!valid && pdpTableSync() < 0) {
+        return -1;
     }
 
-    int skip = 0;
-    char *sskip = NULL;
-    char *input = p_response->p_intermediates->line;
+    for (cid = 1; cid <= MAX_PDP; cid++) {
+        pthread_mutex_lock(&s_pdpMutex);
+        dirty = s_PDP[cid - 1].active && s_PDP[cid - 1].dirty;
+        pthread_mutex_unlock(&s_pdpMutex);
 
-    int ncid = -1;
-    err = at_tok_start(&input);
-    if (err < 0) goto error;
+        if (dirty && pdpRefreshContext(cid) < 0) {
+            RLOGE("failed to read settings of context %d", cid);
+        }
+    }
+    return 0;
+}
 
-    err = at_tok_nextint(&input, &ncid);  // cid
-    if (err < 0) goto error;
+/**
+ * Apply the addresses, default routes and MTU of an active context to
+ * the data interface in one netlink batch.
+ */
+static void pdpConfigureInterface(int cid)
+{
+    struct PDPInfo pdp;
 
-    if (cid != ncid) goto error;
+    if (pdpTableUpdate() < 0) {
+        return;
+    }
 
-    i = ncid - 1;
+    pthread_mutex_lock(&s_pdpMutex);
+    pdp = s_PDP[cid - 1];
+    pthread_mutex_unlock(&s_pdpMutex);
 
-    err = at_tok_nextint(&input, &skip);  // bearer_id
-    if (err < 0) goto error;
+    if (pdp.active) {
+        netlink_configure(getRadioInterfaceName(), pdp.addresses, pdp.mtu);
+    }
+}
 
-    err = at_tok_nextstr(&input, &sskip);  // apn
-    if (err < 0) goto error;
+/**
+ * Fill responses with the active contexts (or only cid, if cid > 0).
+ * The strings point into pdps, which must outlive the responses.
+ * returns the number of responses
+ */
+static int pdpTableSnapshot(int cid, struct PDPInfo *pdps,
+                            RIL_Data_Call_Response_v11 *responses)
+{
+    const char *radioInterfaceName = getRadioInterfaceName();
+    int i, n = 0;
 
-    err = at_tok_nextstr(&input, &sskip);  // local_addr_and_subnet_mask
-    if (err < 0) goto error;
+    pthread_mutex_lock(&s_pdpMutex);
+    memcpy(pdps, s_PDP, sizeof(s_PDP));
+    pthread_mutex_unlock(&s_pdpMutex);
 
-    err = at_tok_nextstr(&input, &responses[i].gateways);  // gw_addr
-    if (err < 0) goto error;
+    for (i = 0; i < MAX_PDP; i++) {
+        struct PDPInfo *pdp = &pdps[i];
+        RIL_Data_Call_Response_v11 *response = &responses[n];
 
-    err = at_tok_nextstr(&input, &responses[i].dnses);  // dns_prim_addr
-    if (err < 0) goto error;
+        if (!pdp->active || (cid > 0 && pdp->cid != cid)) {
+            continue;
+        }
+        memset(response, 0, sizeof(*response));
+        response->status = 0;
+        response->suggestedRetryTime = -1;
+        response->cid = pdp->cid;
+        response->active = 1;
+        response->type = pdp->type;
+        response->ifname = (char *)radioInterfaceName;
+        response->addresses = pdp->addresses;
+        response->dnses = pdp->dnses;
+        response->gateways = pdp->gateways;
+        response->pcscf = "";
+        response->mtu = pdp->mtu;
+        n++;
+    }
+    return n;
+}
 
-    if (t != NULL)
-        RIL_onRequestComplete(*t, RIL_E_SUCCESS, &responses[i],
-                               sizeof(RIL_Data_Call_Response_v11));
-    else
+/**
+ * Apply a +CGEV packet domain event to the context table. Runs on the
+ * reader thread, so contexts whose settings changed are only marked dirty
+ * and read later from onDataCallListChanged().
+ * returns true if the data call list may have changed
+ */
+static bool pdpTableApplyEvent(const char *s)
+{
+    const char *ev = s + strlen("+CGEV:");
+    struct PDPInfo *pdp;
+    bool changed = false;
+    int cid, i;
+
+    while (*ev == ' ') ev++;
+
+    /* class changes and rejected network requests don't affect contexts */
+    if (strStartsWith(ev, "NW CLASS") || strStartsWith(ev, "ME CLASS")
+            || strStartsWith(ev, "REJECT")) {
+        return false;
+    }
+
+    pthread_mutex_lock(&s_pdpMutex);
+    if (strStartsWith(ev, "NW DETACH") || strStartsWith(ev, "ME DETACH")) {
+        for (i = 0; i < MAX_PDP; i++) {
+            changed |= s_PDP[i].active;
+            pdpClearRuntimeLocked(&s_PDP[i]);
+        }
+    } else if (sscanf(ev, "%*2s PDN ACT %d", &cid) == 1) {
+        if ((pdp = pdpFromCid(cid)) != NULL) {
+            pdp->active = true;
+            pdp->dirty = true;
+            changed = true;
+        }
+    } else if (sscanf(ev, "%*2s PDN DEACT %d", &cid) == 1) {
+        if ((pdp = pdpFromCid(cid)) != NULL) {
+            changed = pdp->active;
+            pdpClearRuntimeLocked(pdp);
+        }
+    } else if (sscanf(ev, "%*2s MODIFY %d", &cid) == 1) {
+        if ((pdp = pdpFromCid(cid)) != NULL && pdp->active) {
+            pdp->dirty = true;
+            changed = true;
+        }
+    } else if ((strStartsWith(ev, "NW ACT") || strStartsWith(ev, "ME ACT")
+                || strStartsWith(ev, "NW DEACT") || strStartsWith(ev, "ME DEACT"))
+            && strchr(ev, '"') == NULL) {
+        /* dedicated bearers, <p_cid>,<cid>,<event_type>: list unchanged */
+    } else {
+        /* pre-R8 "<PDP_type>,<PDP_addr>" events and anything unknown */
+        s_pdpTableValid = false;
+        changed = true;
+    }
+
+    if (changed && s_pdpUpdatePending) {
+        changed = false;
+    } else if (changed) {
+        s_pdpUpdatePending = true;
+    }
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    return changed;
+}
+
+static void requestOrSendDataCallList(int cid, RIL_Token *t)
+{
+    struct PDPInfo pdps[MAX_PDP];
+    RIL_Data_Call_Response_v11 responses[MAX_PDP];
+    int n;
+
+    if (pdpTableUpdate() < 0) goto error;
+
+    n = pdpTableSnapshot(cid, pdps, responses);
+
+    if (t != NULL) {
+        if (cid > 0 && n == 0) goto error;
+        RIL_onRequestComplete(*t, RIL_E_SUCCESS, n > 0 ? responses : NULL,
+                              n * sizeof(RIL_Data_Call_Response_v11));
+    } else {
         RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
-                                  responses,
+                                  n > 0 ? responses : NULL,
                                   n * sizeof(RIL_Data_Call_Response_v11));
-
-    at_response_free(p_response);
+    }
     return;
 
 error:
@@ -1017,7 +1541,6 @@ error:
     else
         RIL_onUnsolicitedResponse(RIL_UNSOL_DATA_CALL_LIST_CHANGED,
                                   NULL, 0);
-    at_response_free(p_response);
 }
 
 static void requestQueryNetworkSelectionMode(
@@ -1064,15 +1587,18 @@ static void sendCallStateChanged(void *param __unused)
         NULL, 0);
 }
 
-static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused, RIL_Token t)
+/**
+ * Resync the call table from AT+CLCC.
+ * Returns 0 on success, -1 on failure; *p_changed reports whether the
+ * table changed and *p_needRepoll whether a call is in a transient state.
+ */
+static int syncCallTable(unsigned int gen, bool *p_changed, int *p_needRepoll)
 {
     int err;
     ATResponse *p_response;
     ATLine *p_cur;
-    int countCalls;
+    RIL_Call calls[MAX_CALLS];
     int countValidCalls;
-    RIL_Call *p_calls;
-    RIL_Call **pp_calls;
     int i;
     int needRepoll = 0;
 
@@ -1086,49 +1612,32 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
     err = at_send_command_multiline ("AT+CLCC", "+CLCC:", &p_response);
 
     if (err != 0 || p_response->success == 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        return;
-    }
-
-    /* count the calls */
-    for (countCalls = 0, p_cur = p_response->p_intermediates
-            ; p_cur != NULL
-            ; p_cur = p_cur->p_next
-    ) {
-        countCalls++;
+        at_response_free(p_response);
+        return -1;
     }
 
-    /* yes, there's an array of pointers and then an array of structures */
-
-    pp_calls = (RIL_Call **)alloca(countCalls * sizeof(RIL_Call *));
-    p_calls = (RIL_Call *)alloca(countCalls * sizeof(RIL_Call));
-    memset (p_calls, 0, countCalls * sizeof(RIL_Call));
-
-    /* init the pointer array */
-    for(i = 0; i < countCalls ; i++) {
-        pp_calls[i] = &(p_calls[i]);
-    }
+    memset (calls, 0, sizeof(calls));
 
     for (countValidCalls = 0, p_cur = p_response->p_intermediates
-            ; p_cur != NULL
+            ; p_cur != NULL && countValidCalls < MAX_CALLS
             ; p_cur = p_cur->p_next
     ) {
-        err = callFromCLCCLine(p_cur->line, p_calls + countValidCalls);
+        err = callFromCLCCLine(p_cur->line, calls + countValidCalls);
 
         if (err != 0) {
             continue;
         }
 
 #ifdef WORKAROUND_ERRONEOUS_ANSWER
-        if (p_calls[countValidCalls].state == RIL_CALL_INCOMING
-            || p_calls[countValidCalls].state == RIL_CALL_WAITING
+        if (calls[countValidCalls].state == RIL_CALL_INCOMING
+            || calls[countValidCalls].state == RIL_CALL_WAITING
         ) {
-            s_incomingOrWaitingLine = p_calls[countValidCalls].index;
+            s_incomingOrWaitingLine = calls[countValidCalls].index;
         }
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
 
-        if (p_calls[countValidCalls].state != RIL_CALL_ACTIVE
-            && p_calls[countValidCalls].state != RIL_CALL_HOLDING
+        if (calls[countValidCalls].state != RIL_CALL_ACTIVE
+            && calls[countValidCalls].state != RIL_CALL_HOLDING
         ) {
             needRepoll = 1;
         }
@@ -1150,15 +1659,16 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
     ) {
         for (i = 0; i < countValidCalls ; i++) {
 
-            if (p_calls[i].index == prevIncomingOrWaitingLine
-                    && p_calls[i].state == RIL_CALL_ACTIVE
+            if (calls[i].index == prevIncomingOrWaitingLine
+                    && calls[i].state == RIL_CALL_ACTIVE
                     && s_repollCallsCount < REPOLL_CALLS_COUNT_MAX
             ) {
                 RLOGI(
                     "Hit WORKAROUND_ERRONOUS_ANSWER case."
                     " Repoll count: %d\n", s_repollCallsCount);
                 s_repollCallsCount++;
-                goto error;
+                at_response_free(p_response);
+                return -1;
             }
         }
     }
@@ -1167,26 +1677,48 @@ static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused,
     s_repollCallsCount = 0;
 #endif /*WORKAROUND_ERRONEOUS_ANSWER*/
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, pp_calls,
-            countValidCalls * sizeof (RIL_Call *));
-
+    /* the table keeps its own copy of the numbers */
+    *p_changed = callTableReplace(calls, countValidCalls, gen);
     at_response_free(p_response);
 
 #ifdef POLL_CALL_STATE
-    if (countValidCalls) {  // We don't seem to get a "NO CARRIER" message from
-                            // smd, so we're forced to poll until the call ends.
+    *p_needRepoll = countValidCalls;
 #else
-    if (needRepoll) {
+    *p_needRepoll = needRepoll;
 #endif
-        RIL_requestTimedCallback (sendCallStateChanged, NULL, &TIMEVAL_CALLSTATEPOLL);
+    return 0;
+}
+
+static void requestGetCurrentCalls(void *data __unused, size_t datalen __unused, RIL_Token t)
+{
+    CallEntry entries[MAX_CALLS];
+    RIL_Call *pp_calls[MAX_CALLS];
+    int countCalls;
+    bool valid;
+    bool changed = false;
+    unsigned int gen;
+    int needRepoll = 0;
+
+    countCalls = callTableSnapshot(entries, pp_calls, &valid, &gen);
+    if (!valid) {
+        if (syncCallTable(gen, &changed, &needRepoll) < 0) {
+            RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+            return;
+        }
+        countCalls = callTableSnapshot(entries, pp_calls, &valid, &gen);
     }
 
-    return;
-#ifdef WORKAROUND_ERRONEOUS_ANSWER
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
-#endif
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, pp_calls,
+            countCalls * sizeof (RIL_Call *));
+
+    if (!s_callUrcSupported && needRepoll) {
+        // Without call status URCs we're forced to poll until the call
+        // settles (we don't always get a "NO CARRIER" message).
+        RIL_requestTimedCallback (sendCallStateChanged, NULL, &TIMEVAL_CALLSTATEPOLL);
+    } else if (s_callUrcSupported && changed && valid) {
+        // The resync found something the URCs missed
+        sendCallStateChanged(NULL);
+    }
 }
 
 static void requestDial(void *data, size_t datalen __unused, RIL_Token t)
@@ -1235,6 +1767,7 @@ static void requestWriteSmsToSim(void *data, size_t datalen __unused, RIL_Token
     asprintf(&cmd, "AT+CMGW=%d,%d", length, p_args->status);
 
     err = at_send_command_sms(cmd, p_args->pdu, "+CMGW:", &p_response);
+    sim_cache_invalidate_file(EF_SMS);
 
     if (err != 0 || p_response->success == 0) goto error;
 
@@ -1273,119 +1806,524 @@ static void requestHangup(void *data, size_t datalen __unused, RIL_Token t)
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 }
 
-static void requestSignalStrength(void *data __unused, size_t datalen __unused, RIL_Token t)
-{
-    ATResponse *p_response = NULL;
-    int err;
-    char *line;
-    int count = 0;
-    // Accept a response that is at least v6, and up to v12
-    int minNumOfElements=sizeof(RIL_SignalStrength_v6)/sizeof(int);
-    int maxNumOfElements=sizeof(RIL_SignalStrength_v12)/sizeof(int);
-    int response[maxNumOfElements];
+/*
+ * Signal strength reporting. Measurements combine AT+CSQ (GSM/WCDMA RSSI)
+ * with AT+QENG="servingcell" for the LTE metrics. A +CSQ/+QIND "csq"
+ * indication schedules a measurement, but RIL_UNSOL_SIGNAL_STRENGTH is
+ * only sent when the leading measurement (RSRP on LTE, RSSI otherwise)
+ * crosses a threshold by more than the hysteresis, or the RAT changes.
+ */
+#define MAX_SIGNAL_THRESHOLDS 8
 
-    memset(response, 0, sizeof(response));
+/* AccessNetwork values of the radio HAL */
+#define ACCESS_NETWORK_GERAN    1
+#define ACCESS_NETWORK_UTRAN    2
+#define ACCESS_NETWORK_EUTRAN   3
+#define ACCESS_NETWORK_COUNT    4
 
-    err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
+typedef struct {
+    int hysteresisMs;
+    int hysteresisDb;
+    int thresholdCount;
+    int thresholds[MAX_SIGNAL_THRESHOLDS];
+} SignalCriteria;
+
+/* framework defaults until criteria are set */
+static SignalCriteria s_signalCriteria[ACCESS_NETWORK_COUNT] = {
+    [ACCESS_NETWORK_GERAN]  = { 0, 2, 4, { -110, -103, -97, -89 } },
+    [ACCESS_NETWORK_UTRAN]  = { 0, 2, 4, { -110, -103, -97, -89 } },
+    [ACCESS_NETWORK_EUTRAN] = { 0, 2, 4, { -128, -118, -108, -98 } },
+};
 
-    if (err < 0 || p_response->success == 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        goto error;
-    }
+static pthread_mutex_t s_signalMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool s_signalReported = false;
+static int s_signalReportedNetwork = 0;
+static int s_signalReportedDbm = 0;
+static int64_t s_signalReportedMs = 0;
+static bool s_signalPollPending = false;
 
-    line = p_response->p_intermediates->line;
+/** next integer field, def if it is empty or "-" as QENG reports them */
+static int nextIntOr(char **p_cur, int def)
+{
+    char *tok, *end;
+    long value;
 
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
+    if (at_tok_nextstr(p_cur, &tok) < 0 || tok[0] == '\0') {
+        return def;
+    }
+    value = strtol(tok, &end, 10);
+    return (end == tok || *end != '\0') ? def : (int)value;
+}
 
-    err = at_tok_nextint(&line, &(response[0]));
-    err = at_tok_nextint(&line, &(response[1]));
+/** next hexadecimal field, as QENG reports LAC, TAC and cell IDs */
+static int nextHexOr(char **p_cur, int def)
+{
+    char *tok, *end;
+    unsigned long value;
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
+    if (at_tok_nextstr(p_cur, &tok) < 0 || tok[0] == '\0') {
+        return def;
+    }
+    value = strtoul(tok, &end, 16);
+    return (end == tok || *end != '\0' || value > INT_MAX) ? def : (int)value;
+}
 
-    at_response_free(p_response);
-    return;
+static int skipFields(char **p_cur, int count)
+{
+    char *tok;
 
-error:
-    RLOGE("requestSignalStrength must never return an error when radio is on");
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
+    while (count-- > 0) {
+        if (at_tok_nextstr(p_cur, &tok) < 0) return -1;
+    }
+    return 0;
 }
 
-/**
- * networkModePossible. Decides whether the network mode is appropriate for the
- * specified modem
- */
-static int networkModePossible(ModemInfo *mdm, int nm)
+/** RSSI in dBm to the 0..31 ASU scale of +CSQ, 99 if unknown */
+static int asuFromDbm(int dbm)
 {
-    const int asize = sizeof(net2modem) / sizeof(net2modem[0]);
-    if (nm >= asize || nm < 0) {
-        RLOGW("%s %d: invalid net2modem index: %d", __func__, __LINE__, nm);
-        return 0;
-    }
-    if ((net2modem[nm] & mdm->supportedTechs) == net2modem[nm]) {
-       return 1;
+    if (dbm == INT_MAX) {
+        return 99;
     }
-    return 0;
+    dbm = (dbm + 113) / 2;
+    return dbm < 0 ? 0 : (dbm > 31 ? 31 : dbm);
 }
 
-int getPreferredFromBitmap(int value, int *index) {
-    for (unsigned int i = 0; i < sizeof(s_networkMask) / sizeof(NetworkTypeBitmap); i++) {
-        if (s_networkMask[i].bitmap == value) {
-            if (index) *index = i;
-            return s_networkMask[i].type;
+/** Set up a cell info entry with all identity and signal fields unknown */
+static void initCellInfo(RIL_CellInfo_v12 *ci, RIL_CellInfoType type, int registered)
+{
+    memset(ci, 0, sizeof(*ci));
+    ci->cellInfoType = type;
+    ci->registered = registered;
+    ci->timeStampType = RIL_TIMESTAMP_TYPE_OEM_RIL;
+
+    switch (type) {
+        case RIL_CELL_INFO_TYPE_GSM: {
+            RIL_CellInfoGsm_v12 *gsm = &ci->CellInfo.gsm;
+            gsm->cellIdentityGsm.mcc = INT_MAX;
+            gsm->cellIdentityGsm.mnc = INT_MAX;
+            gsm->cellIdentityGsm.lac = INT_MAX;
+            gsm->cellIdentityGsm.cid = INT_MAX;
+            gsm->cellIdentityGsm.arfcn = INT_MAX;
+            gsm->cellIdentityGsm.bsic = 0xFF;
+            gsm->signalStrengthGsm.signalStrength = 99;
+            gsm->signalStrengthGsm.bitErrorRate = 99;
+            gsm->signalStrengthGsm.timingAdvance = INT_MAX;
+            break;
         }
+        case RIL_CELL_INFO_TYPE_WCDMA: {
+            RIL_CellInfoWcdma_v12 *wcdma = &ci->CellInfo.wcdma;
+            wcdma->cellIdentityWcdma.mcc = INT_MAX;
+            wcdma->cellIdentityWcdma.mnc = INT_MAX;
+            wcdma->cellIdentityWcdma.lac = INT_MAX;
+            wcdma->cellIdentityWcdma.cid = INT_MAX;
+            wcdma->cellIdentityWcdma.psc = INT_MAX;
+            wcdma->cellIdentityWcdma.uarfcn = INT_MAX;
+            wcdma->signalStrengthWcdma.signalStrength = 99;
+            wcdma->signalStrengthWcdma.bitErrorRate = 99;
+            break;
+        }
+        case RIL_CELL_INFO_TYPE_LTE: {
+            RIL_CellInfoLte_v12 *lte = &ci->CellInfo.lte;
+            lte->cellIdentityLte.mcc = INT_MAX;
+            lte->cellIdentityLte.mnc = INT_MAX;
+            lte->cellIdentityLte.ci = INT_MAX;
+            lte->cellIdentityLte.pci = INT_MAX;
+            lte->cellIdentityLte.tac = INT_MAX;
+            lte->cellIdentityLte.earfcn = INT_MAX;
+            lte->signalStrengthLte.signalStrength = 99;
+            lte->signalStrengthLte.rsrp = INT_MAX;
+            lte->signalStrengthLte.rsrq = INT_MAX;
+            lte->signalStrengthLte.rssnr = INT_MAX;
+            lte->signalStrengthLte.cqi = INT_MAX;
+            lte->signalStrengthLte.timingAdvance = INT_MAX;
+            break;
+        }
+        default:
+            break;
     }
-    // set default value here, since there is no match found
-    // ref.
-    //{LTE | GSM | WCDMA,               MDM_LTE | MDM_GSM | MDM_WCDMA},             // 9 - LTE, GSM/WCDMA
-    //
-    const int DEFAULT_PREFERRED_INDEX = 9;
-    const int DEFAULT_PREFERRED_BITMAP = MDM_LTE | MDM_GSM | MDM_WCDMA;
-    assert(s_networkMask[DEFAULT_PREFERRED_INDEX] == DEFAULT_PREFERRED_BITMAP);
-    if (index) {
-        *index = DEFAULT_PREFERRED_INDEX;
-    }
-    RLOGD("getPreferredFromBitmap %d not match", value);
-    return  DEFAULT_PREFERRED_BITMAP;
 }
 
-unsigned getBitmapFromPreferred(int value) {
-    for (unsigned int i = 0; i < sizeof(s_networkMask) / sizeof(NetworkTypeBitmap); i++) {
-        if (s_networkMask[i].type == value) {
-            return s_networkMask[i].bitmap;
+/** Convert QENG LTE measurements, in dBm/dB as reported, into the RIL units */
+static void setLteSignal(RIL_LTE_SignalStrength_v8 *lte, int rsrp, int rsrq,
+                         int rssi, int sinr, int cqi)
+{
+    lte->signalStrength = asuFromDbm(rssi);
+    /* the RIL reports RSRP and RSRQ as positive values */
+    lte->rsrp = (rsrp >= -140 && rsrp <= -44) ? -rsrp : INT_MAX;
+    lte->rsrq = (rsrq >= -20 && rsrq <= -3) ? -rsrq : INT_MAX;
+    /* SINR comes in 1/5 dB from -20 dB, RSSNR is in 1/10 dB */
+    lte->rssnr = (sinr >= 0 && sinr <= 250) ? sinr * 2 - 200 : INT_MAX;
+    lte->cqi = (cqi >= 0 && cqi <= 15) ? cqi : INT_MAX;
+}
+
+/**
+ * Parse a +QENG: "servingcell" line.
+ * returns 0 if a cell is in service, -1 while searching or on parse errors
+ */
+static int parseServingCell(char *line, RIL_CellInfo_v12 *ci)
+{
+    char *tag, *state, *rat;
+    int registered, mcc, mnc;
+
+    if (at_tok_start(&line) < 0
+            || at_tok_nextstr(&line, &tag) < 0 || strcmp(tag, "servingcell")
+            || at_tok_nextstr(&line, &state) < 0
+            || at_tok_nextstr(&line, &rat) < 0) {
+        return -1;
+    }
+    /* SEARCH: no cell, LIMSRV: camped for emergency calls only */
+    registered = !strcmp(state, "NOCONN") || !strcmp(state, "CONNECT");
+
+    if (!strcmp(rat, "LTE")) {
+        // <is_tdd>,<MCC>,<MNC>,<cellID>,<PCID>,<earfcn>,<freq_band_ind>,
+        // <UL_bandwidth>,<DL_bandwidth>,<TAC>,<RSRP>,<RSRQ>,<RSSI>,<SINR>,
+        // <CQI>,<tx_power>,<srxlev>
+        RIL_CellIdentityLte_v12 *id = &ci->CellInfo.lte.cellIdentityLte;
+        int rsrp, rsrq, rssi, sinr;
+
+        initCellInfo(ci, RIL_CELL_INFO_TYPE_LTE, registered);
+        if (skipFields(&line, 1) < 0) return -1;
+        id->mcc = nextIntOr(&line, INT_MAX);
+        id->mnc = nextIntOr(&line, INT_MAX);
+        id->ci = nextHexOr(&line, INT_MAX);
+        id->pci = nextIntOr(&line, INT_MAX);
+        id->earfcn = nextIntOr(&line, INT_MAX);
+        if (skipFields(&line, 3) < 0) return -1;
+        id->tac = nextHexOr(&line, INT_MAX);
+        rsrp = nextIntOr(&line, INT_MAX);
+        rsrq = nextIntOr(&line, INT_MAX);
+        rssi = nextIntOr(&line, INT_MAX);
+        sinr = nextIntOr(&line, INT_MAX);
+        setLteSignal(&ci->CellInfo.lte.signalStrengthLte, rsrp, rsrq, rssi,
+                     sinr, nextIntOr(&line, INT_MAX));
+    } else if (!strcmp(rat, "WCDMA")) {
+        // <MCC>,<MNC>,<LAC>,<cellID>,<uarfcn>,<PSC>,<RAC>,<RSCP>,<ecio>,...
+        RIL_CellIdentityWcdma_v12 *id = &ci->CellInfo.wcdma.cellIdentityWcdma;
+        int rscp, ecio;
+
+        initCellInfo(ci, RIL_CELL_INFO_TYPE_WCDMA, registered);
+        id->mcc = nextIntOr(&line, INT_MAX);
+        id->mnc = nextIntOr(&line, INT_MAX);
+        id->lac = nextHexOr(&line, INT_MAX);
+        id->cid = nextHexOr(&line, INT_MAX);
+        id->uarfcn = nextIntOr(&line, INT_MAX);
+        id->psc = nextIntOr(&line, INT_MAX);
+        if (skipFields(&line, 1) < 0) return -1;
+        rscp = nextIntOr(&line, INT_MAX);
+        ecio = nextIntOr(&line, INT_MAX);
+        /* RSSI = RSCP - Ec/Io */
+        ci->CellInfo.wcdma.signalStrengthWcdma.signalStrength =
+                asuFromDbm(rscp == INT_MAX || ecio == INT_MAX ? INT_MAX : rscp - ecio);
+    } else if (!strcmp(rat, "GSM")) {
+        // <MCC>,<MNC>,<LAC>,<cellID>,<bsic>,<arfcn>,<band>,<rxlev>,<txp>,
+        // <rla>,<drx>,<c1>,<c2>,<gprs>,<tch>,<ts>,<ta>,...
+        RIL_CellInfoGsm_v12 *gsm = &ci->CellInfo.gsm;
+        int bsic, rxlev, ta;
+
+        initCellInfo(ci, RIL_CELL_INFO_TYPE_GSM, registered);
+        gsm->cellIdentityGsm.mcc = nextIntOr(&line, INT_MAX);
+        gsm->cellIdentityGsm.mnc = nextIntOr(&line, INT_MAX);
+        gsm->cellIdentityGsm.lac = nextHexOr(&line, INT_MAX);
+        gsm->cellIdentityGsm.cid = nextHexOr(&line, INT_MAX);
+        bsic = nextIntOr(&line, INT_MAX);
+        gsm->cellIdentityGsm.bsic = (bsic >= 0 && bsic <= 63) ? bsic : 0xFF;
+        gsm->cellIdentityGsm.arfcn = nextIntOr(&line, INT_MAX);
+        if (skipFields(&line, 1) < 0) return -1;
+        /* RXLEV 0..63 counts from -110 dBm */
+        rxlev = nextIntOr(&line, INT_MAX);
+        gsm->signalStrengthGsm.signalStrength =
+                asuFromDbm(rxlev >= 0 && rxlev <= 63 ? rxlev - 110 : INT_MAX);
+        if (skipFields(&line, 8) == 0) {
+            ta = nextIntOr(&line, INT_MAX);
+            gsm->signalStrengthGsm.timingAdvance = (ta >= 0 && ta <= 219) ? ta : INT_MAX;
         }
+    } else {
+        return -1;
     }
-    RLOGD("getBitmapFromPreferred %d not match", value);
-    return  LTE | GSM | WCDMA;
+    return 0;
 }
 
-static void requestSetPreferredNetworkType(int request, void *data,
-                                           size_t datalen __unused, RIL_Token t )
+/**
+ * Measure the signal strength, *p_network receives the access network
+ * whose measurement leads reporting, *p_dbm that measurement.
+ * returns 0 on success, -1 if not even AT+CSQ could be read
+ */
+static int measureSignalStrength(RIL_SignalStrength_v12 *ss, int *p_network,
+                                 int *p_dbm)
 {
     ATResponse *p_response = NULL;
-    char *cmd = NULL;
-    int value = *(int *)data;
-    int index = value;
-    int current, old;
-    int err;
-    int32_t preferred;
+    RIL_CellInfo_v12 serving;
+    char *line;
+    int err, rssi, ber;
 
-    if (request == RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE) {
-        preferred = net2pmask[value];
-    } else {
-        preferred = getPreferredFromBitmap(value, &index);
-    }
-    RLOGD("requestSetPreferredNetworkType: current: %x. New: %x", PREFERRED_NETWORK(sMdmInfo), preferred);
+    memset(ss, 0, sizeof(*ss));
+    ss->LTE_SignalStrength.signalStrength = 99;
+    ss->LTE_SignalStrength.rsrp = INT_MAX;
+    ss->LTE_SignalStrength.rsrq = INT_MAX;
+    ss->LTE_SignalStrength.rssnr = INT_MAX;
+    ss->LTE_SignalStrength.cqi = INT_MAX;
+    ss->LTE_SignalStrength.timingAdvance = INT_MAX;
 
-    if (!networkModePossible(sMdmInfo, index)) {
-        RIL_onRequestComplete(t, RIL_E_MODE_NOT_SUPPORTED, NULL, 0);
-        return;
-    }
+    err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
+    if (err < 0 || p_response->success == 0) goto error;
 
-    if (query_ctec(sMdmInfo, &current, NULL) < 0) {
-        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-        return;
+    line = p_response->p_intermediates->line;
+    if (at_tok_start(&line) < 0
+            || at_tok_nextint(&line, &rssi) < 0
+            || at_tok_nextint(&line, &ber) < 0) {
+        goto error;
+    }
+    at_response_free(p_response);
+    p_response = NULL;
+
+    ss->GW_SignalStrength.signalStrength = rssi;
+    ss->GW_SignalStrength.bitErrorRate = ber;
+    ss->WCDMA_SignalStrength.signalStrength = rssi;
+    ss->WCDMA_SignalStrength.bitErrorRate = ber;
+    *p_network = ACCESS_NETWORK_GERAN;
+    *p_dbm = (rssi >= 0 && rssi <= 31) ? -113 + 2 * rssi : INT_MIN;
+
+    err = at_send_command_singleline("AT+QENG=\"servingcell\"", "+QENG:",
+                                     &p_response);
+    if (err == 0 && p_response->success
+            && parseServingCell(p_response->p_intermediates->line, &serving) == 0
+            && serving.cellInfoType == RIL_CELL_INFO_TYPE_LTE) {
+        ss->LTE_SignalStrength = serving.CellInfo.lte.signalStrengthLte;
+        ss->LTE_SignalStrength.signalStrength = rssi;
+        *p_network = ACCESS_NETWORK_EUTRAN;
+        if (ss->LTE_SignalStrength.rsrp != INT_MAX) {
+            *p_dbm = -ss->LTE_SignalStrength.rsrp;
+        }
+    }
+    at_response_free(p_response);
+    return 0;
+
+error:
+    at_response_free(p_response);
+    return -1;
+}
+
+/** returns the index of the threshold band dbm falls into */
+static int signalLevel(const SignalCriteria *c, int dbm)
+{
+    int i, level = 0;
+
+    for (i = 0; i < c->thresholdCount; i++) {
+        if (dbm >= c->thresholds[i]) {
+            level = i + 1;
+        }
+    }
+    return level;
+}
+
+/**
+ * Decide whether a measurement is worth reporting against the last
+ * reported one and if so, make it the new reference.
+ */
+static bool signalShouldReport(int network, int dbm)
+{
+    const SignalCriteria *c = &s_signalCriteria[network];
+    int64_t now = monotonicMsec();
+    bool report;
+
+    pthread_mutex_lock(&s_signalMutex);
+    if (!s_signalReported || network != s_signalReportedNetwork
+            || (dbm == INT_MIN) != (s_signalReportedDbm == INT_MIN)) {
+        report = true;
+    } else if (dbm == INT_MIN) {
+        report = false;
+    } else if (now - s_signalReportedMs < c->hysteresisMs) {
+        report = false;
+    } else if (c->thresholdCount == 0) {
+        report = abs(dbm - s_signalReportedDbm) >= c->hysteresisDb;
+    } else {
+        report = signalLevel(c, dbm) != signalLevel(c, s_signalReportedDbm)
+                && abs(dbm - s_signalReportedDbm) >= c->hysteresisDb;
+    }
+    if (report) {
+        s_signalReported = true;
+        s_signalReportedNetwork = network;
+        s_signalReportedDbm = dbm;
+        s_signalReportedMs = now;
+    }
+    pthread_mutex_unlock(&s_signalMutex);
+
+    return report;
+}
+
+static void onSignalStrengthChanged(void *param __unused)
+{
+    RIL_SignalStrength_v12 ss;
+    int network, dbm;
+
+    pthread_mutex_lock(&s_signalMutex);
+    s_signalPollPending = false;
+    pthread_mutex_unlock(&s_signalMutex);
+
+    if (sState != RADIO_STATE_ON) {
+        return;
+    }
+    if (measureSignalStrength(&ss, &network, &dbm) == 0
+            && signalShouldReport(network, dbm)) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_SIGNAL_STRENGTH, &ss, sizeof(ss));
+    }
+}
+
+/** schedule a measurement from the reader thread, once per burst */
+static void scheduleSignalStrengthUpdate()
+{
+    bool schedule;
+
+    pthread_mutex_lock(&s_signalMutex);
+    schedule = !s_signalPollPending;
+    s_signalPollPending = true;
+    pthread_mutex_unlock(&s_signalMutex);
+
+    if (schedule) {
+        RIL_requestTimedCallback(onSignalStrengthChanged, NULL, NULL);
+    }
+}
+
+static void requestSignalStrength(void *data __unused, size_t datalen __unused, RIL_Token t)
+{
+    RIL_SignalStrength_v12 ss;
+    int network, dbm;
+
+    if (measureSignalStrength(&ss, &network, &dbm) < 0) {
+        RLOGE("requestSignalStrength must never return an error when radio is on");
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
+    }
+
+    /* the framework now knows this value, report changes against it */
+    pthread_mutex_lock(&s_signalMutex);
+    s_signalReported = true;
+    s_signalReportedNetwork = network;
+    s_signalReportedDbm = dbm;
+    s_signalReportedMs = monotonicMsec();
+    pthread_mutex_unlock(&s_signalMutex);
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, &ss, sizeof(ss));
+}
+
+/**
+ * The criteria apply to the access network they name, or to all of them
+ * if it is unknown.
+ */
+static void requestSetSignalStrengthReportingCriteria(void *data, size_t datalen,
+                                                      RIL_Token t)
+{
+    const RIL_SignalStrengthReportingCriteria *criteria =
+            (const RIL_SignalStrengthReportingCriteria *)data;
+    SignalCriteria c;
+    int network, i;
+
+    if (data == NULL || datalen != sizeof(*criteria)
+            || criteria->thresholdsDbmNumber < 0
+            || criteria->thresholdsDbmNumber > MAX_SIGNAL_THRESHOLDS
+            || (criteria->thresholdsDbmNumber > 0 && criteria->thresholdsDbm == NULL)) {
+        RIL_onRequestComplete(t, RIL_E_INVALID_ARGUMENTS, NULL, 0);
+        return;
+    }
+    network = criteria->accessNetwork;
+    if (network != UNKNOWN
+            && (network < ACCESS_NETWORK_GERAN || network > ACCESS_NETWORK_EUTRAN)) {
+        RIL_onRequestComplete(t, RIL_E_INVALID_ARGUMENTS, NULL, 0);
+        return;
+    }
+
+    c.hysteresisMs = criteria->hysteresisMs;
+    c.hysteresisDb = criteria->hysteresisDb;
+    c.thresholdCount = criteria->thresholdsDbmNumber;
+    for (i = 0; i < c.thresholdCount; i++) {
+        c.thresholds[i] = criteria->thresholdsDbm[i];
+    }
+
+    pthread_mutex_lock(&s_signalMutex);
+    for (i = ACCESS_NETWORK_GERAN; i <= ACCESS_NETWORK_EUTRAN; i++) {
+        if (network == UNKNOWN || network == i) {
+            s_signalCriteria[i] = c;
+        }
+    }
+    pthread_mutex_unlock(&s_signalMutex);
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+}
+
+/**
+ * networkModePossible. Decides whether the network mode is appropriate for the
+ * specified modem
+ */
+static int networkModePossible(ModemInfo *mdm, int nm)
+{
+    const int asize = sizeof(net2modem) / sizeof(net2modem[0]);
+    if (nm >= asize || nm < 0) {
+        RLOGW("%s %d: invalid net2modem index: %d", __func__, __LINE__, nm);
+        return 0;
+    }
+    if ((net2modem[nm] & mdm->supportedTechs) == net2modem[nm]) {
+       return 1;
+    }
+    return 0;
+}
+
+int getPreferredFromBitmap(int value, int *index) {
+    for (unsigned int i = 0; i < sizeof(s_networkMask) / sizeof(NetworkTypeBitmap); i++) {
+        if (s_networkMask[i].bitmap == value) {
+            if (index) *index = i;
+            return s_networkMask[i].type;
+        }
+    }
+    // set default value here, since there is no match found
+    // ref.
+    //{LTE | GSM | WCDMA,               MDM_LTE | MDM_GSM | MDM_WCDMA},             // 9 - LTE, GSM/WCDMA
+    //
+    const int DEFAULT_PREFERRED_INDEX = 9;
+    const int DEFAULT_PREFERRED_BITMAP = MDM_LTE | MDM_GSM | MDM_WCDMA;
+    assert(s_networkMask[DEFAULT_PREFERRED_INDEX] == DEFAULT_PREFERRED_BITMAP);
+    if (index) {
+        *index = DEFAULT_PREFERRED_INDEX;
+    }
+    RLOGD("getPreferredFromBitmap %d not match", value);
+    return  DEFAULT_PREFERRED_BITMAP;
+}
+
+unsigned getBitmapFromPreferred(int value) {
+    for (unsigned int i = 0; i < sizeof(s_networkMask) / sizeof(NetworkTypeBitmap); i++) {
+        if (s_networkMask[i].type == value) {
+            return s_networkMask[i].bitmap;
+        }
+    }
+    RLOGD("getBitmapFromPreferred %d not match", value);
+    return  LTE | GSM | WCDMA;
+}
+
+static void requestSetPreferredNetworkType(int request, void *data,
+                                           size_t datalen __unused, RIL_Token t )
+{
+    ATResponse *p_response = NULL;
+    char *cmd = NULL;
+    int value = *(int *)data;
+    int index = value;
+    int current, old;
+    int err;
+    int32_t preferred;
+
+    if (request == RIL_REQUEST_SET_PREFERRED_NETWORK_TYPE) {
+        preferred = net2pmask[value];
+    } else {
+        preferred = getPreferredFromBitmap(value, &index);
+    }
+    RLOGD("requestSetPreferredNetworkType: current: %x. New: %x", PREFERRED_NETWORK(sMdmInfo), preferred);
+
+    if (!networkModePossible(sMdmInfo, index)) {
+        RIL_onRequestComplete(t, RIL_E_MODE_NOT_SUPPORTED, NULL, 0);
+        return;
+    }
+
+    if (query_ctec(sMdmInfo, &current, NULL) < 0) {
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
     }
     old = PREFERRED_NETWORK(sMdmInfo);
     RLOGD("old != preferred: %d", old != preferred);
@@ -1661,115 +2599,197 @@ error:
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
 }
 
-static int parseRegistrationState(char *str, int *type, int *items, int **response)
+/*
+ * Operator identity cache: long name, short name and numeric PLMN as
+ * read by requestOperator. Invalidated when registration moves to another
+ * state, LAC or TAC and when the network sends time/name updates (NITZ).
+ * s_operatorGen lets a query that raced with an invalidation drop its
+ * result.
+ */
+#define OPERATOR_NAME_LEN 64
+
+static pthread_mutex_t s_operatorMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool s_operatorValid = false;
+static unsigned int s_operatorGen = 0;
+/* empty strings for names the modem didn't report */
+static char s_operatorNames[3][OPERATOR_NAME_LEN];
+
+static void invalidateOperatorCache()
 {
-    int err;
-    char *line = str, *p;
-    int *resp = NULL;
-    int skip;
-    int count = 3;
-    int commas;
+    pthread_mutex_lock(&s_operatorMutex);
+    s_operatorValid = false;
+    s_operatorGen++;
+    pthread_mutex_unlock(&s_operatorMutex);
+}
 
-    RLOGD("parseRegistrationState. Parsing: %s",str);
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
+/*
+ * Registration snapshots, one per domain, kept current by the +CREG,
+ * +CGREG and +CEREG URCs. Registration state requests are served from
+ * them and only query the modem while a snapshot is invalid.
+ */
+typedef enum {
+    REG_DOMAIN_CS,      /* +CREG */
+    REG_DOMAIN_PS,      /* +CGREG */
+    REG_DOMAIN_EPS,     /* +CEREG */
+    REG_DOMAIN_COUNT,
+} RegDomain;
 
-    /* Ok you have to be careful here
-     * The solicited version of the CREG response is
-     * +CREG: n, stat, [lac, cid]
-     * and the unsolicited version is
-     * +CREG: stat, [lac, cid]
-     * The <n> parameter is basically "is unsolicited creg on?"
-     * which it should always be
-     *
-     * Now we should normally get the solicited version here,
-     * but the unsolicited version could have snuck in
-     * so we have to handle both
-     *
-     * Also since the LAC and CID are only reported when registered,
-     * we can have 1, 2, 3, or 4 arguments here
-     *
-     * finally, a +CGREG: answer may have a fifth value that corresponds
-     * to the network type, as in;
-     *
-     *   +CGREG: n, stat [,lac, cid [,networkType]]
-     */
+typedef struct {
+    bool valid;
+    int stat;
+    int lac;            /* LAC or TAC, -1 if unknown */
+    int cid;            /* -1 if unknown */
+    int act;            /* -1 if unknown */
+} RegSnapshot;
+
+#define REG_MAX_FIELDS 6
+
+static const char *s_regQueries[REG_DOMAIN_COUNT] = {
+    "AT+CREG?", "AT+CGREG?", "AT+CEREG?",
+};
+static const char *s_regPrefixes[REG_DOMAIN_COUNT] = {
+    "+CREG:", "+CGREG:", "+CEREG:",
+};
+
+static pthread_mutex_t s_regMutex = PTHREAD_MUTEX_INITIALIZER;
+static RegSnapshot s_regSnapshots[REG_DOMAIN_COUNT];
+
+/** returns the domain of a +CREG/+CGREG/+CEREG line, -1 for others */
+static int regDomainFromLine(const char *s)
+{
+    int i;
 
-    /* count number of commas */
-    commas = 0;
-    for (p = line ; *p != '\0' ;p++) {
-        if (*p == ',') commas++;
+    for (i = 0; i < REG_DOMAIN_COUNT; i++) {
+        if (strStartsWith(s, s_regPrefixes[i])) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    resp = (int *)calloc(commas + 1, sizeof(int));
-    if (!resp) goto error;
-    switch (commas) {
-        case 0: /* +CREG: <stat> */
-            err = at_tok_nextint(&line, &resp[0]);
-            if (err < 0) goto error;
-            resp[1] = -1;
-            resp[2] = -1;
-        break;
+/**
+ * Parse a registration line, either the solicited form
+ *   +CREG: <n>,<stat>[,<lac>,<ci>[,<AcT>...]]
+ * or the URC
+ *   +CREG: <stat>[,<lac>,<ci>[,<AcT>...]]
+ * Both have the same number of fields in some cases, but <lac> is always
+ * quoted and <stat> never is, so a quoted second field means a URC.
+ * returns 0 on success, -1 on parse errors
+ */
+static int parseRegistrationLine(const char *s, RegSnapshot *reg)
+{
+    char buf[128], *p, *fields[REG_MAX_FIELDS];
+    bool quoted[REG_MAX_FIELDS];
+    int count = 0, first;
+
+    p = strchr(s, ':');
+    if (p == NULL) return -1;
+    strlcpy(buf, p + 1, sizeof(buf));
+
+    for (p = buf; count < REG_MAX_FIELDS; count++) {
+        while (*p == ' ') p++;
+        quoted[count] = (*p == '"');
+        if (quoted[count]) p++;
+        fields[count] = p;
+        p += strcspn(p, quoted[count] ? "\"" : ",");
+        if (*p == '"') *p++ = '\0';
+        p = strchr(p, ',');
+        if (p == NULL) {
+            count++;
+            break;
+        }
+        *p++ = '\0';
+    }
 
-        case 1: /* +CREG: <n>, <stat> */
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &resp[0]);
-            if (err < 0) goto error;
-            resp[1] = -1;
-            resp[2] = -1;
-            if (err < 0) goto error;
-        break;
+    first = (count >= 2 && !quoted[1]) ? 1 : 0;
+    if (fields[first][0] == '\0') return -1;
 
-        case 2: /* +CREG: <stat>, <lac>, <cid> */
-            err = at_tok_nextint(&line, &resp[0]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &resp[1]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &resp[2]);
-            if (err < 0) goto error;
-        break;
-        case 3: /* +CREG: <n>, <stat>, <lac>, <cid> */
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &resp[0]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &resp[1]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &resp[2]);
-            if (err < 0) goto error;
-        break;
-        /* special case for CGREG, there is a fourth parameter
-         * that is the network type (unknown/gprs/edge/umts)
-         */
-        case 4: /* +CGREG: <n>, <stat>, <lac>, <cid>, <networkType> */
-            err = at_tok_nextint(&line, &skip);
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &resp[0]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &resp[1]);
-            if (err < 0) goto error;
-            err = at_tok_nexthexint(&line, &resp[2]);
-            if (err < 0) goto error;
-            err = at_tok_nextint(&line, &resp[3]);
-            if (err < 0) goto error;
-            count = 4;
-        break;
-        default:
-            goto error;
+    reg->stat = atoi(fields[first]);
+    reg->lac = (count > first + 1 && fields[first + 1][0] != '\0')
+            ? (int)strtol(fields[first + 1], NULL, 16) : -1;
+    reg->cid = (count > first + 2 && fields[first + 2][0] != '\0')
+            ? (int)strtol(fields[first + 2], NULL, 16) : -1;
+    reg->act = (count > first + 3 && fields[first + 3][0] != '\0')
+            ? atoi(fields[first + 3]) : -1;
+    reg->valid = true;
+    return 0;
+}
+
+/** Record the first home or roaming registration in the boot timeline */
+static void noteRegistration(const RegSnapshot *reg)
+{
+    if (reg->stat == 1 || reg->stat == 5) {
+        boottime_mark(BOOT_REGISTERED);
+    }
+}
+
+/** Update a snapshot from a registration URC, called on the reader thread */
+static void onRegistrationUrc(const char *s)
+{
+    int domain = regDomainFromLine(s);
+    RegSnapshot reg, old;
+
+    if (domain < 0 || parseRegistrationLine(s, &reg) < 0) {
+        RLOGE("Ignoring malformed registration URC: %s", s);
+        return;
+    }
+    pthread_mutex_lock(&s_regMutex);
+    old = s_regSnapshots[domain];
+    s_regSnapshots[domain] = reg;
+    pthread_mutex_unlock(&s_regMutex);
+    noteRegistration(&reg);
+
+    /* a new PLMN shows up as a registration or location area change */
+    if (!old.valid || old.stat != reg.stat || old.lac != reg.lac) {
+        invalidateOperatorCache();
+    }
+}
+
+/** Force the next registration request to query the modem */
+static void invalidateRegistrationSnapshots()
+{
+    int i;
+
+    pthread_mutex_lock(&s_regMutex);
+    for (i = 0; i < REG_DOMAIN_COUNT; i++) {
+        s_regSnapshots[i].valid = false;
+    }
+    pthread_mutex_unlock(&s_regMutex);
+}
+
+/**
+ * Copy the snapshot of a domain, querying the modem if it is invalid.
+ * returns 0 on success, -1 if the state is not known
+ */
+static int getRegistration(RegDomain domain, RegSnapshot *reg)
+{
+    ATResponse *p_response = NULL;
+    int err;
+
+    pthread_mutex_lock(&s_regMutex);
+    *reg = s_regSnapshots[domain];
+    pthread_mutex_unlock(&s_regMutex);
+    if (reg->valid) {
+        return 0;
+    }
+
+    err = at_send_command_singleline(s_regQueries[domain], s_regPrefixes[domain],
+                                     &p_response);
+    if (err < 0 || !p_response->success
+            || parseRegistrationLine(p_response->p_intermediates->line, reg) < 0) {
+        at_response_free(p_response);
+        return -1;
+    }
+    at_response_free(p_response);
+    noteRegistration(reg);
+
+    pthread_mutex_lock(&s_regMutex);
+    /* a URC that arrived meanwhile is newer than the query */
+    if (!s_regSnapshots[domain].valid) {
+        s_regSnapshots[domain] = *reg;
     }
-    s_lac = resp[1];
-    s_cid = resp[2];
-    if (response)
-        *response = resp;
-    if (items)
-        *items = commas + 1;
-    if (type)
-        *type = techFromModemType(TECH(sMdmInfo));
+    pthread_mutex_unlock(&s_regMutex);
     return 0;
-error:
-    free(resp);
-    return -1;
 }
 
 static int mapNetworkRegistrationResponse(int in_response) {
@@ -1817,151 +2837,115 @@ static int mapNetworkRegistrationResponse(int in_response) {
 
 #define REG_STATE_LEN 18
 #define REG_DATA_STATE_LEN 14
+#define REG_FIELD_LEN 12
+
+/*
+ * Response buffers for the registration state requests. Both requests run
+ * on the network request queue, one at a time, and libril copies the
+ * strings before RIL_onRequestComplete returns.
+ */
+static char s_regFields[REG_STATE_LEN][REG_FIELD_LEN];
+static char *s_regResponse[REG_STATE_LEN];
+
+/* fields 3..14 of a 3GPP2 voice registration */
+static const char *s_cdmaRegFields[] = {
+    "8",        // EvDo revA
+    "1",        // BSID
+    "123",      // Latitude
+    "222",      // Longitude
+    "0",        // CSS Indicator
+    "4",        // SID
+    "65535",    // NID
+    "0",        // Roaming indicator
+    "1",        // System is in PRL
+    "0",        // Default Roaming indicator
+    "0",        // Reason for denial
+    "0",        // Primary Scrambling Code of Current cell
+};
+
+static char *setRegField(int index, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(s_regFields[index], REG_FIELD_LEN, fmt, ap);
+    va_end(ap);
+    s_regResponse[index] = s_regFields[index];
+    return s_regResponse[index];
+}
+
 static void requestRegistrationState(int request, void *data __unused,
                                         size_t datalen __unused, RIL_Token t)
 {
-    int err;
-    int *registration;
-    char **responseStr = NULL;
-    ATResponse *p_response = NULL;
-    const char *cmd;
-    const char *prefix;
-    char *line;
-    int i = 0, j, numElements = 0;
-    int count = 3;
-    int type, startfrom;
+    RegSnapshot reg, eps;
+    int numElements, mccIndex, i;
 
-    RLOGD("requestRegistrationState");
     if (request == RIL_REQUEST_VOICE_REGISTRATION_STATE) {
-        cmd = "AT+CREG?";
-        prefix = "+CREG:";
         numElements = REG_STATE_LEN;
+        mccIndex = 15;
+        if (getRegistration(REG_DOMAIN_CS, &reg) < 0) goto error;
     } else if (request == RIL_REQUEST_DATA_REGISTRATION_STATE) {
-        cmd = "AT+CGREG?";
-        prefix = "+CGREG:";
         numElements = REG_DATA_STATE_LEN;
-        if (TECH_BIT(sMdmInfo) == MDM_LTE) {
-            cmd = "AT+CEREG?";
-            prefix = "+CEREG:";
+        mccIndex = 11;
+        if (getRegistration(REG_DOMAIN_PS, &reg) < 0) goto error;
+        /* on LTE the data registration is the EPS one */
+        if (getRegistration(REG_DOMAIN_EPS, &eps) == 0
+                && (eps.stat == 1 || eps.stat == 5)) {
+            reg = eps;
         }
     } else {
         assert(0);
         goto error;
     }
 
-    err = at_send_command_singleline(cmd, prefix, &p_response);
+    memset(s_regResponse, 0, sizeof(s_regResponse));
+    setRegField(0, "%d", reg.stat);
 
-    if (err < 0 || !p_response->success) goto error;
-
-    line = p_response->p_intermediates->line;
-
-    if (parseRegistrationState(line, &type, &count, &registration)) goto error;
-
-    responseStr = malloc(numElements * sizeof(char *));
-    if (!responseStr) goto error;
-    memset(responseStr, 0, numElements * sizeof(char *));
-    /**
-     * The first '4' bytes for both registration states remain the same.
-     * But if the request is 'DATA_REGISTRATION_STATE',
-     * the 5th and 6th byte(s) are optional.
-     */
-    if (is3gpp2(type) == 1) {
-        RLOGD("registration state type: 3GPP2");
+    if (is3gpp2(techFromModemType(TECH(sMdmInfo))) == 1) {
         // TODO: Query modem
-        startfrom = 3;
-        if(request == RIL_REQUEST_VOICE_REGISTRATION_STATE) {
-            asprintf(&responseStr[3], "8");     // EvDo revA
-            asprintf(&responseStr[4], "1");     // BSID
-            asprintf(&responseStr[5], "123");   // Latitude
-            asprintf(&responseStr[6], "222");   // Longitude
-            asprintf(&responseStr[7], "0");     // CSS Indicator
-            asprintf(&responseStr[8], "4");     // SID
-            asprintf(&responseStr[9], "65535"); // NID
-            asprintf(&responseStr[10], "0");    // Roaming indicator
-            asprintf(&responseStr[11], "1");    // System is in PRL
-            asprintf(&responseStr[12], "0");    // Default Roaming indicator
-            asprintf(&responseStr[13], "0");    // Reason for denial
-            asprintf(&responseStr[14], "0");    // Primary Scrambling Code of Current cell
-      } else if (request == RIL_REQUEST_DATA_REGISTRATION_STATE) {
-            asprintf(&responseStr[3], "8");   // Available data radio technology
-      }
-    } else { // type == RADIO_TECH_3GPP
-        RLOGD("registration state type: 3GPP");
-        startfrom = 0;
-        asprintf(&responseStr[1], "%x", registration[1]);
-        asprintf(&responseStr[2], "%x", registration[2]);
-        if (count > 3) {
-            asprintf(&responseStr[3], "%d", mapNetworkRegistrationResponse(registration[3]));
-        }
-    }
-    asprintf(&responseStr[0], "%d", registration[0]);
-
-    /**
-     * Optional bytes for DATA_REGISTRATION_STATE request
-     * 4th byte : Registration denial code
-     * 5th byte : The max. number of simultaneous Data Calls
-     */
-    if (request == RIL_REQUEST_DATA_REGISTRATION_STATE) {
-        // asprintf(&responseStr[4], "3");
-        // asprintf(&responseStr[5], "1");
-        asprintf(&responseStr[11], "%d", s_mcc);
-        asprintf(&responseStr[12], "%d", s_mnc);
-        if (s_mncLength == 2) {
-          asprintf(&responseStr[13], "%03d%02d", s_mcc, s_mnc);
+        if (request == RIL_REQUEST_VOICE_REGISTRATION_STATE) {
+            for (i = 0; i < (int)(sizeof(s_cdmaRegFields) / sizeof(s_cdmaRegFields[0])); i++) {
+                s_regResponse[3 + i] = (char *)s_cdmaRegFields[i];
+            }
         } else {
-          asprintf(&responseStr[13], "%03d%03d", s_mcc, s_mnc);
+            s_regResponse[3] = "8";   // Available data radio technology
         }
-    } else {  // Voice
-        asprintf(&responseStr[15], "%d", s_mcc);
-        asprintf(&responseStr[16], "%d", s_mnc);
-        if (s_mncLength == 2) {
-          asprintf(&responseStr[17], "%03d%02d", s_mcc, s_mnc);
-        } else {
-          asprintf(&responseStr[17], "%03d%03d", s_mcc, s_mnc);
+    } else {
+        if (reg.lac >= 0) setRegField(1, "%x", reg.lac);
+        if (reg.cid >= 0) setRegField(2, "%x", reg.cid);
+        if (reg.act >= 0) {
+            setRegField(3, "%d", mapNetworkRegistrationResponse(reg.act));
         }
     }
 
-
-    for (j = startfrom; j < numElements; j++) {
-        if (!responseStr[i]) goto error;
-    }
-    free(registration);
-    registration = NULL;
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, responseStr, numElements*sizeof(responseStr));
-    for (j = 0; j < numElements; j++ ) {
-        free(responseStr[j]);
-        responseStr[j] = NULL;
+    setRegField(mccIndex, "%d", s_mcc);
+    setRegField(mccIndex + 1, "%d", s_mnc);
+    if (s_mncLength == 2) {
+        setRegField(mccIndex + 2, "%03d%02d", s_mcc, s_mnc);
+    } else {
+        setRegField(mccIndex + 2, "%03d%03d", s_mcc, s_mnc);
     }
-    free(responseStr);
-    responseStr = NULL;
-    at_response_free(p_response);
 
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, s_regResponse,
+                          numElements * sizeof(char *));
     return;
+
 error:
-    if (responseStr) {
-        for (j = 0; j < numElements; j++) {
-            free(responseStr[j]);
-            responseStr[j] = NULL;
-        }
-        free(responseStr);
-        responseStr = NULL;
-    }
     RLOGE("requestRegistrationState must never return an error when radio is on");
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
 }
 
-static void requestOperator(void *data __unused, size_t datalen __unused, RIL_Token t)
+/**
+ * Read the operator names into names[3] (long, short, numeric), leaving
+ * empty strings for those that are not reported while unregistered.
+ * returns 0 on success, -1 on failure
+ */
+static int queryOperator(char names[3][OPERATOR_NAME_LEN])
 {
-    int err;
-    int i;
-    int skip;
-    ATLine *p_cur;
-    char *response[3];
-
-    memset(response, 0, sizeof(response));
-
     ATResponse *p_response = NULL;
+    ATLine *p_cur;
+    char *line, *name;
+    int err, i, skip;
 
     err = at_send_command_multiline(
         "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
@@ -1973,13 +2957,14 @@ static void requestOperator(void *data __unused, size_t datalen __unused, RIL_To
      * +COPS: 0,2,"310170"
      */
 
-    if (err != 0) goto error;
+    if (err != 0 || !p_response->success) goto error;
 
     for (i = 0, p_cur = p_response->p_intermediates
-            ; p_cur != NULL
+            ; p_cur != NULL && i < 3
             ; p_cur = p_cur->p_next, i++
     ) {
-        char *line = p_cur->line;
+        line = p_cur->line;
+        names[i][0] = '\0';
 
         err = at_tok_start(&line);
         if (err < 0) goto error;
@@ -1990,7 +2975,6 @@ static void requestOperator(void *data __unused, size_t datalen __unused, RIL_To
         // If we're unregistered, we may just get
         // a "+COPS: 0" response
         if (!at_tok_hasmore(&line)) {
-            response[i] = NULL;
             continue;
         }
 
@@ -1999,43 +2983,78 @@ static void requestOperator(void *data __unused, size_t datalen __unused, RIL_To
 
         // a "+COPS: 0, n" response is also possible
         if (!at_tok_hasmore(&line)) {
-            response[i] = NULL;
             continue;
         }
 
-        err = at_tok_nextstr(&line, &(response[i]));
+        err = at_tok_nextstr(&line, &name);
         if (err < 0) goto error;
+        strlcpy(names[i], name, OPERATOR_NAME_LEN);
+    }
+
+    if (i != 3 || p_cur != NULL) {
+        /* expect 3 lines exactly */
+        goto error;
+    }
+
+    at_response_free(p_response);
+    return 0;
+
+error:
+    at_response_free(p_response);
+    return -1;
+}
+
+static void requestOperator(void *data __unused, size_t datalen __unused, RIL_Token t)
+{
+    char names[3][OPERATOR_NAME_LEN];
+    char *response[3];
+    unsigned int gen;
+    bool valid;
+    int i, length;
+
+    pthread_mutex_lock(&s_operatorMutex);
+    valid = s_operatorValid;
+    gen = s_operatorGen;
+    memcpy(names, s_operatorNames, sizeof(names));
+    pthread_mutex_unlock(&s_operatorMutex);
+
+    if (!valid) {
+        if (queryOperator(names) < 0) goto error;
+
         // Simple assumption that mcc and mnc are 3 digits each
-        int length = strlen(response[i]);
+        length = strlen(names[2]);
         if (length == 6) {
             s_mncLength = 3;
-            if (sscanf(response[i], "%3d%3d", &s_mcc, &s_mnc) != 2) {
+            if (sscanf(names[2], "%3d%3d", &s_mcc, &s_mnc) != 2) {
                 RLOGE("requestOperator expected mccmnc to be 6 decimal digits");
             }
         } else if (length == 5) {
             s_mncLength = 2;
-            if (sscanf(response[i], "%3d%2d", &s_mcc, &s_mnc) != 2) {
+            if (sscanf(names[2], "%3d%2d", &s_mcc, &s_mnc) != 2) {
                 RLOGE("requestOperator expected mccmnc to be 5 decimal digits");
             }
         }
-    }
 
-    if (i != 3) {
-        /* expect 3 lines exactly */
-        goto error;
+        pthread_mutex_lock(&s_operatorMutex);
+        if (gen == s_operatorGen) {
+            memcpy(s_operatorNames, names, sizeof(names));
+            s_operatorValid = true;
+        }
+        pthread_mutex_unlock(&s_operatorMutex);
     }
 
+    for (i = 0; i < 3; i++) {
+        response[i] = names[i][0] != '\0' ? names[i] : NULL;
+    }
     RIL_onRequestComplete(t, RIL_E_SUCCESS, response, sizeof(response));
-    at_response_free(p_response);
-
     return;
+
 error:
     RLOGE("requestOperator must not return error when radio is on");
     s_mncLength = 0;
     s_mcc = 0;
     s_mnc = 0;
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
-    at_response_free(p_response);
 }
 
 static void requestCdmaSendSMS(void *data, size_t datalen, RIL_Token t)
@@ -2078,15 +3097,20 @@ error:
     RIL_onRequestComplete(t, RIL_E_SMS_SEND_FAIL_RETRY, &response, sizeof(response));
 }
 
-static void requestSendSMS(void *data, size_t datalen, RIL_Token t)
+/** SmsTimerFn for sms_submit, restores AT+CMMS on the main request thread */
+static void smsSubmitTimer(void (*callback)(void *param), void *param, int delayMs)
+{
+    const struct timeval tv = { delayMs / 1000, (delayMs % 1000) * 1000 };
+
+    RIL_requestTimedCallback(callback, param, &tv);
+}
+
+static void requestSendSMS(void *data, size_t datalen, RIL_Token t, bool expectMore)
 {
-    int err;
     const char *smsc;
     const char *pdu;
-    int tpLayerLength;
-    char *cmd1, *cmd2;
+    int messageRef;
     RIL_SMS_Response response;
-    ATResponse *p_response = NULL;
 
     if (getSIMStatus() == SIM_ABSENT) {
         RIL_onRequestComplete(t, RIL_E_SIM_ABSENT, NULL, 0);
@@ -2102,48 +3126,21 @@ static void requestSendSMS(void *data, size_t datalen, RIL_Token t)
     smsc = ((const char **)data)[0];
     pdu = ((const char **)data)[1];
 
-    tpLayerLength = strlen(pdu)/2;
-
-    // "NULL for default SMSC"
-    if (smsc == NULL) {
-        smsc= "00";
-    }
-
-    asprintf(&cmd1, "AT+CMGS=%d", tpLayerLength);
-    asprintf(&cmd2, "%s%s", smsc, pdu);
-
-    err = at_send_command_sms(cmd1, cmd2, "+CMGS:", &p_response);
-
-    free(cmd1);
-    free(cmd2);
-
-    if (err != 0 || p_response->success == 0) goto error;
-
-    int messageRef = 1;
-    char *line = p_response->p_intermediates->line;
-
-    err = at_tok_start(&line);
-    if (err < 0) goto error;
-
-    err = at_tok_nextint(&line, &messageRef);
-    if (err < 0) goto error;
+    if (sms_submit(smsc, pdu, expectMore, &messageRef) < 0) goto error;
 
     /* FIXME fill in ackPDU */
     response.messageRef = messageRef;
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
-    at_response_free(p_response);
 
     return;
 error:
     response.messageRef = -2;
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, &response, sizeof(response));
-    at_response_free(p_response);
     return;
 error2:
     // send retry error.
     response.messageRef = -1;
     RIL_onRequestComplete(t, RIL_E_SMS_SEND_FAIL_RETRY, &response, sizeof(response));
-    at_response_free(p_response);
     return;
 }
 
@@ -2173,7 +3170,7 @@ static void requestImsSendSMS(void *data, size_t datalen, RIL_Token t)
     if (RADIO_TECH_3GPP == p_args->tech) {
         return requestSendSMS(p_args->message.gsmMessage,
                 datalen - sizeof(RIL_RadioTechnologyFamily),
-                t);
+                t, false);
     } else if (RADIO_TECH_3GPP2 == p_args->tech) {
         return requestCdmaSendSMS(p_args->message.cdmaMessage,
                 datalen - sizeof(RIL_RadioTechnologyFamily),
@@ -2207,9 +3204,11 @@ static int sendCmdAgainForOpenChannelWithP2( char *data,
     RIL_Errno errType = RIL_E_GENERIC_FAILURE;
     ATResponse *p_response = NULL;
     RIL_SIM_IO_Response sr;
+    uint8_t bytes[259];
 
     memset(&sr, 0, sizeof(sr));
-    sscanf(data, "%2x", &(response[0]));  // response[0] is channel number
+    response[0] = hex_decode_byte(data);  // response[0] is channel number
+    if (response[0] < 0) goto done;
 
     // Send SELECT command to MF
     snprintf(cmd, sizeof(cmd), "AT+CGLA=%d,14,00A400%02X023F00", response[0],
@@ -2232,13 +3231,14 @@ static int sendCmdAgainForOpenChannelWithP2( char *data,
         goto done;
     }
 
-    sscanf(&(sr.simResponse[len - 4]), "%02x%02x", &(sr.sw1), &(sr.sw2));
+    if (parseApduStatusWord(sr.simResponse, &sr) < 0) goto done;
 
     if (sr.sw1 == 0x90 && sr.sw2 == 0x00) {  // 9000 is successful
-        int length = len / 2;
+        int length = hex_decode(sr.simResponse, strlen(sr.simResponse),
+                                bytes, sizeof(bytes));
+        if (length < 0) goto done;
         for (*rspLen = 1; *rspLen <= length; (*rspLen)++) {
-            sscanf(sr.simResponse, "%02x", &(response[*rspLen]));
-            sr.simResponse += 2;
+            response[*rspLen] = bytes[*rspLen - 1];
         }
         errType = RIL_E_SUCCESS;
     } else {  // close channel
@@ -2265,6 +3265,7 @@ static void requestSimOpenChannel(void *data, size_t datalen, RIL_Token t)
     char *line = NULL;
     int skip = 0;
     char *statusWord = NULL;
+    uint8_t bytes[260];
     int err_no = RIL_E_GENERIC_FAILURE;
 
     RIL_OpenChannelParams *params = (RIL_OpenChannelParams *)data;
@@ -2297,10 +3298,11 @@ static void requestSimOpenChannel(void *data, size_t datalen, RIL_Token t)
         if (err < 0) goto error;
 
         if (params->p2 < 0) {
-            int length = strlen(statusWord) / 2;
+            int length = hex_decode(statusWord, strlen(statusWord),
+                                    bytes, sizeof(bytes));
+            if (length < 0) goto error;
             for (responseLen = 0; responseLen < length; responseLen++) {
-                sscanf(statusWord, "%02x", &(response[responseLen]));
-                statusWord += 2;
+                response[responseLen] = bytes[responseLen];
             }
             err_no = RIL_E_SUCCESS;
         } else {
@@ -2406,11 +3408,8 @@ static void requestSimTransmitApduChannel(void *data,
     err = at_tok_nextstr(&line, &(sr.simResponse));
     if (err < 0) goto error;
 
-    len = strlen(sr.simResponse);
-    if (len < 4) goto error;
-
-    sscanf(&(sr.simResponse[len - 4]), "%02x%02x", &(sr.sw1), &(sr.sw2));
-    sr.simResponse[len - 4] = '\0';
+    if (parseApduStatusWord(sr.simResponse, &sr) < 0) goto error;
+    sr.simResponse[strlen(sr.simResponse) - 4] = '\0';
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
     at_response_free(p_response);
@@ -2421,79 +3420,31 @@ error:
     at_response_free(p_response);
 }
 
+/**
+ * EAP-SIM and EAP-AKA authentication through AT^MBAU, the challenge and
+ * response framing is in sim_auth.c.
+ */
 static void requestSimAuthentication(int authContext, char* authData, RIL_Token t) {
-    int err = -1, ret = 0;
-    int status = 0;
-    int binSimResponseLen = 0;
-    char *cmd = NULL;
-    char *line = NULL;
-    // Input data
-    int randLen = 0, autnLen = 0;
-    char *rand = NULL, *autn = NULL;
-    // EAP-SIM response data
-    int kcLen = 0, sresLen = 0;
-    char *kc = NULL, *sres = NULL;
-    // EAP-AKA response data
-    int ckLen = 0, ikLen = 0, resAutsLen = 0;
-    char *ck = NULL, *ik = NULL, *resAuts = NULL;
-    unsigned char *binSimResponse = NULL;
-    unsigned char *binAuthData = NULL;
-    unsigned char *hexAuthData = NULL;
     ATResponse *p_response = NULL;
     RIL_SIM_IO_Response response;
+    char cmd[SIM_AUTH_COMMAND_SIZE];
+    char encoded[SIM_AUTH_RESPONSE_SIZE];
+    bool aka = authContext == AUTH_CONTEXT_EAP_AKA;
+    int err, status;
+    char *line, *kc, *sres, *ck, *ik, *resAuts;
 
     memset(&response, 0, sizeof(response));
     response.sw1 = 0x90;
     response.sw2 = 0;
 
-    binAuthData  =
-            (unsigned char *)malloc(sizeof(*binAuthData) * strlen(authData));
-    if (binAuthData == NULL) {
+    if (authContext != AUTH_CONTEXT_EAP_SIM && authContext != AUTH_CONTEXT_EAP_AKA) {
         goto error;
     }
-    if(base64_decode(authData, binAuthData) <= 0) {
-        RLOGE("base64_decode failed %s %d", __func__, __LINE__);
-        goto error;
-    }
-    hexAuthData =
-            (unsigned char *)malloc(strlen(authData) * 2 + sizeof(char));
-    if (hexAuthData == NULL) {
-        goto error;
-    }
-    memset(hexAuthData, 0, strlen(authData) * 2 + sizeof(char));
-    convertBytesToHexString((char *)binAuthData, strlen(authData), hexAuthData);
-
-    randLen = binAuthData[0];
-    rand = (char *)malloc(sizeof(char) * (randLen * 2 + sizeof(char)));
-    if (rand == NULL) {
-        goto error;
-    }
-    memcpy(rand, hexAuthData + 2, randLen * 2);
-    memcpy(rand + randLen * 2, "\0", 1);
-
-    if (authContext == AUTH_CONTEXT_EAP_AKA) {
-        // There's the autn value to parse as well.
-        autnLen = binAuthData[1 + randLen];
-        autn = (char*)malloc(sizeof(char) * (autnLen * 2 + sizeof(char)));
-        if (autn == NULL) {
-            goto error;
-        }
-        memcpy(autn, hexAuthData + 2 + randLen * 2 + 2, autnLen * 2);
-        memcpy(autn + autnLen * 2, "\0", 1);
-    }
-
-    if (authContext == AUTH_CONTEXT_EAP_SIM) {
-        ret = asprintf(&cmd, "AT^MBAU=\"%s\"", rand);
-    } else {
-        ret = asprintf(&cmd, "AT^MBAU=\"%s,%s\"", rand, autn);
-    }
-    if (ret < 0) {
-        RLOGE("Failed to asprintf");
+    if (sim_auth_command(authData, aka, cmd, sizeof(cmd)) < 0) {
         goto error;
     }
-    err = at_send_command_singleline( cmd, "^MBAU:", &p_response);
-    free(cmd);
 
+    err = at_send_command_singleline(cmd, "^MBAU:", &p_response);
     if (err < 0 || p_response->success == 0) {
         goto error;
     }
@@ -2507,100 +3458,25 @@ static void requestSimAuthentication(int authContext, char* authData, RIL_Token
         goto error;
     }
 
-    if (authContext == AUTH_CONTEXT_EAP_SIM) {
-        err = at_tok_nextstr(&line, &kc);
-        if (err < 0) goto error;
-        kcLen = strlen(kc);
-
-        err = at_tok_nextstr(&line, &sres);
-        if (err < 0) goto error;
-        sresLen = strlen(sres);
-
-        // sresLen + sres + kcLen + kc + '\0'
-        binSimResponseLen = (kcLen + sresLen) / 2 + 3 * sizeof(char);
-        binSimResponse = (unsigned char*)malloc(binSimResponseLen + sizeof(char));
-        if (binSimResponse == NULL) goto error;
-        memset(binSimResponse, 0, binSimResponseLen);
-        // set sresLen and sres
-        binSimResponse[0] = (sresLen / 2) & 0xFF;
-        uint8_t* tmpBinSimResponse = convertHexStringToBytes(sres, sresLen);
-        snprintf((char*)(binSimResponse + 1), sresLen / 2, "%s", tmpBinSimResponse);
-        free(tmpBinSimResponse);
-        tmpBinSimResponse = NULL;
-        // set kcLen and kc
-        binSimResponse[1 + sresLen / 2] = (kcLen / 2) & 0xFF;
-        tmpBinSimResponse = convertHexStringToBytes(kc, kcLen);
-        snprintf((char*)(binSimResponse + 1 + sresLen / 2 + 1), kcLen / 2, "%s", tmpBinSimResponse);
-        free(tmpBinSimResponse);
-        tmpBinSimResponse = NULL;
-    } else {  // AUTH_CONTEXT_EAP_AKA
-        err = at_tok_nextstr(&line, &ck);
-        if (err < 0) goto error;
-        ckLen = strlen(ck);
-
-        err = at_tok_nextstr(&line, &ik);
-        if (err < 0) goto error;
-        ikLen = strlen(ik);
-
-        err = at_tok_nextstr(&line, &resAuts);
-        if (err < 0) goto error;
-        resAutsLen = strlen(resAuts);
-
-        // 0xDB + ckLen + ck + ikLen + ik + resAutsLen + resAuts + '\0'
-        binSimResponseLen = (ckLen + ikLen + resAutsLen) / 2 + 5 * sizeof(char);
-        binSimResponse = (unsigned char*)malloc(binSimResponseLen + sizeof(char));
-        if (binSimResponse == NULL) goto error;
-        memset(binSimResponse, 0, binSimResponseLen);
-        // The DB prefix indicates successful auth. Not produced by the SIM.
-        binSimResponse[0] = 0xDB;
-        // Set ckLen and ck
-        binSimResponse[1] = (ckLen / 2) & 0xFF;
-        uint8_t* tmpBinSimResponse = convertHexStringToBytes(ck, ckLen);
-        snprintf((char*)(binSimResponse + 2), ckLen / 2 + 1, "%s", tmpBinSimResponse);
-        free(tmpBinSimResponse);
-        tmpBinSimResponse = NULL;
-        // Set ikLen and ik
-        binSimResponse[2 + ckLen / 2] = (ikLen / 2) & 0xFF;
-        tmpBinSimResponse = convertHexStringToBytes(ik, ikLen);
-        snprintf((char*)(binSimResponse + 2 + ckLen / 2 + 1), ikLen / 2 + 1, "%s",
-                 tmpBinSimResponse);
-        free(tmpBinSimResponse);
-        tmpBinSimResponse = NULL;
-        // Set resAutsLen and resAuts
-        binSimResponse[2 + ckLen / 2 + 1 + ikLen / 2] = (resAutsLen / 2) & 0xFF;
-        tmpBinSimResponse = convertHexStringToBytes(resAuts, resAutsLen);
-        snprintf((char*)(binSimResponse + 2 + ckLen / 2 + 1 + ikLen / 2 + 1), resAutsLen / 2 + 1,
-                 "%s", tmpBinSimResponse);
-        free(tmpBinSimResponse);
-        tmpBinSimResponse = NULL;
-    }
-
-    response.simResponse = (char*)malloc(2 * binSimResponseLen + sizeof(char));
-    if (response.simResponse == NULL) goto error;
-    if (NULL == base64_encode(binSimResponse, response.simResponse, binSimResponseLen - 1)) {
-        RLOGE("Failed to call base64_encode %s %d", __func__, __LINE__);
-        goto error;
+    if (!aka) {
+        if (at_tok_nextstr(&line, &kc) < 0 || at_tok_nextstr(&line, &sres) < 0
+                || sim_auth_gsm_response(sres, kc, encoded, sizeof(encoded)) < 0) {
+            goto error;
+        }
+    } else {
+        if (at_tok_nextstr(&line, &ck) < 0 || at_tok_nextstr(&line, &ik) < 0
+                || at_tok_nextstr(&line, &resAuts) < 0
+                || sim_auth_umts_response(resAuts, ck, ik, encoded, sizeof(encoded)) < 0) {
+            goto error;
+        }
     }
+    response.simResponse = encoded;
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &response, sizeof(response));
     at_response_free(p_response);
-
-    free(binAuthData);
-    free(hexAuthData);
-    free(rand);
-    free(autn);
-    free(response.simResponse);
-    free(binSimResponse);
     return;
 
 error:
-    free(binAuthData);
-    free(hexAuthData);
-    free(rand);
-    free(autn);
-    free(response.simResponse);
-    free(binSimResponse);
-
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
 }
@@ -2652,8 +3528,8 @@ static void requestTransmitApduBasic( void *data, size_t datalen,
     err = at_tok_nextstr(&line, &(sr.simResponse));
     if (err < 0) goto error;
 
-    sscanf(&(sr.simResponse[len - 4]), "%02x%02x", &(sr.sw1), &(sr.sw2));
-    sr.simResponse[len - 4] = '\0';
+    if (parseApduStatusWord(sr.simResponse, &sr) < 0) goto error;
+    sr.simResponse[strlen(sr.simResponse) - 4] = '\0';
 
     instruction = p_args->instruction;
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
@@ -2668,6 +3544,7 @@ error:
 static int getPDP() {
     int ret = -1;
 
+    pthread_mutex_lock(&s_pdpMutex);
     for (int i = 0; i < MAX_PDP; i++) {
         if (s_PDP[i].state == PDP_IDLE) {
             s_PDP[i].state = PDP_BUSY;
@@ -2675,6 +3552,7 @@ static int getPDP() {
             break;
         }
     }
+    pthread_mutex_unlock(&s_pdpMutex);
     return ret;
 }
 
@@ -2683,7 +3561,70 @@ static void putPDP(int cid) {
         return;
     }
 
+    pthread_mutex_lock(&s_pdpMutex);
     s_PDP[cid - 1].state = PDP_IDLE;
+    pthread_mutex_unlock(&s_pdpMutex);
+}
+
+/**
+ * Start a data call on profile cid over QMI. The runtime settings come
+ * with the call, so the context table is filled in without AT+CGCONTRDP.
+ * returns 0 on success, -1 on failure
+ */
+static int setupQmiDataCall(QmiDevice *qmi, int cid, const char *apn,
+                            const char *pdp_type, const char *user,
+                            const char *password, int authType)
+{
+    QmiServingSystem ss;
+    QmiStartParams params;
+    QmiRuntimeSettings rs;
+    struct PDPInfo *pdp;
+    uint32_t handle;
+    int endReason;
+
+    if (qmi_get_serving_system(qmi, &ss) == 0 && ss.psAttachState != 1) {
+        RLOGE("not attached to the packet domain, not starting data");
+        return -1;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.apn = apn;
+    params.username = user;
+    params.password = password;
+    params.authType = authType;
+    params.ipFamily = strcmp(pdp_type, "IPV6") == 0 ? 6 : 4;
+    params.profileIndex = cid;
+
+    if (qmi_start_network(qmi, &params, &handle, &endReason) < 0) {
+        RLOGE("QMI data call on cid %d failed, call end reason %d",
+              cid, endReason);
+        return -1;
+    }
+
+    if (qmi_get_runtime_settings(qmi, &rs) < 0
+            || netlink_configure(s_qmiIfname, rs.address, rs.mtu) < 0
+            || netlink_wait_link(s_qmiIfname, IFF_UP | IFF_RUNNING,
+                                 DATA_LINK_TIMEOUT_MS) < 0) {
+        qmi_stop_network(qmi, handle);
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_pdpMutex);
+    pdp = &s_PDP[cid - 1];
+    strlcpy(pdp->type, pdp_type, sizeof(pdp->type));
+    strlcpy(pdp->apn, apn, sizeof(pdp->apn));
+    strlcpy(pdp->addresses, rs.address, sizeof(pdp->addresses));
+    strlcpy(pdp->gateways, rs.gateway, sizeof(pdp->gateways));
+    pdp->dnses[0] = '\0';
+    appendToList(pdp->dnses, sizeof(pdp->dnses), rs.dns1);
+    appendToList(pdp->dnses, sizeof(pdp->dnses), rs.dns2);
+    pdp->mtu = rs.mtu;
+    pdp->qmiHandle = handle;
+    pdp->active = true;
+    pdp->dirty = false;
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    return 0;
 }
 
 static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
@@ -2693,6 +3634,8 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
     int err = -1;
     int cid = -1;
     ATResponse *p_response = NULL;
+    QmiDevice *qmi;
+    const char *pdp_type;
 
     apn = ((const char **)data)[2];
 
@@ -2704,88 +3647,42 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
     err = at_send_command("AT%DATA=2,\"UART\",1,,\"SER\",\"UART\",0", NULL);
 #endif /* USE_TI_COMMANDS */
 
-    int fd, qmistatus;
-    size_t cur = 0;
-    size_t len;
-    ssize_t written, rlen;
-    char status[32] = {0};
-    int retry = 10;
-    const char *pdp_type;
+    if (datalen > 6 * sizeof(char *)) {
+        pdp_type = ((const char **)data)[6];
+    } else {
+        pdp_type = "IP";
+    }
 
     RLOGD("requesting data connection to APN '%s'", apn);
 
-    fd = open ("/dev/qmi", O_RDWR);
-    if (fd >= 0) { /* the device doesn't exist on the emulator */
-
-        RLOGD("opened the qmi device\n");
-        asprintf(&cmd, "up:%s", apn);
-        len = strlen(cmd);
+    cid = getPDP();
+    if (cid < 1 ) goto error;
 
-        while (cur < len) {
-            do {
-                written = write (fd, cmd + cur, len - cur);
-            } while (written < 0 && errno == EINTR);
+    asprintf(&cmd, "AT+CGDCONT=%d,\"%s\",\"%s\",,0,0", cid, pdp_type, apn);
+    //FIXME check for error here
+    err = at_send_command(cmd, NULL);
+    free(cmd);
 
-            if (written < 0) {
-                RLOGE("### ERROR writing to /dev/qmi");
-                close(fd);
-                goto error;
-            }
+    qmi = getQmiDevice();
+    if (qmi != NULL) {
+        const char *user = NULL, *password = NULL;
+        int authType = 0;
 
-            cur += written;
+        if (datalen > 5 * sizeof(char *)) {
+            user = ((const char **)data)[3];
+            password = ((const char **)data)[4];
+            authType = ((const char **)data)[5] ? atoi(((const char **)data)[5]) : 0;
         }
-
-        // wait for interface to come online
-
-        do {
-            sleep(1);
-            do {
-                rlen = read(fd, status, 31);
-            } while (rlen < 0 && errno == EINTR);
-
-            if (rlen < 0) {
-                RLOGE("### ERROR reading from /dev/qmi");
-                close(fd);
-                goto error;
-            } else {
-                status[rlen] = '\0';
-                RLOGD("### status: %s", status);
-            }
-        } while (strncmp(status, "STATE=up", 8) && strcmp(status, "online") && --retry);
-
-        close(fd);
-
-        if (retry == 0) {
-            RLOGE("### Failed to get data connection up\n");
+        if (setupQmiDataCall(qmi, cid, apn, pdp_type, user, password,
+                             authType) < 0) {
             goto error;
         }
-
-        qmistatus = system("netcfg rmnet0 dhcp");
-
-        RLOGD("netcfg rmnet0 dhcp: status %d\n", qmistatus);
-
-        if (qmistatus < 0) goto error;
-
     } else {
         const char* radioInterfaceName = getRadioInterfaceName();
         if (setInterfaceState(radioInterfaceName, kInterfaceUp) != RIL_E_SUCCESS) {
             goto error;
         }
 
-        if (datalen > 6 * sizeof(char *)) {
-            pdp_type = ((const char **)data)[6];
-        } else {
-            pdp_type = "IP";
-        }
-
-        cid = getPDP();
-        if (cid < 1 ) goto error;
-
-        asprintf(&cmd, "AT+CGDCONT=%d,\"%s\",\"%s\",,0,0", cid, pdp_type, apn);
-        //FIXME check for error here
-        err = at_send_command(cmd, NULL);
-        free(cmd);
-
         // Set required QoS params to default
         err = at_send_command("AT+CGQREQ=1", NULL);
 
@@ -2804,14 +3701,28 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
         if (err < 0 || p_response->success == 0) {
             goto error;
         }
+
+        /* the modem reports no +CGEV for contexts we activate ourselves */
+        pthread_mutex_lock(&s_pdpMutex);
+        strlcpy(s_PDP[cid - 1].type, pdp_type, sizeof(s_PDP[cid - 1].type));
+        strlcpy(s_PDP[cid - 1].apn, apn, sizeof(s_PDP[cid - 1].apn));
+        s_PDP[cid - 1].active = true;
+        s_PDP[cid - 1].dirty = true;
+        pthread_mutex_unlock(&s_pdpMutex);
+
+#ifdef CUTTLEFISH_ENABLE
+        pdpConfigureInterface(cid);
+#endif
     }
 
+    boottime_mark(BOOT_DATA_UP);
     requestOrSendDataCallList(cid, &t);
 
     at_response_free(p_response);
 
     return;
 error:
+    putPDP(cid);
     RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
     at_response_free(p_response);
 }
@@ -2827,82 +3738,403 @@ static void requestDeactivateDataCall(void *data, RIL_Token t)
     }
 
     const char* radioInterfaceName = getRadioInterfaceName();
-    rilErrno = setInterfaceState(radioInterfaceName, kInterfaceDown);
+    char addresses[PDP_LIST_LEN];
+    uint32_t qmiHandle;
+
+    pthread_mutex_lock(&s_pdpMutex);
+    strlcpy(addresses, s_PDP[cid - 1].addresses, sizeof(addresses));
+    qmiHandle = s_PDP[cid - 1].qmiHandle;
+    s_PDP[cid - 1].qmiHandle = 0;
+    pdpClearRuntimeLocked(&s_PDP[cid - 1]);
+    pthread_mutex_unlock(&s_pdpMutex);
+
+    if (qmiHandle != 0) {
+        qmi_stop_network(getQmiDevice(), qmiHandle);
+    }
+
+    /* drops the addresses configured at setup and sets the link down */
+    rilErrno = netlink_deconfigure(radioInterfaceName, addresses) == 0
+            ? RIL_E_SUCCESS : netlinkToRilErrno();
+
     RIL_onRequestComplete(t, rilErrno, NULL, 0);
     putPDP(cid);
 }
 
-static void requestSMSAcknowledge(void *data, size_t datalen __unused, RIL_Token t)
+/*
+ * Incoming SMS queue. +CMT and +CDS PDUs are queued and handed to the
+ * framework one at a time, the next one after it acknowledged the
+ * previous. The network acknowledgment (AT+CNMA) follows the framework's:
+ * RP-ACK when it accepted the message, RP-ERROR with its cause when it
+ * didn't, in which case the network delivers the message again later.
+ * The modem doesn't announce another message before AT+CNMA, so these
+ * are queued in front of messages read back from storage.
+ *
+ * When the queue fills up, CNMI switches to storing new messages
+ * (announced by +CMTI) in the preferred storage, which is drained with
+ * AT+CMGL once the queue has room again. A stored message is deleted
+ * when the framework accepted it and otherwise left in storage.
+ */
+#define SMS_QUEUE_MAX           8
+#define SMS_QUEUE_RESUME        2   /* drain storage below this depth */
+#define SMS_ACK_TIMEOUT_MS      10000
+#define SMS_ACK_HOLD_MS         5000
+/* TS 23.040 9.2.3.22, TP-FCS if the framework gave none */
+#define SMS_CAUSE_UNSPECIFIED   0xff
+
+typedef struct {
+    char *pdu;
+    bool statusReport;
+    bool networkAck;        /* needs AT+CNMA */
+    int storageIndex;       /* read from storage at this index, or -1 */
+} QueuedSms;
+
+static pthread_mutex_t s_smsQueueMutex = PTHREAD_MUTEX_INITIALIZER;
+static QueuedSms s_smsQueue[SMS_QUEUE_MAX];
+static int s_smsQueueCount = 0;
+static bool s_smsOutstanding = false;   /* head delivered, waiting for ack */
+static int64_t s_smsDeliveredMs = 0;
+static int64_t s_smsHoldUntilMs = 0;    /* no delivery before, after a timeout */
+static bool s_smsStorageMode = false;
+static bool s_smsStored = false;        /* +CMTI seen since the last drain */
+static bool s_smsUpdatePending = false;
+/* framework acknowledgment latency */
+static unsigned int s_smsAckCount = 0;
+static int64_t s_smsAckTotalMs = 0;
+static int64_t s_smsAckMaxMs = 0;
+
+static void onSmsQueueChanged(void *param);
+
+static void scheduleSmsQueueUpdate(int delayMs)
 {
-    int ackSuccess;
-    int err;
+    struct timeval tv = { delayMs / 1000, (delayMs % 1000) * 1000 };
+    bool schedule;
 
-    if (getSIMStatus() == SIM_ABSENT) {
-        RIL_onRequestComplete(t, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
-        return;
+    pthread_mutex_lock(&s_smsQueueMutex);
+    schedule = !s_smsUpdatePending || delayMs > 0;
+    if (delayMs == 0) {
+        s_smsUpdatePending = true;
     }
+    pthread_mutex_unlock(&s_smsQueueMutex);
 
-    ackSuccess = ((int *)data)[0];
+    if (schedule) {
+        RIL_requestTimedCallback(onSmsQueueChanged, NULL, delayMs > 0 ? &tv : NULL);
+    }
+}
 
-    if (ackSuccess == 1) {
-        err = at_send_command("AT+CNMA=1", NULL);
-    } else if (ackSuccess == 0)  {
-        err = at_send_command("AT+CNMA=2", NULL);
-    } else {
-        RLOGE("unsupported arg to RIL_REQUEST_SMS_ACKNOWLEDGE\n");
-        goto error;
+/**
+ * Messages needing a network ack go in front of those from storage,
+ * behind the one the framework is busy with.
+ * returns false if the queue is full, called with s_smsQueueMutex held
+ */
+static bool smsQueuePushLocked(const char *pdu, bool statusReport, int storageIndex)
+{
+    QueuedSms *sms;
+    char *copy;
+    int pos = s_smsQueueCount;
+
+    if (s_smsQueueCount >= SMS_QUEUE_MAX || (copy = strdup(pdu)) == NULL) {
+        return false;
     }
+    if (storageIndex < 0) {
+        for (pos = s_smsOutstanding ? 1 : 0; pos < s_smsQueueCount; pos++) {
+            if (!s_smsQueue[pos].networkAck) {
+                break;
+            }
+        }
+        memmove(&s_smsQueue[pos + 1], &s_smsQueue[pos],
+                (s_smsQueueCount - pos) * sizeof(s_smsQueue[0]));
+    }
+    s_smsQueueCount++;
+    sms = &s_smsQueue[pos];
+    sms->pdu = copy;
+    sms->statusReport = statusReport;
+    sms->networkAck = storageIndex < 0;
+    sms->storageIndex = storageIndex;
+    return true;
+}
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
-error:
-    RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+/** returns the head for the caller to free, called with s_smsQueueMutex held */
+static QueuedSms smsQueuePopLocked()
+{
+    QueuedSms head = s_smsQueue[0];
+
+    s_smsQueueCount--;
+    memmove(&s_smsQueue[0], &s_smsQueue[1], s_smsQueueCount * sizeof(s_smsQueue[0]));
+    s_smsOutstanding = false;
+    return head;
 }
 
-void convertBytesToHex(uint8_t *bytes, int length, uint8_t *hex_str) {
+/** Returns true if a stored message with this index is queued */
+static bool smsQueueHasStoredLocked(int storageIndex)
+{
     int i;
-    unsigned char tmp;
 
-    if (bytes == NULL || hex_str == NULL) {
+    for (i = 0; i < s_smsQueueCount; i++) {
+        if (s_smsQueue[i].storageIndex == storageIndex) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Drop the queue when the radio goes off, nothing is acknowledged any more */
+static void invalidateSmsQueue()
+{
+    pthread_mutex_lock(&s_smsQueueMutex);
+    while (s_smsQueueCount > 0) {
+        free(smsQueuePopLocked().pdu);
+    }
+    s_smsHoldUntilMs = 0;
+    s_smsStorageMode = false;
+    s_smsStored = false;
+    pthread_mutex_unlock(&s_smsQueueMutex);
+}
+
+/** Queue a +CMT/+CDS PDU, called on the reader thread */
+static void onIncomingSms(const char *pdu, bool statusReport)
+{
+    bool queued;
+
+    pthread_mutex_lock(&s_smsQueueMutex);
+    queued = smsQueuePushLocked(pdu, statusReport, -1);
+    pthread_mutex_unlock(&s_smsQueueMutex);
+
+    if (!queued) {
+        /* not acknowledged, the network will retry */
+        RLOGE("SMS queue full, dropping incoming %s",
+              statusReport ? "status report" : "message");
         return;
     }
-    for (i = 0; i < length; i++) {
-        tmp = (unsigned char)((bytes[i] & 0xf0) >> 4);
-        if (tmp <= 9) {
-            *hex_str = (unsigned char)(tmp + '0');
-        } else {
-            *hex_str = (unsigned char)(tmp + 'A' - 10);
+    scheduleSmsQueueUpdate(0);
+}
+
+/** Note that CNMI stored a message, called on the reader thread */
+static void onSmsStored()
+{
+    sim_cache_invalidate_file(EF_SMS);
+    pthread_mutex_lock(&s_smsQueueMutex);
+    s_smsStored = true;
+    pthread_mutex_unlock(&s_smsQueueMutex);
+    scheduleSmsQueueUpdate(0);
+}
+
+/**
+ * Move stored messages into the queue. They stay in storage until the
+ * framework accepted them.
+ * returns true if storage may still hold messages
+ */
+static bool drainStoredSms()
+{
+    ATResponse *p_response = NULL;
+    ATLine *p_cur;
+    char *line;
+    int err, index;
+    bool queued, more = false;
+
+    /* 0: received unread, which is what CNMI stored for us */
+    err = at_send_command_multiline_pdu("AT+CMGL=0", "+CMGL:", &p_response);
+    /* listing marks the messages read */
+    sim_cache_invalidate_file(EF_SMS);
+    if (err < 0 || !p_response->success) {
+        at_response_free(p_response);
+        return true;
+    }
+
+    for (p_cur = p_response->p_intermediates;
+            p_cur != NULL && p_cur->p_next != NULL;
+            p_cur = p_cur->p_next->p_next) {
+        /* +CMGL: <index>,<stat>,[<alpha>],<length> followed by the PDU */
+        line = p_cur->line;
+        if (at_tok_start(&line) < 0 || at_tok_nextint(&line, &index) < 0) {
+            continue;
         }
-        hex_str++;
-        tmp = (unsigned char)(bytes[i] & 0x0f);
-        if (tmp <= 9) {
-            *hex_str = (unsigned char)(tmp + '0');
-        } else {
-            *hex_str = (unsigned char)(tmp + 'A' - 10);
+
+        pthread_mutex_lock(&s_smsQueueMutex);
+        queued = smsQueueHasStoredLocked(index)
+                || smsQueuePushLocked(p_cur->p_next->line, false, index);
+        pthread_mutex_unlock(&s_smsQueueMutex);
+        if (!queued) {
+            more = true;
+            break;
         }
-        hex_str++;
     }
+    at_response_free(p_response);
+    return more;
 }
 
-#define TYPE_EF                                 4
-#define RESPONSE_EF_SIZE                        15
-#define TYPE_FILE_DES_LEN                       5
-#define RESPONSE_DATA_FILE_DES_FLAG             2
-#define RESPONSE_DATA_FILE_DES_LEN_FLAG         3
-#define RESPONSE_DATA_FILE_TYPE                 6
-#define RESPONSE_DATA_FILE_SIZE_1               2
-#define RESPONSE_DATA_FILE_SIZE_2               3
-#define RESPONSE_DATA_STRUCTURE                 13
-#define RESPONSE_DATA_RECORD_LENGTH             14
-#define RESPONSE_DATA_FILE_RECORD_LEN_1         6
-#define RESPONSE_DATA_FILE_RECORD_LEN_2         7
-#define EF_TYPE_TRANSPARENT                     0x01
-#define EF_TYPE_LINEAR_FIXED                    0x02
-#define EF_TYPE_CYCLIC                          0x06
-#define USIM_DATA_OFFSET_2                      2
-#define USIM_DATA_OFFSET_3                      3
-#define USIM_FILE_DES_TAG                       0x82
-#define USIM_FILE_SIZE_TAG                      0x80
+/**
+ * Pass the framework's verdict on a delivered message on: to the network
+ * for a message that came with +CMT/+CDS, to storage for one read from
+ * there. Called without s_smsQueueMutex held.
+ */
+static void finishSms(const QueuedSms *sms, bool accepted, int cause)
+{
+    char cmd[32], pdu[8];
+
+    if (sms->networkAck && accepted) {
+        at_send_command("AT+CNMA=1", NULL);
+    } else if (sms->networkAck) {
+        /* SMS-DELIVER-REPORT for RP-ERROR: TP-MTI, TP-FCS, TP-PI */
+        snprintf(pdu, sizeof(pdu), "00%02X00", cause & 0xff);
+        snprintf(cmd, sizeof(cmd), "AT+CNMA=2,%zu", strlen(pdu) / 2);
+        at_send_command_sms(cmd, pdu, "+CNMA:", NULL);
+    } else if (accepted) {
+        snprintf(cmd, sizeof(cmd), "AT+CMGD=%d", sms->storageIndex);
+        at_send_command(cmd, NULL);
+        sim_cache_invalidate_file(EF_SMS);
+    } else {
+        RLOGW("SMS at storage index %d not accepted, leaving it there",
+              sms->storageIndex);
+    }
+}
+
+/**
+ * Runs on the main thread: expire a delivery the framework didn't
+ * acknowledge in time, adjust the CNMI routing to the queue depth and
+ * deliver the head of the queue if the framework isn't busy with a
+ * previous message.
+ */
+static void onSmsQueueChanged(void *param __unused)
+{
+    QueuedSms head, expired = { NULL, false, false, -1 };
+    bool full, drain, resume = false;
+    int unsol = 0;
+    int64_t now = monotonicMsec();
+    char *pdu = NULL;
+
+    pthread_mutex_lock(&s_smsQueueMutex);
+    s_smsUpdatePending = false;
+    if (s_smsOutstanding && now - s_smsDeliveredMs >= SMS_ACK_TIMEOUT_MS) {
+        expired = smsQueuePopLocked();
+        /* an ack arriving late would be taken for the next message's */
+        s_smsHoldUntilMs = now + SMS_ACK_HOLD_MS;
+    }
+    full = s_smsQueueCount >= SMS_QUEUE_MAX && !s_smsStorageMode;
+    if (full) {
+        s_smsStorageMode = true;
+    }
+    drain = s_smsStored && s_smsQueueCount < SMS_QUEUE_RESUME;
+    if (drain) {
+        s_smsStored = false;
+    }
+    pthread_mutex_unlock(&s_smsQueueMutex);
+
+    if (expired.pdu != NULL) {
+        RLOGE("SMS not acknowledged within %d ms, rejecting it", SMS_ACK_TIMEOUT_MS);
+        finishSms(&expired, false, SMS_CAUSE_UNSPECIFIED);
+        free(expired.pdu);
+        scheduleSmsQueueUpdate(SMS_ACK_HOLD_MS);
+    }
+
+    if (full) {
+        RLOGI("SMS queue full, routing new messages to storage");
+        at_send_command(CNMI_ROUTE_STORAGE, NULL);
+    }
+
+    if (drain && drainStoredSms()) {
+        pthread_mutex_lock(&s_smsQueueMutex);
+        s_smsStored = true;
+        pthread_mutex_unlock(&s_smsQueueMutex);
+    }
+
+    pthread_mutex_lock(&s_smsQueueMutex);
+    if (s_smsStorageMode && !s_smsStored && s_smsQueueCount < SMS_QUEUE_RESUME) {
+        s_smsStorageMode = false;
+        resume = true;
+    }
+    if (!s_smsOutstanding && s_smsQueueCount > 0 && now >= s_smsHoldUntilMs) {
+        head = s_smsQueue[0];
+        s_smsOutstanding = true;
+        s_smsDeliveredMs = now;
+        unsol = head.statusReport ? RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT
+                                  : RIL_UNSOL_RESPONSE_NEW_SMS;
+        pdu = strdup(head.pdu);
+    }
+    pthread_mutex_unlock(&s_smsQueueMutex);
+
+    if (resume) {
+        RLOGI("SMS queue drained, routing new messages directly");
+        at_send_command(CNMI_ROUTE_DIRECT, NULL);
+    }
+
+    if (pdu != NULL) {
+        RIL_onUnsolicitedResponse(unsol, pdu, strlen(pdu));
+        free(pdu);
+        scheduleSmsQueueUpdate(SMS_ACK_TIMEOUT_MS);
+    }
+}
+
+static void requestSMSAcknowledge(void *data, size_t datalen, RIL_Token t)
+{
+    int ackSuccess, cause;
+    int64_t latency;
+    QueuedSms head;
+
+    if (getSIMStatus() == SIM_ABSENT) {
+        RIL_onRequestComplete(t, RIL_E_RADIO_NOT_AVAILABLE, NULL, 0);
+        return;
+    }
+
+    ackSuccess = ((int *)data)[0];
+    if (ackSuccess != 0 && ackSuccess != 1) {
+        RLOGE("unsupported arg to RIL_REQUEST_SMS_ACKNOWLEDGE\n");
+        RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
+        return;
+    }
+    /* TS 23.040 9.2.3.22 failure cause, only with a failure */
+    cause = datalen >= 2 * sizeof(int) ? ((int *)data)[1] : SMS_CAUSE_UNSPECIFIED;
+
+    pthread_mutex_lock(&s_smsQueueMutex);
+    if (!s_smsOutstanding) {
+        pthread_mutex_unlock(&s_smsQueueMutex);
+        RLOGE("SMS acknowledged, but none was delivered");
+        RIL_onRequestComplete(t, RIL_E_INVALID_STATE, NULL, 0);
+        return;
+    }
+
+    latency = monotonicMsec() - s_smsDeliveredMs;
+    s_smsAckCount++;
+    s_smsAckTotalMs += latency;
+    if (latency > s_smsAckMaxMs) {
+        s_smsAckMaxMs = latency;
+    }
+    RLOGD("SMS ack after %" PRId64 " ms (average %" PRId64 ", max %" PRId64 ")",
+          latency, s_smsAckTotalMs / s_smsAckCount, s_smsAckMaxMs);
+
+    head = smsQueuePopLocked();
+    pthread_mutex_unlock(&s_smsQueueMutex);
+
+    finishSms(&head, ackSuccess == 1, cause);
+    free(head.pdu);
+    scheduleSmsQueueUpdate(0);
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+}
+
+#define TYPE_EF                                 4
+#define RESPONSE_EF_SIZE                        15
+#define TYPE_FILE_DES_LEN                       5
+#define RESPONSE_DATA_FILE_DES_FLAG             2
+#define RESPONSE_DATA_FILE_DES_LEN_FLAG         3
+#define RESPONSE_DATA_FILE_TYPE                 6
+#define RESPONSE_DATA_FILE_SIZE_1               2
+#define RESPONSE_DATA_FILE_SIZE_2               3
+#define RESPONSE_DATA_STRUCTURE                 13
+#define RESPONSE_DATA_RECORD_LENGTH             14
+#define RESPONSE_DATA_FILE_RECORD_LEN_1         6
+#define RESPONSE_DATA_FILE_RECORD_LEN_2         7
+#define EF_TYPE_TRANSPARENT                     0x01
+#define EF_TYPE_LINEAR_FIXED                    0x02
+#define EF_TYPE_CYCLIC                          0x06
+#define USIM_DATA_OFFSET_2                      2
+#define USIM_DATA_OFFSET_3                      3
+#define USIM_FILE_DES_TAG                       0x82
+#define USIM_FILE_SIZE_TAG                      0x80
 
+/**
+ * Convert a USIM FCP template to the GSM GET RESPONSE layout.
+ * hexSIM must hold RESPONSE_EF_SIZE * 2 + 1 characters.
+ */
 bool convertUsimToSim(uint8_t *byteUSIM, int len, uint8_t *hexSIM) {
     int desIndex = 0;
     int sizeIndex = 0;
@@ -2951,13 +4183,119 @@ bool convertUsimToSim(uint8_t *byteUSIM, int len, uint8_t *hexSIM) {
                 (byteUSIM[RESPONSE_DATA_FILE_RECORD_LEN_2] & 0xff);
     }
 
-    convertBytesToHex(byteSIM, RESPONSE_EF_SIZE, hexSIM);
+    hex_encode(byteSIM, RESPONSE_EF_SIZE, (char *)hexSIM,
+               RESPONSE_EF_SIZE * 2 + 1);
     return true;
 
 error:
     return false;
 }
 
+#define SIM_COMMAND_READ_BINARY                 176
+#define SIM_COMMAND_READ_RECORD                 178
+#define SIM_COMMAND_GET_RESPONSE                192
+#define SIM_COMMAND_UPDATE_BINARY               214
+#define SIM_COMMAND_UPDATE_RECORD               220
+
+static bool simIoCacheable(const RIL_SIM_IO_v6 *p_args)
+{
+    if (p_args->data != NULL || p_args->pin2 != NULL) {
+        return false;
+    }
+    return p_args->command == SIM_COMMAND_READ_BINARY
+            || p_args->command == SIM_COMMAND_READ_RECORD
+            || p_args->command == SIM_COMMAND_GET_RESPONSE;
+}
+
+/*
+ * Record prefetch. The framework reads linear fixed files (ADN, SMS, ...)
+ * one READ RECORD at a time right after their GET RESPONSE, so on a miss
+ * the following records are read along in one compound command line and
+ * put in the SIM cache. The geometry comes from the cached, converted
+ * GET RESPONSE of the file.
+ */
+#define SIM_GET_RESPONSE_EF_SIZE    15  /* P3 used by the framework */
+#define SIM_READ_RECORD_ABSOLUTE    4
+#define SIM_PREFETCH_RECORDS        8
+#define SIM_PREFETCH_MAX_FAILURES   3
+
+static int s_simPrefetchFailures = 0;   /* SIM request class only */
+
+static void prefetchRecords(const RIL_SIM_IO_v6 *p_args)
+{
+    ATResponse *p_response = NULL;
+    ATLine *p_cur;
+    SimCacheKey key;
+    RIL_SIM_IO_Response sr;
+    char hex[RESPONSE_EF_SIZE * 2 + 1];
+    uint8_t info[RESPONSE_EF_SIZE];
+    char cmd[SIM_PREFETCH_RECORDS * 32];
+    int sw1, sw2, recordLen, count, last, record, len, err;
+
+    if (s_simPrefetchFailures >= SIM_PREFETCH_MAX_FAILURES
+            || p_args->p2 != SIM_READ_RECORD_ABSOLUTE) {
+        return;
+    }
+
+    key.command = SIM_COMMAND_GET_RESPONSE;
+    key.fileid = p_args->fileid;
+    key.path = p_args->path;
+    key.p1 = 0;
+    key.p2 = 0;
+    key.p3 = SIM_GET_RESPONSE_EF_SIZE;
+    if (!sim_cache_lookup(&key, &sw1, &sw2, hex, sizeof(hex))
+            || hex_decode(hex, strlen(hex), info, sizeof(info)) != RESPONSE_EF_SIZE) {
+        return;
+    }
+    recordLen = info[RESPONSE_DATA_RECORD_LENGTH];
+    if (info[RESPONSE_DATA_STRUCTURE] != 1 || recordLen != p_args->p3) {
+        return;
+    }
+    count = ((info[RESPONSE_DATA_FILE_SIZE_1] << 8)
+            | info[RESPONSE_DATA_FILE_SIZE_2]) / recordLen;
+    last = p_args->p1 + SIM_PREFETCH_RECORDS - 1;
+    if (last > count) {
+        last = count;
+    }
+    if (last <= p_args->p1) {
+        return;
+    }
+
+    len = snprintf(cmd, sizeof(cmd), "AT");
+    for (record = p_args->p1; record <= last; record++) {
+        len += snprintf(cmd + len, sizeof(cmd) - len, "%s+CRSM=%d,%d,%d,%d,%d",
+                        record == p_args->p1 ? "" : ";", SIM_COMMAND_READ_RECORD,
+                        p_args->fileid, record, SIM_READ_RECORD_ABSOLUTE, recordLen);
+    }
+
+    err = at_send_command_multiline(cmd, "+CRSM:", &p_response);
+    if (err < 0 || p_response->success == 0) {
+        s_simPrefetchFailures++;
+        RLOGW("Record prefetch of %04x failed (%d)", p_args->fileid,
+              s_simPrefetchFailures);
+        goto done;
+    }
+    s_simPrefetchFailures = 0;
+
+    key.command = SIM_COMMAND_READ_RECORD;
+    key.p2 = SIM_READ_RECORD_ABSOLUTE;
+    key.p3 = recordLen;
+    for (p_cur = p_response->p_intermediates, record = p_args->p1;
+            p_cur != NULL && record <= last; p_cur = p_cur->p_next, record++) {
+        memset(&sr, 0, sizeof(sr));
+        if (parseSimResponseLine(p_cur->line, &sr) < 0) {
+            break;
+        }
+        key.p1 = record;
+        sim_cache_store(&key, sr.sw1, sr.sw2, sr.simResponse);
+    }
+    RLOGD("Prefetched records %d-%d of %04x", p_args->p1, record - 1,
+          p_args->fileid);
+
+done:
+    at_response_free(p_response);
+}
+
 static void  requestSIM_IO(void *data, size_t datalen __unused, RIL_Token t)
 {
     ATResponse *p_response = NULL;
@@ -2966,14 +4304,49 @@ static void  requestSIM_IO(void *data, size_t datalen __unused, RIL_Token t)
     char *cmd = NULL;
     RIL_SIM_IO_v6 *p_args;
     char *line;
+    SimCacheKey key;
+    bool cacheable;
+    char cached[256 * 2 + 1];
 
     /* For Convert USIM to SIM */
     uint8_t hexSIM[RESPONSE_EF_SIZE * 2 + sizeof(char)] = {0};
+    uint8_t bytes[256];
+    int bytesLen;
 
     memset(&sr, 0, sizeof(sr));
 
     p_args = (RIL_SIM_IO_v6 *)data;
 
+    /*
+     * EF contents only change through updates, which go through here, or
+     * behind our back announced by a REFRESH, so reads are served from
+     * the SIM cache, also across radio power cycles.
+     */
+    key.command = p_args->command;
+    key.fileid = p_args->fileid;
+    key.path = p_args->path;
+    key.p1 = p_args->p1;
+    key.p2 = p_args->p2;
+    key.p3 = p_args->p3;
+    cacheable = simIoCacheable(p_args);
+    if (cacheable && sim_cache_lookup(&key, &sr.sw1, &sr.sw2, cached, sizeof(cached))) {
+        sr.simResponse = cached[0] != '\0' ? cached : NULL;
+        RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
+        return;
+    }
+    if (cacheable && p_args->command == SIM_COMMAND_READ_RECORD) {
+        prefetchRecords(p_args);
+        if (sim_cache_lookup(&key, &sr.sw1, &sr.sw2, cached, sizeof(cached))) {
+            sr.simResponse = cached[0] != '\0' ? cached : NULL;
+            RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
+            return;
+        }
+    }
+    if (p_args->command == SIM_COMMAND_UPDATE_BINARY
+            || p_args->command == SIM_COMMAND_UPDATE_RECORD) {
+        sim_cache_invalidate_file(p_args->fileid);
+    }
+
     /* FIXME handle pin2 */
 
     if (p_args->data == NULL) {
@@ -2999,23 +4372,25 @@ static void  requestSIM_IO(void *data, size_t datalen __unused, RIL_Token t)
         goto error;
     }
     if (sr.simResponse != NULL &&  // Default to be USIM card
-        p_args->command == 192) {  // Get response
-        uint8_t *bytes = convertHexStringToBytes(sr.simResponse, strlen(sr.simResponse));
-        if (bytes == NULL) {
+        p_args->command == SIM_COMMAND_GET_RESPONSE) {
+        bytesLen = hex_decode(sr.simResponse, strlen(sr.simResponse),
+                              bytes, sizeof(bytes));
+        if (bytesLen <= 0) {
             RLOGE("Failed to convert sim response to bytes");
             goto error;
         }
         if (bytes[0] != 0x62) {
             RLOGE("Wrong FCP flag, unable to convert to sim ");
-            free(bytes);
             goto error;
         }
-        if (convertUsimToSim(bytes, strlen(sr.simResponse) / 2, hexSIM)) {
+        if (convertUsimToSim(bytes, bytesLen, hexSIM)) {
           sr.simResponse = (char *)hexSIM;
         }
-        free(bytes);
     }
 
+    if (cacheable) {
+        sim_cache_store(&key, sr.sw1, sr.sw2, sr.simResponse);
+    }
     RIL_onRequestComplete(t, RIL_E_SUCCESS, &sr, sizeof(sr));
     at_response_free(p_response);
     free(cmd);
@@ -3071,6 +4446,8 @@ static void  requestEnterSimPin(int request, void*  data, size_t  datalen, RIL_T
 
     err = at_send_command_singleline(cmd, "+CPIN:", &p_response);
     free(cmd);
+    /* lock state changes (or remaining attempts run out) either way */
+    invalidateSimState();
 
     if (err < 0 || p_response->success == 0) {
 error:
@@ -3102,6 +4479,7 @@ static void  requestChangeSimPin(int request, void*  data, size_t  datalen, RIL_
 
     err = at_send_command_singleline(cmd, "+CPIN:", &p_response);
     free(cmd);
+    invalidateSimState();
 
     if (err < 0 || p_response->success == 0) {
 error:
@@ -3209,46 +4587,299 @@ static int techFromModemType(int mdmtype)
     return ret;
 }
 
-static void requestGetCellInfoList(void *data __unused, size_t datalen __unused, RIL_Token t)
+/*
+ * Cell info. The serving and neighbour cells come from AT+QENG. While a
+ * reporting rate is set, a timer polls them and sends
+ * RIL_UNSOL_CELL_INFO_LIST only if the cell set changed or the serving
+ * cell signal moved by at least CELL_INFO_SIGNAL_DELTA_DB.
+ */
+#define MAX_CELL_INFOS              16
+#define CELL_INFO_MIN_RATE_MS       2000
+#define CELL_INFO_SIGNAL_DELTA_DB   3
+
+static pthread_mutex_t s_cellInfoMutex = PTHREAD_MUTEX_INITIALIZER;
+static RIL_CellInfo_v12 s_cellInfoReported[MAX_CELL_INFOS];
+static int s_cellInfoReportedCount = -1;  /* -1: nothing reported yet */
+static unsigned int s_cellInfoTimerGen = 0;
+
+/**
+ * Parse a +QENG: "neighbourcell ..." line, servingType selects between the
+ * GSM neighbour formats of GSM and LTE mode.
+ * returns 0 on success, -1 for unknown or malformed lines
+ */
+static int parseNeighbourCell(char *line, RIL_CellInfoType servingType,
+                              RIL_CellInfo_v12 *ci)
 {
-    uint64_t curTime = ril_nano_time();
-    RIL_CellInfo_v12 ci[1] =
-    {
-        { // ci[0]
-            1, // cellInfoType
-            1, // registered
-            RIL_TIMESTAMP_TYPE_MODEM,
-            curTime - 1000, // Fake some time in the past
-            { // union CellInfo
-                {  // RIL_CellInfoGsm gsm
-                    {  // gsm.cellIdneityGsm
-                        s_mcc, // mcc
-                        s_mnc, // mnc
-                        s_lac, // lac
-                        s_cid, // cid
-                        0, //arfcn unknown
-                        0x1, // Base Station Identity Code set to arbitrarily 1
-                    },
-                    {  // gsm.signalStrengthGsm
-                        10, // signalStrength
-                        0  // bitErrorRate
-                        , INT_MAX // timingAdvance invalid value
-                    }
+    char *tag, *rat;
+
+    if (at_tok_start(&line) < 0
+            || at_tok_nextstr(&line, &tag) < 0
+            || !strStartsWith(tag, "neighbourcell")
+            || at_tok_nextstr(&line, &rat) < 0) {
+        return -1;
+    }
+
+    if (!strcmp(rat, "LTE")) {
+        RIL_CellIdentityLte_v12 *id = &ci->CellInfo.lte.cellIdentityLte;
+        int rsrp, rsrq, rssi = INT_MAX;
+
+        initCellInfo(ci, RIL_CELL_INFO_TYPE_LTE, 0);
+        id->earfcn = nextIntOr(&line, INT_MAX);
+        id->pci = nextIntOr(&line, INT_MAX);
+        if (strcmp(tag, "neighbourcell")) {
+            // "neighbourcell intra"/"inter": <earfcn>,<pcid>,<rsrq>,<rsrp>,<rssi>,...
+            rsrq = nextIntOr(&line, INT_MAX);
+            rsrp = nextIntOr(&line, INT_MAX);
+            rssi = nextIntOr(&line, INT_MAX);
+        } else {
+            // from WCDMA: <earfcn>,<pcid>,<rsrp>,<rsrq>,<srxlev>
+            rsrp = nextIntOr(&line, INT_MAX);
+            rsrq = nextIntOr(&line, INT_MAX);
+        }
+        setLteSignal(&ci->CellInfo.lte.signalStrengthLte, rsrp, rsrq, rssi,
+                     INT_MAX, INT_MAX);
+    } else if (!strcmp(rat, "WCDMA")) {
+        // <uarfcn>,<cell_resel_priority>,<thresh_Xhigh>,<thresh_Xlow>,<PSC>,
+        // <RSCP>,<ecno>,<srxlev>
+        RIL_CellIdentityWcdma_v12 *id = &ci->CellInfo.wcdma.cellIdentityWcdma;
+        int rscp, ecno;
+
+        initCellInfo(ci, RIL_CELL_INFO_TYPE_WCDMA, 0);
+        id->uarfcn = nextIntOr(&line, INT_MAX);
+        if (skipFields(&line, 3) < 0) return -1;
+        id->psc = nextIntOr(&line, INT_MAX);
+        rscp = nextIntOr(&line, INT_MAX);
+        ecno = nextIntOr(&line, INT_MAX);
+        ci->CellInfo.wcdma.signalStrengthWcdma.signalStrength =
+                asuFromDbm(rscp == INT_MAX || ecno == INT_MAX ? INT_MAX : rscp - ecno);
+    } else if (!strcmp(rat, "GSM")) {
+        RIL_CellInfoGsm_v12 *gsm = &ci->CellInfo.gsm;
+        int bsic, rxlev;
+
+        initCellInfo(ci, RIL_CELL_INFO_TYPE_GSM, 0);
+        if (servingType == RIL_CELL_INFO_TYPE_GSM) {
+            // <MCC>,<MNC>,<LAC>,<cellID>,<bsic>,<arfcn>,<rxlev>,...
+            gsm->cellIdentityGsm.mcc = nextIntOr(&line, INT_MAX);
+            gsm->cellIdentityGsm.mnc = nextIntOr(&line, INT_MAX);
+            gsm->cellIdentityGsm.lac = nextHexOr(&line, INT_MAX);
+            gsm->cellIdentityGsm.cid = nextHexOr(&line, INT_MAX);
+            bsic = nextIntOr(&line, INT_MAX);
+            gsm->cellIdentityGsm.arfcn = nextIntOr(&line, INT_MAX);
+            rxlev = nextIntOr(&line, INT_MAX);
+            gsm->signalStrengthGsm.signalStrength =
+                    asuFromDbm(rxlev >= 0 && rxlev <= 63 ? rxlev - 110 : INT_MAX);
+        } else {
+            // <arfcn>,<cell_resel_priority>,<thresh_gsm_high>,
+            // <thresh_gsm_low>,<ncc_permitted>,<band>,<bsic_id>,<rssi>,<srxlev>
+            gsm->cellIdentityGsm.arfcn = nextIntOr(&line, INT_MAX);
+            if (skipFields(&line, 5) < 0) return -1;
+            bsic = nextIntOr(&line, INT_MAX);
+            gsm->signalStrengthGsm.signalStrength = asuFromDbm(nextIntOr(&line, INT_MAX));
+        }
+        gsm->cellIdentityGsm.bsic = (bsic >= 0 && bsic <= 63) ? bsic : 0xFF;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read the serving cell and its neighbours.
+ * returns the number of cells, -1 if the modem doesn't answer
+ */
+static int queryCellInfo(RIL_CellInfo_v12 *cells, int maxCells)
+{
+    ATResponse *p_response = NULL;
+    ATLine *p_cur;
+    RIL_CellInfoType servingType = RIL_CELL_INFO_TYPE_NONE;
+    uint64_t now = ril_nano_time();
+    int err, count = 0, i;
+
+    err = at_send_command_singleline("AT+QENG=\"servingcell\"", "+QENG:",
+                                     &p_response);
+    if (err < 0 || p_response->success == 0) goto error;
+
+    if (parseServingCell(p_response->p_intermediates->line, &cells[0]) == 0) {
+        servingType = cells[0].cellInfoType;
+        count++;
+    }
+    at_response_free(p_response);
+    p_response = NULL;
+
+    if (servingType != RIL_CELL_INFO_TYPE_NONE) {
+        err = at_send_command_multiline("AT+QENG=\"neighbourcell\"", "+QENG:",
+                                        &p_response);
+        if (err == 0 && p_response->success) {
+            for (p_cur = p_response->p_intermediates;
+                    p_cur != NULL && count < maxCells; p_cur = p_cur->p_next) {
+                if (parseNeighbourCell(p_cur->line, servingType, &cells[count]) == 0) {
+                    count++;
                 }
             }
         }
-    };
+        at_response_free(p_response);
+    }
+
+    for (i = 0; i < count; i++) {
+        cells[i].timeStamp = now;
+    }
+    return count;
+
+error:
+    at_response_free(p_response);
+    return -1;
+}
+
+/** serving cell signal in dB, on a scale comparable within one RAT */
+static int cellInfoSignalDb(const RIL_CellInfo_v12 *ci)
+{
+    switch (ci->cellInfoType) {
+        case RIL_CELL_INFO_TYPE_GSM:
+            return ci->CellInfo.gsm.signalStrengthGsm.signalStrength * 2;
+        case RIL_CELL_INFO_TYPE_WCDMA:
+            return ci->CellInfo.wcdma.signalStrengthWcdma.signalStrength * 2;
+        case RIL_CELL_INFO_TYPE_LTE:
+            return ci->CellInfo.lte.signalStrengthLte.rsrp;
+        default:
+            return 0;
+    }
+}
+
+static bool sameCellIdentity(const RIL_CellInfo_v12 *a, const RIL_CellInfo_v12 *b)
+{
+    if (a->cellInfoType != b->cellInfoType || a->registered != b->registered) {
+        return false;
+    }
+    /* entries are zeroed by initCellInfo, so padding compares equal */
+    switch (a->cellInfoType) {
+        case RIL_CELL_INFO_TYPE_GSM:
+            return !memcmp(&a->CellInfo.gsm.cellIdentityGsm,
+                           &b->CellInfo.gsm.cellIdentityGsm,
+                           sizeof(a->CellInfo.gsm.cellIdentityGsm));
+        case RIL_CELL_INFO_TYPE_WCDMA:
+            return !memcmp(&a->CellInfo.wcdma.cellIdentityWcdma,
+                           &b->CellInfo.wcdma.cellIdentityWcdma,
+                           sizeof(a->CellInfo.wcdma.cellIdentityWcdma));
+        case RIL_CELL_INFO_TYPE_LTE:
+            return !memcmp(&a->CellInfo.lte.cellIdentityLte,
+                           &b->CellInfo.lte.cellIdentityLte,
+                           sizeof(a->CellInfo.lte.cellIdentityLte));
+        default:
+            return true;
+    }
+}
+
+/**
+ * Compare a cell list against the last reported one and if it differs,
+ * make it the new reference.
+ * returns true if the list should be reported
+ */
+static bool cellInfoChanged(const RIL_CellInfo_v12 *cells, int count)
+{
+    bool changed = false;
+    int i;
+
+    pthread_mutex_lock(&s_cellInfoMutex);
+    if (count != s_cellInfoReportedCount) {
+        changed = true;
+    }
+    for (i = 0; !changed && i < count; i++) {
+        if (!sameCellIdentity(&cells[i], &s_cellInfoReported[i])) {
+            changed = true;
+        }
+    }
+    if (!changed && count > 0 && cells[0].registered
+            && abs(cellInfoSignalDb(&cells[0]) - cellInfoSignalDb(&s_cellInfoReported[0]))
+                    >= CELL_INFO_SIGNAL_DELTA_DB) {
+        changed = true;
+    }
+    if (changed) {
+        memcpy(s_cellInfoReported, cells, count * sizeof(*cells));
+        s_cellInfoReportedCount = count;
+    }
+    pthread_mutex_unlock(&s_cellInfoMutex);
+
+    return changed;
+}
+
+static void onCellInfoTimer(void *param);
+
+static void scheduleCellInfoTimer(uintptr_t gen, int delayMs)
+{
+    struct timeval tv = { delayMs / 1000, (delayMs % 1000) * 1000 };
+
+    RIL_requestTimedCallback(onCellInfoTimer, (void *)gen, &tv);
+}
+
+static void onCellInfoTimer(void *param)
+{
+    RIL_CellInfo_v12 cells[MAX_CELL_INFOS];
+    unsigned int gen;
+    int rate, count;
+
+    pthread_mutex_lock(&s_cellInfoMutex);
+    gen = s_cellInfoTimerGen;
+    rate = s_cell_info_rate_ms;
+    pthread_mutex_unlock(&s_cellInfoMutex);
+
+    if ((uintptr_t)param != gen) {
+        // the rate changed, a newer timer took over
+        return;
+    }
+
+    if (sState == RADIO_STATE_ON) {
+        count = queryCellInfo(cells, MAX_CELL_INFOS);
+        if (count >= 0 && cellInfoChanged(cells, count)) {
+            RIL_onUnsolicitedResponse(RIL_UNSOL_CELL_INFO_LIST, cells,
+                                      count * sizeof(*cells));
+        }
+    }
 
-    RIL_onRequestComplete(t, RIL_E_SUCCESS, ci, sizeof(ci));
+    scheduleCellInfoTimer(gen, rate < CELL_INFO_MIN_RATE_MS ? CELL_INFO_MIN_RATE_MS : rate);
 }
 
+static void requestGetCellInfoList(void *data __unused, size_t datalen __unused, RIL_Token t)
+{
+    RIL_CellInfo_v12 cells[MAX_CELL_INFOS];
+    int count;
+
+    count = queryCellInfo(cells, MAX_CELL_INFOS);
+    if (count < 0) {
+        RIL_onRequestComplete(t, RIL_E_MODEM_ERR, NULL, 0);
+        return;
+    }
+
+    /* periodic reports only need to tell what the framework doesn't know */
+    cellInfoChanged(cells, count);
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, cells, count * sizeof(*cells));
+}
 
-static void requestSetCellInfoListRate(void *data, size_t datalen __unused, RIL_Token t)
+/**
+ * 0 means report on any change, which is detected by polling at
+ * CELL_INFO_MIN_RATE_MS; INT_MAX stops reporting.
+ */
+static void requestSetCellInfoListRate(void *data, size_t datalen, RIL_Token t)
 {
-    // For now we'll save the rate but no RIL_UNSOL_CELL_INFO_LIST messages
-    // will be sent.
-    assert (datalen == sizeof(int));
-    s_cell_info_rate_ms = ((int *)data)[0];
+    unsigned int gen;
+    int rate;
+
+    if (data == NULL || datalen < sizeof(int) || ((int *)data)[0] < 0) {
+        RIL_onRequestComplete(t, RIL_E_INVALID_ARGUMENTS, NULL, 0);
+        return;
+    }
+    rate = ((int *)data)[0];
+
+    pthread_mutex_lock(&s_cellInfoMutex);
+    s_cell_info_rate_ms = rate;
+    gen = ++s_cellInfoTimerGen;
+    /* report the current cells once under the new rate */
+    s_cellInfoReportedCount = -1;
+    pthread_mutex_unlock(&s_cellInfoMutex);
+
+    if (rate != INT_MAX) {
+        scheduleCellInfoTimer(gen, 0);
+    }
 
     RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
 }
@@ -3353,39 +4984,156 @@ static void requestSetMute(void *data, size_t datalen, RIL_Token t)
     at_response_free(p_response);
 }
 
-static void requestScreenState(void *data, RIL_Token t)
+/**
+ * Send commands, given without the "AT" prefix, on one compound command
+ * line. If the modem rejects the line they are sent one by one.
+ * ok, if not NULL, receives the result of each command.
+ * returns the number of commands that failed
+ */
+static int sendCompoundCommands(const char *const *cmds, size_t n, bool *ok)
 {
-    int status = *((int *)data);
+    ATResponse *p_response = NULL;
+    char line[256], cmd[64];
+    size_t i;
+    int err, failures = 0;
 
-    if (!status) {
-        /* Suspend */
-        at_send_command("AT+CEREG=1", NULL);
-        at_send_command("AT+CREG=1", NULL);
-        at_send_command("AT+CGREG=1", NULL);
-    } else {
-       /* Resume */
-        at_send_command("AT+CEREG=2", NULL);
-        at_send_command("AT+CREG=2", NULL);
-        at_send_command("AT+CGREG=2", NULL);
+    strlcpy(line, "AT", sizeof(line));
+    for (i = 0; i < n; i++) {
+        if (i > 0) strlcat(line, ";", sizeof(line));
+        strlcat(line, cmds[i], sizeof(line));
+    }
+
+    err = at_send_command(line, &p_response);
+    if (err == 0 && p_response->success) {
+        at_response_free(p_response);
+        for (i = 0; ok != NULL && i < n; i++) {
+            ok[i] = true;
+        }
+        return 0;
     }
+    at_response_free(p_response);
+    p_response = NULL;
 
-   RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+    RLOGW("Compound line rejected, sending commands one by one");
+    for (i = 0; i < n; i++) {
+        snprintf(cmd, sizeof(cmd), "AT%s", cmds[i]);
+        err = at_send_command(cmd, &p_response);
+        if (err < 0 || p_response->success == 0) {
+            failures++;
+        }
+        if (ok != NULL) {
+            ok[i] = (err == 0 && p_response->success);
+        }
+        at_response_free(p_response);
+        p_response = NULL;
+    }
+    return failures;
 }
 
-static void requestQueryClip(void *data, size_t datalen, RIL_Token t)
-{
-    RIL_UNUSED_PARM(datalen);
-    RIL_UNUSED_PARM(data);
+/*
+ * URC profiles for screen on and off. With the screen off, registration
+ * URCs are limited to state changes and signal and network time
+ * indications are disabled; each profile is one compound command line,
+ * with a per-command fallback in case the firmware rejects one of them.
+ */
+static const char *s_urcProfileCommands[2][5] = {
+    /* screen off */
+    { "+CREG=1", "+CGREG=1", "+CEREG=1", "+QINDCFG=\"csq\",0", "+CTZR=0" },
+    /* screen on */
+    { "+CREG=2", "+CGREG=2", "+CEREG=2", "+QINDCFG=\"csq\",1", "+CTZR=2" },
+};
 
-    int err = -1;
-    int skip = 0;
-    int response = 0;
-    char *line = NULL;
-    ATResponse *p_response = NULL;
+/* URC wakeup counters, per screen state */
+static pthread_mutex_t s_urcStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_urcScreenOn = 1;
+static int64_t s_urcModeSinceMs = 0;
+static uint64_t s_urcCount[2];
+static int64_t s_urcModeMs[2];
 
-    if (getSIMStatus() == SIM_ABSENT) {
-        RIL_onRequestComplete(t, RIL_E_MODEM_ERR, NULL, 0);
-        return;
+/** Count a URC against the current screen state, called on the reader thread */
+static void recordUrcWakeup()
+{
+    pthread_mutex_lock(&s_urcStatsMutex);
+    s_urcCount[s_urcScreenOn]++;
+    pthread_mutex_unlock(&s_urcStatsMutex);
+}
+
+/** Switch the URC counters to a new screen state and log the rates */
+static void switchUrcStatsMode(int screenOn)
+{
+    int64_t now = monotonicMsec();
+    uint64_t perHour[2];
+    int i;
+
+    pthread_mutex_lock(&s_urcStatsMutex);
+    if (s_urcModeSinceMs != 0) {
+        s_urcModeMs[s_urcScreenOn] += now - s_urcModeSinceMs;
+    }
+    s_urcModeSinceMs = now;
+    s_urcScreenOn = screenOn;
+    for (i = 0; i < 2; i++) {
+        perHour[i] = s_urcModeMs[i] > 0
+                ? s_urcCount[i] * 3600000 / s_urcModeMs[i] : 0;
+    }
+    pthread_mutex_unlock(&s_urcStatsMutex);
+
+    RLOGI("URC wakeups per hour: screen on %" PRIu64 ", screen off %" PRIu64,
+          perHour[1], perHour[0]);
+}
+
+static void applyUrcProfile(int screenOn)
+{
+    sendCompoundCommands(s_urcProfileCommands[screenOn],
+            sizeof(s_urcProfileCommands[0]) / sizeof(s_urcProfileCommands[0][0]),
+            NULL);
+}
+
+/**
+ * Tell the framework about everything that may have changed while
+ * indications were suppressed, in one go.
+ */
+static void resyncAfterScreenOn()
+{
+    /* URCs while suspended carried no location */
+    invalidateRegistrationSnapshots();
+    invalidateOperatorCache();
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
+                              NULL, 0);
+
+    /* report the current signal even if no threshold was crossed */
+    pthread_mutex_lock(&s_signalMutex);
+    s_signalReported = false;
+    pthread_mutex_unlock(&s_signalMutex);
+    scheduleSignalStrengthUpdate();
+}
+
+static void requestScreenState(void *data, RIL_Token t)
+{
+    int status = *((int *)data) ? 1 : 0;
+
+    switchUrcStatsMode(status);
+    applyUrcProfile(status);
+    if (status) {
+        resyncAfterScreenOn();
+    }
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+}
+
+static void requestQueryClip(void *data, size_t datalen, RIL_Token t)
+{
+    RIL_UNUSED_PARM(datalen);
+    RIL_UNUSED_PARM(data);
+
+    int err = -1;
+    int skip = 0;
+    int response = 0;
+    char *line = NULL;
+    ATResponse *p_response = NULL;
+
+    if (getSIMStatus() == SIM_ABSENT) {
+        RIL_onRequestComplete(t, RIL_E_MODEM_ERR, NULL, 0);
+        return;
     }
 
     err = at_send_command_singleline("AT+CLIP?", "+CLIP:", &p_response);
@@ -4112,19 +5860,18 @@ static void requestStkSendEnvelope(void *data, RIL_Token t)
         // type of alpha data is 85, such as 850C546F6F6C6B6974204D656E75
         char *p = strstr(p_response->p_intermediates->line, "85");
         if (p != NULL) {
-            char alphaStrHexLen[3] = {0};
-            char alphaStr[1024] = {0};
-            uint8_t *alphaBytes = NULL;
+            char alpha[256 + 1];
             int len = 0;
 
             p = p + strlen("85");
-            strncpy(alphaStrHexLen, p, 2);
-            len = strtoul(alphaStrHexLen, NULL, 16);
-            strncpy(alphaStr, p + 2, len * 2);
-            alphaBytes = convertHexStringToBytes(alphaStr, strlen(alphaStr));
-            RIL_onUnsolicitedResponse(RIL_UNSOL_STK_CC_ALPHA_NOTIFY, alphaBytes,
-                                      strlen((char *)alphaBytes));
-            free(alphaBytes);
+            len = hex_decode_byte(p);
+            if (len > 0 && strlen(p + 2) >= (size_t)len * 2 &&
+                    hex_decode(p + 2, len * 2, (uint8_t *)alpha,
+                               sizeof(alpha) - 1) == len) {
+                alpha[len] = '\0';
+                RIL_onUnsolicitedResponse(RIL_UNSOL_STK_CC_ALPHA_NOTIFY, alpha,
+                                          len + 1);
+            }
         }
     }
     at_response_free(p_response);
@@ -4216,16 +5963,398 @@ void getConfigSlotStatus(RIL_SimSlotStatus_V1_2 *pSimSlotStatus) {
     pSimSlotStatus->eid = "";
 }
 
-void sendUnsolNetworkScanResult() {
+/*
+ * Network scan. AT+COPS=? keeps the channel it runs on busy for up to
+ * three minutes, so it runs on a second AT port of the modem from a
+ * thread of its own, and calls and SMS keep going on the main channel.
+ * Operators are reported as PARTIAL results as their tuples come in,
+ * the end of the list as COMPLETE. Writing to the job's pipe cancels it.
+ */
+#define SCAN_PORT_PROPERTY      "vendor.ril.scan_port"
+#define SCAN_PORT_DEFAULT       "/dev/ttyUSB3"
+#define SCAN_TIMEOUT_MS         (200 * 1000)
+#define SCAN_MAX_NETWORKS       32
+#define SCAN_BUFFER_SIZE        4096
+#define SCAN_EXIT_TIMEOUT_MS    5000
+
+typedef enum {
+    SCAN_DONE,
+    SCAN_FAILED,
+    SCAN_CANCELLED,
+} ScanOutcome;
+
+typedef struct {
+    RIL_ScanType type;
+    int intervalMs;
+    int cancelPipe[2];
+} ScanJob;
+
+static pthread_mutex_t s_scanMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_scanCond = PTHREAD_COND_INITIALIZER;
+static ScanJob *s_scanJob = NULL;   /* running job, owned by its thread */
+static bool s_scanThreadAlive = false;  /* the port is still in use */
+
+static void sendNetworkScanResult(RIL_ScanStatus status, RIL_Errno error,
+                                  RIL_CellInfo_v12 *infos, size_t count)
+{
     RIL_NetworkScanResult scanr;
+
     memset(&scanr, 0, sizeof(scanr));
-    scanr.status = COMPLETE;
-    scanr.error = RIL_E_SUCCESS;
-    scanr.network_infos = NULL;
-    scanr.network_infos_length = 0;
+    scanr.status = status;
+    scanr.error = error;
+    scanr.network_infos = count > 0 ? infos : NULL;
+    scanr.network_infos_length = count;
     RIL_onUnsolicitedResponse(RIL_UNSOL_NETWORK_SCAN_RESULT, &scanr, sizeof(scanr));
 }
 
+/**
+ * Parse the inside of a +COPS=? operator tuple,
+ * stat,"long","short","numeric"[,AcT]
+ * returns 0 on success, -1 if it is not an operator tuple
+ */
+static int parseScanTuple(char *tuple, RIL_CellInfo_v12 *ci)
+{
+    char *p = tuple;
+    char *name, *numeric;
+    int stat, act = 0, mcc = INT_MAX, mnc = INT_MAX;
+    RIL_CellInfoType type;
+
+    /* the mode lists after the operators have no strings */
+    if (strchr(tuple, '"') == NULL) {
+        return -1;
+    }
+    if (at_tok_nextint(&p, &stat) < 0 || at_tok_nextstr(&p, &name) < 0
+            || at_tok_nextstr(&p, &name) < 0 || at_tok_nextstr(&p, &numeric) < 0) {
+        return -1;
+    }
+    if (at_tok_hasmore(&p)) {
+        at_tok_nextint(&p, &act);
+    }
+
+    switch (act) {
+        case 2: case 4: case 5: case 6:
+            type = RIL_CELL_INFO_TYPE_WCDMA;
+            break;
+        case 7:
+            type = RIL_CELL_INFO_TYPE_LTE;
+            break;
+        default:
+            type = RIL_CELL_INFO_TYPE_GSM;
+            break;
+    }
+    if (strlen(numeric) >= 5) {
+        mnc = atoi(numeric + 3);
+        numeric[3] = '\0';
+        mcc = atoi(numeric);
+    }
+
+    /* stat 2 is the operator we are registered on */
+    initCellInfo(ci, type, stat == 2);
+    ci->timeStamp = ril_nano_time();
+    switch (type) {
+        case RIL_CELL_INFO_TYPE_GSM:
+            ci->CellInfo.gsm.cellIdentityGsm.mcc = mcc;
+            ci->CellInfo.gsm.cellIdentityGsm.mnc = mnc;
+            break;
+        case RIL_CELL_INFO_TYPE_WCDMA:
+            ci->CellInfo.wcdma.cellIdentityWcdma.mcc = mcc;
+            ci->CellInfo.wcdma.cellIdentityWcdma.mnc = mnc;
+            break;
+        default:
+            ci->CellInfo.lte.cellIdentityLte.mcc = mcc;
+            ci->CellInfo.lte.cellIdentityLte.mnc = mnc;
+            break;
+    }
+    return 0;
+}
+
+/**
+ * Wait for fd or the cancel pipe, timeoutMs < 0 waits forever.
+ * returns 1 if fd is readable, 0 on timeout, -1 if cancelled or on error
+ */
+static int waitScanInput(const ScanJob *job, int fd, int timeoutMs)
+{
+    struct pollfd fds[2];
+    int nfds = 0, ret;
+
+    fds[nfds].fd = job->cancelPipe[0];
+    fds[nfds++].events = POLLIN;
+    if (fd >= 0) {
+        fds[nfds].fd = fd;
+        fds[nfds++].events = POLLIN;
+    }
+
+    do {
+        ret = poll(fds, nfds, timeoutMs);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 || fds[0].revents != 0) {
+        return -1;
+    }
+    return ret > 0 ? 1 : 0;
+}
+
+/** Run one AT+COPS=? on fd, reporting operators as they are parsed */
+static ScanOutcome runNetworkScan(const ScanJob *job, int fd)
+{
+    static const char cmd[] = "AT+COPS=?\r";
+    RIL_CellInfo_v12 infos[SCAN_MAX_NETWORKS];
+    char buf[SCAN_BUFFER_SIZE];
+    size_t len = 0, lineStart = 0, tupleStart = 0, scanned = 0;
+    size_t count = 0, reported = 0;
+    int64_t deadline = monotonicMsec() + SCAN_TIMEOUT_MS;
+    int depth = 0;
+    bool quoted = false, inList = false;
+
+    if (write(fd, cmd, sizeof(cmd) - 1) != (ssize_t)(sizeof(cmd) - 1)) {
+        RLOGE("Failed to start network scan: %s", strerror(errno));
+        return SCAN_FAILED;
+    }
+
+    for (;;) {
+        int64_t left = deadline - monotonicMsec();
+        ssize_t n;
+        int ret;
+
+        ret = waitScanInput(job, fd, left > 0 ? (int)left : 0);
+        if (ret < 0) {
+            /* any character aborts the command */
+            write(fd, "\r", 1);
+            return SCAN_CANCELLED;
+        } else if (ret == 0) {
+            RLOGE("Network scan timed out");
+            write(fd, "\r", 1);
+            return SCAN_FAILED;
+        }
+
+        n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0) {
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            RLOGE("Network scan port closed");
+            return SCAN_FAILED;
+        }
+        len += n;
+        buf[len] = '\0';
+
+        for (; scanned < len; scanned++) {
+            char c = buf[scanned];
+
+            if (inList) {
+                /* operator tuples of the +COPS: line, as they complete */
+                if (c == '"') {
+                    quoted = !quoted;
+                } else if (quoted) {
+                    continue;
+                } else if (c == '(' && depth++ == 0) {
+                    tupleStart = scanned + 1;
+                } else if (c == ')' && depth > 0 && --depth == 0) {
+                    buf[scanned] = '\0';
+                    if (count < SCAN_MAX_NETWORKS
+                            && parseScanTuple(buf + tupleStart, &infos[count]) == 0) {
+                        count++;
+                    }
+                    buf[scanned] = ')';
+                }
+            }
+            if (c != '\r' && c != '\n') {
+                if (!inList && scanned - lineStart == 5
+                        && !strncmp(buf + lineStart, "+COPS:", 6)) {
+                    inList = true;
+                }
+                continue;
+            }
+
+            /* end of a line */
+            buf[scanned] = '\0';
+            if (!strcmp(buf + lineStart, "OK")) {
+                sendNetworkScanResult(COMPLETE, RIL_E_SUCCESS,
+                                      infos + reported, count - reported);
+                return SCAN_DONE;
+            } else if (!strcmp(buf + lineStart, "ERROR")
+                    || strStartsWith(buf + lineStart, "+CME ERROR:")) {
+                RLOGE("Network scan failed: %s", buf + lineStart);
+                return SCAN_FAILED;
+            }
+            inList = false;
+            depth = 0;
+            quoted = false;
+            lineStart = scanned + 1;
+        }
+
+        if (count > reported) {
+            sendNetworkScanResult(PARTIAL, RIL_E_SUCCESS,
+                                  infos + reported, count - reported);
+            reported = count;
+        }
+
+        /* drop finished lines to make room */
+        if (lineStart > 0) {
+            memmove(buf, buf + lineStart, len - lineStart);
+            len -= lineStart;
+            scanned -= lineStart;
+            if (tupleStart >= lineStart) {
+                tupleStart -= lineStart;
+            }
+            lineStart = 0;
+        }
+        if (len >= sizeof(buf) - 1) {
+            RLOGE("Network scan response too long");
+            write(fd, "\r", 1);
+            return SCAN_FAILED;
+        }
+    }
+}
+
+static void *networkScanThread(void *param)
+{
+    ScanJob *job = (ScanJob *)param;
+    char port[PROPERTY_VALUE_MAX];
+    struct termios ios;
+    ScanOutcome outcome = SCAN_FAILED;
+    int fd;
+
+    property_get(SCAN_PORT_PROPERTY, port, SCAN_PORT_DEFAULT);
+    fd = open(port, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        RLOGE("Can't open network scan port %s: %s", port, strerror(errno));
+    } else {
+        if (tcgetattr(fd, &ios) == 0) {
+            cfmakeraw(&ios);
+            tcsetattr(fd, TCSANOW, &ios);
+        }
+        tcflush(fd, TCIOFLUSH);
+
+        for (;;) {
+            outcome = runNetworkScan(job, fd);
+            if (outcome != SCAN_DONE || job->type != PERIODIC) {
+                break;
+            }
+            if (waitScanInput(job, -1, job->intervalMs) < 0) {
+                outcome = SCAN_CANCELLED;
+                break;
+            }
+        }
+        close(fd);
+    }
+
+    if (outcome == SCAN_FAILED) {
+        sendNetworkScanResult(COMPLETE, RIL_E_MODEM_ERR, NULL, 0);
+    }
+    RLOGD("Network scan finished (%d)", outcome);
+
+    pthread_mutex_lock(&s_scanMutex);
+    if (s_scanJob == job) {
+        s_scanJob = NULL;
+    }
+    close(job->cancelPipe[0]);
+    close(job->cancelPipe[1]);
+    s_scanThreadAlive = false;
+    pthread_cond_broadcast(&s_scanCond);
+    pthread_mutex_unlock(&s_scanMutex);
+    free(job);
+    return NULL;
+}
+
+/** Cancel the running scan, if any. The job cleans up after itself. */
+static void cancelNetworkScan()
+{
+    pthread_mutex_lock(&s_scanMutex);
+    if (s_scanJob != NULL) {
+        write(s_scanJob->cancelPipe[1], "", 1);
+        s_scanJob = NULL;
+    }
+    pthread_mutex_unlock(&s_scanMutex);
+}
+
+/**
+ * Wait for the thread of a cancelled scan to close the port, called
+ * with s_scanMutex held.
+ * returns 0 once it did, -1 on timeout
+ */
+static int waitScanThreadExitLocked()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += SCAN_EXIT_TIMEOUT_MS / 1000;
+    ts.tv_nsec += (SCAN_EXIT_TIMEOUT_MS % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    while (s_scanThreadAlive) {
+        if (pthread_cond_timedwait(&s_scanCond, &s_scanMutex, &ts) == ETIMEDOUT) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void requestStartNetworkScan(void *data, size_t datalen, RIL_Token t)
+{
+    const RIL_NetworkScanRequest *req = (const RIL_NetworkScanRequest *)data;
+    pthread_attr_t attr;
+    pthread_t tid;
+    ScanJob *job;
+
+    if (req == NULL || datalen != sizeof(*req)
+            || (req->type == PERIODIC && req->interval <= 0)) {
+        RIL_onRequestComplete(t, RIL_E_INVALID_ARGUMENTS, NULL, 0);
+        return;
+    }
+
+    /* a new scan replaces the running one */
+    cancelNetworkScan();
+
+    job = (ScanJob *)calloc(1, sizeof(*job));
+    if (job == NULL) {
+        RIL_onRequestComplete(t, RIL_E_NO_MEMORY, NULL, 0);
+        return;
+    }
+    job->type = req->type;
+    job->intervalMs = req->interval * 1000;
+    if (pipe2(job->cancelPipe, O_CLOEXEC) < 0) {
+        free(job);
+        RIL_onRequestComplete(t, RIL_E_NO_RESOURCES, NULL, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&s_scanMutex);
+    /* the previous scan must be off the port before this one opens it */
+    if (waitScanThreadExitLocked() < 0) {
+        pthread_mutex_unlock(&s_scanMutex);
+        RLOGE("Previous network scan didn't stop");
+        close(job->cancelPipe[0]);
+        close(job->cancelPipe[1]);
+        free(job);
+        RIL_onRequestComplete(t, RIL_E_MODEM_ERR, NULL, 0);
+        return;
+    }
+    s_scanJob = job;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, networkScanThread, job) != 0) {
+        s_scanJob = NULL;
+        pthread_mutex_unlock(&s_scanMutex);
+        close(job->cancelPipe[0]);
+        close(job->cancelPipe[1]);
+        free(job);
+        RIL_onRequestComplete(t, RIL_E_NO_RESOURCES, NULL, 0);
+        return;
+    }
+    s_scanThreadAlive = true;
+    pthread_mutex_unlock(&s_scanMutex);
+
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+}
+
+static void requestStopNetworkScan(RIL_Token t)
+{
+    cancelNetworkScan();
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+}
+
 void onIccSlotStatus(RIL_Token t) {
     RIL_SimSlotStatus_V1_2 *pSimSlotStatusList =
         (RIL_SimSlotStatus_V1_2 *)calloc(SIM_COUNT, sizeof(RIL_SimSlotStatus_V1_2));
@@ -4249,19 +6378,11 @@ void onIccSlotStatus(RIL_Token t) {
 /*** Callback methods from the RIL library to us ***/
 
 /**
- * Call from RIL to us to make a RIL_REQUEST
- *
+ * Handle a RIL_REQUEST, either on the libril thread or on a request worker.
  * Must be completed with a call to RIL_onRequestComplete()
- *
- * RIL_onRequestComplete() may be called from any thread, before or after
- * this function returns.
- *
- * Because onRequest function could be called from multiple different thread,
- * we must ensure that the underlying at_send_command_* function
- * is atomic.
  */
 static void
-onRequest (int request, void *data, size_t datalen, RIL_Token t)
+processRequest (int request, void *data, size_t datalen, RIL_Token t)
 {
     ATResponse *p_response;
     int err;
@@ -4422,7 +6543,8 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
         }
         case RIL_REQUEST_SEND_SMS:
         case RIL_REQUEST_SEND_SMS_EXPECT_MORE:
-            requestSendSMS(data, datalen, t);
+            requestSendSMS(data, datalen, t,
+                           request == RIL_REQUEST_SEND_SMS_EXPECT_MORE);
             break;
         case RIL_REQUEST_CDMA_SEND_SMS:
             requestCdmaSendSMS(data, datalen, t);
@@ -4548,22 +6670,9 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
             break;
 
 
-        case RIL_REQUEST_OEM_HOOK_STRINGS: {
-            int i;
-            const char ** cur;
-
-            RLOGD("got OEM_HOOK_STRINGS: 0x%8p %lu", data, (long)datalen);
-
-
-            for (i = (datalen / sizeof (char *)), cur = (const char **)data ;
-                    i > 0 ; cur++, i --) {
-                RLOGD("> '%s'", *cur);
-            }
-
-            // echo back strings
-            RIL_onRequestComplete(t, RIL_E_SUCCESS, data, datalen);
+        case RIL_REQUEST_OEM_HOOK_STRINGS:
+            requestOemHookStrings(data, datalen, t);
             break;
-        }
 
         case RIL_REQUEST_WRITE_SMS_TO_SIM:
             requestWriteSmsToSim(data, datalen, t);
@@ -4575,6 +6684,7 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
             asprintf(&cmd, "AT+CMGD=%d", ((int *)data)[0]);
             err = at_send_command(cmd, &p_response);
             free(cmd);
+            sim_cache_invalidate_file(EF_SMS);
             if (err < 0 || p_response->success == 0) {
                 RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
             } else {
@@ -4843,9 +6953,10 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
 
         // New requests after P.
         case RIL_REQUEST_START_NETWORK_SCAN:
-            RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
-            // send unsol network scan results after a short while
-            RIL_requestTimedCallback (sendUnsolNetworkScanResult, NULL, &TIMEVAL_SIMPOLL);
+            requestStartNetworkScan(data, datalen, t);
+            break;
+        case RIL_REQUEST_STOP_NETWORK_SCAN:
+            requestStopNetworkScan(t);
             break;
         case RIL_REQUEST_GET_MODEM_STACK_STATUS:
             RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
@@ -4938,7 +7049,7 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
             break;
         }
         case RIL_REQUEST_SET_SIGNAL_STRENGTH_REPORTING_CRITERIA:
-            RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+            requestSetSignalStrengthReportingCriteria(data, datalen, t);
             break;
         case RIL_REQUEST_SET_LINK_CAPACITY_REPORTING_CRITERIA:
             RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
@@ -4972,42 +7083,403 @@ onRequest (int request, void *data, size_t datalen, RIL_Token t)
     }
 }
 
-/**
- * Synchronous call from the RIL to us to return current radio state.
- * RADIO_STATE_UNAVAILABLE should be the initial state.
- */
-static RIL_RadioState
-currentState()
-{
-    return sState;
-}
-/**
- * Call from RIL to us to find out whether a specific request code
- * is supported by this implementation.
- *
- * Return 1 for "supported" and 0 for "unsupported"
+/*
+ * Requests are dispatched to one worker queue per class so that a slow
+ * request (data call setup, SIM I/O) no longer blocks unrelated ones.
+ * All AT commands still go through the single AT channel, so one worker
+ * per class is all the parallelism the modem offers; it also keeps the
+ * requests of a class in order. Requests not listed here are cheap or
+ * carry payloads we don't deep copy and run on the calling thread.
  */
+typedef enum {
+    REQUEST_CLASS_CALL,
+    REQUEST_CLASS_SMS,
+    REQUEST_CLASS_SIM,
+    REQUEST_CLASS_DATA,
+    REQUEST_CLASS_NETWORK,
+    REQUEST_CLASS_COUNT,
+} RequestClass;
+
+/* how the request payload is deep copied for the worker */
+typedef enum {
+    REQUEST_DATA_NONE,
+    REQUEST_DATA_FLAT,      /* no pointers (int arrays), copied as is */
+    REQUEST_DATA_STRING,    /* single NUL-terminated string */
+    REQUEST_DATA_STRINGS,   /* array of datalen / sizeof(char *) strings */
+    REQUEST_DATA_DIAL,      /* RIL_Dial */
+    REQUEST_DATA_SIM_IO,    /* RIL_SIM_IO_v6 */
+    REQUEST_DATA_SIM_APDU,  /* RIL_SIM_APDU */
+    REQUEST_DATA_SIM_AUTH,  /* RIL_SimAuthentication */
+} RequestDataKind;
+
+static const char *s_requestClassNames[REQUEST_CLASS_COUNT] = {
+    "ril-call", "ril-sms", "ril-sim", "ril-data", "ril-network",
+};
 
-static int
-onSupports (int requestCode __unused)
-{
-    //@@@ todo
-
-    return 1;
-}
+static WorkQueue *s_requestQueues[REQUEST_CLASS_COUNT];
 
-static void onCancel (RIL_Token t __unused)
+typedef struct {
+    int request;
+    void *data;
+    size_t datalen;
+    RIL_Token t;
+} RequestJob;
+
+/** returns false if the request should run on the calling thread */
+static bool getRequestDispatch(int request, RequestClass *p_class,
+                               RequestDataKind *p_kind)
 {
-    //@@@todo
-
-}
+    switch (request) {
+        case RIL_REQUEST_GET_CURRENT_CALLS:
+        case RIL_REQUEST_HANGUP_WAITING_OR_BACKGROUND:
+        case RIL_REQUEST_HANGUP_FOREGROUND_RESUME_BACKGROUND:
+        case RIL_REQUEST_SWITCH_WAITING_OR_HOLDING_AND_ACTIVE:
+        case RIL_REQUEST_CONFERENCE:
+        case RIL_REQUEST_UDUB:
+        case RIL_REQUEST_ANSWER:
+            *p_class = REQUEST_CLASS_CALL;
+            *p_kind = REQUEST_DATA_NONE;
+            return true;
+        case RIL_REQUEST_HANGUP:
+        case RIL_REQUEST_SEPARATE_CONNECTION:
+            *p_class = REQUEST_CLASS_CALL;
+            *p_kind = REQUEST_DATA_FLAT;
+            return true;
+        case RIL_REQUEST_DTMF:
+            *p_class = REQUEST_CLASS_CALL;
+            *p_kind = REQUEST_DATA_STRING;
+            return true;
+        case RIL_REQUEST_DIAL:
+            *p_class = REQUEST_CLASS_CALL;
+            *p_kind = REQUEST_DATA_DIAL;
+            return true;
 
-static const char * getVersion(void)
-{
-    return "android reference-ril 1.0";
-}
+        case RIL_REQUEST_SEND_SMS:
+        case RIL_REQUEST_SEND_SMS_EXPECT_MORE:
+            *p_class = REQUEST_CLASS_SMS;
+            *p_kind = REQUEST_DATA_STRINGS;
+            return true;
+        case RIL_REQUEST_SMS_ACKNOWLEDGE:
+        case RIL_REQUEST_DELETE_SMS_ON_SIM:
+            *p_class = REQUEST_CLASS_SMS;
+            *p_kind = REQUEST_DATA_FLAT;
+            return true;
+
+        case RIL_REQUEST_GET_SIM_STATUS:
+            *p_class = REQUEST_CLASS_SIM;
+            *p_kind = REQUEST_DATA_NONE;
+            return true;
+        case RIL_REQUEST_GET_IMSI:
+        case RIL_REQUEST_ENTER_SIM_PIN:
+        case RIL_REQUEST_ENTER_SIM_PUK:
+        case RIL_REQUEST_ENTER_SIM_PIN2:
+        case RIL_REQUEST_ENTER_SIM_PUK2:
+        case RIL_REQUEST_CHANGE_SIM_PIN:
+        case RIL_REQUEST_CHANGE_SIM_PIN2:
+            *p_class = REQUEST_CLASS_SIM;
+            *p_kind = REQUEST_DATA_STRINGS;
+            return true;
+        case RIL_REQUEST_SIM_IO:
+            *p_class = REQUEST_CLASS_SIM;
+            *p_kind = REQUEST_DATA_SIM_IO;
+            return true;
+        case RIL_REQUEST_SIM_TRANSMIT_APDU_BASIC:
+        case RIL_REQUEST_SIM_TRANSMIT_APDU_CHANNEL:
+            *p_class = REQUEST_CLASS_SIM;
+            *p_kind = REQUEST_DATA_SIM_APDU;
+            return true;
+        case RIL_REQUEST_SIM_AUTHENTICATION:
+            *p_class = REQUEST_CLASS_SIM;
+            *p_kind = REQUEST_DATA_SIM_AUTH;
+            return true;
 
-static void
+        case RIL_REQUEST_SETUP_DATA_CALL:
+        case RIL_REQUEST_DEACTIVATE_DATA_CALL:
+            *p_class = REQUEST_CLASS_DATA;
+            *p_kind = REQUEST_DATA_STRINGS;
+            return true;
+        case RIL_REQUEST_DATA_CALL_LIST:
+            *p_class = REQUEST_CLASS_DATA;
+            *p_kind = REQUEST_DATA_NONE;
+            return true;
+
+        case RIL_REQUEST_SIGNAL_STRENGTH:
+        case RIL_REQUEST_VOICE_REGISTRATION_STATE:
+        case RIL_REQUEST_DATA_REGISTRATION_STATE:
+        case RIL_REQUEST_OPERATOR:
+        case RIL_REQUEST_QUERY_NETWORK_SELECTION_MODE:
+        case RIL_REQUEST_QUERY_AVAILABLE_NETWORKS:
+        case RIL_REQUEST_GET_CELL_INFO_LIST:
+        case RIL_REQUEST_VOICE_RADIO_TECH:
+            *p_class = REQUEST_CLASS_NETWORK;
+            *p_kind = REQUEST_DATA_NONE;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static size_t strSize(const char *str)
+{
+    return str != NULL ? strlen(str) + 1 : 0;
+}
+
+/** copy str to *p_cursor and advance it, returns the copy */
+static char *copyStr(char **p_cursor, const char *str)
+{
+    char *ret;
+    size_t len;
+
+    if (str == NULL) {
+        return NULL;
+    }
+    len = strlen(str) + 1;
+    ret = *p_cursor;
+    memcpy(ret, str, len);
+    *p_cursor += len;
+    return ret;
+}
+
+/**
+ * Deep copy the request payload into a single allocation, as libril frees
+ * it as soon as onRequest() returns.
+ * returns NULL on failure
+ */
+static RequestJob *newRequestJob(int request, RequestDataKind kind,
+                                 void *data, size_t datalen, RIL_Token t)
+{
+    RequestJob *job;
+    size_t size = 0, i, count = 0;
+    char *cursor;
+
+    if (data == NULL) {
+        kind = REQUEST_DATA_NONE;
+    }
+
+    switch (kind) {
+        case REQUEST_DATA_NONE:
+            break;
+        case REQUEST_DATA_FLAT:
+            size = datalen;
+            break;
+        case REQUEST_DATA_STRING:
+            size = strSize((const char *)data);
+            break;
+        case REQUEST_DATA_STRINGS:
+            count = datalen / sizeof(char *);
+            size = count * sizeof(char *);
+            for (i = 0; i < count; i++) {
+                size += strSize(((char **)data)[i]);
+            }
+            break;
+        case REQUEST_DATA_DIAL: {
+            RIL_Dial *p_dial = (RIL_Dial *)data;
+            size = sizeof(RIL_Dial) + strSize(p_dial->address);
+            if (p_dial->uusInfo != NULL) {
+                size += sizeof(RIL_UUS_Info) + p_dial->uusInfo->uusLength;
+            }
+            break;
+        }
+        case REQUEST_DATA_SIM_IO: {
+            RIL_SIM_IO_v6 *p_io = (RIL_SIM_IO_v6 *)data;
+            size = sizeof(RIL_SIM_IO_v6) + strSize(p_io->path) +
+                    strSize(p_io->data) + strSize(p_io->pin2) +
+                    strSize(p_io->aidPtr);
+            break;
+        }
+        case REQUEST_DATA_SIM_APDU:
+            size = sizeof(RIL_SIM_APDU) + strSize(((RIL_SIM_APDU *)data)->data);
+            break;
+        case REQUEST_DATA_SIM_AUTH: {
+            RIL_SimAuthentication *p_auth = (RIL_SimAuthentication *)data;
+            size = sizeof(RIL_SimAuthentication) + strSize(p_auth->authData) +
+                    strSize(p_auth->aid);
+            break;
+        }
+    }
+
+    job = (RequestJob *)calloc(1, sizeof(RequestJob) + size);
+    if (job == NULL) {
+        return NULL;
+    }
+    job->request = request;
+    job->datalen = datalen;
+    job->t = t;
+    job->data = (kind == REQUEST_DATA_NONE) ? data : (void *)(job + 1);
+    cursor = (char *)(job + 1);
+
+    switch (kind) {
+        case REQUEST_DATA_NONE:
+            /* nothing to copy, but don't hand out a soon dangling pointer */
+            job->data = NULL;
+            job->datalen = 0;
+            break;
+        case REQUEST_DATA_FLAT:
+            memcpy(cursor, data, datalen);
+            break;
+        case REQUEST_DATA_STRING:
+            copyStr(&cursor, (const char *)data);
+            break;
+        case REQUEST_DATA_STRINGS: {
+            char **strings = (char **)cursor;
+            cursor += count * sizeof(char *);
+            for (i = 0; i < count; i++) {
+                strings[i] = copyStr(&cursor, ((char **)data)[i]);
+            }
+            break;
+        }
+        case REQUEST_DATA_DIAL: {
+            RIL_Dial *p_dial = (RIL_Dial *)cursor;
+            *p_dial = *(RIL_Dial *)data;
+            cursor += sizeof(RIL_Dial);
+            if (p_dial->uusInfo != NULL) {
+                RIL_UUS_Info *p_uus = (RIL_UUS_Info *)cursor;
+                *p_uus = *p_dial->uusInfo;
+                cursor += sizeof(RIL_UUS_Info);
+                if (p_uus->uusData != NULL && p_uus->uusLength > 0) {
+                    memcpy(cursor, p_uus->uusData, p_uus->uusLength);
+                    p_uus->uusData = cursor;
+                    cursor += p_uus->uusLength;
+                }
+                p_dial->uusInfo = p_uus;
+            }
+            p_dial->address = copyStr(&cursor, p_dial->address);
+            break;
+        }
+        case REQUEST_DATA_SIM_IO: {
+            RIL_SIM_IO_v6 *p_io = (RIL_SIM_IO_v6 *)cursor;
+            *p_io = *(RIL_SIM_IO_v6 *)data;
+            cursor += sizeof(RIL_SIM_IO_v6);
+            p_io->path = copyStr(&cursor, p_io->path);
+            p_io->data = copyStr(&cursor, p_io->data);
+            p_io->pin2 = copyStr(&cursor, p_io->pin2);
+            p_io->aidPtr = copyStr(&cursor, p_io->aidPtr);
+            break;
+        }
+        case REQUEST_DATA_SIM_APDU: {
+            RIL_SIM_APDU *p_apdu = (RIL_SIM_APDU *)cursor;
+            *p_apdu = *(RIL_SIM_APDU *)data;
+            cursor += sizeof(RIL_SIM_APDU);
+            p_apdu->data = copyStr(&cursor, p_apdu->data);
+            break;
+        }
+        case REQUEST_DATA_SIM_AUTH: {
+            RIL_SimAuthentication *p_auth = (RIL_SimAuthentication *)cursor;
+            *p_auth = *(RIL_SimAuthentication *)data;
+            cursor += sizeof(RIL_SimAuthentication);
+            p_auth->authData = copyStr(&cursor, p_auth->authData);
+            p_auth->aid = copyStr(&cursor, p_auth->aid);
+            break;
+        }
+    }
+
+    return job;
+}
+
+/** processRequest() with the processing time accounted */
+static void runRequest(int request, void *data, size_t datalen, RIL_Token t)
+{
+    unsigned int statsId;
+
+    statsId = request_stats_start(t, at_thread_command_time_us());
+    processRequest(request, data, datalen, t);
+    /* t is usually completed by now, the id guards against its reuse */
+    request_stats_processed(t, statsId, at_thread_command_time_us());
+}
+
+static void runRequestJob(void *param)
+{
+    RequestJob *job = (RequestJob *)param;
+
+    runRequest(job->request, job->data, job->datalen, job->t);
+    free(job);
+}
+
+static void initRequestQueues()
+{
+    int i;
+
+    for (i = 0; i < REQUEST_CLASS_COUNT; i++) {
+        s_requestQueues[i] = workqueue_create(s_requestClassNames[i], 1);
+        if (s_requestQueues[i] == NULL) {
+            RLOGE("failed to create %s queue, running inline",
+                  s_requestClassNames[i]);
+        }
+    }
+}
+
+/**
+ * Call from RIL to us to make a RIL_REQUEST
+ *
+ * Must be completed with a call to RIL_onRequestComplete()
+ *
+ * RIL_onRequestComplete() may be called from any thread, before or after
+ * this function returns.
+ *
+ * Because onRequest function could be called from multiple different thread,
+ * we must ensure that the underlying at_send_command_* function
+ * is atomic.
+ */
+static void
+onRequest (int request, void *data, size_t datalen, RIL_Token t)
+{
+    RequestClass requestClass;
+    RequestDataKind kind;
+    RequestJob *job;
+
+    request_stats_begin(t, request);
+    if (getRequestDispatch(request, &requestClass, &kind)
+            && s_requestQueues[requestClass] != NULL) {
+        job = newRequestJob(request, kind, data, datalen, t);
+        if (job != NULL
+                && workqueue_post(s_requestQueues[requestClass],
+                                  runRequestJob, job) == 0) {
+            return;
+        }
+        RLOGE("failed to queue %s, running inline", requestToString(request));
+        free(job);
+    }
+
+    runRequest(request, data, datalen, t);
+}
+
+/**
+ * Synchronous call from the RIL to us to return current radio state.
+ * RADIO_STATE_UNAVAILABLE should be the initial state.
+ */
+static RIL_RadioState
+currentState()
+{
+    return sState;
+}
+/**
+ * Call from RIL to us to find out whether a specific request code
+ * is supported by this implementation.
+ *
+ * Return 1 for "supported" and 0 for "unsupported"
+ */
+
+static int
+onSupports (int requestCode __unused)
+{
+    //@@@ todo
+
+    return 1;
+}
+
+static void onCancel (RIL_Token t __unused)
+{
+    //@@@todo
+
+}
+
+static const char * getVersion(void)
+{
+    return "android reference-ril 1.0";
+}
+
+static void
 setRadioTechnology(ModemInfo *mdm, int newtech)
 {
     RLOGD("setRadioTechnology(%d)", newtech);
@@ -5057,6 +7529,14 @@ setRadioState(RIL_RadioState newState)
 
     /* do these outside of the mutex */
     if (sState != oldState) {
+        invalidateSimState();
+        invalidateCallTable();
+        invalidatePdpTable();
+        invalidateRegistrationSnapshots();
+        invalidateOperatorCache();
+        if (sState != RADIO_STATE_ON) {
+            invalidateSmsQueue();
+        }
         RIL_onUnsolicitedResponse (RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
                                     NULL, 0);
         // Sim state can change as result of radio state change
@@ -5069,6 +7549,7 @@ setRadioState(RIL_RadioState newState)
          * will need to be dispatched on the request thread
          */
         if (sState == RADIO_STATE_ON) {
+            boottime_mark(BOOT_RADIO_ON);
             onRadioPowerOn();
         }
     }
@@ -5151,17 +7632,74 @@ done:
     return ret;
 }
 
-/** Returns SIM_NOT_READY on error */
-static SIM_Status
-getSIMStatus()
+/**
+ * Map a +CPIN: result to a SIM state. READY maps to SIM_READY regardless
+ * of the radio state.
+ */
+static SIM_Status simStatusFromCpin(const char *cpinResult)
+{
+    if (0 == strcmp (cpinResult, "SIM PIN")) {
+        return SIM_PIN;
+    } else if (0 == strcmp (cpinResult, "SIM PUK")) {
+        return SIM_PUK;
+    } else if (0 == strcmp (cpinResult, "PH-NET PIN")) {
+        return SIM_NETWORK_PERSONALIZATION;
+    } else if (0 == strcmp (cpinResult, "NOT READY")) {
+        return SIM_NOT_READY;
+    } else if (0 != strcmp (cpinResult, "READY"))  {
+        /* we're treating unsupported lock types as "sim absent" */
+        return SIM_ABSENT;
+    }
+    return SIM_READY;
+}
+
+/**
+ * Store a SIM state in the cache. SIM_NOT_READY is transitional and
+ * leaves the cache invalid so the next reader queries the modem again.
+ * Returns true if the cached state changed.
+ */
+static bool updateSimState(SIM_Status status)
+{
+    bool changed;
+
+    pthread_mutex_lock(&s_simStateMutex);
+    changed = (s_simState != status);
+    s_simState = status;
+    s_simStateValid = (status != SIM_NOT_READY);
+    pthread_mutex_unlock(&s_simStateMutex);
+
+    if (status == SIM_ABSENT) {
+        sim_cache_clear();
+    } else if (status == SIM_READY) {
+        boottime_mark(BOOT_SIM_READY);
+    }
+
+    if (changed) {
+        RLOGD("SIM state changed to %d", status);
+    }
+    return changed;
+}
+
+static void invalidateSimState()
+{
+    pthread_mutex_lock(&s_simStateMutex);
+    s_simStateValid = false;
+    pthread_mutex_unlock(&s_simStateMutex);
+}
+
+/**
+ * Query AT+CPIN? and update the cache.
+ * Returns SIM_NOT_READY on error, the cache is left untouched then.
+ */
+static SIM_Status refreshSIMStatus()
 {
     ATResponse *p_response = NULL;
     int err;
-    int ret;
+    SIM_Status ret;
     char *cpinLine;
     char *cpinResult;
 
-    RLOGD("getSIMStatus(). sState: %d",sState);
+    RLOGD("refreshSIMStatus(). sState: %d",sState);
     err = at_send_command_singleline("AT+CPIN?", "+CPIN:", &p_response);
 
     if (err != 0) {
@@ -5175,11 +7713,11 @@ getSIMStatus()
 
         case CME_SIM_NOT_INSERTED:
             ret = SIM_ABSENT;
-            goto done;
+            goto update;
 
         default:
             ret = SIM_NOT_READY;
-            goto done;
+            goto update;
     }
 
     /* CPIN? has succeeded, now look at the result */
@@ -5199,31 +7737,41 @@ getSIMStatus()
         goto done;
     }
 
-    if (0 == strcmp (cpinResult, "SIM PIN")) {
-        ret = SIM_PIN;
-        goto done;
-    } else if (0 == strcmp (cpinResult, "SIM PUK")) {
-        ret = SIM_PUK;
-        goto done;
-    } else if (0 == strcmp (cpinResult, "PH-NET PIN")) {
-        return SIM_NETWORK_PERSONALIZATION;
-    } else if (0 != strcmp (cpinResult, "READY"))  {
-        /* we're treating unsupported lock types as "sim absent" */
-        ret = SIM_ABSENT;
-        goto done;
-    }
-
-    at_response_free(p_response);
-    p_response = NULL;
-    cpinResult = NULL;
+    ret = simStatusFromCpin(cpinResult);
 
-    ret = (sState == RADIO_STATE_ON) ? SIM_READY : SIM_NOT_READY;
+update:
+    updateSimState(ret);
 
 done:
     at_response_free(p_response);
     return ret;
 }
 
+/**
+ * Returns the cached SIM state, only querying the modem if the cache
+ * was invalidated. Returns SIM_NOT_READY on error.
+ */
+static SIM_Status
+getSIMStatus()
+{
+    SIM_Status ret;
+    bool valid;
+
+    pthread_mutex_lock(&s_simStateMutex);
+    ret = s_simState;
+    valid = s_simStateValid;
+    pthread_mutex_unlock(&s_simStateMutex);
+
+    if (!valid) {
+        ret = refreshSIMStatus();
+    }
+
+    if (ret == SIM_READY && sState != RADIO_STATE_ON) {
+        ret = SIM_NOT_READY;
+    }
+    return ret;
+}
+
 static void getIccId(char *iccid, int size) {
     int err = 0;
     ATResponse *p_response = NULL;
@@ -5241,6 +7789,7 @@ static void getIccId(char *iccid, int size) {
     at_tok_start(&line);
 
     snprintf(iccid, size, "%s", line);
+    sim_cache_set_card(iccid);
 
 error:
     at_response_free(p_response);
@@ -5380,13 +7929,54 @@ static void freeCardStatus(RIL_CardStatus_v1_5 *p_card_status) {
  *  (all SMS-related commands)
  */
 
-static void pollSIMState (void *param __unused)
+static void scheduleSimPoll(int delayMs)
 {
-    ATResponse *p_response;
-    int ret;
+    struct timeval tv = { delayMs / 1000, (delayMs % 1000) * 1000 };
+    uintptr_t gen;
+
+    pthread_mutex_lock(&s_simStateMutex);
+    gen = ++s_simPollGen;
+    pthread_mutex_unlock(&s_simStateMutex);
+
+    RIL_requestTimedCallback (pollSIMState, (void *)gen, &tv);
+}
 
-    if (sState != RADIO_STATE_UNAVAILABLE) {
-        // no longer valid to poll
+/**
+ * Re-evaluate the SIM state now and restart the fallback backoff.
+ * Safe to call from the reader thread.
+ */
+static void kickSimPoll()
+{
+    pthread_mutex_lock(&s_simStateMutex);
+    s_simPollDelayMs = SIM_POLL_INITIAL_MS;
+    pthread_mutex_unlock(&s_simStateMutex);
+    scheduleSimPoll(0);
+}
+
+/** Poll again later, backing off while the SIM stays unusable */
+static void retrySimPoll()
+{
+    int delayMs;
+
+    pthread_mutex_lock(&s_simStateMutex);
+    delayMs = s_simPollDelayMs;
+    if (s_simPollDelayMs < SIM_POLL_MAX_MS) {
+        s_simPollDelayMs *= 2;
+    }
+    pthread_mutex_unlock(&s_simStateMutex);
+    scheduleSimPoll(delayMs);
+}
+
+static void pollSIMState (void *param)
+{
+    unsigned int gen;
+
+    pthread_mutex_lock(&s_simStateMutex);
+    gen = s_simPollGen;
+    pthread_mutex_unlock(&s_simStateMutex);
+
+    if ((uintptr_t)param != gen || sState != RADIO_STATE_ON) {
+        // superseded by a newer kick or no longer valid to poll
         return;
     }
 
@@ -5401,12 +7991,19 @@ static void pollSIMState (void *param __unused)
         return;
 
         case SIM_NOT_READY:
-            RIL_requestTimedCallback (pollSIMState, NULL, &TIMEVAL_SIMPOLL);
+            retrySimPoll();
         return;
 
         case SIM_READY:
+            if (s_simReadyDone) {
+                return;
+            }
             RLOGI("SIM_READY");
-            onSIMReady();
+            s_simReadyDone = (onSIMReady() == 0);
+            if (!s_simReadyDone) {
+                /* SMS not set up and +QIND: SMS DONE may never come */
+                retrySimPoll();
+            }
             RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED, NULL, 0);
         return;
     }
@@ -5607,73 +8204,148 @@ static void probeForModemMode(ModemInfo *info)
     RLOGI("Found GSM Modem");
 }
 
-/**
- * Initialize everything that can be configured while we're still in
- * AT+CFUN=0
+/*
+ * Modem initialization, a few commands per command line. The settings the
+ * modem keeps in its user profile are sent every time as well, since the
+ * live state can differ from the profile (the screen off URC profile
+ * changes the registration reports), and are written to the profile with
+ * AT&W so they are in effect right after a cold boot. A fingerprint of the
+ * stored settings is kept in a property so AT&W, which writes flash, is
+ * only issued when they changed.
  */
-static void initializeCallback(void *param __unused)
-{
-    ATResponse *p_response = NULL;
-    int err;
+#define INIT_PROFILE_PROPERTY   "persist.vendor.ril.init_profile"
+
+static const char *const s_initProfileCommands[] = {
+    /* atchannel is tolerant of echo but it must have verbose result codes */
+    "E0Q0V1",
+    /* no auto-answer */
+    "S0=0",
+    /* extended errors */
+    "+CMEE=1",
+    /* network, GPRS and EPS registration events, with location */
+    "+CREG=2",
+    "+CGREG=2",
+    "+CEREG=2",
+};
 
-    setRadioState (RADIO_STATE_OFF);
+static const char *const s_initCallCommands[] = {
+    /* call status indications, keeps the call table up to date */
+    "^DSCI=1",
+    /* network time and time zone reports (+CTZE) */
+    "+CTZR=2",
+    /* call waiting notifications */
+    "+CCWA=1",
+    /* alternating voice/data off */
+    "+CMOD=0",
+    /* not muted */
+    "+CMUT=0",
+    /* +CSSU unsolicited supp service notifications */
+    "+CSSN=0,1",
+    /* no connected line identification */
+    "+COLP=0",
+};
 
-    at_handshake();
+static const char *const s_initServiceCommands[] = {
+    /* HEX isn't supported by the EG25, use GSM (default) */
+    "+CSCS=\"GSM\"",
+    /* USSD unsolicited */
+    "+CUSD=1",
+    /* +CGEV GPRS event notifications, but don't buffer */
+    "+CGEREP=1,0",
+    /* SMS PDU mode */
+    "+CMGF=0",
+    /* SIM card insertion status reports */
+    "+QSIMSTAT=1",
+    /* +QIND: "csq" on signal changes, filtered by the reporting criteria */
+    "+QINDCFG=\"csq\",1",
+};
 
-    probeForModemMode(sMdmInfo);
-    /* note: we don't check errors here. Everything important will
-       be handled in onATTimeout and onATReaderClosed */
+static int64_t s_portOpenMs = -1;
 
-    /*  atchannel is tolerant of echo but it must */
-    /*  have verbose result codes */
-    at_send_command("ATE0Q0V1", NULL);
+/* 32 bit FNV-1a over the profile commands */
+static uint32_t initProfileFingerprint()
+{
+    size_t n = sizeof(s_initProfileCommands) / sizeof(s_initProfileCommands[0]);
+    uint32_t hash = 2166136261u;
+    size_t i;
+    const char *p;
 
-    /*  No auto-answer */
-    at_send_command("ATS0=0", NULL);
+    for (i = 0; i < n; i++) {
+        for (p = s_initProfileCommands[i]; ; p++) {
+            hash ^= (uint8_t)*p;
+            hash *= 16777619u;
+            if (*p == '\0') break;
+        }
+    }
+    return hash;
+}
 
-    /*  Extended errors */
-    at_send_command("AT+CMEE=1", NULL);
+static void applyInitProfile()
+{
+    size_t n = sizeof(s_initProfileCommands) / sizeof(s_initProfileCommands[0]);
+    ATResponse *p_response = NULL;
+    char fingerprint[16], value[PROPERTY_VALUE_MAX];
+    bool ok[sizeof(s_initProfileCommands) / sizeof(s_initProfileCommands[0])];
+    size_t i;
+    int err;
 
-    /*  Network registration events */
-    err = at_send_command("AT+CREG=2", &p_response);
+    if (sendCompoundCommands(s_initProfileCommands, n, ok) > 0) {
+        for (i = 0; i < n; i++) {
+            /* some handsets -- in tethered mode -- don't support CREG=2 */
+            if (!ok[i] && !strcmp(s_initProfileCommands[i], "+CREG=2")) {
+                at_send_command("AT+CREG=1", NULL);
+            }
+        }
+        /* don't store a profile that differs from the fingerprint */
+        return;
+    }
 
-    /* some handsets -- in tethered mode -- don't support CREG=2 */
-    if (err < 0 || p_response->success == 0) {
-        at_send_command("AT+CREG=1", NULL);
+    snprintf(fingerprint, sizeof(fingerprint), "%08" PRIx32, initProfileFingerprint());
+    property_get(INIT_PROFILE_PROPERTY, value, "");
+    if (!strcmp(value, fingerprint)) {
+        return;
     }
 
+    err = at_send_command("AT&W", &p_response);
+    if (err == 0 && p_response->success) {
+        RLOGI("Stored modem profile %s", fingerprint);
+        property_set(INIT_PROFILE_PROPERTY, fingerprint);
+    }
     at_response_free(p_response);
+}
 
-    /*  GPRS registration events */
-    at_send_command("AT+CGREG=1", NULL);
-
-    /*  Call Waiting notifications */
-    at_send_command("AT+CCWA=1", NULL);
-
-    /*  Alternating voice/data off */
-    at_send_command("AT+CMOD=0", NULL);
+/**
+ * Initialize everything that can be configured while we're still in
+ * AT+CFUN=0
+ */
+static void initializeCallback(void *param __unused)
+{
+    bool callOk[sizeof(s_initCallCommands) / sizeof(s_initCallCommands[0])];
+    int64_t handshakeMs;
+    char value[PROPERTY_VALUE_MAX];
 
-    /*  Not muted */
-    at_send_command("AT+CMUT=0", NULL);
+    setRadioState (RADIO_STATE_OFF);
 
-    /*  +CSSU unsolicited supp service notifications */
-    at_send_command("AT+CSSN=0,1", NULL);
+    at_handshake();
+    handshakeMs = monotonicMsec();
+    boottime_mark(BOOT_HANDSHAKE_DONE);
 
-    /*  no connected line identification */
-    at_send_command("AT+COLP=0", NULL);
+    probeForModemMode(sMdmInfo);
+    /* note: we don't check errors here. Everything important will
+       be handled in onATTimeout and onATReaderClosed */
 
-    /*  HEX character set */
-    at_send_command("AT+CSCS=\"GSM\"", NULL);
-//    HEX isn't suportedby QC25 Use GSM (default)
+    applyInitProfile();
 
-    /*  USSD unsolicited */
-    at_send_command("AT+CUSD=1", NULL);
+    sendCompoundCommands(s_initCallCommands,
+            sizeof(s_initCallCommands) / sizeof(s_initCallCommands[0]), callOk);
+    s_callUrcSupported = callOk[0];
+    invalidateCallTable();
 
-    /*  Enable +CGEV GPRS event notifications, but don't buffer */
-    at_send_command("AT+CGEREP=1,0", NULL);
+    sendCompoundCommands(s_initServiceCommands,
+            sizeof(s_initServiceCommands) / sizeof(s_initServiceCommands[0]), NULL);
 
-    /*  SMS PDU mode */
-    at_send_command("AT+CMGF=0", NULL);
+    /*  Pick the data path before the framework asks for interface names */
+    getQmiDevice();
 
 #ifdef USE_TI_COMMANDS
 
@@ -5689,6 +8361,17 @@ static void initializeCallback(void *param __unused)
     if (isRadioOn() > 0) {
         setRadioState (RADIO_STATE_ON);
     }
+
+    if (s_portOpenMs >= 0) {
+        int64_t now = monotonicMsec();
+
+        RLOGI("Modem ready %" PRId64 " ms after port open (handshake %" PRId64 " ms)",
+              now - s_portOpenMs, handshakeMs - s_portOpenMs);
+        snprintf(value, sizeof(value), "%" PRId64, now - s_portOpenMs);
+        property_set("vendor.ril.init_ms", value);
+        s_portOpenMs = -1;
+    }
+    boottime_mark(BOOT_INIT_DONE);
 }
 
 static void waitForClose()
@@ -5751,9 +8434,12 @@ static int parseProactiveCmdInd(char *response) {
            ret = STK_UNSOL_EVENT_NOTIFY;
            break;
        case STK_REFRESH:
+           /* whatever the refresh mode, EF contents may have changed */
+           sim_cache_clear();
            if (strncasecmp(&(response[typePos + 2]), "04", 2) == 0) {  // SIM_RESET
                RLOGD("Type of Refresh is SIM_RESET");
                s_stkServiceRunning = false;
+               invalidateSimState();
                ret = STK_UNSOL_PROACTIVE_CMD;
            } else {
                ret = STK_UNSOL_EVENT_NOTIFY;
@@ -5779,241 +8465,600 @@ static int parseProactiveCmdInd(char *response) {
 }
 
 /**
- * Called by atchannel when an unsolicited line appears
- * This is called on atchannel's reader thread. AT commands may
- * not be issued here
+ * Handle +CPIN:, +QUSIM: and +QSIMSTAT: on the reader thread. Only the
+ * cached SIM state is touched; the framework re-reads it when notified.
  */
-static void onUnsolicited (const char *s, const char *sms_pdu)
+static void onSimStatusUnsol(const char *s)
 {
-    char *line = NULL, *p;
-    int err;
+    char *line, *p;
+    char *cpinResult;
+    int enable, inserted;
+    bool notify = true;
 
-    /* Ignore unsolicited responses until we're initialized.
-     * This is OK because the RIL library will poll for initial state
-     */
-    if (sState == RADIO_STATE_UNAVAILABLE) {
+    line = p = strdup(s);
+    if (!line) {
         return;
     }
+    if (at_tok_start(&p) < 0) {
+        goto done;
+    }
 
-#define  CGFPCCFG "%CGFPCCFG:"
-    if (strStartsWith(s, CGFPCCFG)) {
-        /* cuttlefish/goldfish specific
-        */
-        char *response;
-        line = p = strdup(s);
-        RLOGD("got CGFPCCFG line %s and %s\n", s, p);
-        err = at_tok_start(&line);
-        if(err) {
-            RLOGE("invalid CGFPCCFG line %s and %s\n", s, p);
+    if (strStartsWith(s, "+CPIN:")) {
+        if (at_tok_nextstr(&p, &cpinResult) < 0) {
+            RLOGE("invalid +CPIN line %s", s);
+            goto done;
         }
-#define kSize 5
-        int configs[kSize];
-        for (int i=0; i < kSize && !err; ++i) {
-            err = at_tok_nextint(&line, &(configs[i]));
-            RLOGD("got i %d, val = %d", i, configs[i]);
+        notify = updateSimState(simStatusFromCpin(cpinResult));
+        if (simStatusFromCpin(cpinResult) == SIM_READY) {
+            kickSimPoll();
         }
-        if(err) {
-            RLOGE("invalid CGFPCCFG line %s and %s\n", s, p);
+    } else if (strStartsWith(s, "+QSIMSTAT:")) {
+        if (at_tok_nextint(&p, &enable) < 0 ||
+                at_tok_nextint(&p, &inserted) < 0) {
+            RLOGE("invalid +QSIMSTAT line %s", s);
+            goto done;
+        }
+        if (inserted == 0) {
+            notify = updateSimState(SIM_ABSENT);
         } else {
-            int modem_tech = configs[2];
-            configs[2] = techFromModemType(modem_tech);
-            RIL_onUnsolicitedResponse (
-                RIL_UNSOL_PHYSICAL_CHANNEL_CONFIGS,
-                configs, kSize);
+            /* card inserted, lock state follows with +CPIN: */
+            invalidateSimState();
         }
-        free(p);
-    } else if (strStartsWith(s, "%CTZV:")) {
-        /* TI specific -- NITZ time */
-        char *response;
+    } else {
+        /* +QUSIM: the SIM application was (re)initialized */
+        invalidateSimState();
+    }
 
-        line = p = strdup(s);
-        at_tok_start(&p);
+    if (notify) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED,
+                                  NULL, 0);
+    }
+done:
+    free(line);
+}
 
-        err = at_tok_nextstr(&p, &response);
+/*
+ * Coalescing of notifications that the modem tends to emit in bursts.
+ * The first post of a type arms a timer for its window; further posts
+ * before it fires are merged into that one notification. Call-critical
+ * events flush everything pending right away. Windows are read from
+ * vendor.ril.coalesce.<name>_ms, 0 disables coalescing for that type.
+ */
+typedef enum {
+    COALESCE_NETWORK_STATE,     /* RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED */
+    COALESCE_DATA_CALL_LIST,    /* data call list refresh */
+    COALESCE_COUNT,
+} CoalesceType;
 
-        if (err != 0) {
-            RLOGE("invalid NITZ line %s\n", s);
-        } else {
-            RIL_onUnsolicitedResponse (
-                RIL_UNSOL_NITZ_TIME_RECEIVED,
-                response, strlen(response) + 1);
+#define COALESCE_TYPE_BITS 4
+
+typedef struct {
+    const char *name;
+    int defaultWindowMs;
+    void (*flush)(void);
+    int windowMs;
+    bool pending;
+    unsigned int gen;
+    unsigned int merged;        /* posts merged into the pending one */
+    uint64_t posted;
+    uint64_t delivered;
+} Coalescer;
+
+static void flushNetworkStateChanged(void)
+{
+    RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
+                              NULL, 0);
+}
+
+static void flushDataCallListChanged(void)
+{
+    /* the refresh sends AT commands, run it on the main thread */
+    RIL_requestTimedCallback(onDataCallListChanged, NULL, NULL);
+}
+
+static pthread_mutex_t s_coalesceMutex = PTHREAD_MUTEX_INITIALIZER;
+static Coalescer s_coalescers[COALESCE_COUNT] = {
+    [COALESCE_NETWORK_STATE] = { "network", 500, flushNetworkStateChanged },
+    [COALESCE_DATA_CALL_LIST] = { "data", 200, flushDataCallListChanged },
+};
+
+static void initCoalescers()
+{
+    char prop[PROPERTY_KEY_MAX];
+    int i;
+
+    for (i = 0; i < COALESCE_COUNT; i++) {
+        snprintf(prop, sizeof(prop), "vendor.ril.coalesce.%s_ms", s_coalescers[i].name);
+        s_coalescers[i].windowMs = property_get_int32(prop, s_coalescers[i].defaultWindowMs);
+        if (s_coalescers[i].windowMs < 0) {
+            s_coalescers[i].windowMs = 0;
         }
-        free(line);
-    } else if (strStartsWith(s,"+CRING:")
-                || strStartsWith(s,"RING")
-                || strStartsWith(s,"NO CARRIER")
-                || strStartsWith(s,"+CCWA")
-    ) {
+    }
+}
+
+/** Deliver a pending notification, called with s_coalesceMutex held */
+static bool takePendingLocked(Coalescer *c)
+{
+    if (!c->pending) {
+        return false;
+    }
+    c->pending = false;
+    c->gen++;
+    c->delivered++;
+    if (c->merged > 0) {
+        RLOGD("coalesced %u %s notifications (%" PRIu64 " of %" PRIu64 " total)",
+              c->merged, c->name, c->posted - c->delivered, c->posted);
+    }
+    c->merged = 0;
+    return true;
+}
+
+static void onCoalesceTimer(void *param)
+{
+    uintptr_t value = (uintptr_t)param;
+    uintptr_t type = value & ((1 << COALESCE_TYPE_BITS) - 1);
+    Coalescer *c = &s_coalescers[type];
+    bool flush = false;
+
+    pthread_mutex_lock(&s_coalesceMutex);
+    /* a flush in between delivered it already */
+    if ((((uintptr_t)c->gen << COALESCE_TYPE_BITS) | type) == value) {
+        flush = takePendingLocked(c);
+    }
+    pthread_mutex_unlock(&s_coalesceMutex);
+
+    if (flush) {
+        c->flush();
+    }
+}
+
+/** Post a notification, safe to call from the reader thread */
+static void coalescePost(CoalesceType type)
+{
+    Coalescer *c = &s_coalescers[type];
+    struct timeval tv;
+    uintptr_t param;
+    bool arm = false, now = false;
+
+    pthread_mutex_lock(&s_coalesceMutex);
+    c->posted++;
+    if (c->windowMs == 0) {
+        c->delivered++;
+        now = true;
+    } else if (c->pending) {
+        c->merged++;
+    } else {
+        c->pending = true;
+        param = ((uintptr_t)c->gen << COALESCE_TYPE_BITS) | type;
+        arm = true;
+    }
+    pthread_mutex_unlock(&s_coalesceMutex);
+
+    if (now) {
+        c->flush();
+    } else if (arm) {
+        tv.tv_sec = c->windowMs / 1000;
+        tv.tv_usec = (c->windowMs % 1000) * 1000;
+        RIL_requestTimedCallback(onCoalesceTimer, (void *)param, &tv);
+    }
+}
+
+/** Deliver everything pending now, for call-critical events */
+static void coalesceFlushAll()
+{
+    bool flush[COALESCE_COUNT];
+    int i;
+
+    pthread_mutex_lock(&s_coalesceMutex);
+    for (i = 0; i < COALESCE_COUNT; i++) {
+        flush[i] = takePendingLocked(&s_coalescers[i]);
+    }
+    pthread_mutex_unlock(&s_coalesceMutex);
+
+    for (i = 0; i < COALESCE_COUNT; i++) {
+        if (flush[i]) {
+            s_coalescers[i].flush();
+        }
+    }
+}
+
+#define  CGFPCCFG "%CGFPCCFG:"
+static void onUrcPhysicalChannelConfigs(const char *s, const char *sms_pdu __unused)
+{
+    /* cuttlefish/goldfish specific
+    */
+    char *line, *p;
+    int err;
+
+    line = p = strdup(s);
+    RLOGD("got CGFPCCFG line %s and %s\n", s, p);
+    err = at_tok_start(&line);
+    if(err) {
+        RLOGE("invalid CGFPCCFG line %s and %s\n", s, p);
+    }
+#define kSize 5
+    int configs[kSize];
+    for (int i=0; i < kSize && !err; ++i) {
+        err = at_tok_nextint(&line, &(configs[i]));
+        RLOGD("got i %d, val = %d", i, configs[i]);
+    }
+    if(err) {
+        RLOGE("invalid CGFPCCFG line %s and %s\n", s, p);
+    } else {
+        int modem_tech = configs[2];
+        configs[2] = techFromModemType(modem_tech);
+        RIL_onUnsolicitedResponse (
+            RIL_UNSOL_PHYSICAL_CHANNEL_CONFIGS,
+            configs, kSize);
+    }
+    free(p);
+}
+
+static void onUrcTiNitz(const char *s, const char *sms_pdu __unused)
+{
+    /* TI specific -- NITZ time */
+    char *line, *p, *response;
+    int err;
+
+    line = p = strdup(s);
+    at_tok_start(&p);
+
+    err = at_tok_nextstr(&p, &response);
+
+    if (err != 0) {
+        RLOGE("invalid NITZ line %s\n", s);
+    } else {
+        RIL_onUnsolicitedResponse (
+            RIL_UNSOL_NITZ_TIME_RECEIVED,
+            response, strlen(response) + 1);
+    }
+    free(line);
+}
+
+static void onUrcNitz(const char *s, const char *sms_pdu __unused)
+{
+    /* NITZ: +CTZE: <tz>,<dst>,<time> with the time in UTC */
+    char *line, *p, *tz, *time;
+    char nitz[64];
+    int dst, yyyy, MM, dd, hh, mm, ss;
+
+    invalidateOperatorCache();
+
+    line = p = strdup(s);
+    at_tok_start(&p);
+
+    if (at_tok_nextstr(&p, &tz) < 0
+            || at_tok_nextint(&p, &dst) < 0
+            || at_tok_nextstr(&p, &time) < 0
+            || sscanf(time, "%d/%d/%d,%d:%d:%d",
+                      &yyyy, &MM, &dd, &hh, &mm, &ss) != 6) {
+        RLOGE("invalid NITZ line %s\n", s);
+    } else {
+        /* yy/mm/dd,hh:mm:ss(+/-)tz,dt with tz in quarter hours */
+        snprintf(nitz, sizeof(nitz), "%02d/%02d/%02d,%02d:%02d:%02d%s%s,%d",
+                 yyyy % 100, MM, dd, hh, mm, ss,
+                 (tz[0] == '+' || tz[0] == '-') ? "" : "+", tz, dst);
+        RIL_onUnsolicitedResponse (
+            RIL_UNSOL_NITZ_TIME_RECEIVED,
+            nitz, strlen(nitz) + 1);
+    }
+    free(line);
+}
+
+static void onUrcTimeZone(const char *s __unused, const char *sms_pdu __unused)
+{
+    /* time zone only, but the network name may have changed with it */
+    invalidateOperatorCache();
+}
+
+static void onUrcSimStatus(const char *s, const char *sms_pdu __unused)
+{
+    onSimStatusUnsol(s);
+}
+
+static void onUrcCallStatus(const char *s, const char *sms_pdu __unused)
+{
+    RIL_Call call;
+    bool active;
+    char *line;
+
+    line = strdup(s);
+    if (line != NULL && callFromDSCILine(line, &call, &active) == 0
+            && callTableUpdate(&call, active)) {
+        coalesceFlushAll();
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
             NULL, 0);
+    }
+    free(line);
+}
+
+static void onUrcSimFilesReady(const char *s __unused, const char *sms_pdu __unused)
+{
+    /* SIM files are initialized, finish SIM bring-up */
+    kickSimPoll();
+}
+
+static void onUrcCallStateChanged(const char *s, const char *sms_pdu __unused)
+{
+    if (s_callUrcSupported) {
+        /*
+         * ^DSCI already reported these; RING repeats every few seconds
+         * while ringing so only react if the table missed the call.
+         */
+        if (strStartsWith(s, "NO CARRIER")) {
+            invalidateCallTable();
+        } else if (callTableHasState(RIL_CALL_INCOMING, RIL_CALL_WAITING)) {
+            return;
+        } else {
+            invalidateCallTable();
+        }
+    }
+    coalesceFlushAll();
+    RIL_onUnsolicitedResponse (
+        RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
+        NULL, 0);
 #ifdef WORKAROUND_FAKE_CGEV
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL); //TODO use new function
+    invalidatePdpTable();
+    coalescePost(COALESCE_DATA_CALL_LIST);
 #endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s,"+CREG:")
-                || strStartsWith(s,"+CGREG:")
-    ) {
-        RIL_onUnsolicitedResponse (
-            RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
-            NULL, 0);
+}
+
+static void onUrcRegistration(const char *s, const char *sms_pdu __unused)
+{
+    onRegistrationUrc(s);
+    coalescePost(COALESCE_NETWORK_STATE);
 #ifdef WORKAROUND_FAKE_CGEV
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+    invalidatePdpTable();
+    coalescePost(COALESCE_DATA_CALL_LIST);
 #endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s, "+CMT:")) {
-        RIL_onUnsolicitedResponse (
-            RIL_UNSOL_RESPONSE_NEW_SMS,
-            sms_pdu, strlen(sms_pdu));
-    } else if (strStartsWith(s, "+CDS:")) {
-        RIL_onUnsolicitedResponse (
-            RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
-            sms_pdu, strlen(sms_pdu));
-    } else if (strStartsWith(s, "+CGEV:")) {
-        /* Really, we can ignore NW CLASS and ME CLASS events here,
-         * but right now we don't since extranous
-         * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
-         */
-        /* can't issue AT commands here -- call on main thread */
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+}
+
+static void onUrcNewSms(const char *s __unused, const char *sms_pdu)
+{
+    onIncomingSms(sms_pdu, false);
+}
+
+static void onUrcSmsStatusReport(const char *s __unused, const char *sms_pdu)
+{
+    onIncomingSms(sms_pdu, true);
+}
+
+static void onUrcSmsStored(const char *s __unused, const char *sms_pdu __unused)
+{
+    onSmsStored();
+}
+
+static void onUrcPdpEvent(const char *s, const char *sms_pdu __unused)
+{
+    /* can't issue AT commands here -- the table marks what to re-read
+     * and the update runs on the main thread, once per burst */
+    if (pdpTableApplyEvent(s)) {
+        coalescePost(COALESCE_DATA_CALL_LIST);
+    }
+}
+
 #ifdef WORKAROUND_FAKE_CGEV
-    } else if (strStartsWith(s, "+CME ERROR: 150")) {
-        RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
+static void onUrcPdpError(const char *s __unused, const char *sms_pdu __unused)
+{
+    invalidatePdpTable();
+    coalescePost(COALESCE_DATA_CALL_LIST);
+}
 #endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s, "+CTEC: ")) {
-        int tech, mask;
-        switch (parse_technology_response(s, &tech, NULL))
-        {
-            case -1: // no argument could be parsed.
-                RLOGE("invalid CTEC line %s\n", s);
-                break;
-            case 1: // current mode correctly parsed
-            case 0: // preferred mode correctly parsed
-                mask = 1 << tech;
-                if (mask != MDM_GSM && mask != MDM_CDMA &&
-                     mask != MDM_WCDMA && mask != MDM_LTE) {
-                    RLOGE("Unknown technology %d\n", tech);
-                } else {
-                    setRadioTechnology(sMdmInfo, tech);
-                }
-                break;
-        }
-    } else if (strStartsWith(s, "+CCSS: ")) {
-        int source = 0;
-        line = p = strdup(s);
-        if (!line) {
-            RLOGE("+CCSS: Unable to allocate memory");
-            return;
-        }
-        if (at_tok_start(&p) < 0) {
-            free(line);
-            return;
-        }
-        if (at_tok_nextint(&p, &source) < 0) {
-            RLOGE("invalid +CCSS response: %s", line);
-            free(line);
-            return;
-        }
-        SSOURCE(sMdmInfo) = source;
-        RIL_onUnsolicitedResponse(RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED,
-                                  &source, sizeof(source));
+
+static void onUrcTechnology(const char *s, const char *sms_pdu __unused)
+{
+    int tech, mask;
+    switch (parse_technology_response(s, &tech, NULL))
+    {
+        case -1: // no argument could be parsed.
+            RLOGE("invalid CTEC line %s\n", s);
+            break;
+        case 1: // current mode correctly parsed
+        case 0: // preferred mode correctly parsed
+            mask = 1 << tech;
+            if (mask != MDM_GSM && mask != MDM_CDMA &&
+                 mask != MDM_WCDMA && mask != MDM_LTE) {
+                RLOGE("Unknown technology %d\n", tech);
+            } else {
+                setRadioTechnology(sMdmInfo, tech);
+            }
+            break;
+    }
+}
+
+static void onUrcSubscriptionSource(const char *s, const char *sms_pdu __unused)
+{
+    char *line, *p;
+    int source = 0;
+
+    line = p = strdup(s);
+    if (!line) {
+        RLOGE("+CCSS: Unable to allocate memory");
+        return;
+    }
+    if (at_tok_start(&p) < 0) {
         free(line);
-    } else if (strStartsWith(s, "+WSOS: ")) {
-        char state = 0;
-        int unsol;
-        line = p = strdup(s);
-        if (!line) {
-            RLOGE("+WSOS: Unable to allocate memory");
-            return;
-        }
-        if (at_tok_start(&p) < 0) {
-            free(line);
-            return;
-        }
-        if (at_tok_nextbool(&p, &state) < 0) {
-            RLOGE("invalid +WSOS response: %s", line);
-            free(line);
-            return;
-        }
+        return;
+    }
+    if (at_tok_nextint(&p, &source) < 0) {
+        RLOGE("invalid +CCSS response: %s", line);
         free(line);
+        return;
+    }
+    SSOURCE(sMdmInfo) = source;
+    RIL_onUnsolicitedResponse(RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED,
+                              &source, sizeof(source));
+    free(line);
+}
 
-        unsol = state ?
-                RIL_UNSOL_ENTER_EMERGENCY_CALLBACK_MODE : RIL_UNSOL_EXIT_EMERGENCY_CALLBACK_MODE;
-
-        RIL_onUnsolicitedResponse(unsol, NULL, 0);
+static void onUrcEmergencyCallbackMode(const char *s, const char *sms_pdu __unused)
+{
+    char *line, *p;
+    char state = 0;
+    int unsol;
 
-    } else if (strStartsWith(s, "+WPRL: ")) {
-        int version = -1;
-        line = p = strdup(s);
-        if (!line) {
-            RLOGE("+WPRL: Unable to allocate memory");
-            return;
-        }
-        if (at_tok_start(&p) < 0) {
-            RLOGE("invalid +WPRL response: %s", s);
-            free(line);
-            return;
-        }
-        if (at_tok_nextint(&p, &version) < 0) {
-            RLOGE("invalid +WPRL response: %s", s);
-            free(line);
-            return;
-        }
+    line = p = strdup(s);
+    if (!line) {
+        RLOGE("+WSOS: Unable to allocate memory");
+        return;
+    }
+    if (at_tok_start(&p) < 0) {
         free(line);
-        RIL_onUnsolicitedResponse(RIL_UNSOL_CDMA_PRL_CHANGED, &version, sizeof(version));
-    } else if (strStartsWith(s, "+CFUN: 0")) {
-        setRadioState(RADIO_STATE_OFF);
-    } else if (strStartsWith(s, "+CSQ: ")) {
-        // Accept a response that is at least v6, and up to v12
-        int minNumOfElements=sizeof(RIL_SignalStrength_v6)/sizeof(int);
-        int maxNumOfElements=sizeof(RIL_SignalStrength_v12)/sizeof(int);
-        int response[maxNumOfElements];
-        memset(response, 0, sizeof(response));
-
-        line = p = strdup(s);
-        at_tok_start(&p);
-
-        for (int count = 0; count < maxNumOfElements; count++) {
-            err = at_tok_nextint(&p, &(response[count]));
-            if (err < 0 && count < minNumOfElements) {
-              free(line);
-              return;
-            }
-        }
+        return;
+    }
+    if (at_tok_nextbool(&p, &state) < 0) {
+        RLOGE("invalid +WSOS response: %s", line);
+        free(line);
+        return;
+    }
+    free(line);
+
+    unsol = state ?
+            RIL_UNSOL_ENTER_EMERGENCY_CALLBACK_MODE : RIL_UNSOL_EXIT_EMERGENCY_CALLBACK_MODE;
 
-        RIL_onUnsolicitedResponse(RIL_UNSOL_SIGNAL_STRENGTH,
-            response, sizeof(response));
+    RIL_onUnsolicitedResponse(unsol, NULL, 0);
+}
+
+static void onUrcPrlVersion(const char *s, const char *sms_pdu __unused)
+{
+    char *line, *p;
+    int version = -1;
+
+    line = p = strdup(s);
+    if (!line) {
+        RLOGE("+WPRL: Unable to allocate memory");
+        return;
+    }
+    if (at_tok_start(&p) < 0) {
+        RLOGE("invalid +WPRL response: %s", s);
         free(line);
-    } else if (strStartsWith(s, "+CUSATEND")) {  // session end
-      RIL_onUnsolicitedResponse(RIL_UNSOL_STK_SESSION_END, NULL, 0);
-    } else if (strStartsWith(s, "+CUSATP:")) {
-        line = p = strdup(s);
-        if (!line) {
-            RLOGE("+CUSATP: Unable to allocate memory");
-            return;
-        }
-        if (at_tok_start(&p) < 0) {
-            RLOGE("invalid +CUSATP response: %s", s);
-            free(line);
-            return;
-        }
+        return;
+    }
+    if (at_tok_nextint(&p, &version) < 0) {
+        RLOGE("invalid +WPRL response: %s", s);
+        free(line);
+        return;
+    }
+    free(line);
+    RIL_onUnsolicitedResponse(RIL_UNSOL_CDMA_PRL_CHANGED, &version, sizeof(version));
+}
 
-        char *response = NULL;
-        if (at_tok_nextstr(&p, &response) < 0) {
-            RLOGE("%s fail", s);
-            free(line);
-            return;
-        }
+static void onUrcRadioOff(const char *s __unused, const char *sms_pdu __unused)
+{
+    setRadioState(RADIO_STATE_OFF);
+}
 
-        StkUnsolEvent ret = parseProactiveCmdInd(response);
-        if (ret == STK_UNSOL_EVENT_NOTIFY) {
-            RIL_onUnsolicitedResponse(RIL_UNSOL_STK_EVENT_NOTIFY, response,
-                                      strlen(response) + 1);
-        } else if (ret == STK_UNSOL_PROACTIVE_CMD) {
-            RIL_onUnsolicitedResponse(RIL_UNSOL_STK_PROACTIVE_COMMAND, response,
-                                      strlen(response) + 1);
-        }
+static void onUrcSignalStrength(const char *s __unused, const char *sms_pdu __unused)
+{
+    /* measured and filtered against the thresholds on the main thread */
+    scheduleSignalStrengthUpdate();
+}
 
+static void onUrcStkSessionEnd(const char *s __unused, const char *sms_pdu __unused)
+{
+    RIL_onUnsolicitedResponse(RIL_UNSOL_STK_SESSION_END, NULL, 0);
+}
+
+static void onUrcStkProactiveCommand(const char *s, const char *sms_pdu __unused)
+{
+    char *line, *p;
+
+    line = p = strdup(s);
+    if (!line) {
+        RLOGE("+CUSATP: Unable to allocate memory");
+        return;
+    }
+    if (at_tok_start(&p) < 0) {
+        RLOGE("invalid +CUSATP response: %s", s);
+        free(line);
+        return;
+    }
+
+    char *response = NULL;
+    if (at_tok_nextstr(&p, &response) < 0) {
+        RLOGE("%s fail", s);
         free(line);
+        return;
+    }
+
+    StkUnsolEvent ret = parseProactiveCmdInd(response);
+    if (ret == STK_UNSOL_EVENT_NOTIFY) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_STK_EVENT_NOTIFY, response,
+                                  strlen(response) + 1);
+    } else if (ret == STK_UNSOL_PROACTIVE_CMD) {
+        RIL_onUnsolicitedResponse(RIL_UNSOL_STK_PROACTIVE_COMMAND, response,
+                                  strlen(response) + 1);
+    }
+
+    free(line);
+}
+
+static const struct {
+    const char *prefix;
+    UrcHandler handler;
+} s_urcHandlers[] = {
+    { CGFPCCFG,             onUrcPhysicalChannelConfigs },
+    { "%CTZV:",             onUrcTiNitz },
+    { "+CTZE:",             onUrcNitz },
+    { "+CTZV:",             onUrcTimeZone },
+    { "+CPIN:",             onUrcSimStatus },
+    { "+QUSIM:",            onUrcSimStatus },
+    { "+QSIMSTAT:",         onUrcSimStatus },
+    { "^DSCI:",             onUrcCallStatus },
+    { "+QIND: SMS DONE",    onUrcSimFilesReady },
+    { "+QIND: PB DONE",     onUrcSimFilesReady },
+    { "+QIND: \"csq\"",     onUrcSignalStrength },
+    { "+CRING:",            onUrcCallStateChanged },
+    { "RING",               onUrcCallStateChanged },
+    { "NO CARRIER",         onUrcCallStateChanged },
+    { "+CCWA",              onUrcCallStateChanged },
+    { "+CREG:",             onUrcRegistration },
+    { "+CGREG:",            onUrcRegistration },
+    { "+CEREG:",            onUrcRegistration },
+    { "+CMT:",              onUrcNewSms },
+    { "+CDS:",              onUrcSmsStatusReport },
+    { "+CMTI:",             onUrcSmsStored },
+    { "+CGEV:",             onUrcPdpEvent },
+#ifdef WORKAROUND_FAKE_CGEV
+    { "+CME ERROR: 150",    onUrcPdpError },
+#endif /* WORKAROUND_FAKE_CGEV */
+    { "+CTEC: ",            onUrcTechnology },
+    { "+CCSS: ",            onUrcSubscriptionSource },
+    { "+WSOS: ",            onUrcEmergencyCallbackMode },
+    { "+WPRL: ",            onUrcPrlVersion },
+    { "+CFUN: 0",           onUrcRadioOff },
+    { "+CSQ: ",             onUrcSignalStrength },
+    { "+CUSATEND",          onUrcStkSessionEnd },
+    { "+CUSATP:",           onUrcStkProactiveCommand },
+};
+
+static void registerUrcHandlers()
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(s_urcHandlers) / sizeof(s_urcHandlers[0]); i++) {
+        urc_register(s_urcHandlers[i].prefix, s_urcHandlers[i].handler);
+    }
+}
+
+/**
+ * Called by atchannel when an unsolicited line appears
+ * This is called on atchannel's reader thread. AT commands may
+ * not be issued here
+ */
+static void onUnsolicited (const char *s, const char *sms_pdu)
+{
+    recordUrcWakeup();
+
+    /* Ignore unsolicited responses until we're initialized.
+     * This is OK because the RIL library will poll for initial state
+     */
+    if (sState == RADIO_STATE_UNAVAILABLE) {
+        return;
     }
+
+    urc_dispatch(s, sms_pdu);
 }
 
 /* Called on command or reader thread */
@@ -6047,6 +9092,82 @@ static void setHardwareConfiguration(int num, RIL_HardwareConfig *cfg)
    RIL_onUnsolicitedResponse(RIL_UNSOL_HARDWARE_CONFIG_CHANGED, cfg, num*sizeof(*cfg));
 }
 
+#define BOOTTIME_LINE_LEN 64
+
+/** Reply with the boot timeline, one "name=ms +delta" line per milestone */
+static void requestBoottimeDump(RIL_Token t)
+{
+    static char lines[BOOT_MILESTONE_COUNT][BOOTTIME_LINE_LEN];
+    char *response[BOOT_MILESTONE_COUNT];
+    int64_t start = boottime_get(BOOT_RILD_START);
+    int i, n = 0;
+
+    if (start < 0) {
+        start = boottime_get(BOOT_RIL_INIT);
+    }
+    for (i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+        int64_t when = boottime_get(i);
+
+        if (when < 0) {
+            continue;
+        }
+        snprintf(lines[n], sizeof(lines[n]), "%s=%" PRId64 " +%" PRId64,
+                 boottime_name(i), when, when - start);
+        response[n] = lines[n];
+        n++;
+    }
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, response, n * sizeof(char *));
+}
+
+/** Reply with the request statistics, one line per request seen */
+static void requestStatsDump(RIL_Token t)
+{
+    char **lines;
+    size_t count = 0;
+
+    lines = request_stats_dump(&count, requestToString);
+    if (lines == NULL) {
+        RIL_onRequestComplete(t, RIL_E_NO_MEMORY, NULL, 0);
+        return;
+    }
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, lines, count * sizeof(char *));
+    free(lines);
+}
+
+/**
+ * OEM_HOOK_STRINGS: "boottime" dumps the startup timeline, "stats" the
+ * request statistics and "stats", "reset" clears them. Anything else is
+ * echoed back.
+ */
+static void requestOemHookStrings(void *data, size_t datalen, RIL_Token t)
+{
+    const char **strings = (const char **)data;
+    size_t count = datalen / sizeof(char *);
+    size_t i;
+
+    RLOGD("got OEM_HOOK_STRINGS: 0x%8p %lu", data, (long)datalen);
+    for (i = 0; i < count; i++) {
+        RLOGD("> '%s'", strings[i]);
+    }
+
+    if (count > 0 && strings[0] != NULL && !strcmp(strings[0], "boottime")) {
+        requestBoottimeDump(t);
+        return;
+    }
+    if (count > 0 && strings[0] != NULL && !strcmp(strings[0], "stats")) {
+        if (count > 1 && strings[1] != NULL && !strcmp(strings[1], "reset")) {
+            request_stats_reset();
+            RIL_onRequestComplete(t, RIL_E_SUCCESS, NULL, 0);
+        } else {
+            requestStatsDump(t);
+        }
+        return;
+    }
+
+    // echo back strings
+    RIL_onRequestComplete(t, RIL_E_SUCCESS, data, datalen);
+}
+
 static void usage(char *s __unused)
 {
 #ifdef RIL_SHLIB
@@ -6117,6 +9238,8 @@ mainLoop(void *param __unused)
         }
 
         s_closed = 0;
+        s_portOpenMs = monotonicMsec();
+        boottime_mark(BOOT_PORT_OPEN);
         ret = at_open(fd, onUnsolicited);
 
         if (ret < 0) {
@@ -6149,6 +9272,7 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
     s_rilenv = env;
 
     RLOGD("RIL_Init");
+    boottime_init();
     while ( -1 != (opt = getopt(argc, argv, "p:d:s:c:m:"))) {
         switch (opt) {
             case 'p':
@@ -6197,6 +9321,11 @@ const RIL_RadioFunctions *RIL_Init(const struct RIL_Env *env, int argc, char **a
         RLOGE("Unable to alloc memory for ModemInfo");
         return NULL;
     }
+    initRequestQueues();
+    initCoalescers();
+    registerUrcHandlers();
+    sms_submit_set_timer(smsSubmitTimer);
+
     pthread_attr_init (&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     ret = pthread_create(&s_tid_mainloop, &attr, mainLoop, NULL);
@@ -0,0 +1,262 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "request_stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#include "misc.h"
+
+#define STATS_MAX_REQUEST       256     /* request ids tracked */
+#define STATS_MAX_PENDING       64      /* power of two */
+#define STATS_BUCKETS           16      /* <1ms, <2ms, ... >=16s */
+#define STATS_LINE_LEN          256
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    int64_t totalUs;
+    int64_t queueUs;
+    int64_t modemUs;
+    int64_t maxUs;
+    uint32_t histogram[STATS_BUCKETS];
+} RequestStats;
+
+typedef struct {
+    const void *token;      /* NULL if the slot is free */
+    unsigned int id;        /* unique among requests seen, never 0 */
+    int request;
+    int64_t beginUs;
+    int64_t startUs;        /* 0 until processing starts */
+    int64_t commandUs;      /* thread's command time at start */
+    int64_t modemUs;
+    bool processed;
+} PendingRequest;
+
+static pthread_mutex_t s_statsMutex = PTHREAD_MUTEX_INITIALIZER;
+static RequestStats s_stats[STATS_MAX_REQUEST];
+static PendingRequest s_pending[STATS_MAX_PENDING];
+static unsigned int s_nextId = 0;
+
+static size_t tokenSlot(const void *token)
+{
+    uintptr_t v = (uintptr_t)token;
+
+    return (size_t)((v >> 4) ^ (v >> 12)) & (STATS_MAX_PENDING - 1);
+}
+
+/* open addressing, linear probing */
+static PendingRequest *findPendingLocked(const void *token)
+{
+    size_t i, slot = tokenSlot(token);
+
+    for (i = 0; i < STATS_MAX_PENDING; i++) {
+        PendingRequest *p = &s_pending[(slot + i) & (STATS_MAX_PENDING - 1)];
+
+        if (p->token == token) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* removing from a probed table, move later entries of the run up */
+static void removePendingLocked(PendingRequest *p)
+{
+    size_t hole = p - s_pending;
+    size_t i = hole;
+
+    p->token = NULL;
+    for (;;) {
+        PendingRequest *next;
+        size_t home;
+
+        i = (i + 1) & (STATS_MAX_PENDING - 1);
+        next = &s_pending[i];
+        if (next->token == NULL) {
+            break;
+        }
+        home = tokenSlot(next->token);
+        /* move it unless its home lies cyclically in (hole, i] */
+        if (((i - home) & (STATS_MAX_PENDING - 1))
+                >= ((i - hole) & (STATS_MAX_PENDING - 1))) {
+            s_pending[hole] = *next;
+            next->token = NULL;
+            hole = i;
+        }
+    }
+}
+
+static int bucketOf(int64_t us)
+{
+    int64_t ms = us / 1000;
+    int bucket = 0;
+
+    while (ms > 0 && bucket < STATS_BUCKETS - 1) {
+        ms >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void request_stats_begin(const void *token, int request)
+{
+    size_t i, slot = tokenSlot(token);
+
+    if (token == NULL || request < 0 || request >= STATS_MAX_REQUEST) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_statsMutex);
+    for (i = 0; i < STATS_MAX_PENDING; i++) {
+        PendingRequest *p = &s_pending[(slot + i) & (STATS_MAX_PENDING - 1)];
+
+        if (p->token == NULL) {
+            memset(p, 0, sizeof(*p));
+            p->token = token;
+            if (++s_nextId == 0) {
+                s_nextId = 1;
+            }
+            p->id = s_nextId;
+            p->request = request;
+            p->beginUs = monotonicUsec();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_statsMutex);
+}
+
+unsigned int request_stats_start(const void *token, int64_t commandUs)
+{
+    PendingRequest *p;
+    unsigned int id = 0;
+
+    pthread_mutex_lock(&s_statsMutex);
+    p = findPendingLocked(token);
+    if (p != NULL && p->startUs == 0) {
+        p->startUs = monotonicUsec();
+        p->commandUs = commandUs;
+        id = p->id;
+    }
+    pthread_mutex_unlock(&s_statsMutex);
+    return id;
+}
+
+void request_stats_processed(const void *token, unsigned int id,
+                             int64_t commandUs)
+{
+    PendingRequest *p;
+
+    if (id == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_statsMutex);
+    p = findPendingLocked(token);
+    if (p != NULL && p->id == id && p->startUs != 0) {
+        p->modemUs = commandUs - p->commandUs;
+        p->processed = true;
+    }
+    pthread_mutex_unlock(&s_statsMutex);
+}
+
+void request_stats_complete(const void *token, int error, int64_t commandUs)
+{
+    int64_t now = monotonicUsec();
+    PendingRequest *p;
+    RequestStats *st;
+    int64_t totalUs;
+
+    pthread_mutex_lock(&s_statsMutex);
+    p = findPendingLocked(token);
+    if (p == NULL) {
+        pthread_mutex_unlock(&s_statsMutex);
+        return;
+    }
+
+    st = &s_stats[p->request];
+    totalUs = now - p->beginUs;
+    st->count++;
+    if (error != 0) {
+        st->errors++;
+    }
+    st->totalUs += totalUs;
+    if (p->startUs != 0) {
+        st->queueUs += p->startUs - p->beginUs;
+        /* completed while still being processed, on this thread */
+        st->modemUs += p->processed ? p->modemUs
+                : commandUs - p->commandUs;
+    }
+    if (totalUs > st->maxUs) {
+        st->maxUs = totalUs;
+    }
+    st->histogram[bucketOf(totalUs)]++;
+
+    removePendingLocked(p);
+    pthread_mutex_unlock(&s_statsMutex);
+}
+
+char **request_stats_dump(size_t *p_count, const char *(*nameOf)(int request))
+{
+    char **lines;
+    char *text;
+    size_t n = 0;
+    int i, b;
+
+    pthread_mutex_lock(&s_statsMutex);
+    for (i = 0; i < STATS_MAX_REQUEST; i++) {
+        if (s_stats[i].count > 0) {
+            n++;
+        }
+    }
+
+    lines = (char **)malloc(n * (sizeof(char *) + STATS_LINE_LEN) + 1);
+    if (lines == NULL) {
+        pthread_mutex_unlock(&s_statsMutex);
+        return NULL;
+    }
+    text = (char *)(lines + n);
+
+    n = 0;
+    for (i = 0; i < STATS_MAX_REQUEST; i++) {
+        const RequestStats *st = &s_stats[i];
+        int len;
+
+        if (st->count == 0) {
+            continue;
+        }
+        lines[n] = text + n * STATS_LINE_LEN;
+        len = snprintf(lines[n], STATS_LINE_LEN,
+                "%s count=%" PRIu64 " errors=%" PRIu64 " avg=%" PRId64
+                "us queue=%" PRId64 "us modem=%" PRId64 "us max=%" PRId64 "us ms_log2=",
+                nameOf(i), st->count, st->errors,
+                st->totalUs / (int64_t)st->count, st->queueUs / (int64_t)st->count,
+                st->modemUs / (int64_t)st->count, st->maxUs);
+        for (b = 0; b < STATS_BUCKETS && len > 0 && len < STATS_LINE_LEN; b++) {
+            len += snprintf(lines[n] + len, STATS_LINE_LEN - len, "%s%" PRIu32,
+                            b > 0 ? "," : "", st->histogram[b]);
+        }
+        n++;
+    }
+    pthread_mutex_unlock(&s_statsMutex);
+
+    *p_count = n;
+    return lines;
+}
+
+void request_stats_reset(void)
+{
+    pthread_mutex_lock(&s_statsMutex);
+    memset(s_stats, 0, sizeof(s_stats));
+    pthread_mutex_unlock(&s_statsMutex);
+}
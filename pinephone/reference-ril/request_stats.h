@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Per request latency statistics. A request is traced by its token from
+ * the moment the RIL hands it to us until it is completed, split into
+ * time spent queued, time spent waiting for the modem while it was
+ * processed and the rest. Latencies are also kept in a log2 histogram
+ * of milliseconds.
+ */
+
+/** A request came in, called before it is queued */
+void request_stats_begin(const void *token, int request);
+
+/**
+ * Processing of the request starts on the calling thread.
+ * commandUs is at_thread_command_time_us() of that thread.
+ * returns an id for request_stats_processed(), 0 if not traced
+ */
+unsigned int request_stats_start(const void *token, int64_t commandUs);
+
+/**
+ * Processing of the request ended on the calling thread, it may
+ * still complete later from elsewhere. id is what request_stats_start()
+ * returned; if the request completed meanwhile its token may already
+ * belong to a new request, which the id tells apart.
+ */
+void request_stats_processed(const void *token, unsigned int id,
+                             int64_t commandUs);
+
+/**
+ * The request completed with error (0 for success). commandUs is
+ * at_thread_command_time_us() of the calling thread, used if the request
+ * completes while it is processed.
+ */
+void request_stats_complete(const void *token, int error, int64_t commandUs);
+
+/**
+ * Format the statistics of every request seen, one line each, named
+ * through nameOf. The result is a single allocation, release it with
+ * free().
+ * returns the lines, NULL if out of memory
+ */
+char **request_stats_dump(size_t *p_count, const char *(*nameOf)(int request));
+
+/** Forget all statistics */
+void request_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "ril_boottime.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cutils/properties.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#include "misc.h"
+
+#define BOOTTIME_PROPERTY_PREFIX "vendor.ril.boottime."
+
+static const char *s_names[BOOT_MILESTONE_COUNT] = {
+    [BOOT_RILD_START] = "rild_start",
+    [BOOT_RIL_INIT] = "ril_init",
+    [BOOT_PORT_OPEN] = "port_open",
+    [BOOT_HANDSHAKE_DONE] = "handshake",
+    [BOOT_INIT_DONE] = "init_done",
+    [BOOT_RADIO_ON] = "radio_on",
+    [BOOT_SIM_READY] = "sim_ready",
+    [BOOT_REGISTERED] = "registered",
+    [BOOT_DATA_UP] = "data_up",
+};
+
+static pthread_mutex_t s_bootMutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t s_times[BOOT_MILESTONE_COUNT] = {
+    [0 ... BOOT_MILESTONE_COUNT - 1] = -1,
+};
+
+static void setProperty(BootMilestone m, const char *value)
+{
+    char name[PROPERTY_KEY_MAX];
+
+    snprintf(name, sizeof(name), BOOTTIME_PROPERTY_PREFIX "%s", s_names[m]);
+    property_set(name, value);
+}
+
+void boottime_init(void)
+{
+    char name[PROPERTY_KEY_MAX], value[PROPERTY_VALUE_MAX];
+    int i;
+
+    snprintf(name, sizeof(name), BOOTTIME_PROPERTY_PREFIX "%s",
+             s_names[BOOT_RILD_START]);
+    if (property_get(name, value, "") > 0) {
+        pthread_mutex_lock(&s_bootMutex);
+        s_times[BOOT_RILD_START] = strtoll(value, NULL, 10);
+        pthread_mutex_unlock(&s_bootMutex);
+    }
+
+    for (i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+        if (i != BOOT_RILD_START) {
+            setProperty(i, "");
+        }
+    }
+
+    boottime_mark(BOOT_RIL_INIT);
+}
+
+void boottime_mark(BootMilestone m)
+{
+    char value[PROPERTY_VALUE_MAX];
+    int64_t now = monotonicMsec();
+    int64_t start;
+
+    pthread_mutex_lock(&s_bootMutex);
+    if (s_times[m] >= 0) {
+        pthread_mutex_unlock(&s_bootMutex);
+        return;
+    }
+    s_times[m] = now;
+    start = s_times[BOOT_RILD_START];
+    pthread_mutex_unlock(&s_bootMutex);
+
+    if (start >= 0) {
+        RLOGI("Boot milestone %s at %" PRId64 " ms (+%" PRId64 " ms)",
+              s_names[m], now, now - start);
+    } else {
+        RLOGI("Boot milestone %s at %" PRId64 " ms", s_names[m], now);
+    }
+    snprintf(value, sizeof(value), "%" PRId64, now);
+    setProperty(m, value);
+}
+
+int64_t boottime_get(BootMilestone m)
+{
+    int64_t t;
+
+    pthread_mutex_lock(&s_bootMutex);
+    t = s_times[m];
+    pthread_mutex_unlock(&s_bootMutex);
+    return t;
+}
+
+const char *boottime_name(BootMilestone m)
+{
+    return s_names[m];
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Startup timeline. Each milestone keeps the CLOCK_MONOTONIC time in ms
+ * of its first occurrence and is published as vendor.ril.boottime.<name>.
+ * rild sets vendor.ril.boottime.rild_start itself before loading the RIL.
+ * Repeated bring-ups (radio power cycles, modem reconnects) are measured
+ * by reference-ril.c as vendor.ril.sim_ready_ms and vendor.ril.init_ms.
+ */
+typedef enum {
+    BOOT_RILD_START,
+    BOOT_RIL_INIT,
+    BOOT_PORT_OPEN,
+    BOOT_HANDSHAKE_DONE,
+    BOOT_INIT_DONE,
+    BOOT_RADIO_ON,
+    BOOT_SIM_READY,
+    BOOT_REGISTERED,
+    BOOT_DATA_UP,
+    BOOT_MILESTONE_COUNT
+} BootMilestone;
+
+/**
+ * Start a new timeline: pick up the rild start time and clear the
+ * properties a previous instance left behind. Records BOOT_RIL_INIT.
+ */
+void boottime_init(void);
+
+/** Record a milestone now, unless it was already recorded */
+void boottime_mark(BootMilestone m);
+
+/** returns the time of a milestone in ms, or -1 if not recorded */
+int64_t boottime_get(BootMilestone m);
+
+/** returns the property suffix of a milestone, eg "sim_ready" */
+const char *boottime_name(BootMilestone m);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "sim_auth.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+/* TS 31.102 7.1.2.1, successful 3G context, not produced by the SIM */
+#define SIM_AUTH_UMTS_SUCCESS   0xDB
+
+/**
+ * Append a length-value field, decoded from a hex string, to buf.
+ * returns the new length of buf, -1 if the value is invalid or doesn't fit
+ */
+static int appendLvFromHex(uint8_t *buf, int len, size_t bufSize, const char *hex)
+{
+    size_t hexLen = strlen(hex);
+    int n;
+
+    if (len < 0 || hexLen / 2 > 0xFF || len + 1 + hexLen / 2 > bufSize) {
+        return -1;
+    }
+    n = hex_decode(hex, hexLen, buf + len + 1, bufSize - len - 1);
+    if (n < 0) {
+        return -1;
+    }
+    buf[len] = (uint8_t)n;
+    return len + 1 + n;
+}
+
+int sim_auth_command(const char *challenge, bool aka, char *cmd, size_t cmdSize)
+{
+    static const char prefix[] = "AT^MBAU=\"";
+    uint8_t data[SIM_AUTH_MAX_DATA];
+    size_t used = sizeof(prefix) - 1;
+    int dataLen, randLen, autnLen = 0, n;
+
+    dataLen = base64_decode_buf(challenge, challenge != NULL ? strlen(challenge) : 0,
+                                data, sizeof(data));
+    if (dataLen <= 0) {
+        RLOGE("Invalid base64 in authentication data");
+        return -1;
+    }
+    randLen = data[0];
+    if (1 + randLen > dataLen) {
+        RLOGE("Truncated RAND in authentication data");
+        return -1;
+    }
+    if (aka) {
+        if (1 + randLen + 1 > dataLen
+                || 1 + randLen + 1 + data[1 + randLen] > dataLen) {
+            RLOGE("Truncated AUTN in authentication data");
+            return -1;
+        }
+        autnLen = data[1 + randLen];
+    }
+
+    if (cmdSize < sizeof(prefix)) {
+        return -1;
+    }
+    memcpy(cmd, prefix, sizeof(prefix));
+    n = hex_encode(data + 1, randLen, cmd + used, cmdSize - used);
+    if (n < 0) {
+        return -1;
+    }
+    used += n;
+    if (aka) {
+        if (used + 1 >= cmdSize) {
+            return -1;
+        }
+        cmd[used++] = ',';
+        n = hex_encode(data + 1 + randLen + 1, autnLen, cmd + used, cmdSize - used);
+        if (n < 0) {
+            return -1;
+        }
+        used += n;
+    }
+    if (used + 2 > cmdSize) {
+        return -1;
+    }
+    cmd[used++] = '"';
+    cmd[used] = '\0';
+    return 0;
+}
+
+int sim_auth_gsm_response(const char *sres, const char *kc, char *out, size_t outSize)
+{
+    uint8_t result[SIM_AUTH_MAX_DATA];
+    int len = 0;
+
+    len = appendLvFromHex(result, len, sizeof(result), sres);
+    len = appendLvFromHex(result, len, sizeof(result), kc);
+    if (len < 0) {
+        return -1;
+    }
+    return base64_encode_buf(result, len, out, outSize) < 0 ? -1 : 0;
+}
+
+int sim_auth_umts_response(const char *res, const char *ck, const char *ik,
+                           char *out, size_t outSize)
+{
+    uint8_t result[SIM_AUTH_MAX_DATA];
+    int len = 0;
+
+    result[len++] = SIM_AUTH_UMTS_SUCCESS;
+    len = appendLvFromHex(result, len, sizeof(result), res);
+    len = appendLvFromHex(result, len, sizeof(result), ck);
+    len = appendLvFromHex(result, len, sizeof(result), ik);
+    if (len < 0) {
+        return -1;
+    }
+    return base64_encode_buf(result, len, out, outSize) < 0 ? -1 : 0;
+}
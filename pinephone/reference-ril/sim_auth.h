@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "base64util.h"
+#include "hexutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * EAP-SIM and EAP-AKA authentication data for AT^MBAU, see TS 31.102
+ * 7.1.2. Challenges and responses are base64 encoded sequences of length
+ * byte and value pairs; all lengths are explicit so values with zero
+ * bytes pass unchanged. Functions return 0 on success and -1 if the data
+ * is malformed or doesn't fit.
+ */
+
+/* largest authentication challenge or response, in bytes */
+#define SIM_AUTH_MAX_DATA       256
+/* buffer sizes for sim_auth_command() and the responses */
+#define SIM_AUTH_COMMAND_SIZE   (sizeof("AT^MBAU=\",\"") + HEX_ENCODED_LEN(SIM_AUTH_MAX_DATA))
+#define SIM_AUTH_RESPONSE_SIZE  (BASE64_ENCODED_LEN(SIM_AUTH_MAX_DATA) + 1)
+
+/**
+ * Build the AT^MBAU command for a challenge: RAND, and AUTN if aka is
+ * set, each with a length byte in front.
+ */
+int sim_auth_command(const char *challenge, bool aka, char *cmd, size_t cmdSize);
+
+/** GSM context response from the hex SRES and Kc the modem returned */
+int sim_auth_gsm_response(const char *sres, const char *kc, char *out, size_t outSize);
+
+/**
+ * Successful 3G context response from the hex RES, CK and IK the modem
+ * returned
+ */
+int sim_auth_umts_response(const char *res, const char *ck, const char *ik,
+                           char *out, size_t outSize);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "sim_cache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#define SIM_CACHE_BUCKETS       256     /* power of two */
+#define SIM_CACHE_MAX_ENTRIES   1024
+#define SIM_CACHE_MAX_PATH      32
+#define SIM_CACHE_MAX_ICCID     32
+
+typedef struct SimCacheEntry {
+    struct SimCacheEntry *next;
+    int command;
+    int fileid;
+    int p1;
+    int p2;
+    int p3;
+    char path[SIM_CACHE_MAX_PATH];
+    int sw1;
+    int sw2;
+    char response[];
+} SimCacheEntry;
+
+static pthread_mutex_t s_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static SimCacheEntry *s_buckets[SIM_CACHE_BUCKETS];
+static int s_entryCount = 0;
+static char s_iccid[SIM_CACHE_MAX_ICCID];
+
+static const char *keyPath(const SimCacheKey *key)
+{
+    return key->path != NULL ? key->path : "";
+}
+
+/* 32 bit FNV-1a over the key */
+static uint32_t keyHash(const SimCacheKey *key)
+{
+    const int fields[] = { key->command, key->fileid, key->p1, key->p2, key->p3 };
+    const char *path = keyPath(key);
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(fields); i++) {
+        hash ^= ((const uint8_t *)fields)[i];
+        hash *= 16777619u;
+    }
+    for (; *path != '\0'; path++) {
+        hash ^= (uint8_t)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool entryMatches(const SimCacheEntry *e, const SimCacheKey *key)
+{
+    return e->command == key->command && e->fileid == key->fileid
+            && e->p1 == key->p1 && e->p2 == key->p2 && e->p3 == key->p3
+            && !strcmp(e->path, keyPath(key));
+}
+
+static void clearLocked(void)
+{
+    SimCacheEntry *e, *next;
+    int i;
+
+    for (i = 0; i < SIM_CACHE_BUCKETS; i++) {
+        for (e = s_buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+        s_buckets[i] = NULL;
+    }
+    s_entryCount = 0;
+}
+
+bool sim_cache_lookup(const SimCacheKey *key, int *p_sw1, int *p_sw2,
+                      char *response, size_t responseSize)
+{
+    SimCacheEntry *e;
+    bool hit = false;
+
+    pthread_mutex_lock(&s_cacheMutex);
+    for (e = s_buckets[keyHash(key) & (SIM_CACHE_BUCKETS - 1)]; e != NULL; e = e->next) {
+        if (entryMatches(e, key)) {
+            if (strlen(e->response) < responseSize) {
+                strcpy(response, e->response);
+                *p_sw1 = e->sw1;
+                *p_sw2 = e->sw2;
+                hit = true;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    return hit;
+}
+
+void sim_cache_store(const SimCacheKey *key, int sw1, int sw2,
+                     const char *response)
+{
+    SimCacheEntry *e, **bucket, **pp;
+    size_t len = response != NULL ? strlen(response) : 0;
+
+    if ((sw1 != 0x90 && sw1 != 0x91) || strlen(keyPath(key)) >= SIM_CACHE_MAX_PATH) {
+        return;
+    }
+
+    e = malloc(sizeof(*e) + len + 1);
+    if (e == NULL) {
+        return;
+    }
+    e->command = key->command;
+    e->fileid = key->fileid;
+    e->p1 = key->p1;
+    e->p2 = key->p2;
+    e->p3 = key->p3;
+    strcpy(e->path, keyPath(key));
+    e->sw1 = sw1;
+    e->sw2 = sw2;
+    memcpy(e->response, response != NULL ? response : "", len + 1);
+
+    pthread_mutex_lock(&s_cacheMutex);
+    if (s_entryCount >= SIM_CACHE_MAX_ENTRIES) {
+        RLOGD("SIM cache full, starting over");
+        clearLocked();
+    }
+    bucket = &s_buckets[keyHash(key) & (SIM_CACHE_BUCKETS - 1)];
+    /* replace an older copy */
+    for (pp = bucket; *pp != NULL; pp = &(*pp)->next) {
+        if (entryMatches(*pp, key)) {
+            SimCacheEntry *old = *pp;
+            *pp = old->next;
+            free(old);
+            s_entryCount--;
+            break;
+        }
+    }
+    e->next = *bucket;
+    *bucket = e;
+    s_entryCount++;
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void sim_cache_invalidate_file(int fileid)
+{
+    SimCacheEntry *e, **pp;
+    int i;
+
+    pthread_mutex_lock(&s_cacheMutex);
+    for (i = 0; i < SIM_CACHE_BUCKETS; i++) {
+        for (pp = &s_buckets[i]; (e = *pp) != NULL;) {
+            if (e->fileid == fileid) {
+                *pp = e->next;
+                free(e);
+                s_entryCount--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void sim_cache_clear(void)
+{
+    pthread_mutex_lock(&s_cacheMutex);
+    clearLocked();
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void sim_cache_set_card(const char *iccid)
+{
+    if (iccid == NULL || iccid[0] == '\0') {
+        return;
+    }
+
+    pthread_mutex_lock(&s_cacheMutex);
+    if (strncmp(s_iccid, iccid, sizeof(s_iccid) - 1)) {
+        if (s_iccid[0] != '\0') {
+            RLOGI("SIM card changed, dropping the SIM cache");
+        }
+        clearLocked();
+        strlcpy(s_iccid, iccid, sizeof(s_iccid));
+    }
+    pthread_mutex_unlock(&s_cacheMutex);
+}
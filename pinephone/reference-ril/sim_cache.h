@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Read cache for SIM elementary files, holding SIM_IO responses of
+ * READ BINARY, READ RECORD and GET RESPONSE by their parameters. Only
+ * normal endings (SW1 0x90/0x91) are cached. All functions are thread
+ * safe.
+ */
+typedef struct {
+    int command;
+    int fileid;
+    const char *path;   /* may be NULL */
+    int p1;
+    int p2;
+    int p3;
+} SimCacheKey;
+
+/**
+ * Look up a response. On a hit, response (of responseSize bytes) receives
+ * the hex response, or an empty string if there was none.
+ * returns true on a hit
+ */
+bool sim_cache_lookup(const SimCacheKey *key, int *p_sw1, int *p_sw2,
+                      char *response, size_t responseSize);
+
+/** Store a response, response may be NULL */
+void sim_cache_store(const SimCacheKey *key, int sw1, int sw2,
+                     const char *response);
+
+/** Drop everything cached for a file, eg after it was updated */
+void sim_cache_invalidate_file(int fileid);
+
+/** Drop everything, eg on SIM removal or STK REFRESH */
+void sim_cache_clear(void);
+
+/** Tell the cache which card is inserted, it is cleared if that changed */
+void sim_cache_set_card(const char *iccid);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "sms_submit.h"
+#include "atchannel.h"
+#include "at_tok.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+static pthread_mutex_t s_cmmsMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool s_cmmsActive = false;
+static unsigned int s_cmmsGen = 0;
+static SmsTimerFn s_timer = NULL;
+
+void sms_submit_set_timer(SmsTimerFn timer)
+{
+    s_timer = timer;
+}
+
+static void restoreMoreMessagesMode(void *param)
+{
+    bool restore;
+
+    pthread_mutex_lock(&s_cmmsMutex);
+    /* with param, only if no segment was sent since the timer was armed */
+    restore = s_cmmsActive && (param == NULL || (uintptr_t)param == s_cmmsGen);
+    if (restore) {
+        s_cmmsActive = false;
+        s_cmmsGen++;
+    }
+    pthread_mutex_unlock(&s_cmmsMutex);
+
+    if (restore) {
+        at_send_command("AT+CMMS=0", NULL);
+    }
+}
+
+/** Keep the link up for the next segment and re-arm the restore timer */
+static void keepMoreMessagesMode()
+{
+    bool enable;
+    uintptr_t gen;
+
+    pthread_mutex_lock(&s_cmmsMutex);
+    enable = !s_cmmsActive;
+    s_cmmsActive = true;
+    gen = ++s_cmmsGen;
+    pthread_mutex_unlock(&s_cmmsMutex);
+
+    if (enable) {
+        ATResponse *p_response = NULL;
+        int err = at_send_command("AT+CMMS=2", &p_response);
+
+        if (err < 0 || p_response->success == 0) {
+            RLOGE("AT+CMMS=2 failed, segments will be sent separately");
+            /* try again with the next segment */
+            pthread_mutex_lock(&s_cmmsMutex);
+            s_cmmsActive = false;
+            pthread_mutex_unlock(&s_cmmsMutex);
+        }
+        at_response_free(p_response);
+    }
+    if (s_timer != NULL) {
+        s_timer(restoreMoreMessagesMode, (void *)gen, SMS_CMMS_RESTORE_MS);
+    }
+}
+
+int sms_submit(const char *smsc, const char *pdu, bool expectMore,
+               int *p_messageRef)
+{
+    ATResponse *p_response = NULL;
+    char *cmd1 = NULL, *cmd2 = NULL;
+    char *line;
+    int err;
+
+    // "NULL for default SMSC"
+    if (smsc == NULL) {
+        smsc = "00";
+    }
+
+    if (asprintf(&cmd1, "AT+CMGS=%zu", strlen(pdu) / 2) < 0) {
+        cmd1 = NULL;
+        goto error;
+    }
+    if (asprintf(&cmd2, "%s%s", smsc, pdu) < 0) {
+        cmd2 = NULL;
+        goto error;
+    }
+
+    if (expectMore) {
+        keepMoreMessagesMode();
+    }
+
+    err = at_send_command_sms(cmd1, cmd2, "+CMGS:", &p_response);
+
+    if (!expectMore) {
+        /* the last segment, or a single message */
+        restoreMoreMessagesMode(NULL);
+    }
+
+    if (err != 0 || p_response->success == 0) goto error;
+
+    line = p_response->p_intermediates->line;
+
+    err = at_tok_start(&line);
+    if (err < 0) goto error;
+
+    err = at_tok_nextint(&line, p_messageRef);
+    if (err < 0) goto error;
+
+    free(cmd1);
+    free(cmd2);
+    at_response_free(p_response);
+    return 0;
+
+error:
+    free(cmd1);
+    free(cmd2);
+    at_response_free(p_response);
+    return -1;
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * SMS submission with AT+CMGS over the AT channel. Segments of a
+ * concatenated message are sent with expectMore set, which turns on
+ * AT+CMMS=2 so the radio link stays up between them. Unlike AT+CMMS=1,
+ * which the modem reverts on its own after a 1-5 s gap between messages,
+ * mode 2 holds until AT+CMMS=0. That is sent after the last segment
+ * (expectMore clear) or, if that never comes, SMS_CMMS_RESTORE_MS after
+ * the most recent segment.
+ */
+#define SMS_CMMS_RESTORE_MS 5000
+
+/** Run callback(param) delayMs from now, on a thread that may send AT commands */
+typedef void (*SmsTimerFn)(void (*callback)(void *param), void *param, int delayMs);
+
+/** Set the timer used to restore AT+CMMS, NULL (the default) for none */
+void sms_submit_set_timer(SmsTimerFn timer);
+
+/**
+ * Send one SMS. smsc is the hex SMSC address, NULL for the default, pdu
+ * the hex TPDU.
+ * returns 0 and the TP-Message-Reference in *p_messageRef, or -1
+ */
+int sms_submit(const char *smsc, const char *pdu, bool expectMore,
+               int *p_messageRef);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,331 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "netlink.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <set>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+constexpr const char *kIfname = "rmnet_test0";
+constexpr const char *kAddresses = "10.64.1.2/30 2001:db8:1::2/64";
+
+bool s_haveNetns = false;
+
+/*
+ * Everything runs in a private network namespace, entered before gtest
+ * starts any thread so the whole process (and the sockets netlink.c opens
+ * lazily) lives in it.
+ */
+class NetnsEnvironment : public ::testing::Environment {
+  public:
+    void SetUp() override
+    {
+        s_haveNetns = unshare(CLONE_NEWNET) == 0
+                || unshare(CLONE_NEWUSER | CLONE_NEWNET) == 0;
+    }
+};
+
+::testing::Environment *const s_env =
+        ::testing::AddGlobalTestEnvironment(new NetnsEnvironment);
+
+/** send one rtnetlink request and wait for its ack, returns 0 or -errno */
+int rtnlRequest(struct nlmsghdr *nlh)
+{
+    struct sockaddr_nl kernel = {};
+    char buf[4096];
+    int fd, ret = -EIO;
+
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        return -errno;
+    }
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, nlh, nlh->nlmsg_len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) >= 0
+            && recv(fd, buf, sizeof(buf), 0) >= (ssize_t)NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+        const struct nlmsghdr *reply = (const struct nlmsghdr *)buf;
+
+        if (reply->nlmsg_type == NLMSG_ERROR) {
+            ret = ((const struct nlmsgerr *)NLMSG_DATA(reply))->error;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+void addAttr(struct nlmsghdr *nlh, int type, const void *data, size_t len)
+{
+    struct rtattr *rta = (struct rtattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/** create a link of the given kind, down */
+int createLink(const char *ifname, const char *kind)
+{
+    union {
+        struct nlmsghdr nlh;
+        char buf[512];
+    } req = {};
+    struct rtattr *linkinfo;
+
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nlh.nlmsg_type = RTM_NEWLINK;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
+    ((struct ifinfomsg *)NLMSG_DATA(&req.nlh))->ifi_family = AF_UNSPEC;
+    addAttr(&req.nlh, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+    linkinfo = (struct rtattr *)(req.buf + NLMSG_ALIGN(req.nlh.nlmsg_len));
+    addAttr(&req.nlh, IFLA_LINKINFO, nullptr, 0);
+    addAttr(&req.nlh, IFLA_INFO_KIND, kind, strlen(kind));
+    linkinfo->rta_len = (char *)&req.nlh + req.nlh.nlmsg_len - (char *)linkinfo;
+    return rtnlRequest(&req.nlh);
+}
+
+int deleteLink(const char *ifname)
+{
+    union {
+        struct nlmsghdr nlh;
+        char buf[256];
+    } req = {};
+
+    req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nlh.nlmsg_type = RTM_DELLINK;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    ((struct ifinfomsg *)NLMSG_DATA(&req.nlh))->ifi_family = AF_UNSPEC;
+    addAttr(&req.nlh, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+    return rtnlRequest(&req.nlh);
+}
+
+unsigned int linkFlags(const char *ifname)
+{
+    struct ifreq ifr = {};
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (fd < 0 || ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) {
+        ifr.ifr_flags = 0;
+    }
+    close(fd);
+    return (unsigned short)ifr.ifr_flags;
+}
+
+int linkMtu(const char *ifname)
+{
+    struct ifreq ifr = {};
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (fd < 0 || ioctl(fd, SIOCGIFMTU, &ifr) < 0) {
+        ifr.ifr_mtu = -1;
+    }
+    close(fd);
+    return ifr.ifr_mtu;
+}
+
+/** addresses of ifname as "address/prefix" */
+std::set<std::string> linkAddresses(const char *ifname)
+{
+    std::set<std::string> result;
+    struct ifaddrs *list, *ifa;
+
+    if (getifaddrs(&list) < 0) {
+        return result;
+    }
+    for (ifa = list; ifa != nullptr; ifa = ifa->ifa_next) {
+        char addr[INET6_ADDRSTRLEN];
+        const void *src, *mask;
+        int prefix = 0;
+        size_t i, len;
+
+        if (ifa->ifa_addr == nullptr || strcmp(ifa->ifa_name, ifname)) {
+            continue;
+        }
+        if (ifa->ifa_addr->sa_family == AF_INET) {
+            src = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+            mask = &((struct sockaddr_in *)ifa->ifa_netmask)->sin_addr;
+            len = 4;
+        } else if (ifa->ifa_addr->sa_family == AF_INET6) {
+            src = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+            mask = &((struct sockaddr_in6 *)ifa->ifa_netmask)->sin6_addr;
+            len = 16;
+            /* skip the kernel's link local address */
+            if (IN6_IS_ADDR_LINKLOCAL((const struct in6_addr *)src)) {
+                continue;
+            }
+        } else {
+            continue;
+        }
+        for (i = 0; i < len; i++) {
+            prefix += __builtin_popcount(((const unsigned char *)mask)[i]);
+        }
+        inet_ntop(ifa->ifa_addr->sa_family, src, addr, sizeof(addr));
+        result.insert(std::string(addr) + "/" + std::to_string(prefix));
+    }
+    freeifaddrs(list);
+    return result;
+}
+
+/** true if there is a default route (IPv4 or IPv6) through ifname */
+bool hasDefaultRoute(const char *ifname)
+{
+    std::ifstream v4("/proc/net/route"), v6("/proc/net/ipv6_route");
+    std::string line;
+
+    while (std::getline(v4, line)) {
+        char dev[IFNAMSIZ + 1], dst[16];
+
+        if (sscanf(line.c_str(), "%16s %15s", dev, dst) == 2
+                && !strcmp(dev, ifname) && !strcmp(dst, "00000000")) {
+            return true;
+        }
+    }
+    while (std::getline(v6, line)) {
+        if (line.compare(0, 35, std::string(32, '0') + " 00") == 0
+                && line.find(ifname) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+class NetlinkTest : public ::testing::Test {
+  protected:
+    void SetUp() override
+    {
+        if (!s_haveNetns) {
+            GTEST_SKIP() << "no permission to create a network namespace";
+        }
+        /* dummy is not built into every host kernel, ifb behaves alike */
+        if (createLink(kIfname, "dummy") < 0) {
+            ASSERT_EQ(createLink(kIfname, "ifb"), 0);
+        }
+    }
+
+    void TearDown() override
+    {
+        if (s_haveNetns) {
+            deleteLink(kIfname);
+        }
+    }
+};
+
+TEST_F(NetlinkTest, SetLink)
+{
+    ASSERT_EQ(netlink_set_link(kIfname, true, 1430), 0);
+    EXPECT_TRUE(linkFlags(kIfname) & IFF_UP);
+    EXPECT_EQ(linkMtu(kIfname), 1430);
+
+    /* mtu 0 leaves the MTU alone */
+    ASSERT_EQ(netlink_set_link(kIfname, false, 0), 0);
+    EXPECT_FALSE(linkFlags(kIfname) & IFF_UP);
+    EXPECT_EQ(linkMtu(kIfname), 1430);
+}
+
+TEST_F(NetlinkTest, Configure)
+{
+    ASSERT_EQ(netlink_configure(kIfname, kAddresses, 1400), 0);
+    EXPECT_TRUE(linkFlags(kIfname) & IFF_UP);
+    EXPECT_EQ(linkMtu(kIfname), 1400);
+    EXPECT_EQ(linkAddresses(kIfname),
+              std::set<std::string>({ "10.64.1.2/30", "2001:db8:1::2/64" }));
+    /* routing is netd's business */
+    EXPECT_FALSE(hasDefaultRoute(kIfname));
+}
+
+TEST_F(NetlinkTest, DefaultPrefix)
+{
+    ASSERT_EQ(netlink_configure(kIfname, "10.64.1.2 2001:db8:1::2", 0), 0);
+    EXPECT_EQ(linkAddresses(kIfname),
+              std::set<std::string>({ "10.64.1.2/32", "2001:db8:1::2/128" }));
+}
+
+TEST_F(NetlinkTest, Deconfigure)
+{
+    ASSERT_EQ(netlink_configure(kIfname, kAddresses, 0), 0);
+    ASSERT_EQ(netlink_deconfigure(kIfname, kAddresses), 0);
+    EXPECT_FALSE(linkFlags(kIfname) & IFF_UP);
+    EXPECT_TRUE(linkAddresses(kIfname).empty());
+}
+
+TEST_F(NetlinkTest, InvalidAddressSkipped)
+{
+    ASSERT_EQ(netlink_configure(kIfname, "10.64.1.300/30 10.64.1.2/33 10.64.1.2/30", 0), 0);
+    EXPECT_EQ(linkAddresses(kIfname), std::set<std::string>({ "10.64.1.2/30" }));
+}
+
+TEST_F(NetlinkTest, NoSuchInterface)
+{
+    errno = 0;
+    EXPECT_EQ(netlink_configure("rmnet_none", kAddresses, 0), -1);
+    EXPECT_EQ(errno, ENODEV);
+    errno = 0;
+    EXPECT_EQ(netlink_set_link("rmnet_none", true, 0), -1);
+    EXPECT_EQ(errno, ENODEV);
+}
+
+TEST_F(NetlinkTest, WaitLinkAlreadyUp)
+{
+    ASSERT_EQ(netlink_set_link(kIfname, true, 0), 0);
+    EXPECT_EQ(netlink_wait_link(kIfname, IFF_UP, 0), 0);
+}
+
+TEST_F(NetlinkTest, WaitLinkTimesOut)
+{
+    errno = 0;
+    EXPECT_EQ(netlink_wait_link(kIfname, IFF_UP, 100), -1);
+    EXPECT_EQ(errno, ETIMEDOUT);
+}
+
+TEST_F(NetlinkTest, WaitLinkEvent)
+{
+    std::thread up([] {
+        usleep(100 * 1000);
+        netlink_set_link(kIfname, true, 0);
+    });
+
+    EXPECT_EQ(netlink_wait_link(kIfname, IFF_UP, 2000), 0);
+    up.join();
+}
+
+TEST_F(NetlinkTest, WaitLinkAppears)
+{
+    static constexpr const char *kLate = "rmnet_test1";
+    std::thread add([] {
+        usleep(100 * 1000);
+        if (createLink(kLate, "dummy") < 0) {
+            createLink(kLate, "ifb");
+        }
+        netlink_set_link(kLate, true, 0);
+    });
+
+    EXPECT_EQ(netlink_wait_link(kLate, IFF_UP, 2000), 0);
+    add.join();
+    deleteLink(kLate);
+}
+
+}  // namespace
@@ -0,0 +1,477 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "qmi.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+/* qmi_set_raw_ip() takes the link down first, not needed here */
+extern "C" int netlink_set_link(const char *, bool, int)
+{
+    return 0;
+}
+
+namespace {
+
+constexpr uint8_t kSvcCtl = 0x00;
+constexpr uint8_t kSvcWds = 0x01;
+constexpr uint8_t kSvcNas = 0x03;
+constexpr uint8_t kSvcWda = 0x1a;
+
+typedef std::vector<uint8_t> Bytes;
+
+struct Request {
+    uint8_t service;
+    uint8_t client;
+    uint16_t txn;
+    uint16_t msgId;
+    Bytes tlvs;
+
+    /** returns the value of TLV type, empty if absent */
+    Bytes tlv(uint8_t type) const
+    {
+        size_t off = 0;
+
+        while (off + 3 <= tlvs.size()) {
+            size_t len = tlvs[off + 1] | (tlvs[off + 2] << 8);
+            if (tlvs[off] == type) {
+                return Bytes(tlvs.begin() + off + 3, tlvs.begin() + off + 3 + len);
+            }
+            off += 3 + len;
+        }
+        return Bytes();
+    }
+};
+
+void addTlv(Bytes &out, uint8_t type, const Bytes &value)
+{
+    out.push_back(type);
+    out.push_back(value.size() & 0xff);
+    out.push_back(value.size() >> 8);
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+Bytes le32(uint32_t v)
+{
+    return Bytes{ uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16), uint8_t(v >> 24) };
+}
+
+/** result TLV, QMI_RESULT_SUCCESS or QMI_RESULT_FAILURE with error */
+Bytes result(uint16_t error = 0)
+{
+    Bytes out;
+
+    addTlv(out, 0x02, Bytes{ uint8_t(error ? 1 : 0), 0, uint8_t(error), uint8_t(error >> 8) });
+    return out;
+}
+
+/**
+ * Loopback modem on a pty in raw mode. It parses the QMUX messages the
+ * client writes and answers each with what the handler returns. Messages
+ * go out one at a time, the next one only after the client read the
+ * previous, since cdc-wdm hands out one message per read.
+ */
+class QmiSim {
+  public:
+    /* response TLVs for a request */
+    typedef std::function<Bytes(const Request &)> Handler;
+
+    QmiSim()
+    {
+        struct termios ios;
+
+        mMaster = posix_openpt(O_RDWR | O_NOCTTY);
+        grantpt(mMaster);
+        unlockpt(mMaster);
+        mPath = ptsname(mMaster);
+        /* held open so the client's reads can be followed */
+        mSlave = open(mPath.c_str(), O_RDWR | O_NOCTTY);
+        tcgetattr(mSlave, &ios);
+        cfmakeraw(&ios);
+        tcsetattr(mSlave, TCSANOW, &ios);
+        EXPECT_EQ(pipe(mStopPipe), 0);
+        mThread = std::thread([this] { run(); });
+    }
+
+    ~QmiSim()
+    {
+        EXPECT_EQ(write(mStopPipe[1], "", 1), 1);
+        mThread.join();
+        close(mStopPipe[0]);
+        close(mStopPipe[1]);
+        close(mSlave);
+        close(mMaster);
+    }
+
+    const char *path() const { return mPath.c_str(); }
+
+    void setHandler(Handler handler)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mHandler = handler;
+    }
+
+    /** send a stale response and an indication ahead of each response */
+    void setNoise(bool noise) { mNoise = noise; }
+
+    std::vector<Request> requests()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mRequests;
+    }
+
+  private:
+    void run()
+    {
+        Bytes in;
+        uint8_t buf[2048];
+
+        for (;;) {
+            struct pollfd fds[2] = { { mMaster, POLLIN, 0 }, { mStopPipe[0], POLLIN, 0 } };
+            if (poll(fds, 2, -1) < 0 || fds[1].revents != 0) {
+                return;
+            }
+            ssize_t n = read(mMaster, buf, sizeof(buf));
+            if (n <= 0) {
+                return;
+            }
+            in.insert(in.end(), buf, buf + n);
+
+            /* one QMUX message: if type, length covering all but the if type */
+            while (in.size() >= 3 && in.size() >= 1u + (in[1] | (in[2] << 8))) {
+                size_t total = 1 + (in[1] | (in[2] << 8));
+                handle(Bytes(in.begin(), in.begin() + total));
+                in.erase(in.begin(), in.begin() + total);
+            }
+        }
+    }
+
+    void handle(const Bytes &msg)
+    {
+        Request req;
+        Handler handler;
+        bool ctl = msg[4] == kSvcCtl;
+        size_t hdr = ctl ? 12 : 13;
+
+        req.service = msg[4];
+        req.client = msg[5];
+        if (ctl) {
+            req.txn = msg[7];
+            req.msgId = msg[8] | (msg[9] << 8);
+        } else {
+            req.txn = msg[7] | (msg[8] << 8);
+            req.msgId = msg[9] | (msg[10] << 8);
+        }
+        req.tlvs.assign(msg.begin() + hdr, msg.end());
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mRequests.push_back(req);
+            handler = mHandler;
+        }
+
+        Bytes tlvs = handler ? handler(req) : result();
+        if (mNoise) {
+            /* an indication and a response to an older transaction */
+            send(frame(req, req.msgId, 0, ctl ? 0x02 : 0x04, Bytes()));
+            send(frame(req, req.msgId, uint16_t(req.txn - 1), ctl ? 0x01 : 0x02, result(1)));
+        }
+        send(frame(req, req.msgId, req.txn, ctl ? 0x01 : 0x02, tlvs));
+    }
+
+    static Bytes frame(const Request &req, uint16_t msgId, uint16_t txn, uint8_t flags,
+                       const Bytes &tlvs)
+    {
+        bool ctl = req.service == kSvcCtl;
+        Bytes out{ 0x01, 0, 0, 0x80, req.service, req.client, flags };
+
+        out.push_back(uint8_t(txn));
+        if (!ctl) {
+            out.push_back(uint8_t(txn >> 8));
+        }
+        out.push_back(uint8_t(msgId));
+        out.push_back(uint8_t(msgId >> 8));
+        out.push_back(uint8_t(tlvs.size()));
+        out.push_back(uint8_t(tlvs.size() >> 8));
+        out.insert(out.end(), tlvs.begin(), tlvs.end());
+        out[1] = uint8_t(out.size() - 1);
+        out[2] = uint8_t((out.size() - 1) >> 8);
+        return out;
+    }
+
+    void send(const Bytes &msg)
+    {
+        int pending;
+
+        EXPECT_EQ(write(mMaster, msg.data(), msg.size()), ssize_t(msg.size()));
+        do {
+            usleep(1000);
+        } while (ioctl(mSlave, FIONREAD, &pending) == 0 && pending > 0);
+    }
+
+    int mMaster;
+    int mSlave;
+    int mStopPipe[2];
+    std::string mPath;
+    std::thread mThread;
+    std::mutex mMutex;
+    Handler mHandler;
+    std::vector<Request> mRequests;
+    std::atomic<bool> mNoise{ false };
+};
+
+/** CTL and the allocated client ids, the rest from the test's handler */
+QmiSim::Handler withClients(QmiSim::Handler next)
+{
+    return [next](const Request &req) {
+        if (req.service == kSvcCtl && req.msgId == 0x0022) {
+            Bytes out = result();
+            uint8_t service = req.tlv(0x01).at(0);
+            addTlv(out, 0x01, Bytes{ service, uint8_t(0x10 + service) });
+            return out;
+        }
+        if (req.service == kSvcCtl || !next) {
+            return result();
+        }
+        return next(req);
+    };
+}
+
+class QmiTest : public ::testing::Test {
+  protected:
+    void open(QmiSim::Handler handler = nullptr)
+    {
+        mSim.setHandler(withClients(handler));
+        mDev = qmi_open(mSim.path());
+        ASSERT_NE(mDev, nullptr);
+    }
+
+    void TearDown() override
+    {
+        qmi_close(mDev);
+    }
+
+    /** the requests sent to a service after qmi_open() */
+    std::vector<Request> requestsTo(uint8_t service)
+    {
+        std::vector<Request> out;
+
+        for (const Request &req : mSim.requests()) {
+            if (req.service == service) {
+                out.push_back(req);
+            }
+        }
+        return out;
+    }
+
+    QmiSim mSim;
+    QmiDevice *mDev = nullptr;
+};
+
+TEST_F(QmiTest, OpenSyncsAndAllocatesClients)
+{
+    open();
+
+    std::vector<Request> ctl = requestsTo(kSvcCtl);
+    ASSERT_EQ(ctl.size(), 4u);
+    EXPECT_EQ(ctl[0].msgId, 0x0027);
+    EXPECT_EQ(ctl[1].tlv(0x01), Bytes{ kSvcWds });
+    EXPECT_EQ(ctl[2].tlv(0x01), Bytes{ kSvcNas });
+    EXPECT_EQ(ctl[3].tlv(0x01), Bytes{ kSvcWda });
+
+    qmi_close(mDev);
+    mDev = nullptr;
+
+    ctl = requestsTo(kSvcCtl);
+    ASSERT_EQ(ctl.size(), 7u);
+    EXPECT_EQ(ctl[4].msgId, 0x0023);
+    EXPECT_EQ(ctl[4].tlv(0x01), (Bytes{ kSvcWds, 0x10 + kSvcWds }));
+    EXPECT_EQ(ctl[5].tlv(0x01), (Bytes{ kSvcNas, 0x10 + kSvcNas }));
+    EXPECT_EQ(ctl[6].tlv(0x01), (Bytes{ kSvcWda, 0x10 + kSvcWda }));
+}
+
+TEST_F(QmiTest, OpenFailsWithoutClient)
+{
+    mSim.setHandler([](const Request &req) {
+        return req.msgId == 0x0022 ? result(0x05) : result();
+    });
+    EXPECT_EQ(qmi_open(mSim.path()), nullptr);
+}
+
+TEST_F(QmiTest, ServingSystem)
+{
+    QmiServingSystem ss;
+
+    open([](const Request &req) {
+        Bytes out = result();
+        if (req.service == kSvcNas && req.msgId == 0x0024) {
+            /* registered, CS and PS attached, 3GPP, one radio interface: LTE */
+            addTlv(out, 0x01, Bytes{ 1, 1, 1, 1, 1, 8 });
+        }
+        return out;
+    });
+
+    ASSERT_EQ(qmi_get_serving_system(mDev, &ss), 0);
+    EXPECT_EQ(ss.registrationState, 1);
+    EXPECT_EQ(ss.csAttachState, 1);
+    EXPECT_EQ(ss.psAttachState, 1);
+    EXPECT_EQ(ss.radioInterface, 8);
+    EXPECT_EQ(requestsTo(kSvcNas).back().client, 0x10 + kSvcNas);
+}
+
+TEST_F(QmiTest, StartNetworkSkipsUnrelatedMessages)
+{
+    QmiStartParams params = { "internet", "user", "secret", 3, 4, 1 };
+    uint32_t handle = 0;
+    int endReason;
+
+    open([](const Request &req) {
+        Bytes out = result();
+        if (req.service == kSvcWds && req.msgId == 0x0020) {
+            addTlv(out, 0x01, le32(0x12345678));
+        }
+        return out;
+    });
+    mSim.setNoise(true);
+
+    ASSERT_EQ(qmi_start_network(mDev, &params, &handle, &endReason), 0);
+    EXPECT_EQ(handle, 0x12345678u);
+    EXPECT_EQ(endReason, -1);
+
+    std::vector<Request> wds = requestsTo(kSvcWds);
+    ASSERT_EQ(wds.size(), 2u);
+    /* the IP family preference comes first */
+    EXPECT_EQ(wds[0].msgId, 0x004d);
+    EXPECT_EQ(wds[0].tlv(0x01), Bytes{ 4 });
+    EXPECT_EQ(wds[1].msgId, 0x0020);
+    EXPECT_EQ(wds[1].client, 0x10 + kSvcWds);
+    EXPECT_EQ(wds[1].tlv(0x14), Bytes(params.apn, params.apn + 8));
+    EXPECT_EQ(wds[1].tlv(0x16), Bytes{ 3 });
+    EXPECT_EQ(wds[1].tlv(0x17), Bytes(params.username, params.username + 4));
+    EXPECT_EQ(wds[1].tlv(0x18), Bytes(params.password, params.password + 6));
+    EXPECT_EQ(wds[1].tlv(0x19), Bytes{ 4 });
+    EXPECT_EQ(wds[1].tlv(0x31), Bytes{ 1 });
+    EXPECT_NE(wds[0].txn, wds[1].txn);
+}
+
+TEST_F(QmiTest, StartNetworkFailureReportsEndReason)
+{
+    QmiStartParams params = { "internet", nullptr, nullptr, 0, 6, 0 };
+    uint32_t handle = 0;
+    int endReason;
+
+    open([](const Request &req) {
+        if (req.service == kSvcWds && req.msgId == 0x0020) {
+            /* QMI_ERR_CALL_FAILED, call end reason 1018 */
+            Bytes out = result(0x0e);
+            addTlv(out, 0x10, Bytes{ 0xfa, 0x03 });
+            return out;
+        }
+        return result();
+    });
+
+    EXPECT_EQ(qmi_start_network(mDev, &params, &handle, &endReason), -1);
+    EXPECT_EQ(endReason, 1018);
+
+    std::vector<Request> wds = requestsTo(kSvcWds);
+    ASSERT_EQ(wds.size(), 2u);
+    EXPECT_EQ(wds[1].tlv(0x19), Bytes{ 6 });
+    EXPECT_TRUE(wds[1].tlv(0x17).empty());
+    EXPECT_TRUE(wds[1].tlv(0x31).empty());
+}
+
+TEST_F(QmiTest, StopNetwork)
+{
+    open();
+
+    ASSERT_EQ(qmi_stop_network(mDev, 0x12345678), 0);
+    EXPECT_EQ(requestsTo(kSvcWds).back().msgId, 0x0021);
+    EXPECT_EQ(requestsTo(kSvcWds).back().tlv(0x01), le32(0x12345678));
+}
+
+TEST_F(QmiTest, RuntimeSettingsIpv4)
+{
+    QmiRuntimeSettings rs;
+
+    open([](const Request &req) {
+        Bytes out = result();
+        if (req.service == kSvcWds && req.msgId == 0x002d) {
+            addTlv(out, 0x1e, le32(0x0a010203));    /* 10.1.2.3 */
+            addTlv(out, 0x21, le32(0xfffffff8));    /* /29 */
+            addTlv(out, 0x20, le32(0x0a010201));
+            addTlv(out, 0x15, le32(0x08080808));
+            addTlv(out, 0x16, le32(0x08080404));
+            addTlv(out, 0x29, le32(1430));
+        }
+        return out;
+    });
+
+    ASSERT_EQ(qmi_get_runtime_settings(mDev, &rs), 0);
+    EXPECT_STREQ(rs.address, "10.1.2.3/29");
+    EXPECT_STREQ(rs.gateway, "10.1.2.1");
+    EXPECT_STREQ(rs.dns1, "8.8.8.8");
+    EXPECT_STREQ(rs.dns2, "8.8.4.4");
+    EXPECT_EQ(rs.mtu, 1430);
+}
+
+TEST_F(QmiTest, RuntimeSettingsIpv6)
+{
+    QmiRuntimeSettings rs;
+
+    open([](const Request &req) {
+        Bytes out = result();
+        if (req.service == kSvcWds && req.msgId == 0x002d) {
+            Bytes addr{ 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5 };
+            Bytes gw{ 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+            addr.push_back(64);
+            addTlv(out, 0x25, addr);
+            addTlv(out, 0x26, gw);
+        }
+        return out;
+    });
+
+    ASSERT_EQ(qmi_get_runtime_settings(mDev, &rs), 0);
+    EXPECT_STREQ(rs.address, "2001:db8::5/64");
+    EXPECT_STREQ(rs.gateway, "2001:db8::1");
+    EXPECT_STREQ(rs.dns1, "");
+    EXPECT_EQ(rs.mtu, 0);
+}
+
+TEST_F(QmiTest, RuntimeSettingsWithoutAddress)
+{
+    QmiRuntimeSettings rs;
+
+    open();
+    EXPECT_EQ(qmi_get_runtime_settings(mDev, &rs), -1);
+}
+
+TEST_F(QmiTest, RawIpRefused)
+{
+    open([](const Request &req) {
+        Bytes out = result();
+        if (req.service == kSvcWda && req.msgId == 0x0020) {
+            addTlv(out, 0x11, le32(1));     /* 802.3 */
+        }
+        return out;
+    });
+
+    EXPECT_EQ(qmi_set_raw_ip(mDev, "wwan0"), -1);
+    EXPECT_EQ(requestsTo(kSvcWda).back().tlv(0x11), le32(2));
+}
+
+}  // namespace
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "sim_auth.h"
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+/* TS 35.208 test set 1, as in tests/sim_auth_test.cpp */
+constexpr const char *kRes = "A54211D5E3BA50BF";
+constexpr const char *kCk = "B40BA9A3C58B2A05BBF0D987B21BF8CB";
+constexpr const char *kIk = "F769BCD751044604127672711C6D3441";
+constexpr const char *kSres = "46F8416A";
+constexpr const char *kKc = "EAE4BE823AF9A08B";
+
+constexpr const char *kSimChallenge = "ECNVPL6WN6idIYrmTa5HvzU=";
+constexpr const char *kAkaChallenge = "ECNVPL6WN6idIYrmTa5HvzUQVfMotDV3ublKn/rDVN+vsw==";
+
+void BM_Command(benchmark::State &state)
+{
+    const bool aka = state.range(0) != 0;
+    char cmd[SIM_AUTH_COMMAND_SIZE];
+
+    for (auto _ : state) {
+        if (sim_auth_command(aka ? kAkaChallenge : kSimChallenge, aka, cmd,
+                             sizeof(cmd)) < 0) {
+            state.SkipWithError("sim_auth_command failed");
+            break;
+        }
+        benchmark::DoNotOptimize(cmd);
+    }
+}
+
+BENCHMARK(BM_Command)->ArgName("aka")->Arg(0)->Arg(1);
+
+void BM_GsmResponse(benchmark::State &state)
+{
+    char out[SIM_AUTH_RESPONSE_SIZE];
+
+    for (auto _ : state) {
+        if (sim_auth_gsm_response(kSres, kKc, out, sizeof(out)) < 0) {
+            state.SkipWithError("sim_auth_gsm_response failed");
+            break;
+        }
+        benchmark::DoNotOptimize(out);
+    }
+}
+
+BENCHMARK(BM_GsmResponse);
+
+void BM_UmtsResponse(benchmark::State &state)
+{
+    char out[SIM_AUTH_RESPONSE_SIZE];
+
+    for (auto _ : state) {
+        if (sim_auth_umts_response(kRes, kCk, kIk, out, sizeof(out)) < 0) {
+            state.SkipWithError("sim_auth_umts_response failed");
+            break;
+        }
+        benchmark::DoNotOptimize(out);
+    }
+}
+
+BENCHMARK(BM_UmtsResponse);
+
+}  // namespace
+
+BENCHMARK_MAIN();
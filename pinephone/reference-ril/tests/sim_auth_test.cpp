@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "sim_auth.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+/*
+ * TS 35.208 test set 1: RAND, AUTN (SQN xor AK || AMF || MAC-A) and the
+ * f2, f3 and f4 outputs RES, CK and IK. SRES and Kc are derived from
+ * them with the TS 33.102 conversion functions c2 and c3.
+ */
+constexpr const char *kRand = "23553CBE9637A89D218AE64DAE47BF35";
+constexpr const char *kAutn = "55F328B43577B9B94A9FFAC354DFAFB3";
+constexpr const char *kRes = "A54211D5E3BA50BF";
+constexpr const char *kCk = "B40BA9A3C58B2A05BBF0D987B21BF8CB";
+constexpr const char *kIk = "F769BCD751044604127672711C6D3441";
+constexpr const char *kSres = "46F8416A";
+constexpr const char *kKc = "EAE4BE823AF9A08B";
+
+/* length byte and value pairs, base64 encoded */
+constexpr const char *kSimChallenge = "ECNVPL6WN6idIYrmTa5HvzU=";
+constexpr const char *kAkaChallenge = "ECNVPL6WN6idIYrmTa5HvzUQVfMotDV3ublKn/rDVN+vsw==";
+constexpr const char *kGsmResponse = "BEb4QWoI6uS+gjr5oIs=";
+constexpr const char *kUmtsResponse =
+        "2wilQhHV47pQvxC0C6mjxYsqBbvw2YeyG/jLEPdpvNdRBEYEEnZycRxtNEE=";
+
+std::string command(const char *challenge, bool aka)
+{
+    char cmd[SIM_AUTH_COMMAND_SIZE];
+
+    if (sim_auth_command(challenge, aka, cmd, sizeof(cmd)) < 0) {
+        return "error";
+    }
+    return cmd;
+}
+
+TEST(SimAuthTest, GsmCommand)
+{
+    EXPECT_EQ(command(kSimChallenge, false), std::string("AT^MBAU=\"") + kRand + "\"");
+}
+
+TEST(SimAuthTest, UmtsCommand)
+{
+    EXPECT_EQ(command(kAkaChallenge, true),
+              std::string("AT^MBAU=\"") + kRand + "," + kAutn + "\"");
+}
+
+TEST(SimAuthTest, MalformedChallenge)
+{
+    /* no AUTN */
+    EXPECT_EQ(command(kSimChallenge, true), "error");
+    /* RAND length beyond the data */
+    EXPECT_EQ(command("ESNVPL6WN6idIYrmTa5HvzU=", false), "error");
+    EXPECT_EQ(command("not base64!", false), "error");
+    EXPECT_EQ(command("", false), "error");
+    EXPECT_EQ(command(nullptr, false), "error");
+}
+
+TEST(SimAuthTest, CommandTooLong)
+{
+    char cmd[20];
+
+    EXPECT_EQ(sim_auth_command(kSimChallenge, false, cmd, sizeof(cmd)), -1);
+}
+
+TEST(SimAuthTest, GsmResponse)
+{
+    char out[SIM_AUTH_RESPONSE_SIZE];
+
+    ASSERT_EQ(sim_auth_gsm_response(kSres, kKc, out, sizeof(out)), 0);
+    EXPECT_STREQ(out, kGsmResponse);
+}
+
+TEST(SimAuthTest, UmtsResponse)
+{
+    char out[SIM_AUTH_RESPONSE_SIZE];
+
+    ASSERT_EQ(sim_auth_umts_response(kRes, kCk, kIk, out, sizeof(out)), 0);
+    EXPECT_STREQ(out, kUmtsResponse);
+}
+
+TEST(SimAuthTest, ZeroBytesPassUnchanged)
+{
+    char out[SIM_AUTH_RESPONSE_SIZE];
+
+    /* DB 04 00000000 02 0000 02 0001 */
+    ASSERT_EQ(sim_auth_umts_response("00000000", "0000", "0001", out, sizeof(out)), 0);
+    EXPECT_STREQ(out, "2wQAAAAAAgAAAgAB");
+}
+
+TEST(SimAuthTest, MalformedResponse)
+{
+    char out[SIM_AUTH_RESPONSE_SIZE];
+    std::string tooLong(2 * 256, 'A');
+
+    EXPECT_EQ(sim_auth_gsm_response("46F8416", kKc, out, sizeof(out)), -1);
+    EXPECT_EQ(sim_auth_gsm_response("46F8416X", kKc, out, sizeof(out)), -1);
+    EXPECT_EQ(sim_auth_umts_response(tooLong.c_str(), kCk, kIk, out, sizeof(out)), -1);
+    EXPECT_EQ(sim_auth_gsm_response(kSres, kKc, out, 8), -1);
+}
+
+}  // namespace
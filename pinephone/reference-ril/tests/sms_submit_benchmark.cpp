@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "atchannel.h"
+#include "sms_submit.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+/*
+ * Radio link cost model. Without AT+CMMS the modem releases the link
+ * after every message and sets it up again for the next one; setting up
+ * a link takes an order of magnitude longer than sending a segment.
+ * AT+CMMS=1 falls back to 0 once the gap between two messages exceeds
+ * kCmmsWindow (1-5 s on a real modem), AT+CMMS=2 holds until set to 0.
+ */
+constexpr auto kLinkSetup = std::chrono::milliseconds(40);
+constexpr auto kSegment = std::chrono::milliseconds(4);
+constexpr auto kCmmsWindow = std::chrono::milliseconds(20);
+
+constexpr int kParts = 10;
+/* a full segment: UDH (part 1 of 10) and 153 septets of text */
+const std::string kPdu = "4100" "0B911326880736F4" "0000" "A0"
+        "050003000A01" + std::string(2 * 134, 'A');
+
+/*
+ * AT modem on a pty in raw mode, answering AT+CMMS and AT+CMGS the way
+ * the EG25 does and charging a link setup for every message that is not
+ * covered by AT+CMMS.
+ */
+class SmsModemSim {
+  public:
+    SmsModemSim()
+    {
+        struct termios ios;
+
+        mMaster = posix_openpt(O_RDWR | O_NOCTTY);
+        grantpt(mMaster);
+        unlockpt(mMaster);
+        mSlave = open(ptsname(mMaster), O_RDWR | O_NOCTTY);
+        tcgetattr(mSlave, &ios);
+        cfmakeraw(&ios);
+        tcsetattr(mSlave, TCSANOW, &ios);
+        mThread = std::thread([this] { run(); });
+    }
+
+    /* atchannel has no way to stop its reader, so both live until exit */
+    int fd() const { return mSlave; }
+
+    int linkSetups() const { return mLinkSetups; }
+    int errors() const { return mErrors; }
+
+  private:
+    void reply(const std::string &s)
+    {
+        if (write(mMaster, s.data(), s.size()) != (ssize_t)s.size()) {
+            mErrors++;
+        }
+    }
+
+    void command(const std::string &cmd)
+    {
+        if (cmd == "AT+CMMS=1" || cmd == "AT+CMMS=2") {
+            mCmms = cmd.back() - '0';
+            reply("\r\nOK\r\n");
+        } else if (cmd == "AT+CMMS=0") {
+            mCmms = 0;
+            mLinkUp = false;
+            reply("\r\nOK\r\n");
+        } else if (cmd.compare(0, 8, "AT+CMGS=") == 0) {
+            mPduLength = atoi(cmd.c_str() + 8);
+            mInPdu = true;
+            reply("\r\n> ");
+        } else {
+            reply("\r\nERROR\r\n");
+        }
+    }
+
+    void pdu(const std::string &hex)
+    {
+        /* AT+CMGS counts the TPDU, without the SMSC address */
+        size_t smscLength = hex.size() >= 2 ? strtoul(hex.substr(0, 2).c_str(), NULL, 16) : 0;
+
+        if (hex.size() != 2 * (1 + smscLength + mPduLength)) {
+            mErrors++;
+            reply("\r\n+CMS ERROR: 304\r\n");
+            return;
+        }
+        if (mCmms == 1 && std::chrono::steady_clock::now() - mLastSent > kCmmsWindow) {
+            mCmms = 0;
+            mLinkUp = false;
+        }
+        if (!mLinkUp) {
+            std::this_thread::sleep_for(kLinkSetup);
+            mLinkSetups++;
+            mLinkUp = true;
+        }
+        std::this_thread::sleep_for(kSegment);
+        mLastSent = std::chrono::steady_clock::now();
+        if (mCmms == 0) {
+            mLinkUp = false;
+        }
+        reply("\r\n+CMGS: " + std::to_string(++mMessageRef & 0xff) + "\r\n\r\nOK\r\n");
+    }
+
+    void run()
+    {
+        std::string buf;
+        char c;
+
+        while (read(mMaster, &c, 1) == 1) {
+            if (mInPdu && c == '\032') {
+                mInPdu = false;
+                pdu(buf);
+                buf.clear();
+            } else if (!mInPdu && c == '\r') {
+                if (!buf.empty()) {
+                    command(buf);
+                }
+                buf.clear();
+            } else if (c != '\n') {
+                buf += c;
+            }
+        }
+    }
+
+    int mMaster;
+    int mSlave;
+    std::thread mThread;
+    int mCmms = 0;
+    std::chrono::steady_clock::time_point mLastSent;
+    bool mLinkUp = false;
+    bool mInPdu = false;
+    int mPduLength = 0;
+    int mMessageRef = 0;
+    std::atomic<int> mLinkSetups{ 0 };
+    std::atomic<int> mErrors{ 0 };
+};
+
+void onUnsolicited(const char *, const char *)
+{
+}
+
+SmsModemSim &modem()
+{
+    static SmsModemSim *sim = [] {
+        SmsModemSim *s = new SmsModemSim();
+        at_open(s->fd(), onUnsolicited);
+        return s;
+    }();
+    return *sim;
+}
+
+/**
+ * Send a kParts message the way the framework does: every segment but
+ * the last as SEND_SMS_EXPECT_MORE when expectMore is set, all of them as
+ * SEND_SMS otherwise (the behaviour before AT+CMMS support). gap_ms
+ * spaces the segments out beyond the AT+CMMS=1 window, as a slow
+ * framework would; the gaps are not timed.
+ */
+void BM_TenPartMessage(benchmark::State &state)
+{
+    const bool expectMore = state.range(0) != 0;
+    const auto gap = std::chrono::milliseconds(state.range(1));
+    SmsModemSim &sim = modem();
+    int setups = sim.linkSetups();
+    int errors = sim.errors();
+    int failed = 0;
+
+    for (auto _ : state) {
+        for (int i = 0; i < kParts; i++) {
+            int messageRef;
+
+            if (i > 0 && gap.count() > 0) {
+                state.PauseTiming();
+                std::this_thread::sleep_for(gap);
+                state.ResumeTiming();
+            }
+
+            if (sms_submit(NULL, kPdu.c_str(), expectMore && i < kParts - 1,
+                           &messageRef) < 0) {
+                failed++;
+            }
+        }
+    }
+
+    if (failed > 0 || sim.errors() != errors) {
+        state.SkipWithError("segments failed");
+    }
+    state.counters["link_setups"] = benchmark::Counter(
+            sim.linkSetups() - setups, benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(state.iterations() * kParts);
+}
+
+BENCHMARK(BM_TenPartMessage)
+        ->ArgNames({ "cmms", "gap_ms" })
+        ->ArgsProduct({ { 0, 1 }, { 0, 2 * kCmmsWindow.count() } })
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "urc_dispatch.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+#define URC_MAX_HANDLERS    64
+#define URC_BUCKETS         64  /* power of two */
+#define URC_MAX_PREFIX      32
+
+typedef struct UrcEntry {
+    char prefix[URC_MAX_PREFIX];
+    size_t prefixLen;
+    size_t nameLen;         /* length of the name part of prefix */
+    uint32_t hash;          /* of the name */
+    UrcHandler handler;
+    bool enabled;
+    struct UrcEntry *next;  /* bucket chain, longest prefix first */
+} UrcEntry;
+
+static pthread_mutex_t s_urcMutex = PTHREAD_MUTEX_INITIALIZER;
+static UrcEntry s_entries[URC_MAX_HANDLERS];
+static int s_entryCount = 0;
+static UrcEntry *s_buckets[URC_BUCKETS];
+
+/** length of the URC name of s: up to the first ':', or all of it */
+static size_t urcNameLen(const char *s)
+{
+    const char *colon = strchr(s, ':');
+
+    return colon != NULL ? (size_t)(colon - s) : strlen(s);
+}
+
+/* 32 bit FNV-1a */
+static uint32_t urcHash(const char *s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static UrcEntry *findEntryLocked(const char *prefix)
+{
+    size_t nameLen = urcNameLen(prefix);
+    uint32_t hash = urcHash(prefix, nameLen);
+    UrcEntry *e;
+
+    for (e = s_buckets[hash & (URC_BUCKETS - 1)]; e != NULL; e = e->next) {
+        if (e->hash == hash && !strcmp(e->prefix, prefix)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+int urc_register(const char *prefix, UrcHandler handler)
+{
+    UrcEntry *e, **pp;
+    size_t len = strlen(prefix);
+    int ret = -1;
+
+    if (len == 0 || len >= URC_MAX_PREFIX || handler == NULL) {
+        RLOGE("Invalid URC handler for '%s'", prefix);
+        return -1;
+    }
+
+    pthread_mutex_lock(&s_urcMutex);
+    if (s_entryCount >= URC_MAX_HANDLERS) {
+        RLOGE("URC table full, can't register '%s'", prefix);
+        goto done;
+    }
+    if (findEntryLocked(prefix) != NULL) {
+        RLOGE("URC handler for '%s' already registered", prefix);
+        goto done;
+    }
+
+    e = &s_entries[s_entryCount++];
+    memcpy(e->prefix, prefix, len + 1);
+    e->prefixLen = len;
+    e->nameLen = urcNameLen(prefix);
+    e->hash = urcHash(prefix, e->nameLen);
+    e->handler = handler;
+    e->enabled = true;
+
+    /* keep longer prefixes first so the most specific one matches */
+    for (pp = &s_buckets[e->hash & (URC_BUCKETS - 1)];
+            *pp != NULL && (*pp)->prefixLen >= len; pp = &(*pp)->next) {
+    }
+    e->next = *pp;
+    *pp = e;
+    ret = 0;
+
+done:
+    pthread_mutex_unlock(&s_urcMutex);
+    return ret;
+}
+
+int urc_set_enabled(const char *prefix, bool enabled)
+{
+    UrcEntry *e;
+
+    pthread_mutex_lock(&s_urcMutex);
+    e = findEntryLocked(prefix);
+    if (e != NULL) {
+        e->enabled = enabled;
+    }
+    pthread_mutex_unlock(&s_urcMutex);
+
+    return e != NULL ? 0 : -1;
+}
+
+int urc_dispatch(const char *s, const char *sms_pdu)
+{
+    size_t nameLen = urcNameLen(s);
+    uint32_t hash = urcHash(s, nameLen);
+    UrcHandler handler = NULL;
+    UrcEntry *e;
+
+    pthread_mutex_lock(&s_urcMutex);
+    for (e = s_buckets[hash & (URC_BUCKETS - 1)]; e != NULL; e = e->next) {
+        if (e->hash == hash && e->nameLen == nameLen
+                && !strncmp(s, e->prefix, e->prefixLen)) {
+            if (e->enabled) {
+                handler = e->handler;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_urcMutex);
+
+    if (handler == NULL) {
+        return -1;
+    }
+    handler(s, sms_pdu);
+    return 0;
+}
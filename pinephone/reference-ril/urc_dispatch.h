@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unsolicited response dispatch. Handlers are registered by line prefix
+ * and looked up through a hash of the URC name, the part of the line
+ * before the first ':' ("+CREG" for "+CREG: 1"), or the whole line for
+ * URCs without one ("RING"). Several prefixes may share a name
+ * ("+QIND: SMS DONE", "+QIND: \"csq\""); the longest matching prefix wins.
+ */
+typedef void (*UrcHandler)(const char *s, const char *sms_pdu);
+
+/**
+ * Register a handler, enabled. Meant to be called before the reader
+ * thread starts.
+ * returns 0 on success, -1 if the table is full or the prefix is taken
+ */
+int urc_register(const char *prefix, UrcHandler handler);
+
+/**
+ * Enable or disable the handler of a prefix; lines of a disabled handler
+ * are dropped.
+ * returns 0 on success, -1 if the prefix is not registered
+ */
+int urc_set_enabled(const char *prefix, bool enabled);
+
+/**
+ * Run the handler for a URC line.
+ * returns 0 if a handler ran, -1 if the line is unhandled or disabled
+ */
+int urc_dispatch(const char *s, const char *sms_pdu);
+
+#ifdef __cplusplus
+}
+#endif
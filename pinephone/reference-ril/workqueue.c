@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+
+#include "workqueue.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "RIL"
+#include <utils/Log.h>
+
+typedef struct WorkItem {
+    WorkFunc fn;
+    void *arg;
+    struct WorkItem *next;
+} WorkItem;
+
+struct WorkQueue {
+    char name[16];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    WorkItem *head;
+    WorkItem *tail;
+    size_t depth;
+};
+
+static void *workerLoop(void *arg)
+{
+    WorkQueue *wq = (WorkQueue *)arg;
+    WorkItem *item;
+
+    pthread_setname_np(pthread_self(), wq->name);
+
+    for (;;) {
+        pthread_mutex_lock(&wq->mutex);
+        while (wq->head == NULL) {
+            pthread_cond_wait(&wq->cond, &wq->mutex);
+        }
+        item = wq->head;
+        wq->head = item->next;
+        if (wq->head == NULL) {
+            wq->tail = NULL;
+        }
+        wq->depth--;
+        pthread_mutex_unlock(&wq->mutex);
+
+        item->fn(item->arg);
+        free(item);
+    }
+
+    return NULL;
+}
+
+WorkQueue *workqueue_create(const char *name, int threads)
+{
+    WorkQueue *wq;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i;
+
+    wq = (WorkQueue *)calloc(1, sizeof(*wq));
+    if (wq == NULL) {
+        return NULL;
+    }
+    /* thread names are limited to 15 characters */
+    strlcpy(wq->name, name, sizeof(wq->name));
+    pthread_mutex_init(&wq->mutex, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tid, &attr, workerLoop, wq) != 0) {
+            RLOGE("%s: failed to start worker %d", name, i);
+            /* workers already started keep the queue alive */
+            if (i == 0) {
+                pthread_attr_destroy(&attr);
+                free(wq);
+                return NULL;
+            }
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    return wq;
+}
+
+int workqueue_post(WorkQueue *wq, WorkFunc fn, void *arg)
+{
+    WorkItem *item;
+
+    if (wq == NULL || fn == NULL) {
+        return -1;
+    }
+
+    item = (WorkItem *)malloc(sizeof(*item));
+    if (item == NULL) {
+        return -1;
+    }
+    item->fn = fn;
+    item->arg = arg;
+    item->next = NULL;
+
+    pthread_mutex_lock(&wq->mutex);
+    if (wq->tail != NULL) {
+        wq->tail->next = item;
+    } else {
+        wq->head = item;
+    }
+    wq->tail = item;
+    wq->depth++;
+    pthread_cond_signal(&wq->cond);
+    pthread_mutex_unlock(&wq->mutex);
+
+    return 0;
+}
+
+size_t workqueue_depth(WorkQueue *wq)
+{
+    size_t depth;
+
+    pthread_mutex_lock(&wq->mutex);
+    depth = wq->depth;
+    pthread_mutex_unlock(&wq->mutex);
+
+    return depth;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: Apache-2.0
+ *
+ * Copyright (C) 2021 GloDroid project
+ */
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct WorkQueue WorkQueue;
+typedef void (*WorkFunc)(void *arg);
+
+/**
+ * Create a FIFO work queue served by the given number of detached
+ * worker threads. With a single thread items run strictly in order.
+ * returns NULL on failure
+ */
+WorkQueue *workqueue_create(const char *name, int threads);
+
+/**
+ * Queue fn(arg) to run on one of the queue's threads.
+ * returns 0 on success, -1 on failure (fn will not run)
+ */
+int workqueue_post(WorkQueue *wq, WorkFunc fn, void *arg);
+
+/** number of items waiting to be picked up by a worker */
+size_t workqueue_depth(WorkQueue *wq);
+
+#ifdef __cplusplus
+}
+#endif
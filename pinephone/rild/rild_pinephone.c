@@ -20,6 +20,7 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -79,6 +80,20 @@ static struct RIL_Env s_rilEnv = {
 
 extern void RIL_startEventLoop();
 
+/*
+ * Start of the RIL boot timeline, in CLOCK_MONOTONIC ms like the
+ * milestones the vendor RIL records after it.
+ */
+static void recordStartTime() {
+    struct timespec ts;
+    char value[PROPERTY_VALUE_MAX];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    snprintf(value, sizeof(value), "%lld",
+             (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    property_set("vendor.ril.boottime.rild_start", value);
+}
+
 static int make_argv(char * args, char ** argv) {
     // Note: reserve argv[0]
     int count = 1;
@@ -116,6 +131,7 @@ int main(int argc, char **argv) {
     // ril/socket id received as -c parameter, otherwise set to 0
     const char *clientId = NULL;
 
+    recordStartTime();
     RLOGD("**RIL Daemon Started - Version 1.4**");
     RLOGD("**RILd param count=%d**", argc);
 